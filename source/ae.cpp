@@ -1,43 +1,146 @@
 #include "ae.h"
 
 // ====================================时间事件====================================
+using aeTimePoint = std::chrono::steady_clock::time_point;
+using aeTimeHeapGreater = std::greater<std::pair<aeTimePoint, long long>>; // std::*_heap 默认是最大堆
+
 // 添加时间事件
-void aeEventLoop::addTimeEventToLoop(std::function<void(Server &)> func, std::chrono::milliseconds ms)
+long long aeEventLoop::addTimeEventToLoop(std::function<void(Server &)> func, std::chrono::milliseconds delay, std::chrono::milliseconds period)
 {
     aeTimeEvent event;
-    event.ms = ms;
-    event.timeEventProc = func;
-    this->aeTimeEventList.push_back(event);
+    event.id = this->timeEventNextId++;
+    event.when = std::chrono::steady_clock::now() + delay;
+    event.period = period;
+    event.timeEventProc = std::move(func);
+    this->aeTimeEventHeap.emplace_back(event.when, event.id);
+    std::push_heap(this->aeTimeEventHeap.begin(), this->aeTimeEventHeap.end(), aeTimeHeapGreater());
+    long long id = event.id;
+    this->aeTimeEvents.emplace(id, std::move(event));
+    return id;
+}
+
+// 删除时间事件，堆中的记录在到期或者重建堆时丢弃
+bool aeEventLoop::deleteTimeEvent(long long id)
+{
+    if(this->aeTimeEvents.erase(id) == 0) return false;
+    // 被删除的记录过多时重建堆，避免删除大量长周期事件后堆一直膨胀
+    if(this->aeTimeEventHeap.size() > 2 * this->aeTimeEvents.size() + 64)
+    {
+        this->aeTimeEventHeap.clear();
+        for(auto &p : this->aeTimeEvents) this->aeTimeEventHeap.emplace_back(p.second.when, p.first);
+        std::make_heap(this->aeTimeEventHeap.begin(), this->aeTimeEventHeap.end(), aeTimeHeapGreater());
+    }
+    return true;
 }
 
 // 处理时间事件
 void aeEventLoop::dealWithTimeEvents(Server &server)
 {
-    for(auto it = this->aeTimeEventList.begin();it != this->aeTimeEventList.end();++it)
+    aeTimePoint now = std::chrono::steady_clock::now();
+    while(!this->aeTimeEventHeap.empty() && this->aeTimeEventHeap.front().first <= now)
     {
-        if(it->ms > std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())) 
-            continue;
-        it->timeEventProc(server);
-        if(it->ms.count() >= 0) this->aeTimeEventList.erase(it);
+        long long id = this->aeTimeEventHeap.front().second;
+        std::pop_heap(this->aeTimeEventHeap.begin(), this->aeTimeEventHeap.end(), aeTimeHeapGreater());
+        this->aeTimeEventHeap.pop_back();
+        auto it = this->aeTimeEvents.find(id);
+        if(it == this->aeTimeEvents.end()) continue; // 已经被删除
+        // 处理函数中可能添加或者删除时间事件，先复制一份
+        std::function<void(Server &)> proc = it->second.timeEventProc;
+        if(it->second.period.count() <= 0) this->aeTimeEvents.erase(it);
+        else
+        { // 周期事件，落后太多时不补触发
+            it->second.when += it->second.period;
+            if(it->second.when <= now) it->second.when = now + it->second.period;
+            this->aeTimeEventHeap.emplace_back(it->second.when, id);
+            std::push_heap(this->aeTimeEventHeap.begin(), this->aeTimeEventHeap.end(), aeTimeHeapGreater());
+        }
+        proc(server);
     }
 }
 
-void aeMain(Server &server, aeEventLoop &aeLoop, std::vector<threadsafe_queue<IOThreadNews>> &io_q, threadsafe_queue<std::pair<int, Command>> &exe_q)
+// 向上取整，避免提前醒来之后时间事件还没有到期
+int aeEventLoop::timeEventWaitTime(int maxWait)
+{
+    // 丢弃堆顶已经被删除的记录
+    while(!this->aeTimeEventHeap.empty() && this->aeTimeEvents.count(this->aeTimeEventHeap.front().second) == 0)
+    {
+        std::pop_heap(this->aeTimeEventHeap.begin(), this->aeTimeEventHeap.end(), aeTimeHeapGreater());
+        this->aeTimeEventHeap.pop_back();
+    }
+    if(this->aeTimeEventHeap.empty()) return maxWait;
+    auto wait = this->aeTimeEventHeap.front().first - std::chrono::steady_clock::now();
+    if(wait <= std::chrono::steady_clock::duration::zero()) return 0;
+    long long ms = std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+    if(maxWait >= 0 && ms > maxWait) return maxWait;
+    return static_cast<int>(ms);
+}
+
+// 主线程向 IO 线程的队列放入任务，队列已满或者已经有暂存的任务时放入 overflow，保持任务的顺序
+// 主线程不能阻塞在满的 IO 队列上：IO 线程可能正阻塞在满的执行队列上，等待主线程取出命令
+static void pushIOThreadNews(mpmc_ring_queue<IOThreadNews> &q, std::deque<IOThreadNews> &overflow, IOThreadNews &&news)
+{
+    if(overflow.empty() && q.try_push(std::move(news))) return;
+    overflow.push_back(std::move(news));
+}
+
+// 把暂存的任务尽量放入 IO 队列，还有剩余时返回 true
+static bool flushIOThreadOverflow(mpmc_ring_queue<IOThreadNews> &q, std::deque<IOThreadNews> &overflow)
+{
+    while(!overflow.empty() && q.try_push(std::move(overflow.front()))) overflow.pop_front();
+    return !overflow.empty();
+}
+
+void IOThreadRecycler::putCommand(Command &&cmd)
+{
+    if(cmd.key.capacity() + cmd.value.capacity() > IO_RECYCLE_MAX_BYTES) return;
+    _commands.try_push(std::move(cmd));
+}
+
+void IOThreadRecycler::putReply(std::string &&reply)
+{
+    if(reply.capacity() > IO_RECYCLE_MAX_BYTES) return;
+    _replies.try_push(std::move(reply));
+}
+
+void aeMain(Server &server, aeEventLoop &aeLoop, std::vector<mpmc_ring_queue<IOThreadNews>> &io_q, mpmc_ring_queue<std::pair<int, Command>> &exe_q,
+            std::vector<IOThreadRecycler> &recycle)
 {
     
     aeLoop.aeEventLoopStop = false;
+    std::vector<std::pair<int, Command>> execBatch; // 复用，避免每轮循环重新分配
+    execBatch.reserve(EXEC_BATCH_SIZE);
+    std::vector<IOThreadNews> replies; // 一个批次中每个客户端的回复
+    // clientId 到 replies 下标的映射，nops 表示本批次中还没有回复，按照最大的 clientId 增长，一直复用
+    std::vector<size_t> replyIndex;
+    std::string retMessage; // 执行结果，复用
+    std::vector<std::deque<IOThreadNews>> ioOverflow(io_q.size()); // 每个 IO 队列满时暂存的任务
+    // IO 线程放入命令时通过 eventfd 唤醒 epoll_wait
+    int execWakeFd = server.IOThreadNum > 0 ? exe_q.eventFd() : -1;
+    if(execWakeFd >= 0) aeApiAddEvent(aeLoop, execWakeFd, AE_READABLE);
+    // serverCron 以 hz 的频率执行
+    aeLoop.addTimeEventToLoop(serverCron, std::chrono::milliseconds(1000 / server.hz), std::chrono::milliseconds(1000 / server.hz));
     while(!aeLoop.aeEventLoopStop && !server.serverStop)
     {
-        std::chrono::milliseconds startTime =  std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock().now().time_since_epoch());
         // 处理时间事件
         aeLoop.dealWithTimeEvents(server);
-        // 处理循环的时间事件
-        serverCron(server);
         
-        // 处理IO事件
+        // 等待事件之前把这一轮执行的写命令发送给从机
+        replicationBeforeSleep(server, aeLoop);
+
+        // 处理IO事件，最多等到下一个时间事件到期
+        int waitTime = aeLoop.timeEventWaitTime(-1);
+        // IO 线程取出任务时不会唤醒主线程，还有暂存的任务时最多等待 1ms 再重试
+        bool overflowed = false;
+        for(size_t i=0;i<io_q.size();++i) overflowed = flushIOThreadOverflow(io_q[i], ioOverflow[i]) || overflowed;
+        if(overflowed && (waitTime < 0 || waitTime > 1)) waitTime = 1;
         size_t eventNum = 0;
-        // if(server.fdSet.size() < 20) 
-        eventNum = aeApiPoll(aeLoop, 500);
+        if(execWakeFd >= 0)
+        { // 执行队列中已经有命令时不阻塞
+            exe_q.prepare_wait();
+            eventNum = aeApiPoll(aeLoop, exe_q.empty() ? waitTime : 0);
+            exe_q.finish_wait();
+        }
+        else eventNum = aeApiPoll(aeLoop, waitTime);
         if(eventNum == -1) eventNum = 0;
         
         // 不开启 IO 多线程
@@ -46,13 +149,23 @@ void aeMain(Server &server, aeEventLoop &aeLoop, std::vector<threadsafe_queue<IO
             for(size_t i=0;i<eventNum;++i)
             {
                 int fd = aeLoop.fired[i].fd;
-                std::cout<<fd<<"\n";
                 if(fd == server.config.master_socket_fd)
                 {
                     // 连接客户端
                     aeServerConnectToClient(server,aeLoop,nullptr);
+                    continue;
+                }
+                if(fd == server.config.repl_listen_fd)
+                {
+                    acceptReplicas(server, aeLoop);
+                    continue;
                 }
-                else readQueryFromClient(fd, server,aeLoop,nullptr);
+                int mask = aeLoop.fired[i].mask;
+                if(replicationHandleReplicaEvent(server, aeLoop, fd, mask)) continue;
+                if(mask & AE_READABLE) readQueryFromClient(fd, server,aeLoop,nullptr);
+                // socket 重新可写，继续发送输出缓冲区中剩余的回复
+                Client *c = static_cast<Client *>(aeLoop.fileEvent(fd).clientData);
+                if((mask & AE_WRITABLE) && c != nullptr) flushClientReplies(c, server, aeLoop);
             }
         }
         else // 开启 IO 多线程
@@ -61,7 +174,14 @@ void aeMain(Server &server, aeEventLoop &aeLoop, std::vector<threadsafe_queue<IO
             {
                 int fd = aeLoop.fired[i].fd;
                 int mask = aeLoop.fired[i].mask;
-                std::cout<<fd<<"\n";
+                if(fd == execWakeFd) continue; // 只用于唤醒，命令在下面统一执行
+                // 从机的连接只由主线程处理
+                if(fd == server.config.repl_listen_fd)
+                {
+                    acceptReplicas(server, aeLoop);
+                    continue;
+                }
+                if(replicationHandleReplicaEvent(server, aeLoop, fd, mask)) continue;
                 if(fd == server.config.master_socket_fd && (mask & EPOLLIN))
                 {
                     // 连接客户端
@@ -69,52 +189,109 @@ void aeMain(Server &server, aeEventLoop &aeLoop, std::vector<threadsafe_queue<IO
                 }
                 else
                 { // 读取客户端发来的信息
-                    if(server.fdSet.count(fd)==0)
-                    {
-                        io_q[fd%server.IOThreadNum].push(IOThreadNews(fd, true, std::string()));
-                        std::cout<<"get message from client\n";
-                        server.fdSet.insert(fd);
-                    }
+                    // 同一个 fd 的任务总是由同一个 IO 线程按顺序处理，重复的读任务只会读到 EAGAIN
+                    // 每个可读事件都必须交给 IO 线程，否则边缘触发下可能丢失数据
+                    if(mask & AE_READABLE) pushIOThreadNews(io_q[fd%server.IOThreadNum], ioOverflow[fd%server.IOThreadNum], IOThreadNews(fd, true, std::string()));
+                    // socket 重新可写，由 IO 线程继续发送输出缓冲区，内容为空的写任务表示只发送不追加
+                    if(mask & AE_WRITABLE) pushIOThreadNews(io_q[fd%server.IOThreadNum], ioOverflow[fd%server.IOThreadNum], IOThreadNews(fd, false, std::string()));
                 }
             }
 
-            // 执行数据库修改操作
-            std::pair<int, Command> p;
-            std::string retMessage;
-            while(!exe_q.empty())
+            // 执行数据库修改操作，批量从执行队列中取出命令
+            // 同一批次中发往同一个客户端的回复合并为一个写任务
+            while(exe_q.try_pop_bulk(execBatch, EXEC_BATCH_SIZE) > 0)
             {
-                if(exe_q.try_pop(p))
+                for(auto &p : execBatch)
                 {
-                    retMessage = execCommand(server, p.second);
+                    execCommand(server, p.second, retMessage);
+                    // 命令交还给解析它的 IO 线程，AOF 和从机的数据在执行时已经复制
+                    IOThreadRecycler &r = recycle[p.first%server.IOThreadNum];
+                    r.putCommand(std::move(p.second));
+                    size_t id = static_cast<size_t>(p.first);
+                    if(id >= replyIndex.size()) replyIndex.resize(std::max(id + 1, replyIndex.size() * 2), nops);
+                    if(replyIndex[id] == nops)
+                    { // 复用 IO 线程发送完毕的回复缓冲区
+                        replyIndex[id] = replies.size();
+                        std::string buff;
+                        r.getReply(buff);
+                        buff.clear();
+                        replies.emplace_back(p.first, false, std::move(buff));
+                    }
+                    appendReplyFrame(replies[replyIndex[id]].str, retMessage);
+                }
+                server.statNumCommands += execBatch.size();
+                // 整批命令的 AOF 一起写入，always 策略下一次 fdatasync 之后才发送回复
+                flushAppendOnlyFile(server);
+                for(auto &news : replies)
+                {
+                    replyIndex[news.fd] = nops;
+                    // 将执行的结过发送给客户端
+                    pushIOThreadNews(io_q[news.fd%server.IOThreadNum], ioOverflow[news.fd%server.IOThreadNum], std::move(news));
                 }
-                io_q[p.first%server.IOThreadNum].push(IOThreadNews(p.first, false, retMessage)); // 将执行的结过发送给客户端
+                execBatch.clear();
+                replies.clear();
             }
         }
 
-
-        std::chrono::milliseconds endTime =  std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock().now().time_since_epoch());
-        int circleTime = (endTime - startTime).count();
-        if(circleTime == 0) circleTime = 1000;
-        server.hz = 1000/circleTime > 0 ? 1000/circleTime : 1;
-        continue;
     }
 }
 
 // ==============================IO 事件处理===============================
+aeEventLoop::aeEventLoop(int maxSetSize) : maxfd(-1), setSize(0), maxSetSize(maxSetSize), eventChunks(nullptr), fired(nullptr),
+    timeEventNextId(0), aeEventLoopStop(false), flags(0)
+{
+    // 块的目录按照上限一次分配，之后只填充其中的指针
+    eventChunks = new aeFileEvent*[(maxSetSize + AE_SETSIZE_CHUNK - 1) / AE_SETSIZE_CHUNK]();
+    aeApiCreate(*this);
+    aeResizeSetSize(*this, std::min(maxSetSize, AE_SETSIZE_CHUNK));
+}
+
+aeEventLoop::~aeEventLoop()
+{
+    aeApiFree(*this);
+    for(int i=0;i*AE_SETSIZE_CHUNK<setSize;++i) delete [] eventChunks[i];
+    delete [] eventChunks;
+    delete [] fired;
+}
+
+// 事件表按块增长，fired 和后端的数组只由调用 aeApiPoll 的线程使用，可以重新分配
+int aeResizeSetSize(aeEventLoop &eventloop, int setSize)
+{
+    if(setSize > eventloop.maxSetSize) return -1;
+    if(setSize <= eventloop.setSize) return 0;
+    // 按块对齐，不超过上限
+    setSize = std::min(eventloop.maxSetSize, (setSize + AE_SETSIZE_CHUNK - 1) / AE_SETSIZE_CHUNK * AE_SETSIZE_CHUNK);
+    for(int i=(eventloop.setSize + AE_SETSIZE_CHUNK - 1)/AE_SETSIZE_CHUNK;i*AE_SETSIZE_CHUNK<setSize;++i)
+    {
+        eventloop.eventChunks[i] = new aeFileEvent[AE_SETSIZE_CHUNK];
+    }
+    if(aeApiResize(eventloop, setSize) == -1) return -1;
+    delete [] eventloop.fired;
+    eventloop.fired = new aeFiredEvent[setSize];
+    eventloop.setSize = setSize;
+    return 0;
+}
+
 // 添加 IO 事件
-void aeCreateFileEvent(int fd, aeEventLoop &eventloop, std::function<void(int, Server &, aeEventLoop &, void*)> func, int mask, void *clientData)
+int aeCreateFileEvent(int fd, aeEventLoop &eventloop, aeFileProc *proc, int mask, void *clientData)
 {
-    
+    // 连接数较多时事件表按需增长，每次至少扩大一倍
+    if(fd >= eventloop.setSize && aeResizeSetSize(eventloop, std::max(fd + 1, eventloop.setSize * 2)) == -1 &&
+       aeResizeSetSize(eventloop, fd + 1) == -1)
+    {
+        return -1;
+    }
+    aeFileEvent &event = eventloop.fileEvent(fd); // 添加事件
+    event.clientData = clientData; // io_uring 后端根据 clientData 判断是否是客户端连接
     if(aeApiAddEvent(eventloop, fd, mask) == -1)
     {
         errorHandling("aeApiAddEvent error!");
     }
-    aeFileEvent &event = eventloop.events[fd]; // 添加事件
     event.mask |= mask;
-    if(mask & AE_READABLE) event.rfileProc = func;
-    if(mask & AE_WRITABLE) event.wfileProc = func;
-    event.clientData = clientData;
+    if(mask & AE_READABLE) event.rfileProc = proc;
+    if(mask & AE_WRITABLE) event.wfileProc = proc;
     if(fd > eventloop.maxfd) eventloop.maxfd = fd;
+    return 0;
 }
 
 
@@ -123,66 +300,140 @@ void aeCreateFileEvent(int fd, aeEventLoop &eventloop, std::function<void(int, S
 // 服务器连接客户端
 void aeServerConnectToClient(Server &server, aeEventLoop &aeloop, void*)
 {
-    int listenFd = server.config.master_socket_fd;
-    sockaddr_in client_addr;
-    socklen_t slave_addr_size = sizeof(client_addr);
-    int clientFd = accept(listenFd, reinterpret_cast<sockaddr *>(&client_addr), &slave_addr_size);
-    int optval = 1;
-    setsockopt(clientFd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    acceptClients(server, server.config.master_socket_fd, aeloop);
+}
 
-    // 设置为非阻塞
-    int flag = fcntl(clientFd, F_GETFL, 0);
-    fcntl(clientFd, F_SETFL, flag|O_NONBLOCK);
+// 接受 listenFd 上所有等待的连接，并注册到 aeloop 中
+void acceptClients(Server &server, int listenFd, aeEventLoop &aeloop)
+{
+    // 边缘触发下一次事件可能对应多个连接，需要全部 accept
+    while(true)
+    {
+        int clientFd = aeApiAccept(aeloop, listenFd);
+        if(clientFd < 0) break; // EAGAIN，没有等待的连接
+        // 多个 IO 线程同时 accept，先占用名额再检查
+        if(server.connectedClients.fetch_add(1) >= server.maxclients || clientFd >= aeloop.maxSetSize)
+        {
+            server.connectedClients -= 1;
+            server.statRejectedConnections += 1;
+            std::cout<<"max number of clients reached, fd =="<<clientFd<<std::endl;
+            close(clientFd);
+            continue;
+        }
+        int optval = 1;
+        setsockopt(clientFd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        // 关闭 Nagle 算法，长度和内容分两次写入时避免和延迟 ACK 叠加产生 40ms 的延迟
+        setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+        // 设置为非阻塞
+        int flag = fcntl(clientFd, F_GETFL, 0);
+        fcntl(clientFd, F_SETFL, flag|O_NONBLOCK);
+
+        Client *c = new Client(clientFd);
+        if(aeCreateFileEvent(clientFd, aeloop, readQueryFromClient, AE_READABLE, c) == -1)
+        {
+            server.connectedClients -= 1;
+            delete c;
+            close(clientFd);
+        }
+    }
+}
 
-    aeCreateFileEvent(clientFd, aeloop, readQueryFromClient, AE_READABLE, nullptr);
+// 读取客户端发来的数据，连接关闭、出错或者输入缓冲区超过限制时关闭连接并返回 false
+static bool readClientQuery(Client *c, Server &server, aeEventLoop &aeLoop)
+{
+    int fd = c->fd;
+    if(!c->readQuery(server))
+    {   // 客户端断开连接
+        closeClient(fd, server, aeLoop);
+        return false;
+    }
+    if(!c->checkQueryLimit(server))
+    {
+        std::cout<<"client query buffer limit reached, fd =="<<fd<<std::endl;
+        server.statQueryLimitDisconnections += 1;
+        closeClient(fd, server, aeLoop);
+        return false;
+    }
+    return true;
 }
 
 // 读取客户端的发送的数据并处理
 void readQueryFromClient(int fd, Server &server, aeEventLoop &aeLoop, void *clientData)
 {
-    constexpr size_t BUFFSIZE = 8192;
-    char buff[BUFFSIZE];
-    // 首先读取客户端发送数据的长度
-    size_t len = 0;
-    int readLen = 0;
-    while(readLen != sizeof(size_t))
+    Client *c = static_cast<Client *>(aeLoop.fileEvent(fd).clientData);
+    if(c == nullptr) return;
+    if(!readClientQuery(c, server, aeLoop)) return;
+    // cmd、retMessage 和 out 在主线程中复用，避免每条命令都分配内存
+    static Command cmd;
+    static std::string retMessage;
+    static std::string out;
+    c->takeSentReply(out); // 复用连接发送完毕的回复块
+    out.clear();
+    // 执行缓冲区中所有完整的命令，回复合并后一次发送
+    while(c->nextCommand(cmd))
     {
-        readLen += read(fd, static_cast<void*>(&len+readLen), sizeof(size_t));
-        if(readLen == 0) 
-        {   // 客户端断开连接
-            closeClient(fd, server, aeLoop);
-            return;
-        }
+        execCommand(server,cmd,retMessage);
+        appendReplyFrame(out, retMessage);
+        server.statNumCommands += 1;
     }
-    // len中存储着接下来要发送的数据的长度
-    readLen = 0;
-    while(readLen != len)
+    if(c->protocolError)
     {
-        readLen += read(fd, buff+readLen, len);
+        closeClient(fd, server, aeLoop);
+        return;
+    }
+    flushAppendOnlyFile(server);
+    if(!out.empty())
+    {
+        c->addReply(std::move(out));
+        flushClientReplies(c, server, aeLoop);
     }
-    buff[len] = 0;
-    // std::cout<<buff<<std::endl;
-    Command cmd;
-    parseBinaryCmd(buff,cmd); // 解析cmd
-    showCommand(cmd);
-    // 执行命令并获取结果
-    std::string retMessage = execCommand(server,cmd);
-
-    // 向客户端发送命令的执行情况
-    len = retMessage.length() + 1;
-    write(fd, static_cast<void*>(&len), sizeof(size_t));
-    write(fd, retMessage.c_str(), len);
     return;
 }
 
+// 发送连接输出缓冲区中的数据，没有发送完时注册可写事件，发送完毕后取消
+bool flushClientReplies(Client *c, Server &server, aeEventLoop &aeLoop)
+{
+    int fd = c->fd;
+    bool ok = aeLoop.apiData.uring != nullptr ? aeLoop.apiData.uring->sendReplies(c) : c->writeReplies(server);
+    if(!ok)
+    { // 连接出错
+        closeClient(fd, server, aeLoop);
+        return false;
+    }
+    if(!c->checkOutputLimits(server))
+    {
+        std::cout<<"client output buffer limit reached, fd =="<<fd<<", size = "<<c->outputBufferSize()<<std::endl;
+        server.statOutputLimitDisconnections += 1;
+        closeClient(fd, server, aeLoop);
+        return false;
+    }
+    if(aeLoop.apiData.uring != nullptr) return true; // 由发送完成事件代替可写事件
+    int mask = aeLoop.fileEvent(fd).mask;
+    if(c->hasPendingReplies() && !(mask & AE_WRITABLE))
+    {
+        aeApiAddEvent(aeLoop, fd, AE_WRITABLE);
+        aeLoop.fileEvent(fd).mask |= AE_WRITABLE;
+    }
+    else if(!c->hasPendingReplies() && (mask & AE_WRITABLE))
+    {
+        aeApiDelEvent(aeLoop, fd, AE_WRITABLE);
+        aeLoop.fileEvent(fd).mask &= ~AE_WRITABLE;
+    }
+    return true;
+}
+
 // 关闭客户端
 void closeClient(int fd, Server &server, aeEventLoop &aeLoop)
 {
+    // 先释放连接对象再关闭 fd，关闭之后 fd 可能立即被其他线程 accept 复用
+    aeApiDelEvent(aeLoop,fd,AE_READABLE|AE_WRITABLE);
+    aeLoop.fileEvent(fd).mask = AE_NONE;
+    Client *c = static_cast<Client *>(aeLoop.fileEvent(fd).clientData);
+    aeLoop.fileEvent(fd).clientData = nullptr;
+    if(c != nullptr) aeApiFreeClient(aeLoop, c);
+    server.connectedClients -= 1;
     close(fd); // 关闭客户端
-    aeApiDelEvent(aeLoop,fd,AE_WRITABLE);
-    aeLoop.events[fd].mask = AE_NONE;
-    if(aeLoop.events[fd].clientData != nullptr) delete aeLoop.events[fd].clientData;
-    aeLoop.events[fd].clientData = nullptr;
     std::cout<<"close client, fd =="<<fd<<std::endl;
     return;
 }
@@ -192,7 +443,7 @@ void closeClient(int fd, Server &server, aeEventLoop &aeLoop)
 // 初始化 eventloop 中的 apiData 成员变量
 int aeApiCreate(aeEventLoop &eventloop)
 {
-    eventloop.apiData.events = new epoll_event[eventloop.setSize];
+    eventloop.apiData.events = nullptr; // 由 aeApiResize 分配
     eventloop.apiData.epfd = epoll_create(1024); // 1024 只是一个填充值
 
     // 在给定 fd 上启用FD_CLOEXEC以避免 fd 泄漏。
@@ -203,19 +454,44 @@ int aeApiCreate(aeEventLoop &eventloop)
 // 释放 epoll 有关资源
 void aeApiFree(aeEventLoop &eventloop)
 {
-    close(eventloop.apiData.epfd);
+    delete eventloop.apiData.uring;
+    eventloop.apiData.uring = nullptr;
+    if(eventloop.apiData.epfd >= 0) close(eventloop.apiData.epfd);
     delete [] eventloop.apiData.events;
+    eventloop.apiData.epfd = -1;
+    eventloop.apiData.events = nullptr;
+}
+
+// epoll_wait 一次最多返回 setSize 个事件
+int aeApiResize(aeEventLoop &eventloop, int setSize)
+{
+    if(eventloop.apiData.uring != nullptr) return 0; // 完成事件直接写入 fired 数组
+    delete [] eventloop.apiData.events;
+    eventloop.apiData.events = new epoll_event[setSize];
+    return 0;
+}
+
+// 切换为 io_uring 后端，释放 epoll 的资源
+bool aeApiUseUring(aeEventLoop &eventloop)
+{
+    if(eventloop.apiData.uring != nullptr) return true;
+    aeUring *uring = aeUring::create(AE_URING_ENTRIES);
+    if(uring == nullptr) return false;
+    aeApiFree(eventloop);
+    eventloop.apiData.uring = uring;
+    return true;
 }
 
 // 向 eventloop 中添加 IO事件 
 // 成功返回0，失败返回 -1
 int aeApiAddEvent(aeEventLoop &eventloop, int fd, int mask)
 {
+    if(eventloop.apiData.uring != nullptr) return eventloop.apiData.uring->addEvent(eventloop, fd, mask);
     epoll_event ee {0};
     // 如果这个事件还没有被触发过，则使用 EPOLL_CTL_ADD, 否则使用 EPOLL_CTL_MOD 进行修改
-    int op = eventloop.events[fd].mask == AE_NONE ? EPOLL_CTL_ADD : EPOLL_CTL_MOD; 
+    int op = eventloop.fileEvent(fd).mask == AE_NONE ? EPOLL_CTL_ADD : EPOLL_CTL_MOD; 
     ee.events = 0;
-    mask |= eventloop.events[fd].mask; // 和以前的事件掩码合并
+    mask |= eventloop.fileEvent(fd).mask; // 和以前的事件掩码合并
     // 根据 mask 的值判断这个事件的性质
     if(mask & AE_READABLE) ee.events |= EPOLLIN;
     if(mask & AE_WRITABLE) ee.events |= EPOLLOUT;
@@ -231,12 +507,18 @@ int aeApiAddEvent(aeEventLoop &eventloop, int fd, int mask)
 // 使用 delmask 确定删除的是哪一种类型
 void aeApiDelEvent(aeEventLoop &eventloop, int fd, int delmask)
 {
+    if(eventloop.apiData.uring != nullptr)
+    {
+        eventloop.apiData.uring->delEvent(eventloop, fd, delmask);
+        return;
+    }
     epoll_event ee {0};
-    int mask = eventloop.events[fd].mask & (~delmask); // 删去要监听的事件类型
+    int mask = eventloop.fileEvent(fd).mask & (~delmask); // 删去要监听的事件类型
 
     ee.events = 0;
     if(mask & AE_READABLE) ee.events |= EPOLLIN;
     if(mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+    ee.events |= EPOLLET; // 和 aeApiAddEvent 保持一致
     ee.data.fd = fd;
     if(mask != AE_NONE) // 如果 mask != AE_NONE 代表还有某种类型的事件需要监听
     {
@@ -252,6 +534,7 @@ void aeApiDelEvent(aeEventLoop &eventloop, int fd, int delmask)
 // waitTime 参数表示等待的事件，单位是毫秒, -1 代表永久等待
 int aeApiPoll(aeEventLoop &eventloop, int waitTime)
 {
+    if(eventloop.apiData.uring != nullptr) return eventloop.apiData.uring->poll(eventloop, waitTime);
     int retval = 0, numevent = 0;
     retval = epoll_wait(eventloop.apiData.epfd, eventloop.apiData.events, eventloop.setSize, waitTime);
     if(retval > 0)
@@ -280,53 +563,99 @@ int aeApiPoll(aeEventLoop &eventloop, int waitTime)
     return numevent; // 返回事件的数量
 }
 
-std::string aeApiName(void) {
-    return "epoll";
+std::string aeApiName(aeEventLoop &eventloop) {
+    return eventloop.apiData.uring != nullptr ? "io_uring" : "epoll";
+}
+
+int aeApiAccept(aeEventLoop &eventloop, int listenFd)
+{
+    if(eventloop.apiData.uring != nullptr) return eventloop.apiData.uring->accept(listenFd);
+    return accept(listenFd, nullptr, nullptr);
+}
+
+void aeApiFreeClient(aeEventLoop &eventloop, Client *c)
+{
+    if(eventloop.apiData.uring != nullptr) eventloop.apiData.uring->freeClient(c);
+    else delete c;
+}
+
+// 读取 fd 上可读的数据，解析出所有完整的命令并放入执行队列
+// 不完整的命令留在连接的输入缓冲区中，等待下一次可读事件
+// 客户端关闭或者命令格式非法时返回 false
+bool readCommandsFromClient(int fd, int clientId, Server &server, aeEventLoop &aeloop, mpmc_ring_queue<std::pair<int, Command>> &exe_q,
+                            IOThreadRecycler &recycle)
+{
+    Client *c = static_cast<Client *>(aeloop.fileEvent(fd).clientData);
+    if(c == nullptr) return false; // 连接已经关闭
+    if(!readClientQuery(c, server, aeloop)) return false; // 客户端关闭、连接出错或者输入过多
+    // 复用主线程执行完毕的命令，key 和 value 不需要重新分配
+    Command cmd;
+    recycle.getCommand(cmd);
+    while(c->nextCommand(cmd))
+    {
+        // 将解析的命令放入到执行队列中
+        exe_q.push(std::make_pair(clientId, std::move(cmd)));
+        recycle.getCommand(cmd);
+    }
+    recycle.putCommand(std::move(cmd)); // 没有用到的命令放回
+    if(c->protocolError)
+    {
+        closeClient(fd, server, aeloop);
+        return false;
+    }
+    return true;
+}
+
+// 回复的格式和命令相同，先是 size_t 类型的长度，然后是包括 '\0' 在内的内容
+void appendReplyFrame(std::string &out, const std::string &reply)
+{
+    size_t len = reply.length() + 1;
+    out.append(reinterpret_cast<const char *>(&len), sizeof(size_t));
+    out.append(reply.c_str(), len);
+}
+
+// 回复先追加到各个连接的输出缓冲区中，再对每个连接发送一次，同一个连接的多块回复使用一次 writev
+void writeRepliesToClients(Server &server, aeEventLoop &aeloop, std::vector<IOThreadNews> &replies, size_t idDivisor, IOThreadRecycler &recycle)
+{
+    static thread_local std::vector<Client *> touched; // 本批次中需要发送的连接，每个 IO 线程复用
+    touched.clear();
+    for(auto &news : replies)
+    {
+        int fd = static_cast<int>(news.fd / idDivisor);
+        Client *c = static_cast<Client *>(aeloop.fileEvent(fd).clientData);
+        if(c == nullptr) continue; // 连接已经关闭
+        c->addReply(std::move(news.str));
+        if(std::find(touched.begin(), touched.end(), c) == touched.end()) touched.push_back(c);
+    }
+    std::string sent;
+    for(Client *c : touched)
+    {
+        if(!flushClientReplies(c, server, aeloop)) continue; // 连接已经关闭
+        // 发送完毕的回复交还给主线程复用
+        while(c->takeSentReply(sent)) recycle.putReply(std::move(sent));
+    }
 }
 
 // IO 线程运行函数
-void IOThreadMain(Server &server, aeEventLoop &aeloop, threadsafe_queue<IOThreadNews> &io_q, threadsafe_queue<std::pair<int, Command>> &exe_q)
+void IOThreadMain(Server &server, aeEventLoop &aeloop, mpmc_ring_queue<IOThreadNews> &io_q, mpmc_ring_queue<std::pair<int, Command>> &exe_q,
+                  IOThreadRecycler &recycle)
 {
-    // 从 任务队列中取出任务
-    IOThreadNews news;
-    constexpr size_t BUFFSIZE = 8192;
-    char buff[BUFFSIZE];
+    // 从 任务队列中批量取出任务
+    std::vector<IOThreadNews> batch, writes;
     while(true)
     {
-        if(!io_q.try_pop(news))
+        batch.emplace_back();
+        io_q.wait_and_pop(batch.back()); // 队列为空时阻塞在 eventfd 上，由主线程唤醒
+        io_q.try_pop_bulk(batch, IO_BATCH_SIZE);
+        for(auto &news : batch)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
-            continue;
-        }
-        if(news.isRead)
-        { // 读任务 根据 readLen的值判断现在读哪个部分
-            // 不断尝试读取指令，直到读完
-            while(true)
-            {
-                // 首先读取客户端发送数据的长度
-                size_t len = 0;
-                int readLen = 0;
-                bool exit = false;
-                readLen = read(news.fd, static_cast<void*>(&len), sizeof(size_t));
-                if(readLen < 0 && errno == EAGAIN) 
-                    break; // 非阻塞IO，没有数据可读
-                if(readLen == 0)
-                { // 客户端关闭
-                    closeClient(news.fd, server, aeloop);
-                    server.fdSet.erase(news.fd);
-                    break;
-                }
-                // len中存储着接下来要发送的数据的长度
-                readLen = read(news.fd, buff, len);
-                buff[len] = 0;
-                // std::cout<<buff<<std::endl;
-                Command cmd;
-                parseBinaryCmd(buff,cmd); // 解析cmd
-                showCommand(cmd);
-                std::cout<<news.fd<<"\n";
-                // 将解析的命令放入到执行队列中
-                exe_q.push(std::make_pair(news.fd, cmd));
+            if(!news.isRead)
+            { // 写任务，先收集起来，同一个客户端的回复合并发送
+                writes.push_back(std::move(news));
+                continue;
             }
+            // 读任务
+            readCommandsFromClient(news.fd, news.fd, server, aeloop, exe_q, recycle);
 
             // 下面是之前的代码，使用的是epoll ET，但是阻塞IO :)
             // // 首先读取客户端发送数据的长度
@@ -358,16 +687,49 @@ void IOThreadMain(Server &server, aeEventLoop &aeloop, threadsafe_queue<IOThread
             // // 将解析的命令放入到执行队列中
             // exe_q.push(std::make_pair(news.fd, cmd));
         }
-        else
-        { // 写任务
-            // 向客户端发送命令的执行情况
-            size_t len = news.str.length() + 1;
-            write(news.fd, static_cast<void*>(&len), sizeof(size_t));
-            //std::this_thread::sleep_for(std::chrono::milliseconds(500));
-            write(news.fd, news.str.c_str(), len);
-            //std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            server.fdSet.erase(news.fd);
-            
+        writeRepliesToClients(server, aeloop, writes, 1, recycle);
+        batch.clear();
+        writes.clear();
+    }
+}
+
+// 多监听模式下 IO 线程的运行函数
+void IOThreadLoopMain(Server &server, size_t id, mpmc_ring_queue<IOThreadNews> &io_q, mpmc_ring_queue<std::pair<int, Command>> &exe_q,
+                      IOThreadRecycler &recycle)
+{
+    aeEventLoop loop(static_cast<int>(server.maxclients) + CONFIG_FDSET_INCR); // 每个 IO 线程独立的 epoll 实例
+    // 需要在注册事件之前切换后端
+    if(server.ioUringMode && !aeApiUseUring(loop)) std::cout<<"io_uring is not available, fall back to epoll\n";
+    std::cout<<"IO thread "<<id<<" uses "<<aeApiName(loop)<<std::endl;
+    int listenFd = createListenSocket(server.config.master_port, true);
+    aeApiAddEvent(loop, listenFd, AE_READABLE);
+    aeApiAddEvent(loop, io_q.eventFd(), AE_READABLE); // 主线程放入回复时唤醒
+    size_t n = server.IOThreadNum;
+    std::vector<IOThreadNews> replies;
+    while(!server.serverStop)
+    {
+        io_q.prepare_wait();
+        int eventNum = aeApiPoll(loop, io_q.empty() ? 500 : 0);
+        io_q.finish_wait();
+        for(int i=0;i<eventNum;++i)
+        {
+            int fd = loop.fired[i].fd;
+            if(fd == listenFd) acceptClients(server, listenFd, loop);
+            else if(fd != io_q.eventFd())
+            {
+                int mask = loop.fired[i].mask;
+                if((mask & AE_READABLE) && !readCommandsFromClient(fd, static_cast<int>(fd * n + id), server, loop, exe_q, recycle)) continue;
+                // socket 重新可写，继续发送输出缓冲区中剩余的回复
+                Client *c = static_cast<Client *>(loop.fileEvent(fd).clientData);
+                if((mask & AE_WRITABLE) && c != nullptr) flushClientReplies(c, server, loop);
+            }
+        }
+        // 发送主线程执行完毕的回复
+        while(io_q.try_pop_bulk(replies, IO_BATCH_SIZE) > 0)
+        {
+            writeRepliesToClients(server, loop, replies, n, recycle);
+            replies.clear();
         }
     }
-}
\ No newline at end of file
+    close(listenFd);
+}
@@ -2,14 +2,22 @@
 #define REDIS_LEARN_AE
 // 事件驱动模型
 
-#include <list>
+#include <vector>
 #include <chrono>
 #include <functional>
 #include <sys/epoll.h>
 #include <errno.h>
 #include <fcntl.h> // 设置非阻塞 IO
+#include <poll.h>
+#include <sys/uio.h> // writev
+#include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <netinet/tcp.h> // TCP_NODELAY
 #include "server.h"
 #include "threadsafe_structures.h"
+#include "networking.h"
+#include "ae_uring.h"
 
 #define AE_NONE 0       /* No events registered. */
 #define AE_READABLE 1   /* Fire when descriptor is readable. */
@@ -35,26 +43,38 @@ class aeApiState
 public:
     int epfd;
     epoll_event *events;
-    aeApiState() {}
+    aeUring *uring; // 不为空时使用 io_uring 后端
+    aeApiState() : epfd(-1), events(nullptr), uring(nullptr) {}
 };
 
-// 封装 epoll
+// 封装 epoll，默认使用 epoll，可以在注册事件之前切换为 io_uring
 int aeApiCreate(aeEventLoop &eventloop);
 void aeApiFree(aeEventLoop &eventloop);
 int aeApiAddEvent(aeEventLoop &eventloop, int fd, int mask);
 void aeApiDelEvent(aeEventLoop &eventloop, int fd, int delmask);
 int aeApiPoll(aeEventLoop &eventloop, int waitTime);
-std::string aeApiName(void);
+int aeApiResize(aeEventLoop &eventloop, int setSize);
+std::string aeApiName(aeEventLoop &eventloop);
+// 把事件循环切换为 io_uring 后端，内核不支持时继续使用 epoll 并返回 false
+bool aeApiUseUring(aeEventLoop &eventloop);
+// 取出 listenFd 上一个新的连接，没有时返回 -1
+int aeApiAccept(aeEventLoop &eventloop, int listenFd);
+// 释放连接对象，io_uring 后端会等待连接上所有请求完成之后再释放
+void aeApiFreeClient(aeEventLoop &eventloop, Client *c);
+
+// IO 事件处理函数
+typedef void aeFileProc(int fd, Server &server, aeEventLoop &eventLoop, void *clientData);
 
 // IO 事件
-class aeFileEvent
+// 每个 fd 的状态只有 32 字节，对齐之后一个 fd 的状态不会跨越缓存行
+class alignas(32) aeFileEvent
 {
 public:
     int mask; // 类型掩码 0 为缺省值，1 表示读事件， 2 表示写事件, 4 表示屏障事件
-    std::function<void(int, Server &, aeEventLoop &, void *)> rfileProc;
-    std::function<void(int, Server &, aeEventLoop &, void *)> wfileProc;
+    aeFileProc *rfileProc;
+    aeFileProc *wfileProc;
     void *clientData;  // 客户端发来的数据
-    aeFileEvent() : mask(AE_NONE), clientData(nullptr) {}
+    aeFileEvent() : mask(AE_NONE), rfileProc(nullptr), wfileProc(nullptr), clientData(nullptr) {}
 private:
 };
 
@@ -63,9 +83,10 @@ class aeTimeEvent
 {
 public:
     long long id;
-    std::chrono::milliseconds ms;
+    std::chrono::steady_clock::time_point when; // 下一次触发的时间
+    std::chrono::milliseconds period; // 触发周期，0 表示只触发一次
     std::function<void(Server &)> timeEventProc; // 时间事件处理函数
-    aeTimeEvent() : ms(std::chrono::milliseconds(0)) {}
+    aeTimeEvent() : id(0), period(std::chrono::milliseconds(0)) {}
 private:
 };
 
@@ -77,24 +98,39 @@ public:
     int mask; // 类型掩码
 };
 
+// 事件表每次增长的 fd 数目，也是事件表分块的大小
+constexpr int AE_SETSIZE_CHUNK = 1024;
+
 // 事件池
 class aeEventLoop
 {
 public:
     int maxfd; /* highest file descriptor currently registered */
-    int setSize; /* max number of file descriptors tracked */
+    int setSize; /* max number of file descriptors tracked, grows on demand */
+    int maxSetSize; /* setSize can grow up to this value */
 
     // IO event
-    aeFileEvent *events; // 已经注册的 IO 事件
-    aeFiredEvent *fired; // 触发的 IO 事件
+    // 已经注册的 IO 事件按照 fd 分块保存，增长时只分配新的块，已有的块不会移动，
+    // 主线程注册新连接的同时，IO 线程可以继续访问已经注册的 fd
+    aeFileEvent **eventChunks;
+    aeFiredEvent *fired; // 触发的 IO 事件，长度为 setSize
     aeApiState apiData;
+    aeFileEvent &fileEvent(int fd) { return eventChunks[fd / AE_SETSIZE_CHUNK][fd % AE_SETSIZE_CHUNK]; }
     // timeEvent
-    size_t numberOfTimeEvent;
-    std::list<aeTimeEvent> aeTimeEventList;
+    // 最小堆按照触发时间排序，堆中只保存 (触发时间, id)，事件本身保存在 aeTimeEvents 中
+    // 删除事件时只从 aeTimeEvents 中删除，堆顶的 id 已经不存在时直接丢弃
+    long long timeEventNextId;
+    std::unordered_map<long long, aeTimeEvent> aeTimeEvents;
+    std::vector<std::pair<std::chrono::steady_clock::time_point, long long>> aeTimeEventHeap;
     bool aeEventLoopStop; // 事件循环停止标志
     // 处理时间事件
-    void addTimeEventToLoop(std::function<void(Server &)> func, std::chrono::milliseconds ms); // 添加时间事件
-    void dealWithTimeEvents(Server &server); // 处理时间事件
+    // 添加时间事件，delay 之后触发，period 不为 0 时之后每隔 period 触发一次，返回事件的 id
+    long long addTimeEventToLoop(std::function<void(Server &)> func, std::chrono::milliseconds delay,
+                                 std::chrono::milliseconds period = std::chrono::milliseconds(0));
+    bool deleteTimeEvent(long long id); // 删除时间事件，事件不存在时返回 false
+    void dealWithTimeEvents(Server &server); // 处理所有已经到期的时间事件
+    // 距离最近的时间事件还需要等待的毫秒数，不超过 maxWait，没有时间事件时返回 maxWait
+    int timeEventWaitTime(int maxWait);
 
     // before .... after
     std::function<void(Server &)> beforeSleep;
@@ -103,30 +139,20 @@ public:
     // 处理标志
     int flags;
 
-    aeEventLoop() : aeEventLoopStop(false), maxfd(INT8_MAX), setSize(INT8_MAX), flags(0), events(nullptr), fired(nullptr)
-    {
-        events = new aeFileEvent[this->setSize];
-        fired = new aeFiredEvent[this->setSize];
-        aeApiCreate(*this);
-    }
-    aeEventLoop(int setSize) : aeEventLoopStop(false), maxfd(INT8_MAX), setSize(setSize), flags(0), events(nullptr), fired(nullptr)
-    {
-        events = new aeFileEvent[this->setSize];
-        fired = new aeFiredEvent[this->setSize];
-        aeApiCreate(*this);
-    }
-
-    ~aeEventLoop()
-    {
-        aeApiFree(*this);
-        if(events != nullptr) delete [] events;
-        if(fired != nullptr) delete [] fired;
-    }
+    // maxSetSize 一般为 maxclients + CONFIG_FDSET_INCR，事件表最初只有一块，注册更大的 fd 时增长
+    explicit aeEventLoop(int maxSetSize = CONFIG_DEFAULT_MAX_CLIENTS + CONFIG_FDSET_INCR);
+
+    ~aeEventLoop();
 
+    aeEventLoop(const aeEventLoop &el) = delete;
     aeEventLoop& operator=(const aeEventLoop &el) = delete;
 private:
 };
 
+// 把事件表扩大到可以容纳 setSize 个 fd，超过 maxSetSize 时返回 -1，事件表不会缩小
+// 只能由调用 aeApiPoll 的线程调用
+int aeResizeSetSize(aeEventLoop &eventloop, int setSize);
+
 // IO 线程处理的信息
 class IOThreadNews
 {
@@ -135,30 +161,57 @@ public:
     bool isRead;
     std::string str;
     IOThreadNews() = default;
-    IOThreadNews(int fd, bool isRead, std::string str) : fd(fd), isRead(isRead), str(str) {}
-    IOThreadNews& operator=(const IOThreadNews &news)
-    {
-        this->fd = news.fd;
-        this->isRead = news.isRead;
-        this->str = news.str;
-        return *this;
-    }
+    IOThreadNews(int fd, bool isRead, std::string str) : fd(fd), isRead(isRead), str(std::move(str)) {}
 };
 
-// 添加 IO 事件
-void aeCreateFileEvent(int fd, aeEventLoop &eventloop, std::function<void(Server &, aeEventLoop &, void*)> func, int mask, void *clientData);
+// 每个 IO 线程回收的命令和回复缓冲区的最大数目
+constexpr size_t IO_RECYCLE_SIZE = 1024;
+// 占用内存超过这个值的命令和回复缓冲区不回收，大命令的内存不会一直留在池中
+constexpr size_t IO_RECYCLE_MAX_BYTES = 16 * 1024;
+
+// 主线程和一个 IO 线程之间来回传递的对象，稳定状态下命令和回复经过线程之间的队列时不需要分配内存
+// IO 线程解析命令时取出回收的 Command，主线程执行完毕后放回，key 和 value 的内存被复用
+// 主线程合并回复时取出回收的缓冲区，IO 线程发送完毕后放回
+class IOThreadRecycler
+{
+public:
+    IOThreadRecycler() : _commands(IO_RECYCLE_SIZE, false), _replies(IO_RECYCLE_SIZE, false) {}
+    // 没有回收的对象时返回 false，参数不变
+    bool getCommand(Command &cmd) { return _commands.try_pop(cmd); }
+    bool getReply(std::string &reply) { return _replies.try_pop(reply); }
+    // 过大或者池已满时不回收，由调用者释放
+    void putCommand(Command &&cmd);
+    void putReply(std::string &&reply);
+private:
+    mpmc_ring_queue<Command> _commands;
+    mpmc_ring_queue<std::string> _replies;
+};
+
+// 添加 IO 事件，fd 超过事件表的上限时返回 -1
+int aeCreateFileEvent(int fd, aeEventLoop &eventloop, aeFileProc *proc, int mask, void *clientData);
+
+// 主线程每次从执行队列中批量取出的命令数目
+constexpr size_t EXEC_BATCH_SIZE = 256;
+// IO 线程每次从任务队列中批量取出的任务数目
+constexpr size_t IO_BATCH_SIZE = 64;
 
 // 事件循环函数
-void aeMain(Server &server, aeEventLoop &aeLoop, std::vector<threadsafe_queue<IOThreadNews>> &io_q, threadsafe_queue<std::pair<int, Command>> &exe_q);
+// recycle[i] 为主线程和第 i 个 IO 线程之间回收的对象
+void aeMain(Server &server, aeEventLoop &aeLoop, std::vector<mpmc_ring_queue<IOThreadNews>> &io_q, mpmc_ring_queue<std::pair<int, Command>> &exe_q,
+            std::vector<IOThreadRecycler> &recycle);
 
 
 // 服务器连接客户端
 void aeServerConnectToClient(Server &server, aeEventLoop &aeloop, void*);
 
+// 接受 listenFd 上所有等待的连接，并注册到 aeloop 中，超过 maxclients 的连接会被直接关闭
+void acceptClients(Server &server, int listenFd, aeEventLoop &aeloop);
+
 // 读取客户端的发送的数据并处理
 // 客户端和服务器的沟通方式
 // 双发在发送内容前首先发送一个size_t大小的数据包，表明接下来要发送的数据包的长度
 // 发送完长度之后才会正在发送数据包
+// 数据先读入连接的输入缓冲区，一次可以处理多条流水线发送的命令
 void readQueryFromClient(int fd, Server &server, aeEventLoop &aeLoop, void *clientData);
 
 // 关闭客户端
@@ -166,8 +219,35 @@ void closeClient(int fd, Server &server, aeEventLoop &aeLoop);
 
 
 
+// IO 线程读取 fd 上可读的数据，把输入缓冲区中所有完整的命令放入执行队列
+// clientId 是主线程回复时使用的编号，clientId % IOThreadNum 为负责该连接的 IO 线程
+// 解析命令时复用 recycle 中回收的 Command
+// 客户端关闭或者命令格式非法时返回 false
+bool readCommandsFromClient(int fd, int clientId, Server &server, aeEventLoop &aeloop, mpmc_ring_queue<std::pair<int, Command>> &exe_q,
+                            IOThreadRecycler &recycle);
+
+// 将一条回复按照发送格式追加到 out 中
+void appendReplyFrame(std::string &out, const std::string &reply);
+
+// 向客户端发送一批写任务，写任务中的 str 已经是发送格式，可能包含多条回复，为空时表示只发送不追加
+// 写任务的 fd 为 clientId，实际的 fd 为 clientId / idDivisor，发送完毕的回复缓冲区放回 recycle
+void writeRepliesToClients(Server &server, aeEventLoop &aeloop, std::vector<IOThreadNews> &replies, size_t idDivisor, IOThreadRecycler &recycle);
+
+// 发送连接输出缓冲区中的数据，socket 写满时注册可写事件，发送完毕后取消
+// io_uring 后端只准备发送请求，在下一次 aeApiPoll 时和其他连接的请求一起提交，发送完成后触发可写事件
+// 连接出错或者输出缓冲区超过限制时关闭连接并返回 false
+bool flushClientReplies(Client *c, Server &server, aeEventLoop &aeLoop);
+
 // IO 线程运行函数
-void IOThreadMain(Server &server, aeEventLoop &aeloop, threadsafe_queue<IOThreadNews> &io_q, threadsafe_queue<std::pair<int, Command>> &exe_q);
+// 主线程负责 accept 和监听所有客户端，IO 线程只负责读写
+void IOThreadMain(Server &server, aeEventLoop &aeloop, mpmc_ring_queue<IOThreadNews> &io_q, mpmc_ring_queue<std::pair<int, Command>> &exe_q,
+                  IOThreadRecycler &recycle);
+
+// 多监听模式下 IO 线程的运行函数
+// 每个 IO 线程拥有独立的事件循环和 SO_REUSEPORT 监听套接字，自己 accept、读取和解析命令，
+// 只把命令交给主线程执行，clientId 为 fd * IOThreadNum + id，主线程据此把回复发回该线程
+void IOThreadLoopMain(Server &server, size_t id, mpmc_ring_queue<IOThreadNews> &io_q, mpmc_ring_queue<std::pair<int, Command>> &exe_q,
+                      IOThreadRecycler &recycle);
 
 
 #endif // REDIS_LEARN_AE
\ No newline at end of file
@@ -0,0 +1,479 @@
+#include "ae_uring.h"
+#include "ae.h"
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// user_data 的低 3 位表示请求的类型，其余部分是 fd 或者 aeUringConn 的地址
+constexpr uint64_t URING_OP_BITS = 3;
+constexpr uint64_t URING_OP_MASK = (1 << URING_OP_BITS) - 1;
+constexpr uint64_t URING_OP_IGNORE = 0; // 取消、修改请求的完成事件不需要处理
+constexpr uint64_t URING_OP_ACCEPT = 1;
+constexpr uint64_t URING_OP_POLL = 2;
+constexpr uint64_t URING_OP_RECV = 3;
+constexpr uint64_t URING_OP_SEND = 4;
+
+static uint64_t fdData(int fd, uint64_t op) { return (static_cast<uint64_t>(fd) << URING_OP_BITS) | op; }
+static uint64_t connData(aeUringConn *conn, uint64_t op) { return reinterpret_cast<uint64_t>(conn) | op; }
+
+static unsigned pollEvents(int mask)
+{
+    unsigned events = 0;
+    if(mask & AE_READABLE) events |= POLLIN;
+    if(mask & AE_WRITABLE) events |= POLLOUT;
+    return events;
+}
+
+aeUring::aeUring() : _ringFd(-1), _sqRing(nullptr), _sqRingSize(0), _sqHead(nullptr), _sqTail(nullptr), _sqMask(0), _sqEntries(0), _sqLocalTail(0),
+    _sqes(nullptr), _sqesSize(0), _cqRing(nullptr), _cqRingSize(0), _cqHead(nullptr), _cqTail(nullptr), _cqMask(0), _cqes(nullptr),
+    _bufRing(nullptr), _bufRingSize(0), _bufs(nullptr), _bufTail(0)
+{
+}
+
+aeUring *aeUring::create(unsigned entries)
+{
+    aeUring *ring = new aeUring();
+    if(!ring->setup(entries))
+    {
+        delete ring;
+        return nullptr;
+    }
+    return ring;
+}
+
+aeUring::~aeUring()
+{
+    // 关闭 io_uring 会取消所有未完成的请求，之后才能释放它们使用的内存
+    // 事件循环只在线程退出时销毁，此时还没有释放的连接不再处理
+    if(_ringFd >= 0) close(_ringFd);
+    if(_sqes != nullptr) munmap(_sqes, _sqesSize);
+    if(_cqRing != nullptr && _cqRing != _sqRing) munmap(_cqRing, _cqRingSize);
+    if(_sqRing != nullptr) munmap(_sqRing, _sqRingSize);
+    free(_bufRing);
+    free(_bufs);
+}
+
+bool aeUring::setup(unsigned entries)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // 只有创建它的线程提交请求，内核推迟到 io_uring_enter 时才处理完成事件，减少中断当前线程
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 4;
+    _ringFd = syscall(__NR_io_uring_setup, entries, &p);
+    if(_ringFd < 0 && errno == EINVAL)
+    { // 内核版本较低，不使用这些标志
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        _ringFd = syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if(_ringFd < 0) return false;
+    // 需要 io_uring_enter 支持超时参数，完成队列满时内核不能丢弃事件
+    if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) return false;
+
+    // 映射提交队列、完成队列和 sqe 数组
+    _sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+    void *ptr = mmap(nullptr, _sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _ringFd, IORING_OFF_SQ_RING);
+    if(ptr == MAP_FAILED) return false;
+    _sqRing = ptr;
+    if(p.features & IORING_FEAT_SINGLE_MMAP) _cqRing = _sqRing;
+    else
+    {
+        ptr = mmap(nullptr, _cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _ringFd, IORING_OFF_CQ_RING);
+        if(ptr == MAP_FAILED) return false;
+        _cqRing = ptr;
+    }
+    _sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    ptr = mmap(nullptr, _sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _ringFd, IORING_OFF_SQES);
+    if(ptr == MAP_FAILED) return false;
+    _sqes = static_cast<io_uring_sqe *>(ptr);
+
+    char *sq = static_cast<char *>(_sqRing);
+    _sqHead = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    _sqTail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    _sqMask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    _sqEntries = p.sq_entries;
+    _sqLocalTail = *_sqTail;
+    // sqe 的下标和提交队列中的位置一一对应
+    unsigned *array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    for(unsigned i=0;i<p.sq_entries;++i) array[i] = i;
+    char *cq = static_cast<char *>(_cqRing);
+    _cqHead = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    _cqTail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    _cqMask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    _cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+
+    // 注册缓冲区环，multishot recv 每次从中取出一个缓冲区存放收到的数据
+    // 缓冲区环需要按页对齐
+    _bufRingSize = AE_URING_BUF_COUNT * sizeof(io_uring_buf);
+    if(posix_memalign(&ptr, sysconf(_SC_PAGESIZE), _bufRingSize) != 0) return false;
+    memset(ptr, 0, _bufRingSize);
+    _bufRing = static_cast<io_uring_buf_ring *>(ptr);
+    _bufs = static_cast<char *>(malloc(static_cast<size_t>(AE_URING_BUF_COUNT) * AE_URING_BUF_SIZE));
+    if(_bufs == nullptr) return false;
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(_bufRing);
+    reg.ring_entries = AE_URING_BUF_COUNT;
+    reg.bgid = 0;
+    if(syscall(__NR_io_uring_register, _ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+    for(unsigned i=0;i<AE_URING_BUF_COUNT;++i) recycleBuffer(static_cast<unsigned short>(i));
+    __atomic_store_n(&_bufRing->tail, _bufTail, __ATOMIC_RELEASE);
+    return true;
+}
+
+// 提交队列满时先提交已经填充的请求
+io_uring_sqe *aeUring::getSqe()
+{
+    if(_sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+    {
+        enter(0, 0);
+        if(_sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) return nullptr;
+    }
+    io_uring_sqe *sqe = &_sqes[_sqLocalTail & _sqMask];
+    ++_sqLocalTail;
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    return sqe;
+}
+
+// 提交所有已经填充的请求，并等待至少 minComplete 个完成事件，最多等待 waitTime 毫秒，-1 表示一直等待
+int aeUring::enter(unsigned minComplete, int waitTime)
+{
+    __atomic_store_n(_sqTail, _sqLocalTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = _sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    __kernel_timespec ts;
+    if(minComplete > 0 && waitTime >= 0)
+    {
+        ts.tv_sec = waitTime / 1000;
+        ts.tv_nsec = static_cast<long long>(waitTime % 1000) * 1000000;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+    return syscall(__NR_io_uring_enter, _ringFd, toSubmit, minComplete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+bool aeUring::armAccept(int fd)
+{
+    io_uring_sqe *sqe = getSqe();
+    if(sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = fdData(fd, URING_OP_ACCEPT);
+    return true;
+}
+
+bool aeUring::armPoll(int fd, int mask)
+{
+    io_uring_sqe *sqe = getSqe();
+    if(sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = pollEvents(mask);
+    sqe->user_data = fdData(fd, URING_OP_POLL);
+    return true;
+}
+
+bool aeUring::armRecv(aeUringConn *conn)
+{
+    io_uring_sqe *sqe = getSqe();
+    if(sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = connData(conn, URING_OP_RECV);
+    conn->recvArmed = true;
+    ++conn->inflight;
+    return true;
+}
+
+// 按照 user_data 取消请求，被取消的请求会产生一个 -ECANCELED 的完成事件
+void aeUring::cancel(uint64_t userData)
+{
+    io_uring_sqe *sqe = getSqe();
+    if(sqe == nullptr) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = userData;
+    sqe->user_data = URING_OP_IGNORE;
+}
+
+void aeUring::recycleBuffer(unsigned short bid)
+{
+    // 头文件中的柔性数组在 C++ 中会被编译器加上偏移，直接按照 io_uring_buf 数组访问
+    // 不能写入 resv 字段，第一个元素的 resv 就是环的 tail
+    io_uring_buf *buf = reinterpret_cast<io_uring_buf *>(_bufRing) + (_bufTail & (AE_URING_BUF_COUNT - 1));
+    buf->addr = reinterpret_cast<uint64_t>(_bufs + static_cast<size_t>(bid) * AE_URING_BUF_SIZE);
+    buf->len = AE_URING_BUF_SIZE;
+    buf->bid = bid;
+    ++_bufTail;
+}
+
+int aeUring::addEvent(aeEventLoop &eventloop, int fd, int mask)
+{
+    Client *c = static_cast<Client *>(eventloop.fileEvent(fd).clientData);
+    if(c != nullptr)
+    { // 客户端连接，可写事件由发送完成事件代替
+        aeUringConn *conn = static_cast<aeUringConn *>(c->apiData);
+        if(conn == nullptr)
+        {
+            conn = new aeUringConn(c);
+            c->apiData = conn;
+            c->queryFedByLoop = true;
+        }
+        if((mask & AE_READABLE) && !conn->recvArmed && !armRecv(conn)) return -1;
+        return 0;
+    }
+    auto it = _watched.find(fd);
+    if(it == _watched.end())
+    {
+        int listening = 0;
+        socklen_t len = sizeof(listening);
+        bool listener = getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 && listening;
+        _watched[fd] = Watched{mask, listener};
+        return (listener ? armAccept(fd) : armPoll(fd, mask)) ? 0 : -1;
+    }
+    int merged = it->second.mask | mask;
+    if(merged == it->second.mask) return 0;
+    it->second.mask = merged;
+    if(it->second.listener) return 0;
+    // 原地修改 multishot poll 监听的事件
+    io_uring_sqe *sqe = getSqe();
+    if(sqe == nullptr) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = fdData(fd, URING_OP_POLL);
+    sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = pollEvents(merged);
+    sqe->user_data = URING_OP_IGNORE;
+    return 0;
+}
+
+void aeUring::delEvent(aeEventLoop &eventloop, int fd, int delmask)
+{
+    Client *c = static_cast<Client *>(eventloop.fileEvent(fd).clientData);
+    if(c != nullptr)
+    {
+        aeUringConn *conn = static_cast<aeUringConn *>(c->apiData);
+        if(conn != nullptr && (delmask & AE_READABLE) && conn->recvArmed) cancel(connData(conn, URING_OP_RECV));
+        return;
+    }
+    auto it = _watched.find(fd);
+    if(it == _watched.end()) return;
+    int mask = it->second.mask & ~delmask;
+    if(mask == it->second.mask) return;
+    if(mask != AE_NONE)
+    {
+        it->second.mask = mask;
+        if(it->second.listener) return;
+        io_uring_sqe *sqe = getSqe();
+        if(sqe == nullptr) return;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = fdData(fd, URING_OP_POLL);
+        sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = pollEvents(mask);
+        sqe->user_data = URING_OP_IGNORE;
+        return;
+    }
+    cancel(fdData(fd, it->second.listener ? URING_OP_ACCEPT : URING_OP_POLL));
+    _watched.erase(it);
+}
+
+int aeUring::poll(aeEventLoop &eventloop, int waitTime)
+{
+    bool pending = _sqLocalTail != __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+    bool ready = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE) != *_cqHead;
+    // 已经有完成事件并且没有要提交的请求时不需要进入内核
+    if(pending || !ready)
+    {
+        int ret = enter(ready || waitTime == 0 ? 0 : 1, waitTime);
+        if(ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) return -1;
+    }
+    int numevents = 0;
+    unsigned short bufTail = _bufTail;
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    // 每个完成事件最多增加一个 fired 事件，剩余的完成事件留到下一轮处理
+    while(head != tail && numevents < eventloop.setSize)
+    {
+        handleCqe(eventloop, &_cqes[head & _cqMask], numevents);
+        ++head;
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    // 一次性归还本轮用完的缓冲区
+    if(_bufTail != bufTail) __atomic_store_n(&_bufRing->tail, _bufTail, __ATOMIC_RELEASE);
+    for(int i=0;i<numevents;++i) _firedIndex[eventloop.fired[i].fd] = 0;
+    return numevents;
+}
+
+void aeUring::handleCqe(aeEventLoop &eventloop, const io_uring_cqe *cqe, int &numevents)
+{
+    uint64_t data = cqe->user_data;
+    int res = cqe->res;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    switch(data & URING_OP_MASK)
+    {
+    case URING_OP_ACCEPT:
+    {
+        int fd = static_cast<int>(data >> URING_OP_BITS);
+        auto it = _watched.find(fd);
+        if(res >= 0)
+        {
+            if(it == _watched.end()) close(res); // 监听已经取消
+            else
+            {
+                _accepted.emplace_back(fd, res);
+                fire(eventloop, fd, AE_READABLE, numevents);
+            }
+        }
+        // multishot accept 被内核结束时重新提交，取消的请求不再提交
+        if(!more && res != -ECANCELED && it != _watched.end()) armAccept(fd);
+        break;
+    }
+    case URING_OP_POLL:
+    {
+        int fd = static_cast<int>(data >> URING_OP_BITS);
+        auto it = _watched.find(fd);
+        if(res >= 0)
+        {
+            int mask = 0;
+            if(res & POLLIN) mask |= AE_READABLE;
+            if(res & POLLOUT) mask |= AE_WRITABLE;
+            if(res & (POLLERR|POLLHUP)) mask |= AE_READABLE|AE_WRITABLE;
+            if(it != _watched.end()) fire(eventloop, fd, mask, numevents);
+        }
+        if(!more && res >= 0 && it != _watched.end()) armPoll(fd, it->second.mask);
+        break;
+    }
+    case URING_OP_RECV:
+    {
+        aeUringConn *conn = reinterpret_cast<aeUringConn *>(data & ~URING_OP_MASK);
+        if(cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            unsigned short bid = static_cast<unsigned short>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            if(res > 0 && !conn->closing) conn->c->appendQuery(_bufs + static_cast<size_t>(bid) * AE_URING_BUF_SIZE, res);
+            recycleBuffer(bid);
+        }
+        if(!conn->closing)
+        {
+            // -ENOBUFS 表示缓冲区暂时用完，重新提交即可，其他错误按照连接关闭处理
+            if(res == 0 || (res < 0 && res != -ENOBUFS)) conn->c->queryClosed = true;
+            if(res != -ENOBUFS) fire(eventloop, conn->c->fd, AE_READABLE, numevents);
+        }
+        if(!more)
+        {
+            conn->recvArmed = false;
+            if(!conn->closing && !conn->c->queryClosed && !armRecv(conn))
+            { // 无法重新提交时关闭连接
+                conn->c->queryClosed = true;
+                fire(eventloop, conn->c->fd, AE_READABLE, numevents);
+            }
+            requestDone(conn);
+        }
+        break;
+    }
+    case URING_OP_SEND:
+    {
+        aeUringConn *conn = reinterpret_cast<aeUringConn *>(data & ~URING_OP_MASK);
+        conn->sending = false;
+        if(!conn->closing)
+        {
+            if(res >= 0) conn->c->consumeReplies(static_cast<size_t>(res));
+            else conn->sendFailed = true;
+            // 还有剩余的数据或者发送出错时通知上层，由 flushClientReplies 继续发送或者关闭连接
+            if(conn->sendFailed || conn->c->hasPendingReplies()) fire(eventloop, conn->c->fd, AE_WRITABLE, numevents);
+        }
+        requestDone(conn);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// 同一个 fd 在一轮中的多个完成事件合并为一个 fired 事件
+void aeUring::fire(aeEventLoop &eventloop, int fd, int mask, int &numevents)
+{
+    if(fd >= static_cast<int>(_firedIndex.size())) _firedIndex.resize(fd + 1, 0);
+    int &index = _firedIndex[fd];
+    if(index == 0)
+    {
+        eventloop.fired[numevents].fd = fd;
+        eventloop.fired[numevents].mask = mask;
+        index = ++numevents;
+    }
+    else eventloop.fired[index - 1].mask |= mask;
+}
+
+void aeUring::requestDone(aeUringConn *conn)
+{
+    if(--conn->inflight == 0 && conn->closing)
+    {
+        delete conn->c;
+        delete conn;
+    }
+}
+
+int aeUring::accept(int listenFd)
+{
+    for(auto it = _accepted.begin();it != _accepted.end();++it)
+    {
+        if(it->first != listenFd) continue;
+        int fd = it->second;
+        _accepted.erase(it);
+        return fd;
+    }
+    return -1;
+}
+
+bool aeUring::sendReplies(Client *c)
+{
+    aeUringConn *conn = static_cast<aeUringConn *>(c->apiData);
+    if(conn == nullptr || conn->sendFailed) return false;
+    if(conn->sending || !c->hasPendingReplies()) return true;
+    io_uring_sqe *sqe = getSqe();
+    if(sqe == nullptr) return false;
+    memset(&conn->msg, 0, sizeof(msghdr));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = c->fillReplyIov(conn->iov, PROTO_REPLY_IOV_MAX);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&conn->msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL; // 对端关闭时返回错误而不是产生 SIGPIPE
+    sqe->user_data = connData(conn, URING_OP_SEND);
+    conn->sending = true;
+    ++conn->inflight;
+    return true;
+}
+
+void aeUring::freeClient(Client *c)
+{
+    aeUringConn *conn = static_cast<aeUringConn *>(c->apiData);
+    if(conn == nullptr)
+    {
+        delete c;
+        return;
+    }
+    conn->closing = true;
+    if(conn->recvArmed) cancel(connData(conn, URING_OP_RECV));
+    if(conn->inflight == 0)
+    {
+        delete c;
+        delete conn;
+    }
+}
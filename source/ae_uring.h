@@ -0,0 +1,111 @@
+#ifndef REDIS_LEARN_AE_URING
+#define REDIS_LEARN_AE_URING
+// 基于 io_uring 的事件循环后端
+// 直接使用 io_uring_setup / io_uring_enter / io_uring_register 系统调用，不依赖 liburing，需要 6.0 以上的内核
+// 监听套接字使用 multishot accept，客户端连接使用 multishot recv，数据由内核写入注册的缓冲区环，
+// 回复使用 sendmsg 请求，一轮循环中所有连接的请求在 aeApiPoll 中和等待事件一起通过一次 io_uring_enter 提交
+// 完成事件转换为 aeFiredEvent，上层仍然按照可读、可写事件处理：
+//   可读：连接的数据已经追加到输入缓冲区中，或者连接已经关闭
+//   可写：一次发送已经完成，输出缓冲区中还有剩余的数据，或者发送出错
+// 事件循环和它的连接只能由创建它的线程访问
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include "networking.h"
+
+class aeEventLoop;
+
+constexpr unsigned AE_URING_ENTRIES = 1024; // 提交队列的长度，完成队列是它的 4 倍
+constexpr unsigned AE_URING_BUF_COUNT = 256; // 缓冲区环中缓冲区的数目，必须是 2 的幂
+constexpr unsigned AE_URING_BUF_SIZE = 16 * 1024; // 每个缓冲区的大小
+
+// io_uring 附加在每个客户端连接上的状态
+class aeUringConn
+{
+public:
+    Client *c;
+    int inflight; // 还没有完成的请求数，连接关闭后等它归零才能释放
+    bool recvArmed; // multishot recv 是否还在工作
+    bool sending; // 是否有正在进行的发送
+    bool sendFailed;
+    bool closing;
+    msghdr msg; // 发送请求使用，发送完成之前不能修改
+    iovec iov[PROTO_REPLY_IOV_MAX];
+    explicit aeUringConn(Client *c) : c(c), inflight(0), recvArmed(false), sending(false), sendFailed(false), closing(false), msg() {}
+};
+
+class aeUring
+{
+public:
+    // 内核不支持或者没有权限时返回 nullptr
+    static aeUring *create(unsigned entries);
+    ~aeUring();
+    aeUring(const aeUring &) = delete;
+    aeUring& operator=(const aeUring &) = delete;
+
+    // 和 aeApi* 的语义相同
+    int addEvent(aeEventLoop &eventloop, int fd, int mask);
+    void delEvent(aeEventLoop &eventloop, int fd, int delmask);
+    int poll(aeEventLoop &eventloop, int waitTime);
+
+    // 取出 listenFd 上一个已经由 multishot accept 建立的连接，没有时返回 -1
+    int accept(int listenFd);
+    // 为连接准备一个发送请求，已经有发送在进行时等它完成后再发送，发送出错时返回 false
+    bool sendReplies(Client *c);
+    // 连接关闭，还有请求没有完成时推迟释放
+    void freeClient(Client *c);
+
+private:
+    // 非客户端的 fd，监听套接字使用 multishot accept，其他使用 multishot poll
+    struct Watched
+    {
+        int mask;
+        bool listener;
+    };
+
+    aeUring();
+    bool setup(unsigned entries);
+    io_uring_sqe *getSqe();
+    int enter(unsigned minComplete, int waitTime);
+    bool armAccept(int fd);
+    bool armPoll(int fd, int mask);
+    bool armRecv(aeUringConn *conn);
+    void cancel(uint64_t userData);
+    void recycleBuffer(unsigned short bid);
+    void handleCqe(aeEventLoop &eventloop, const io_uring_cqe *cqe, int &numevents);
+    void fire(aeEventLoop &eventloop, int fd, int mask, int &numevents);
+    void requestDone(aeUringConn *conn);
+
+    int _ringFd;
+    // 提交队列
+    void *_sqRing;
+    size_t _sqRingSize;
+    unsigned *_sqHead;
+    unsigned *_sqTail;
+    unsigned _sqMask;
+    unsigned _sqEntries;
+    unsigned _sqLocalTail; // 已经填充但还没有提交的请求在 _sqTail 之后
+    io_uring_sqe *_sqes;
+    size_t _sqesSize;
+    // 完成队列
+    void *_cqRing;
+    size_t _cqRingSize;
+    unsigned *_cqHead;
+    unsigned *_cqTail;
+    unsigned _cqMask;
+    io_uring_cqe *_cqes;
+    // 提供给 multishot recv 的缓冲区环
+    io_uring_buf_ring *_bufRing;
+    size_t _bufRingSize;
+    char *_bufs;
+    unsigned short _bufTail;
+
+    std::unordered_map<int, Watched> _watched;
+    std::vector<std::pair<int, int>> _accepted; // (监听 fd, 新连接 fd)
+    std::vector<int> _firedIndex; // fd 在本轮 fired 数组中的位置加一，用于合并同一个 fd 的多个完成事件
+};
+
+#endif // REDIS_LEARN_AE_URING
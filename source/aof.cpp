@@ -0,0 +1,364 @@
+#include "aof.h"
+#include "crc64.h"
+#include "bio.h"
+#include <cstring>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <sstream>
+
+const char* aofFsyncPolicyName(AofFsyncPolicy policy)
+{
+    switch(policy)
+    {
+        case AOF_FSYNC_ALWAYS: return "always";
+        case AOF_FSYNC_EVERYSEC: return "everysec";
+        default: return "no";
+    }
+}
+
+bool aofParseFsyncPolicy(const std::string &name, AofFsyncPolicy &policy)
+{
+    if(name == "always") policy = AOF_FSYNC_ALWAYS;
+    else if(name == "everysec") policy = AOF_FSYNC_EVERYSEC;
+    else if(name == "no") policy = AOF_FSYNC_NO;
+    else return false;
+    return true;
+}
+
+// ==============================AofWriter==============================
+AofWriter::AofWriter() : _fd(-1), _size(0), _policy(AOF_FSYNC_DEFAULT), _lastWriteOk(true), _fsyncs(0), _unsynced(false) {}
+
+AofWriter::~AofWriter()
+{
+    close();
+}
+
+bool AofWriter::open(const std::string &fileName, AofFsyncPolicy policy)
+{
+    close();
+    _fd = ::open(fileName.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if(_fd == -1) return false;
+    struct stat st;
+    if(fstat(_fd, &st) == -1)
+    {
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+    _size = st.st_size;
+    _policy = policy;
+    _lastWriteOk = true;
+    _unsynced = false;
+    _lastFsync = std::chrono::steady_clock::now();
+    _buf.clear();
+    if(_size == 0)
+    {
+        _buf.append(AOF_MAGIC, sizeof(AOF_MAGIC));
+        _buf.append(reinterpret_cast<const char *>(&AOF_VERSION), sizeof(AOF_VERSION));
+    }
+    return true;
+}
+
+void AofWriter::append(uint8_t cmd, std::string_view key, std::string_view value)
+{
+    if(_fd == -1) return;
+    size_t start = _buf.size();
+    uint32_t payload = static_cast<uint32_t>(AOF_RECORD_MIN_PAYLOAD + key.size() + value.size());
+    uint32_t keyLen = static_cast<uint32_t>(key.size());
+    _buf.reserve(start + AOF_RECORD_OVERHEAD + key.size() + value.size());
+    _buf.append(reinterpret_cast<const char *>(&payload), sizeof(payload));
+    _buf.push_back(static_cast<char>(cmd));
+    _buf.append(reinterpret_cast<const char *>(&keyLen), sizeof(keyLen));
+    _buf.append(key.data(), key.size());
+    _buf.append(value.data(), value.size());
+    uint64_t crc = crc64(0, _buf.data() + start, _buf.size() - start);
+    _buf.append(reinterpret_cast<const char *>(&crc), sizeof(crc));
+}
+
+bool AofWriter::flush()
+{
+    if(_fd == -1) return true;
+    size_t written = 0;
+    while(written < _buf.size())
+    {
+        ssize_t n = write(_fd, _buf.data() + written, _buf.size() - written);
+        if(n == -1)
+        {
+            if(errno == EINTR) continue;
+            break;
+        }
+        written += n;
+    }
+    if(written < _buf.size())
+    { // 截掉写入了一部分的记录，下一次从完整的记录之后重新写入
+        if(written > 0 && ftruncate(_fd, _size) == -1)
+        { // 无法截断时保留已经写入的部分，只留下剩余的数据
+            _size += written;
+            _buf.erase(0, written);
+        }
+        _lastWriteOk = false;
+        return false;
+    }
+    _size += written;
+    _buf.clear();
+    _lastWriteOk = true;
+    if(written > 0) _unsynced = true;
+    if(!_unsynced || _policy == AOF_FSYNC_NO) return true;
+    if(_policy == AOF_FSYNC_ALWAYS)
+    {
+        if(fdatasync(_fd) == -1)
+        {
+            _lastWriteOk = false;
+            return false;
+        }
+        ++_fsyncs;
+        _unsynced = false;
+        return true;
+    }
+    // everysec，上一次的 fdatasync 还没有完成时 (磁盘很慢) 不再提交新的任务
+    auto now = std::chrono::steady_clock::now();
+    if(now - _lastFsync >= std::chrono::milliseconds(AOF_FSYNC_INTERVAL_MS) && bioPendingJobsOfType(BIO_AOF_FSYNC) == 0)
+    {
+        bioCreateFsyncJob(_fd);
+        ++_fsyncs;
+        _unsynced = false;
+        _lastFsync = now;
+    }
+    return true;
+}
+
+bool AofWriter::close()
+{
+    if(_fd == -1) return true;
+    bool ok = flush();
+    bioDrainWorker(BIO_AOF_FSYNC); // 还在使用这个 fd 的 fdatasync 任务
+    if(fdatasync(_fd) == -1) ok = false;
+    else ++_fsyncs;
+    if(::close(_fd) == -1) ok = false;
+    _fd = -1;
+    return ok;
+}
+
+bool AofWriter::closeInBackground()
+{
+    if(_fd == -1) return true;
+    bool ok = flush();
+    bioCreateCloseAofJob(_fd);
+    ++_fsyncs;
+    _fd = -1;
+    return ok;
+}
+
+// ==============================载入==============================
+AofLoadStatus aofLoadFile(const std::string &fileName,
+                          const std::function<void(uint8_t, std::string_view, std::string_view)> &apply,
+                          uint64_t &validBytes)
+{
+    validBytes = 0;
+    int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return errno == ENOENT ? AOF_LOAD_NOT_EXIST : AOF_LOAD_BAD;
+    struct stat st;
+    if(fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return AOF_LOAD_BAD;
+    }
+    size_t size = st.st_size;
+    if(size == 0)
+    { // 刚创建还没有写入头部
+        close(fd);
+        return AOF_LOAD_OK;
+    }
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return AOF_LOAD_BAD;
+    madvise(map, size, MADV_SEQUENTIAL);
+    const char *data = static_cast<const char *>(map);
+
+    AofLoadStatus status = AOF_LOAD_OK;
+    if(size < AOF_HEADER_SIZE)
+    { // 头部只写入了一部分
+        status = memcmp(data, AOF_MAGIC, std::min(size, sizeof(AOF_MAGIC))) == 0 ? AOF_LOAD_TRUNCATED : AOF_LOAD_BAD;
+        munmap(map, size);
+        return status;
+    }
+    uint32_t version;
+    memcpy(&version, data + sizeof(AOF_MAGIC), sizeof(version));
+    if(memcmp(data, AOF_MAGIC, sizeof(AOF_MAGIC)) != 0 || version != AOF_VERSION)
+    {
+        munmap(map, size);
+        return AOF_LOAD_BAD;
+    }
+    size_t pos = AOF_HEADER_SIZE;
+    validBytes = pos;
+    while(pos < size)
+    {
+        uint32_t payload;
+        if(size - pos < sizeof(payload))
+        {
+            status = AOF_LOAD_TRUNCATED;
+            break;
+        }
+        memcpy(&payload, data + pos, sizeof(payload));
+        if(payload < AOF_RECORD_MIN_PAYLOAD)
+        {
+            status = AOF_LOAD_BAD;
+            break;
+        }
+        size_t recordSize = sizeof(payload) + static_cast<size_t>(payload) + sizeof(uint64_t);
+        if(size - pos < recordSize)
+        {
+            status = AOF_LOAD_TRUNCATED;
+            break;
+        }
+        const char *p = data + pos + sizeof(payload);
+        uint32_t keyLen;
+        uint64_t crc;
+        memcpy(&keyLen, p + 1, sizeof(keyLen));
+        memcpy(&crc, p + payload, sizeof(crc));
+        if(keyLen > payload - AOF_RECORD_MIN_PAYLOAD || crc64(0, data + pos, sizeof(payload) + payload) != crc)
+        {
+            status = AOF_LOAD_BAD;
+            break;
+        }
+        const char *key = p + AOF_RECORD_MIN_PAYLOAD;
+        apply(static_cast<uint8_t>(p[0]), std::string_view(key, keyLen),
+              std::string_view(key + keyLen, payload - AOF_RECORD_MIN_PAYLOAD - keyLen));
+        pos += recordSize;
+        validBytes = pos;
+    }
+    munmap(map, size);
+    return status;
+}
+
+// ==============================manifest==============================
+static std::string aofFileName(uint64_t seq, AofFileType type)
+{
+    return AOF_FILE_PREFIX + "." + std::to_string(seq) + (type == AOF_FILE_TYPE_BASE ? ".base.aof" : ".incr.aof");
+}
+
+std::string AofManifest::toString() const
+{
+    std::string content;
+    auto line = [&content](const AofInfo &info)
+    {
+        content += "file " + info.fileName + " seq " + std::to_string(info.seq) + " type " + static_cast<char>(info.type) + "\n";
+    };
+    if(!base.fileName.empty()) line(base);
+    for(auto &info : history) line(info);
+    for(auto &info : incrs) line(info);
+    return content;
+}
+
+bool AofManifest::parse(const std::string &content)
+{
+    *this = AofManifest();
+    std::istringstream in(content);
+    std::string lineStr;
+    while(std::getline(in, lineStr))
+    {
+        if(lineStr.empty()) continue;
+        std::istringstream line(lineStr);
+        std::string fileKey, seqKey, typeKey, type, extra;
+        AofInfo info;
+        if(!(line>>fileKey>>info.fileName>>seqKey>>info.seq>>typeKey>>type) || (line>>extra)) return false;
+        // 文件名只能是目录中的文件
+        if(fileKey != "file" || seqKey != "seq" || typeKey != "type" || type.size() != 1 ||
+           info.fileName.find('/') != std::string::npos || info.fileName == "." || info.fileName == "..") return false;
+        info.type = static_cast<AofFileType>(type[0]);
+        switch(info.type)
+        {
+            case AOF_FILE_TYPE_BASE:
+                if(!base.fileName.empty()) return false; // 只能有一个 BASE
+                base = info;
+                currBaseSeq = info.seq;
+                break;
+            case AOF_FILE_TYPE_INCR:
+                if(!incrs.empty() && info.seq <= incrs.back().seq) return false;
+                incrs.push_back(info);
+                currIncrSeq = info.seq;
+                break;
+            case AOF_FILE_TYPE_HIST:
+                history.push_back(info);
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+std::string AofManifest::addIncr()
+{
+    AofInfo info{aofFileName(++currIncrSeq, AOF_FILE_TYPE_INCR), currIncrSeq, AOF_FILE_TYPE_INCR};
+    incrs.push_back(info);
+    return info.fileName;
+}
+
+std::string AofManifest::replaceBase()
+{
+    if(!base.fileName.empty())
+    {
+        base.type = AOF_FILE_TYPE_HIST;
+        history.push_back(base);
+    }
+    base = AofInfo{aofFileName(++currBaseSeq, AOF_FILE_TYPE_BASE), currBaseSeq, AOF_FILE_TYPE_BASE};
+    // 重写开始时已经切换到了最后一个 INCR 文件，之前的 INCR 都已经包含在新的 BASE 中
+    while(incrs.size() > 1)
+    {
+        AofInfo info = incrs.front();
+        info.type = AOF_FILE_TYPE_HIST;
+        history.push_back(info);
+        incrs.erase(incrs.begin());
+    }
+    return base.fileName;
+}
+
+bool aofLoadManifest(const std::string &dir, AofManifest &manifest, bool &exist)
+{
+    std::string path = dir + "/" + AOF_MANIFEST_NAME;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    exist = fd != -1 || errno != ENOENT;
+    if(fd == -1) return false;
+    std::string content;
+    char buff[4096];
+    ssize_t n;
+    while((n = read(fd, buff, sizeof(buff))) > 0) content.append(buff, n);
+    close(fd);
+    return n == 0 && manifest.parse(content);
+}
+
+bool aofPersistManifest(const std::string &dir, const AofManifest &manifest)
+{
+    std::string path = dir + "/" + AOF_MANIFEST_NAME;
+    std::string tempName = path + ".tmp";
+    std::string content = manifest.toString();
+    int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1) return false;
+    size_t written = 0;
+    while(written < content.size())
+    {
+        ssize_t n = write(fd, content.data() + written, content.size() - written);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) break;
+        written += n;
+    }
+    bool ok = written == content.size() && fdatasync(fd) == 0;
+    if(close(fd) == -1) ok = false;
+    if(!ok || rename(tempName.c_str(), path.c_str()) == -1)
+    {
+        unlink(tempName.c_str());
+        return false;
+    }
+    // 同步目录，保证重命名 (以及之前重命名到目录中的 BASE 文件) 已经写入磁盘
+    int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirFd == -1) return false;
+    ok = fsync(dirFd) == 0;
+    close(dirFd);
+    return ok;
+}
@@ -0,0 +1,140 @@
+#ifndef REDIS_LEARN_AOF
+#define REDIS_LEARN_AOF
+// 二进制 AOF 文件的格式和写入
+//
+// 文件格式，所有整数都是小端：
+//   头部 8 字节  "RLAF" | 版本 uint32
+//   若干条记录  长度 uint32 | 命令 uint8 | key 的长度 uint32 | key | value | 校验值 uint64
+// 长度为命令、key 的长度、key 和 value 的总字节数，value 的长度由它推出
+// 校验值为记录中校验值之前所有字节的 CRC64，每条记录单独校验，key 和 value 可以包含任意字节
+// 宕机时文件结尾可能只写入了半条记录，载入时可以截断丢弃，中间的记录损坏时拒绝载入
+//
+// appendfsync 策略，命令总是先追加到缓冲区，每一批命令执行完之后统一写入：
+//   always   write 之后立即 fdatasync，然后才发送这一批命令的回复，一次 fdatasync 由整批命令分摊 (group commit)
+//   everysec write 之后每秒向 bio 线程提交一次 fdatasync 任务，宕机时最多丢失约 1 秒的数据
+//   no       只 write，何时写入磁盘由操作系统决定
+//
+// Multi Part AOF：AOF 由一个 BASE 文件和若干个 INCR 文件组成，放在同一个目录中，由 manifest 文件记录
+//   appendonly.aof.<seq>.base.aof   重写时数据库的完整内容
+//   appendonly.aof.<seq>.incr.aof   之后的增量命令，按 seq 的顺序载入，只有最后一个在写入
+//   appendonly.aof.manifest         每行一个文件 "file <文件名> seq <seq> type <b|i|h>"，h 表示等待删除的历史文件
+// manifest 先写入临时文件，fdatasync 之后重命名并同步目录，任何时刻磁盘上的 manifest 都描述一组完整的文件
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+constexpr char AOF_MAGIC[4] = {'R', 'L', 'A', 'F'};
+constexpr uint32_t AOF_VERSION = 1;
+constexpr size_t AOF_HEADER_SIZE = 8;
+constexpr size_t AOF_RECORD_MIN_PAYLOAD = 1 + sizeof(uint32_t); // 命令和 key 的长度
+constexpr size_t AOF_RECORD_OVERHEAD = sizeof(uint32_t) + AOF_RECORD_MIN_PAYLOAD + sizeof(uint64_t);
+// everysec 策略下 fdatasync 的间隔，unit：ms
+constexpr int AOF_FSYNC_INTERVAL_MS = 1000;
+
+enum AofFsyncPolicy {
+    AOF_FSYNC_NO = 0,
+    AOF_FSYNC_EVERYSEC,
+    AOF_FSYNC_ALWAYS
+};
+constexpr AofFsyncPolicy AOF_FSYNC_DEFAULT = AOF_FSYNC_EVERYSEC;
+
+const char* aofFsyncPolicyName(AofFsyncPolicy policy);
+// 解析 "always"、"everysec" 和 "no"，无效时返回 false
+bool aofParseFsyncPolicy(const std::string &name, AofFsyncPolicy &policy);
+
+// AOF 文件的追加写入，只由主线程调用，everysec 策略的 fdatasync 和后台关闭由 bio 线程执行
+class AofWriter
+{
+public:
+    AofWriter();
+    ~AofWriter();
+    AofWriter(const AofWriter &) = delete;
+    AofWriter& operator=(const AofWriter &) = delete;
+
+    // 以追加方式打开文件，文件为空时写入头部
+    bool open(const std::string &fileName, AofFsyncPolicy policy);
+    bool isOpen() const { return _fd != -1; }
+    // 把一条命令编码后追加到缓冲区，文件没有打开时忽略
+    void append(uint8_t cmd, std::string_view key, std::string_view value);
+    // 把缓冲区写入文件，always 策略同时 fdatasync，everysec 策略距离上一次 fdatasync 超过间隔时提交任务
+    // 缓冲区为空时也需要定期调用，保证最后一次写入之后的数据也会被同步
+    // 失败时已经写入的部分会被截掉，数据留在缓冲区中等待下一次写入，返回 false
+    bool flush();
+    // 写入缓冲区，等待还没有完成的 fdatasync 任务，fdatasync 之后关闭文件，用于退出和子进程中
+    bool close();
+    // 写入缓冲区，fdatasync 和关闭交给 bio 线程，主线程不会阻塞
+    bool closeInBackground();
+    AofFsyncPolicy policy() const { return _policy; }
+    size_t pendingBytes() const { return _buf.size(); }
+    uint64_t fileSize() const { return _size; }
+    size_t fsyncCount() const { return _fsyncs; } // 包括提交给 bio 线程的 fdatasync
+    bool lastWriteOk() const { return _lastWriteOk; }
+private:
+    int _fd;
+    std::string _buf; // 还没有写入文件的记录
+    uint64_t _size; // 已经写入文件的字节数
+    AofFsyncPolicy _policy;
+    bool _lastWriteOk;
+    size_t _fsyncs; // fdatasync 的次数
+    bool _unsynced; // 上一次 fdatasync 之后有新的写入
+    std::chrono::steady_clock::time_point _lastFsync; // 上一次提交 fdatasync 的时间
+};
+
+const std::string AOF_FILE_PREFIX = "appendonly.aof";
+const std::string AOF_MANIFEST_NAME = AOF_FILE_PREFIX + ".manifest";
+
+enum AofFileType {
+    AOF_FILE_TYPE_BASE = 'b',
+    AOF_FILE_TYPE_INCR = 'i',
+    AOF_FILE_TYPE_HIST = 'h'
+};
+
+struct AofInfo
+{
+    std::string fileName; // 目录中的文件名
+    uint64_t seq;
+    AofFileType type;
+};
+
+struct AofManifest
+{
+    AofInfo base; // base.fileName 为空表示还没有 BASE 文件
+    std::vector<AofInfo> incrs; // 按 seq 递增，最后一个是正在写入的文件
+    std::vector<AofInfo> history; // 已经被重写替换，等待删除
+    uint64_t currBaseSeq;
+    uint64_t currIncrSeq;
+
+    AofManifest() : base{std::string(), 0, AOF_FILE_TYPE_BASE}, currBaseSeq(0), currIncrSeq(0) {}
+    std::string toString() const;
+    // 解析 manifest 的内容，格式无效时返回 false
+    bool parse(const std::string &content);
+    // 添加一个新的 INCR 文件，返回文件名
+    std::string addIncr();
+    // 重写完成时使用新的 BASE 文件，原来的 BASE 和除了最后一个之外的 INCR 文件变为历史文件，返回新 BASE 的文件名
+    std::string replaceBase();
+};
+
+// 读取并解析 dir 中的 manifest，文件不存在或者格式无效时返回 false，exist 表示文件是否存在
+bool aofLoadManifest(const std::string &dir, AofManifest &manifest, bool &exist);
+// 原子地替换 dir 中的 manifest
+bool aofPersistManifest(const std::string &dir, const AofManifest &manifest);
+
+enum AofLoadStatus {
+    AOF_LOAD_OK = 0,
+    AOF_LOAD_NOT_EXIST, // 文件不存在
+    AOF_LOAD_TRUNCATED, // 结尾有不完整的记录，之前的记录都已经载入
+    AOF_LOAD_BAD // 头部无效或者中间的记录损坏
+};
+
+// 按顺序载入 AOF 文件中的每条记录，对每条记录调用 apply，视图只在调用期间有效
+// validBytes 为最后一条完整记录之后的偏移，结尾不完整时可以把文件截断到这里
+AofLoadStatus aofLoadFile(const std::string &fileName,
+                          const std::function<void(uint8_t, std::string_view, std::string_view)> &apply,
+                          uint64_t &validBytes);
+
+#endif // REDIS_LEARN_AOF
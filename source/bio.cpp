@@ -0,0 +1,237 @@
+#include "bio.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+enum BioWorker {
+    BIO_WORKER_CLOSE_FILE = 0,
+    BIO_WORKER_AOF_FSYNC,
+    BIO_WORKER_LAZY_UNLINK,
+    BIO_WORKER_NUM
+};
+
+// 任务类型到线程的映射，AOF 的 fdatasync 和关闭在同一个线程中按顺序执行
+constexpr BioWorker bioJobToWorker[BIO_NUM_OPS] = {
+    BIO_WORKER_CLOSE_FILE, BIO_WORKER_AOF_FSYNC, BIO_WORKER_AOF_FSYNC, BIO_WORKER_LAZY_UNLINK
+};
+
+struct BioJob
+{
+    BioJobType type;
+    int fd;
+    std::chrono::steady_clock::time_point created;
+};
+
+struct BioWorkerState
+{
+    std::thread thread;
+    std::mutex mutex; // 保护 jobs、stop 和这个线程负责的任务类型的统计信息
+    std::condition_variable newJob; // 有新的任务或者需要停止
+    std::condition_variable jobDone; // 完成了一个任务
+    std::deque<BioJob> jobs; // 正在执行的任务执行完之后才从队列中移除
+    bool stop = false;
+};
+
+struct BioTypeStats
+{
+    size_t pending = 0;
+    size_t processed = 0;
+    size_t errors = 0;
+    uint64_t totalLatencyUs = 0;
+    uint64_t maxLatencyUs = 0;
+    uint64_t lastLatencyUs = 0;
+};
+
+struct BioState
+{
+    BioWorkerState workers[BIO_WORKER_NUM];
+    BioTypeStats stats[BIO_NUM_OPS];
+    pid_t pid; // 创建后台线程的进程，fork 出的子进程中没有这些线程
+};
+
+BioState *bio = nullptr;
+}
+
+static bool bioExecute(const BioJob &job)
+{
+    switch(job.type)
+    {
+        case BIO_AOF_FSYNC:
+            return fdatasync(job.fd) == 0;
+        case BIO_CLOSE_AOF:
+        {
+            bool ok = fdatasync(job.fd) == 0;
+            return close(job.fd) == 0 && ok;
+        }
+        case BIO_CLOSE_FILE:
+        case BIO_LAZY_UNLINK:
+        default:
+            return close(job.fd) == 0;
+    }
+}
+
+static void bioProcessBackgroundJobs(BioWorker worker)
+{
+    BioWorkerState &w = bio->workers[worker];
+    std::unique_lock<std::mutex> lock(w.mutex);
+    while(true)
+    {
+        w.newJob.wait(lock, [&w]() { return w.stop || !w.jobs.empty(); });
+        if(w.jobs.empty()) return; // 停止之前执行完所有任务
+        BioJob job = w.jobs.front();
+        lock.unlock();
+        bool ok = bioExecute(job);
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - job.created).count();
+        lock.lock();
+        w.jobs.pop_front();
+        BioTypeStats &st = bio->stats[job.type];
+        --st.pending;
+        ++st.processed;
+        if(!ok) ++st.errors;
+        st.totalLatencyUs += us;
+        st.lastLatencyUs = us;
+        if(us > st.maxLatencyUs) st.maxLatencyUs = us;
+        w.jobDone.notify_all();
+    }
+}
+
+void bioInit()
+{
+    if(bio != nullptr) return;
+    // 只在 bioShutdown 中释放，没有停止后台线程就 exit 时它们可能还在等待任务
+    bio = new BioState();
+    bio->pid = getpid();
+    for(int i=0;i<BIO_WORKER_NUM;++i) bio->workers[i].thread = std::thread(bioProcessBackgroundJobs, static_cast<BioWorker>(i));
+}
+
+void bioShutdown()
+{
+    if(bio == nullptr || bio->pid != getpid()) return;
+    for(auto &w : bio->workers)
+    {
+        {
+            std::lock_guard<std::mutex> lock(w.mutex);
+            w.stop = true;
+        }
+        w.newJob.notify_one();
+        w.thread.join();
+    }
+    delete bio;
+    bio = nullptr;
+}
+
+static void bioSubmitJob(BioJobType type, int fd)
+{
+    BioJob job{type, fd, std::chrono::steady_clock::now()};
+    if(bio == nullptr || bio->pid != getpid())
+    {
+        bioExecute(job);
+        return;
+    }
+    BioWorkerState &w = bio->workers[bioJobToWorker[type]];
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.jobs.push_back(job);
+        ++bio->stats[type].pending;
+    }
+    w.newJob.notify_one();
+}
+
+void bioCreateCloseJob(int fd)
+{
+    bioSubmitJob(BIO_CLOSE_FILE, fd);
+}
+
+void bioCreateFsyncJob(int fd)
+{
+    bioSubmitJob(BIO_AOF_FSYNC, fd);
+}
+
+void bioCreateCloseAofJob(int fd)
+{
+    bioSubmitJob(BIO_CLOSE_AOF, fd);
+}
+
+void bioUnlinkLazily(const std::string &fileName)
+{
+    // 打开的 fd 保持文件存在，unlink 只删除目录项，很快就会返回
+    int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if(unlink(fileName.c_str()) == -1)
+    {
+        if(fd != -1) close(fd);
+        return;
+    }
+    if(fd != -1) bioSubmitJob(BIO_LAZY_UNLINK, fd);
+}
+
+size_t bioPendingJobsOfType(BioJobType type)
+{
+    if(bio == nullptr || bio->pid != getpid()) return 0;
+    std::lock_guard<std::mutex> lock(bio->workers[bioJobToWorker[type]].mutex);
+    return bio->stats[type].pending;
+}
+
+void bioDrainWorker(BioJobType type)
+{
+    if(bio == nullptr || bio->pid != getpid()) return;
+    BioWorkerState &w = bio->workers[bioJobToWorker[type]];
+    std::unique_lock<std::mutex> lock(w.mutex);
+    w.jobDone.wait(lock, [&w]() { return w.jobs.empty(); });
+}
+
+BioStats bioGetStats(BioJobType type)
+{
+    BioStats st{0, 0, 0, 0, 0, 0};
+    if(bio == nullptr || bio->pid != getpid()) return st;
+    std::lock_guard<std::mutex> lock(bio->workers[bioJobToWorker[type]].mutex);
+    const BioTypeStats &s = bio->stats[type];
+    st.pending = s.pending;
+    st.processed = s.processed;
+    st.errors = s.errors;
+    st.totalLatencyUs = s.totalLatencyUs;
+    st.maxLatencyUs = s.maxLatencyUs;
+    st.lastLatencyUs = s.lastLatencyUs;
+    return st;
+}
+
+const char* bioJobTypeName(BioJobType type)
+{
+    switch(type)
+    {
+        case BIO_CLOSE_FILE: return "close_file";
+        case BIO_AOF_FSYNC: return "aof_fsync";
+        case BIO_CLOSE_AOF: return "close_aof";
+        case BIO_LAZY_UNLINK: return "lazy_unlink";
+        default: return "unknown";
+    }
+}
+
+void bioGenInfoString(std::string &info)
+{
+    char buff[512];
+    for(int i=0;i<BIO_NUM_OPS;++i)
+    {
+        BioJobType type = static_cast<BioJobType>(i);
+        BioStats st = bioGetStats(type);
+        const char *name = bioJobTypeName(type);
+        int len = snprintf(buff, sizeof(buff),
+            "bio_%s_pending:%zu\r\n"
+            "bio_%s_processed:%zu\r\n"
+            "bio_%s_errors:%zu\r\n"
+            "bio_%s_avg_latency_us:%llu\r\n"
+            "bio_%s_max_latency_us:%llu\r\n"
+            "bio_%s_last_latency_us:%llu\r\n",
+            name, st.pending, name, st.processed, name, st.errors,
+            name, static_cast<unsigned long long>(st.processed ? st.totalLatencyUs / st.processed : 0),
+            name, static_cast<unsigned long long>(st.maxLatencyUs),
+            name, static_cast<unsigned long long>(st.lastLatencyUs));
+        info.append(buff, len);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef REDIS_LEARN_BIO
+#define REDIS_LEARN_BIO
+// 后台 IO 线程 (background I/O)，参考 Redis 的 bio.c
+// 关闭文件、fdatasync 和删除大文件都可能阻塞很久，主线程把它们作为任务放入队列，由后台线程执行
+//
+// 每个线程有自己的任务队列，同一个线程中的任务按照放入的顺序执行：
+//   BIO_WORKER_CLOSE_FILE  关闭普通文件
+//   BIO_WORKER_AOF_FSYNC   AOF 的 fdatasync 和关闭，同一个 fd 的 fdatasync 一定在关闭之前完成，不会同步到被复用的 fd
+//   BIO_WORKER_LAZY_UNLINK 删除大文件，主线程只删除目录项，释放磁盘块的 close 在后台进行
+//
+// 没有调用 bioInit 时 (基准测试或者 fork 出的子进程中) 任务在调用线程中直接执行
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+enum BioJobType {
+    BIO_CLOSE_FILE = 0, // 关闭 fd
+    BIO_AOF_FSYNC, // fdatasync AOF 的 fd
+    BIO_CLOSE_AOF, // fdatasync 之后关闭 AOF 的 fd
+    BIO_LAZY_UNLINK, // 关闭已经删除了目录项的文件，释放磁盘空间
+    BIO_NUM_OPS
+};
+
+// 启动后台线程，只需要调用一次
+void bioInit();
+// 执行完所有已经放入的任务之后停止后台线程
+void bioShutdown();
+
+void bioCreateCloseJob(int fd);
+void bioCreateFsyncJob(int fd);
+void bioCreateCloseAofJob(int fd);
+// 删除文件，文件不存在时什么也不做
+// 先打开文件再删除目录项，文件的最后一个引用在后台关闭，删除大文件时主线程不会阻塞
+void bioUnlinkLazily(const std::string &fileName);
+
+// 某种类型还没有执行完的任务数
+size_t bioPendingJobsOfType(BioJobType type);
+// 等待执行 type 的线程完成所有已经放入的任务
+void bioDrainWorker(BioJobType type);
+
+struct BioStats
+{
+    size_t pending; // 队列中和正在执行的任务数
+    size_t processed; // 已经完成的任务数
+    size_t errors; // 执行失败的任务数
+    uint64_t totalLatencyUs; // 从放入队列到执行完成的总耗时
+    uint64_t maxLatencyUs;
+    uint64_t lastLatencyUs;
+};
+BioStats bioGetStats(BioJobType type);
+const char* bioJobTypeName(BioJobType type);
+
+// 追加每种任务的统计信息，格式和 INFO 相同，每行一个 name:value
+void bioGenInfoString(std::string &info);
+
+#endif // REDIS_LEARN_BIO
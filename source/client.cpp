@@ -10,6 +10,9 @@
 #include <string.h>
 #include <fstream>
 #include <chrono>
+#include <vector>
+#include <algorithm>
+#include <mutex>
 using namespace std;
 
 
@@ -42,7 +45,8 @@ enum CMD_FLAG {
     CMD_BGSAVE,
     CMD_SYNC,
     CMD_AOF_REWRIIE,
-    CMD_SHUTDOWN
+    CMD_SHUTDOWN,
+    CMD_INFO
 };
 
 // 命令结构体
@@ -91,6 +95,8 @@ size_t parseBinaryCmd(const char *buff, Command &cmd)
     return sizeof(CMD_FLAG) + 2 * sizeof(size_t) + keyLen + valueLen;
 }
 
+bool readReply(int sock, std::string &reply);
+
 std::string sendCmd(int sock, CMD_FLAG flag, std::string key = std::string(), std::string value = std::string())
 {
     char buff[1024];
@@ -99,14 +105,135 @@ std::string sendCmd(int sock, CMD_FLAG flag, std::string key = std::string(), st
     //std::this_thread::sleep_for(std::chrono::milliseconds(500));
     write(sock, buff, len);
     //for(;;);
-    read(sock,&len, sizeof(size_t));
-    read(sock,buff,len);
-    buff[len]='\0';
-    cout<<buff<<endl;
-    return string(buff);
+    std::string reply;
+    if(!readReply(sock, reply)) errorHandling("server closed!");
+    cout<<reply<<endl;
+    return reply;
     //this_thread::sleep_for(chrono::milliseconds(1000));
 }
 
+// 连接服务器，失败时退出
+int connectServer()
+{
+    int sock = socket(PF_INET, SOCK_STREAM, 0);
+    if(sock == -1) errorHandling("socket get error!");
+    sockaddr_in master_adr;
+    memset(&master_adr, 0, sizeof(master_adr));
+    master_adr.sin_family = AF_INET;
+    master_adr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    master_adr.sin_port = htons(9000);
+    if(connect(sock, reinterpret_cast<sockaddr *>(&master_adr), sizeof(master_adr)))
+    {
+        errorHandling("connect error!");
+    }
+    return sock;
+}
+
+// 读满 n 个字节
+bool readn(int sock, void *buff, size_t n)
+{
+    char *p = static_cast<char *>(buff);
+    while(n > 0)
+    {
+        ssize_t ret = read(sock, p, n);
+        if(ret <= 0) return false;
+        p += ret;
+        n -= ret;
+    }
+    return true;
+}
+
+// 读取一个回复，长度由服务器决定，reply 按需扩大，不会写出界
+bool readReply(int sock, std::string &reply)
+{
+    size_t len = 0;
+    if(!readn(sock, &len, sizeof(size_t))) return false;
+    reply.resize(len);
+    return len == 0 || readn(sock, &reply[0], len);
+}
+
+// 发送一条命令并等待回复，回复写入 reply，不打印，返回往返时间，单位纳秒
+int64_t roundTrip(int sock, char *buff, std::string &reply, CMD_FLAG flag, const std::string &key, const std::string &value)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t len = getBinaryCmd(buff + sizeof(size_t), flag, key, value);
+    *(size_t*)buff = len;
+    write(sock, buff, sizeof(size_t) + len); // 长度和命令一次发送
+    if(!readReply(sock, reply)) errorHandling("server closed!");
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// 一次发送 pipeline 条命令，再依次读取所有回复，返回整个批次的往返时间，单位纳秒
+int64_t pipelineRoundTrip(int sock, std::string &out, std::string &reply, char *buff, int client, int start, int pipeline)
+{
+    auto begin = std::chrono::steady_clock::now();
+    out.clear();
+    for(int i=start;i<start+pipeline;++i)
+    {
+        std::string key = "bench:" + std::to_string(client) + ":" + std::to_string(i % 1000);
+        size_t len = getBinaryCmd(buff + sizeof(size_t), i % 2 == 0 ? CMD_SET : CMD_GET, key, i % 2 == 0 ? "value" : "");
+        *(size_t*)buff = len;
+        out.append(buff, sizeof(size_t) + len);
+    }
+    write(sock, out.data(), out.size());
+    for(int i=0;i<pipeline;++i)
+    {
+        if(!readReply(sock, reply)) errorHandling("server closed!");
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+}
+
+// clients 个连接并发，每个连接交替发送 SET/GET 共 requests 次，统计往返延迟的分布
+// pipeline > 1 时每次发送 pipeline 条命令，统计的是整个批次的往返时间
+void latencyBenchmark(int clients, int requests, int pipeline)
+{
+    std::vector<int64_t> all;
+    std::mutex mtx;
+    auto start = std::chrono::steady_clock::now();
+    vector<thread> tv;
+    for(int c=0;c<clients;++c)
+    {
+        tv.emplace_back([&, c]()
+        {
+            char buff[1024]; // 只用于编码命令，key 和 value 都很短
+            std::string out, reply;
+            std::vector<int64_t> lat;
+            lat.reserve(requests);
+            int sock = connectServer();
+            for(int i=0;i<requests;i+=pipeline)
+            {
+                if(pipeline > 1)
+                {
+                    lat.push_back(pipelineRoundTrip(sock, out, reply, buff, c, i, pipeline));
+                    continue;
+                }
+                std::string key = "bench:" + std::to_string(c) + ":" + std::to_string(i % 1000);
+                if(i % 2 == 0) lat.push_back(roundTrip(sock, buff, reply, CMD_SET, key, "value"));
+                else lat.push_back(roundTrip(sock, buff, reply, CMD_GET, key, std::string()));
+            }
+            close(sock);
+            std::lock_guard<std::mutex> lk(mtx);
+            all.insert(all.end(), lat.begin(), lat.end());
+        });
+    }
+    for(auto &t : tv) t.join();
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) { return all[std::min(all.size() - 1, static_cast<size_t>(p * all.size()))] / 1000.0; };
+    size_t total = all.size() * pipeline;
+    cout<<clients<<" clients, pipeline "<<pipeline<<", "<<total<<" requests, "<<static_cast<size_t>(total / sec)<<" req/s\n";
+    cout<<"p50 = "<<percentile(0.5)<<"us, p99 = "<<percentile(0.99)<<"us, p99.9 = "<<percentile(0.999)
+        <<"us, max = "<<all.back() / 1000.0<<"us\n";
+
+    // 打印服务器的统计信息，可以据此计算每条命令的系统调用次数
+    char buff[1024];
+    std::string info;
+    int sock = connectServer();
+    roundTrip(sock, buff, info, CMD_INFO, std::string(), std::string());
+    close(sock);
+    cout<<info;
+}
+
 void connectToMaster()
 {
     int sock = socket(PF_INET, SOCK_STREAM, 0);
@@ -141,8 +268,14 @@ void connectToMaster()
     return;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    // ./client bench [clients] [requests] [pipeline] 测试往返延迟
+    if(argc > 1 && string(argv[1]) == "bench")
+    {
+        latencyBenchmark(argc > 2 ? stoi(argv[2]) : 10, argc > 3 ? stoi(argv[3]) : 10000, argc > 4 ? stoi(argv[4]) : 1);
+        return 0;
+    }
     std::chrono::milliseconds start = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
     int n = 30;
     vector<thread> tv(0);
@@ -0,0 +1,92 @@
+#include "crc64.h"
+#include <cstring>
+
+namespace
+{
+constexpr uint64_t CRC64_POLY = 0x95ac9329ac4bc9b5ull;
+
+// table[k][b] 为字节 b 后面再跟 k 个 0 字节时的校验值
+struct Crc64Table
+{
+    uint64_t table[8][256];
+    Crc64Table()
+    {
+        for(int b=0;b<256;++b)
+        {
+            uint64_t crc = b;
+            for(int i=0;i<8;++i) crc = (crc & 1) ? (crc >> 1) ^ CRC64_POLY : crc >> 1;
+            table[0][b] = crc;
+        }
+        for(int b=0;b<256;++b)
+        {
+            for(int k=1;k<8;++k) table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    }
+};
+}
+
+uint64_t crc64(uint64_t crc, const void *data, size_t len)
+{
+    static const Crc64Table t;
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    while(len >= 8)
+    { // 按小端读取 8 个字节
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc ^= v;
+        crc = t.table[7][crc & 0xff] ^ t.table[6][(crc >> 8) & 0xff] ^
+              t.table[5][(crc >> 16) & 0xff] ^ t.table[4][(crc >> 24) & 0xff] ^
+              t.table[3][(crc >> 32) & 0xff] ^ t.table[2][(crc >> 40) & 0xff] ^
+              t.table[1][(crc >> 48) & 0xff] ^ t.table[0][crc >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while(len--) crc = t.table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+// 反射形式下的多项式乘法 a * b mod P，最高位表示 x^0
+static uint64_t multmodp(uint64_t a, uint64_t b)
+{
+    uint64_t m = 1ull << 63, p = 0;
+    for(;;)
+    {
+        if(a & m)
+        {
+            p ^= b;
+            if((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC64_POLY : b >> 1;
+    }
+    return p;
+}
+
+// 返回 x^(n * 2^k) mod P，table[i] 为 x^(2^i) mod P
+static uint64_t x2nmodp(uint64_t n, unsigned k)
+{
+    static const struct X2nTable
+    {
+        uint64_t table[64];
+        X2nTable()
+        {
+            uint64_t p = 1ull << 62; // x^1
+            table[0] = p;
+            for(int i=1;i<64;++i) table[i] = p = multmodp(p, p);
+        }
+    } t;
+    uint64_t p = 1ull << 63; // x^0
+    while(n)
+    {
+        if(n & 1) p = multmodp(t.table[k & 63], p);
+        n >>= 1;
+        ++k;
+    }
+    return p;
+}
+
+// 初始值和结果异或值都为 0，校验值是线性的：crc(A|B) = crc(A) * x^(8 * len(B)) mod P ^ crc(B)
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2)
+{
+    return multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+}
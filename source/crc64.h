@@ -0,0 +1,17 @@
+#ifndef REDIS_LEARN_CRC64
+#define REDIS_LEARN_CRC64
+// CRC64 校验，和 Redis 相同使用 Jones 多项式 (反射形式 0x95ac9329ac4bc9b5)，初始值为 0
+// crc64(0, "123456789", 9) == 0xe9c6d914c4b8d9ca
+// 使用 slicing-by-8 查表，每次处理 8 个字节
+
+#include <cstdint>
+#include <cstddef>
+
+// 在 crc 的基础上继续计算 data 的校验值，可以分段调用
+uint64_t crc64(uint64_t crc, const void *data, size_t len);
+
+// 合并两段数据的校验值，crc1 为 A 的校验值，crc2 为 B 的校验值，len2 为 B 的长度，返回 A 后接 B 的校验值
+// 多个线程可以分别计算相邻的数据块，再按顺序合并，耗时只和 len2 的位数有关
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2);
+
+#endif // REDIS_LEARN_CRC64
@@ -1,7 +1,25 @@
 #include "dict.h"
+#include "rdb.h"
+#include "crc64.h"
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <random>
+#include <cstdio>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <memory>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 
-size_t bitwise_hash(const char* first, size_t count)
+size_t bitwise_hash(const char* first, size_t count, uint64_t seed)
 {
 #if (_MSC_VER && _WIN64) || ((__GNUC__ || __clang__) &&__SIZEOF_POINTER__ == 8) // 64位操作系统
   const size_t fnv_offset = 14695981039346656037ull;
@@ -10,7 +28,7 @@ size_t bitwise_hash(const char* first, size_t count)
   const size_t fnv_offset = 2166136261u;
   const size_t fnv_prime = 16777619u;
 #endif
-  size_t result = fnv_offset;
+  size_t result = fnv_offset ^ static_cast<size_t>(seed);
   for (size_t i = 0; i < count; ++i)
   {
     result ^= (size_t)first[i];
@@ -18,7 +36,171 @@ size_t bitwise_hash(const char* first, size_t count)
   }
   return result;
 }
-Hashtable::Hashtable(int baseNum)
+
+static uint64_t fnv_hash(const char *first, size_t count, uint64_t seed)
+{
+    return bitwise_hash(first, count, seed);
+}
+
+// ==============================wyhash==============================
+// 参考 https://github.com/wangyi-fudan/wyhash ，按小端读取
+static const uint64_t wyp[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+
+static inline void wymum(uint64_t *a, uint64_t *b)
+{
+    __uint128_t r = *a;
+    r *= *b;
+    *a = static_cast<uint64_t>(r);
+    *b = static_cast<uint64_t>(r >> 64);
+}
+static inline uint64_t wymix(uint64_t a, uint64_t b) { wymum(&a, &b); return a ^ b; }
+static inline uint64_t wyr8(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t wyr4(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t wyr3(const uint8_t *p, size_t k) { return (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[k >> 1]) << 8) | p[k - 1]; }
+
+uint64_t wy_hash(const char *first, size_t count, uint64_t seed)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(first);
+    size_t len = count;
+    uint64_t a, b;
+    seed ^= wymix(seed ^ wyp[0], wyp[1]);
+    if(len <= 16)
+    {
+        if(len >= 4)
+        {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if(len > 0)
+        {
+            a = wyr3(p, len);
+            b = 0;
+        }
+        else a = b = 0;
+    }
+    else
+    {
+        size_t i = len;
+        if(i > 48)
+        {
+            uint64_t see1 = seed, see2 = seed;
+            do
+            {
+                seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while(i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while(i > 16)
+        {
+            seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+// ==============================crc32c==============================
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DICT_HAVE_CRC32C 1
+// 每次处理 8 个字节，crc 只有 32 位，最后和种子混合扩展为 64 位
+__attribute__((target("sse4.2")))
+static uint64_t crc32c_hash(const char *first, size_t count, uint64_t seed)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(first);
+    uint64_t crc = static_cast<uint32_t>(seed);
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8) crc = _mm_crc32_u64(crc, wyr8(p + i));
+    for(; i < count; ++i) crc = _mm_crc32_u8(static_cast<uint32_t>(crc), p[i]);
+    return wymix(crc ^ wyp[0] ^ count, seed ^ wyp[1]);
+}
+#endif
+
+DictHashFunc dictGetHashFunction(DictHashType type)
+{
+    switch(type)
+    {
+        case DICT_HASH_FNV:
+            return fnv_hash;
+        case DICT_HASH_CRC32C:
+#ifdef DICT_HAVE_CRC32C
+            if(__builtin_cpu_supports("sse4.2")) return crc32c_hash;
+#endif
+            return wy_hash;
+        case DICT_HASH_WY:
+        default:
+            return wy_hash;
+    }
+}
+
+uint64_t dictHashSeed()
+{
+    static const uint64_t seed = []()
+    {
+        std::random_device rd;
+        return (static_cast<uint64_t>(rd()) << 32) | rd();
+    }();
+    return seed;
+}
+
+// 分配清零的数组，大数组由 calloc 通过 mmap 获得，操作系统在第一次访问时才按页清零
+// 因此创建很大的 rehash 目标表几乎不耗时，清零的开销分摊到之后的每一次迁移中
+template <typename T>
+static T* zallocArray(size_t n)
+{
+    if(n == 0) return nullptr;
+    T *p = static_cast<T *>(calloc(n, sizeof(T)));
+    if(p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+// ==============================HashNode==============================
+HashNode* HashNode::create(SlabAllocator *alloc, std::string_view key, std::string_view value)
+{
+    size_t size = sizeof(HashNode) + key.size() + value.size();
+    void *mem = nullptr;
+    if(alloc != nullptr)
+    { // 按大小类取整，多出来的空间留给之后变长的 value
+        size = SlabAllocator::usableSize(size);
+        mem = alloc->allocate(size);
+    }
+    else mem = ::operator new(size);
+    HashNode *node = new (mem) HashNode();
+    node->_next = nullptr;
+    node->_keyLen = static_cast<uint32_t>(key.size());
+    node->_valueLen = static_cast<uint32_t>(value.size());
+    node->_capacity = static_cast<uint32_t>(size - sizeof(HashNode));
+    memcpy(node->data(), key.data(), key.size());
+    memcpy(node->data() + key.size(), value.data(), value.size());
+    return node;
+}
+
+void HashNode::destroy(SlabAllocator *alloc, HashNode *node)
+{
+    if(node == nullptr) return;
+    if(alloc != nullptr) alloc->deallocate(node, node->allocSize());
+    else ::operator delete(node);
+}
+
+bool HashNode::setValue(std::string_view str)
+{
+    if(_keyLen + str.size() > _capacity) return false;
+    memmove(data() + _keyLen, str.data(), str.size());
+    _valueLen = static_cast<uint32_t>(str.size());
+    return true;
+}
+
+// ==============================Hashtable==============================
+Hashtable::Hashtable(int baseNum, DictHashType hashType, SlabAllocator *alloc)
 {
     if (baseNum <= 0)
         baseNum = 2;
@@ -26,68 +208,87 @@ Hashtable::Hashtable(int baseNum)
     _sizeMask = _bucketSize - 1;
     _nodeSize = 0;
     _mlf = 3.0f;
-    _buckets.resize(_bucketSize, nullptr);
+    _buckets = zallocArray<HashNode *>(_bucketSize);
+    _hashFunc = dictGetHashFunction(hashType);
+    _seed = dictHashSeed();
+    _alloc = alloc;
 }
 
+// 使用分配器时节点由分配器整体释放
 Hashtable::~Hashtable()
 {
-    clear();
+    if(_alloc == nullptr) clear();
+    free(_buckets);
 }
 
-size_t Hashtable::hash(const std::string &key)
+Hashtable::Hashtable(Hashtable &&other) : Hashtable(0, DICT_HASH_DEFAULT, nullptr)
 {
-    return bitwise_hash(key.c_str(), key.length() * sizeof(key[0])) % _sizeMask;
+    swap(other);
 }
 
-// 查找，找不到返回nullptr，找到返回对应节点的指针
-HashNode* Hashtable::find(const std::string key)
+Hashtable& Hashtable::operator=(Hashtable &&other)
 {
-    size_t index = hash(key);
-    HashNode *node = _buckets[index];
-    while(node != nullptr)
-    {
-        if(node->getKey() == key)
-            break;
-        node=node->next();
-    }
-    return node;
+    swap(other);
+    return *this;
+}
+
+size_t Hashtable::hash(std::string_view key)
+{
+    return _hashFunc(key.data(), key.length() * sizeof(key[0]), _seed) & _sizeMask;
 }
 
-void Hashtable::insert(std::string key, std::string value)
+HashNode** Hashtable::findLink(std::string_view key)
 {
-    
-    HashNode *node = find(key);
-    if(node == nullptr)
+    HashNode **link = &_buckets[hash(key)];
+    while(*link != nullptr)
     {
-        size_t index = hash(key);
-        node = new HashNode();
-        node->setKey(key);
-        node->setValue(value);
-        if(_buckets[index] != nullptr) node->next() = _buckets[index]->next();
-        _buckets[index] = node;
-        ++_nodeSize; // 增加一个节点的数量
+        if((*link)->getKey() == key)
+            return link;
+        link = &(*link)->next();
     }
-    else // key 已经存在 只需要修改 value 即可
-    {
-        node->setValue(value);
+    return nullptr;
+}
+
+// 查找，找不到返回nullptr，找到返回对应节点的指针
+HashNode* Hashtable::find(std::string_view key)
+{
+    HashNode **link = findLink(key);
+    return link == nullptr ? nullptr : *link;
+}
+
+bool Hashtable::update(std::string_view key, std::string_view value)
+{
+    HashNode **link = findLink(key);
+    if(link == nullptr) return false;
+    HashNode *node = *link;
+    if(!node->setValue(value))
+    { // 原节点空间不足，创建新节点替换
+        HashNode *newNode = HashNode::create(_alloc, key, value);
+        newNode->next() = node->next();
+        *link = newNode;
+        HashNode::destroy(_alloc, node);
     }
+    return true;
 }
 
-// 删除元素 返回删除节点的指针，如果节点不存在，则返回nullptr，对应在堆区开辟的空间，需要程序员自己释放
-HashNode* Hashtable::erase(const std::string key)
+void Hashtable::insert(std::string_view key, std::string_view value)
 {
+    if(update(key, value)) return; // key 已经存在 只需要修改 value 即可
     size_t index = hash(key);
-    HashNode *node = _buckets[index], *prev = nullptr;
-    while(node != nullptr)
-    {
-        prev = node;
-        if(node->getKey() == key)
-            break;
-        node = node->next();
-    }
-    if(node == nullptr) return nullptr;
-    if(prev == _buckets[index]) _buckets[index] = node->next();
-    else prev->next() = node->next();
+    HashNode *node = HashNode::create(_alloc, key, value);
+    node->next() = _buckets[index];
+    _buckets[index] = node;
+    ++_nodeSize; // 增加一个节点的数量
+}
+
+// 删除元素 返回删除节点的指针，如果节点不存在，则返回nullptr
+HashNode* Hashtable::erase(std::string_view key)
+{
+    HashNode **link = findLink(key);
+    if(link == nullptr) return nullptr;
+    HashNode *node = *link;
+    *link = node->next();
+    node->next() = nullptr;
     --_nodeSize;
     return node;
 }
@@ -96,13 +297,13 @@ void Hashtable::clear()
 {
     HashNode *node = nullptr;
     HashNode *temp = nullptr;
-    for(int i=0;i<_bucketSize;++i)
+    for(size_t i=0;i<_bucketSize;++i)
     {
         node = _buckets[i];
         while(node != nullptr)
         {
             temp = node->next();
-            delete node;
+            HashNode::destroy(_alloc, node);
             node = temp;
         }
         _buckets[i] = nullptr;
@@ -113,10 +314,16 @@ void Hashtable::clear()
 void Hashtable::unsafeResize(size_t newSize)
 {
     clear();
+    drop(newSize);
+}
+
+void Hashtable::drop(size_t newSize)
+{
+    free(_buckets);
+    _buckets = zallocArray<HashNode *>(newSize);
     _bucketSize = newSize;
     _nodeSize = 0;
     _sizeMask = _bucketSize - 1;
-    _buckets.resize(newSize, nullptr);
 }
 
 int Hashtable::rehash_if_need(size_t n)
@@ -126,166 +333,485 @@ int Hashtable::rehash_if_need(size_t n)
     else return 0;
 }
 
-Dict::Dict(int baseNum) : _rehashIdx(nops), _iterators(0)
+size_t Hashtable::rehashTarget(int direction)
 {
-    _hashtable[0] = Hashtable(baseNum);
+    size_t target = direction > 0 ? _nodeSize * 2 : _nodeSize / 2;
+    size_t size = DEFAULT_BUCKTNUM;
+    while(size < target) size <<= 1;
+    return size;
 }
 
-HashNode* Dict::find(std::string key)
+size_t Hashtable::migrateBucket(size_t idx, Hashtable &dst)
 {
-    HashNode *node = _hashtable[0].find(key);
-    if(_rehashIdx == nops || node != nullptr)
-    { // 不在 rehash, 或者在第一个表中已经找到
-        return node;
+    HashNode *node = _buckets[idx], *next = nullptr;
+    size_t moved = 0;
+    while(node != nullptr)
+    {   // 进行重哈希
+        next = node->next();
+        size_t index = dst.hash(node->getKey());
+        node->next() = dst._buckets[index];
+        dst._buckets[index] = node;
+        node = next;
+        ++moved;
     }
-    else
-    { // 在 rehash , 并且在第一个 表中没有找到，因此在第二个表中寻找
-        node = _hashtable[1].find(key);
-        return node;
+    _buckets[idx] = nullptr;
+    _nodeSize -= moved;
+    dst._nodeSize += moved;
+    return moved;
+}
+
+void Hashtable::forEach(const std::function<void(HashNode *)> &func) const
+{
+    for(size_t i=0;i<_bucketSize;++i)
+    {
+        for(HashNode *node = _buckets[i]; node != nullptr; node = node->next())
+            func(node);
     }
 }
 
+void Hashtable::linkNodeConcurrent(HashNode *node)
+{
+    HashNode **bucket = &_buckets[hash(node->getKey())];
+    HashNode *head = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+    do node->next() = head;
+    while(!__atomic_compare_exchange_n(bucket, &head, node, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-void Dict::insert(std::string key, std::string value)
+void Hashtable::swap(Hashtable &other)
 {
-    HashNode *node = nullptr;
-    // 先在第一个表中寻找
-    size_t index = _hashtable[0].hash(key);
-    node = _hashtable[0].getBucket()[index];
-    while(node != nullptr)
+    std::swap(_buckets, other._buckets);
+    std::swap(_bucketSize, other._bucketSize);
+    std::swap(_nodeSize, other._nodeSize);
+    std::swap(_sizeMask, other._sizeMask);
+    std::swap(_mlf, other._mlf);
+    std::swap(_hashFunc, other._hashFunc);
+    std::swap(_seed, other._seed);
+    std::swap(_alloc, other._alloc);
+}
+
+// ==============================FlatHashtable==============================
+// 在一组控制字节中匹配 h2，返回匹配位置的位掩码
+static inline uint32_t groupMatch(const int8_t *group, int8_t h2)
+{
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2))));
+#else
+    uint32_t mask = 0;
+    for(size_t i=0;i<FLAT_GROUP_WIDTH;++i)
+        if(group[i] == h2) mask |= 1u << i;
+    return mask;
+#endif
+}
+
+// 返回一组控制字节中空槽或墓碑的位掩码，两者的最高位都为 0
+static inline uint32_t groupMatchFree(const int8_t *group)
+{
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+    return static_cast<uint32_t>(~_mm_movemask_epi8(ctrl)) & 0xffff;
+#else
+    uint32_t mask = 0;
+    for(size_t i=0;i<FLAT_GROUP_WIDTH;++i)
+        if(group[i] >= 0) mask |= 1u << i;
+    return mask;
+#endif
+}
+
+static inline bool flatIsFull(int8_t ctrl) { return ctrl < 0; }
+static inline int8_t flatH2(size_t h) { return static_cast<int8_t>((h & 0x7f) | 0x80); }
+static inline size_t flatH1(size_t h) { return h >> 7; }
+
+FlatHashtable::FlatHashtable(int baseNum, DictHashType hashType, SlabAllocator *alloc)
+{
+    if(baseNum <= 4)
+        baseNum = 4;
+    _capacity = 1ul << baseNum;
+    _groupMask = _capacity / FLAT_GROUP_WIDTH - 1;
+    _nodeSize = 0;
+    _deleted = 0;
+    _ctrl = zallocArray<int8_t>(_capacity);
+    _slots = zallocArray<HashNode *>(_capacity);
+    _hashFunc = dictGetHashFunction(hashType);
+    _seed = dictHashSeed();
+    _alloc = alloc;
+}
+
+// 使用分配器时节点由分配器整体释放
+FlatHashtable::~FlatHashtable()
+{
+    if(_alloc == nullptr) clear();
+    free(_ctrl);
+    free(_slots);
+}
+
+FlatHashtable::FlatHashtable(FlatHashtable &&other) : FlatHashtable(0, DICT_HASH_DEFAULT, nullptr)
+{
+    swap(other);
+}
+
+FlatHashtable& FlatHashtable::operator=(FlatHashtable &&other)
+{
+    swap(other);
+    return *this;
+}
+
+size_t FlatHashtable::hash(std::string_view key)
+{
+    return _hashFunc(key.data(), key.length() * sizeof(key[0]), _seed);
+}
+
+size_t FlatHashtable::findSlot(std::string_view key, size_t h)
+{
+    int8_t h2 = flatH2(h);
+    size_t group = flatH1(h) & _groupMask;
+    // 三角探测，组数目为2的N次方时可以遍历到所有的组
+    for(size_t probe = 1; probe <= _groupMask + 1; ++probe)
     {
-        if(node->getKey() == key) break;
-        node = node->next();
+        const int8_t *ctrl = _ctrl + group * FLAT_GROUP_WIDTH;
+        uint32_t mask = groupMatch(ctrl, h2);
+        while(mask != 0)
+        {
+            size_t idx = group * FLAT_GROUP_WIDTH + __builtin_ctz(mask);
+            if(_slots[idx]->getKey() == key) return idx;
+            mask &= mask - 1;
+        }
+        // 组内存在空槽，说明 key 不存在
+        if(groupMatch(ctrl, FLAT_CTRL_EMPTY) != 0) return nops;
+        group = (group + probe) & _groupMask;
     }
-    if(node != nullptr)
-    { // 在第一个表中找到了
-        node->setValue(value);
-        return;
+    return nops;
+}
+
+size_t FlatHashtable::findFreeSlot(size_t h)
+{
+    size_t group = flatH1(h) & _groupMask;
+    for(size_t probe = 1; ; ++probe)
+    {
+        uint32_t mask = groupMatchFree(_ctrl + group * FLAT_GROUP_WIDTH);
+        if(mask != 0) return group * FLAT_GROUP_WIDTH + __builtin_ctz(mask);
+        group = (group + probe) & _groupMask;
     }
-    if(_rehashIdx == nops)
-    { // 没有 rehash，直接在第一个表插入
-        node = new HashNode();
-        node->setKey(key);
-        node->setValue(value);
-        if(_hashtable[0].getBucket()[index] != nullptr) node->next() = _hashtable[0].getBucket()[index]->next();
-        _hashtable[0].getBucket()[index] = node;
-        ++_hashtable[0].nodeSize();
+}
+
+void FlatHashtable::setSlot(size_t idx, size_t h, HashNode *node)
+{
+    if(_ctrl[idx] == FLAT_CTRL_DELETED) --_deleted;
+    _ctrl[idx] = flatH2(h);
+    _slots[idx] = node;
+    ++_nodeSize;
+}
+
+void FlatHashtable::updateSlot(size_t idx, std::string_view key, std::string_view value)
+{
+    if(!_slots[idx]->setValue(value))
+    { // 原节点空间不足，创建新节点替换
+        HashNode *node = HashNode::create(_alloc, key, value);
+        HashNode::destroy(_alloc, _slots[idx]);
+        _slots[idx] = node;
+    }
+}
+
+void FlatHashtable::grow()
+{
+    // 墓碑较多时保持容量不变，只清理墓碑
+    size_t newCapacity = _nodeSize * 2 >= _capacity ? _capacity * 2 : _capacity;
+    int8_t *oldCtrl = _ctrl;
+    HashNode **oldSlots = _slots;
+    size_t oldCapacity = _capacity;
+    _ctrl = zallocArray<int8_t>(newCapacity);
+    _slots = zallocArray<HashNode *>(newCapacity);
+    _capacity = newCapacity;
+    _groupMask = _capacity / FLAT_GROUP_WIDTH - 1;
+    _nodeSize = 0;
+    _deleted = 0;
+    for(size_t i=0;i<oldCapacity;++i)
+    {
+        if(!flatIsFull(oldCtrl[i])) continue;
+        size_t h = hash(oldSlots[i]->getKey());
+        setSlot(findFreeSlot(h), h, oldSlots[i]);
+    }
+    free(oldCtrl);
+    free(oldSlots);
+}
+
+// 查找，找不到返回nullptr，找到返回对应节点的指针
+HashNode* FlatHashtable::find(std::string_view key)
+{
+    size_t idx = findSlot(key, hash(key));
+    return idx == nops ? nullptr : _slots[idx];
+}
+
+bool FlatHashtable::update(std::string_view key, std::string_view value)
+{
+    size_t idx = findSlot(key, hash(key));
+    if(idx == nops) return false;
+    updateSlot(idx, key, value);
+    return true;
+}
+
+void FlatHashtable::insert(std::string_view key, std::string_view value)
+{
+    size_t h = hash(key);
+    size_t idx = findSlot(key, h);
+    if(idx != nops)
+    { // key 已经存在 只需要修改 value 即可
+        updateSlot(idx, key, value);
         return;
     }
-    // 此时，处于 rehash 状态，并且第一个表中没有找到，在第二个表中进行操作
-    index = _hashtable[1].hash(key);
-    node = _hashtable[1].getBucket()[index];
-    while(node != nullptr)
-    { // 在第二个表中找到key，直接修改value
-        if(node->getKey() == key) break;
-        node = node->next();
+    // 最大负载为 7/8，墓碑同样占用探测序列
+    if((_nodeSize + _deleted + 1) * 8 > _capacity * 7) grow();
+    setSlot(findFreeSlot(h), h, HashNode::create(_alloc, key, value));
+}
+
+HashNode* FlatHashtable::erase(std::string_view key)
+{
+    size_t idx = findSlot(key, hash(key));
+    if(idx == nops) return nullptr;
+    HashNode *node = _slots[idx];
+    _slots[idx] = nullptr;
+    _ctrl[idx] = FLAT_CTRL_DELETED;
+    --_nodeSize;
+    ++_deleted;
+    return node;
+}
+
+void FlatHashtable::clear()
+{
+    for(size_t i=0;i<_capacity;++i)
+    {
+        if(flatIsFull(_ctrl[i])) HashNode::destroy(_alloc, _slots[i]);
+        _slots[i] = nullptr;
+        _ctrl[i] = FLAT_CTRL_EMPTY;
     }
-    if(node != nullptr)
+    _nodeSize = 0;
+    _deleted = 0;
+}
+
+void FlatHashtable::unsafeResize(size_t newSize)
+{
+    clear();
+    drop(newSize);
+}
+
+void FlatHashtable::drop(size_t newSize)
+{
+    if(newSize < FLAT_GROUP_WIDTH) newSize = FLAT_GROUP_WIDTH;
+    _capacity = newSize;
+    _groupMask = _capacity / FLAT_GROUP_WIDTH - 1;
+    _nodeSize = 0;
+    _deleted = 0;
+    free(_ctrl);
+    free(_slots);
+    _ctrl = zallocArray<int8_t>(_capacity);
+    _slots = zallocArray<HashNode *>(_capacity);
+}
+
+// 负载 (包括墓碑) 超过 3/4 时开始渐进式 rehash，保证迁移完成前不会触发 insert 中的同步扩容
+int FlatHashtable::rehash_if_need(size_t n)
+{
+    if((_nodeSize + _deleted + n) * 4 > _capacity * 3) return 1;
+    else if(_capacity > 128 && (_nodeSize + n) * 8 < _capacity) return -1;
+    else return 0;
+}
+
+size_t FlatHashtable::rehashTarget(int direction)
+{
+    // 迁移完成后负载约为 1/2
+    size_t target = direction > 0 ? _nodeSize * 2 : _nodeSize * 2 + 1;
+    // 迁移期间新 key 只插入目标表，目标表超过 7/8 的负载会在 insert 或 migrateBucket 中同步扩容
+    // Dict 的每次操作至少迁移一个节点或者跳过 10 个槽，迁移完成前最多插入 _nodeSize + _capacity / 10 个 key
+    size_t peak = _nodeSize * 2 + _capacity / 10;
+    target = std::max(target, peak * 8 / 7 + 1);
+    size_t size = FLAT_GROUP_WIDTH;
+    while(size < target) size <<= 1;
+    return size;
+}
+
+size_t FlatHashtable::migrateBucket(size_t idx, FlatHashtable &dst)
+{
+    if(!flatIsFull(_ctrl[idx])) return 0;
+    size_t h = hash(_slots[idx]->getKey());
+    // rehashTarget 已经为迁移期间的插入预留了空间，只有迭代器长时间暂停迁移时才会扩容
+    if((dst._nodeSize + dst._deleted + 1) * 8 > dst._capacity * 7) dst.grow();
+    dst.setSlot(dst.findFreeSlot(h), h, _slots[idx]);
+    _slots[idx] = nullptr;
+    // 标记为墓碑，保证旧表中其他 key 的探测序列不被打断
+    _ctrl[idx] = FLAT_CTRL_DELETED;
+    --_nodeSize;
+    ++_deleted;
+    return 1;
+}
+
+void FlatHashtable::forEach(const std::function<void(HashNode *)> &func) const
+{
+    for(size_t i=0;i<_capacity;++i)
     {
-        node->setValue(value);
+        if(flatIsFull(_ctrl[i])) func(_slots[i]);
+    }
+}
+
+void FlatHashtable::swap(FlatHashtable &other)
+{
+    std::swap(_ctrl, other._ctrl);
+    std::swap(_slots, other._slots);
+    std::swap(_capacity, other._capacity);
+    std::swap(_nodeSize, other._nodeSize);
+    std::swap(_deleted, other._deleted);
+    std::swap(_groupMask, other._groupMask);
+    std::swap(_hashFunc, other._hashFunc);
+    std::swap(_seed, other._seed);
+    std::swap(_alloc, other._alloc);
+}
+
+// ==============================Dict==============================
+Dict::Dict(int baseNum, DictEngine engine, DictHashType hashType) : _rehashIdx(nops), _iterators(0), _baseNum(baseNum), _engine(engine), _hashType(hashType)
+{
+    if(_engine == DICT_ENGINE_FLAT)
+    {
+        _flattable[0] = FlatHashtable(baseNum, hashType, &_alloc);
+        _flattable[1] = FlatHashtable(0, hashType, &_alloc);
     }
     else
-    {   // 插入新节点
-        node = new HashNode();
-        node->setKey(key);
-        node->setValue(value);
-        if(_hashtable[1].getBucket()[index] != nullptr) node->next() = _hashtable[1].getBucket()[index]->next();
-        _hashtable[1].getBucket()[index] = node;
-        ++_hashtable[1].nodeSize();
+    {
+        _hashtable[0] = Hashtable(baseNum, hashType, &_alloc);
+        _hashtable[1] = Hashtable(0, hashType, &_alloc);
     }
-    return;
 }
 
-HashNode* Dict::erase(std::string key)
+Dict::Dict(const Dict &other) : Dict(other._baseNum, other._engine, other._hashType)
 {
-    HashNode *node = nullptr, *prev = nullptr;
-    size_t index = _hashtable[0].hash(key);
-    prev = node = _hashtable[0].getBucket()[index];
-    while(node != nullptr)
+    *this = other;
+}
+
+Dict& Dict::operator=(const Dict &other)
+{
+    if(this == &other) return *this;
+    clear();
+    _baseNum = other._baseNum;
+    _engine = other._engine;
+    _hashType = other._hashType;
+    if(_engine == DICT_ENGINE_FLAT)
+    {
+        _flattable[0] = FlatHashtable(_baseNum, _hashType, &_alloc);
+        _flattable[1] = FlatHashtable(0, _hashType, &_alloc);
+    }
+    else
     {
-        prev = node;
-        if(node->getKey() == key) break;
-        node = node->next();
+        _hashtable[0] = Hashtable(_baseNum, _hashType, &_alloc);
+        _hashtable[1] = Hashtable(0, _hashType, &_alloc);
     }
-    if(node != nullptr)
+    other.forEach([this](const HashNode *node)
     {
-        if(prev == _hashtable[0].getBucket()[index])
-        {
-            _hashtable[0].getBucket()[index] = node->next();
-        }
-        else prev->next() = node->next();
-        --_hashtable[0].nodeSize();
+        insert(node->getKey(), node->getValue());
+    });
+    return *this;
+}
+
+template <typename Table>
+HashNode* Dict::findImpl(Table *ht, std::string_view key)
+{
+    HashNode *node = ht[0].find(key);
+    if(_rehashIdx == nops || node != nullptr)
+    { // 不在 rehash, 或者在第一个表中已经找到
         return node;
     }
+    else
+    { // 在 rehash , 并且在第一个 表中没有找到，因此在第二个表中寻找
+        node = ht[1].find(key);
+        return node;
+    }
+}
+
+template <typename Table>
+void Dict::insertImpl(Table *ht, std::string_view key, std::string_view value)
+{
+    if(_rehashIdx == nops)
+    { // 没有 rehash，直接在第一个表插入
+        ht[0].insert(key, value);
+        // 负载过高时开始渐进式 rehash，只分配新表，不迁移
+        if(ht[0].rehash_if_need(0) > 0) rehashImpl(ht, 0);
+        return;
+    }
+    // 处于 rehash 状态，先在第一个表中寻找
+    if(ht[0].update(key, value)) return; // 在第一个表中找到了
+    // 第一个表中没有找到，新节点只插入第二个表
+    ht[1].insert(key, value);
+}
+
+template <typename Table>
+HashNode* Dict::eraseImpl(Table *ht, std::string_view key)
+{
+    HashNode *node = ht[0].erase(key);
     // 第一个表中没有找到key，如果需要，在第二个表中寻找
-    if(_rehashIdx != nops)
+    if(node == nullptr && _rehashIdx != nops)
     {
-        index = _hashtable[1].hash(key);
-        prev = node = _hashtable[1].getBucket()[index];
-        while(node != nullptr)
-        {
-            if(node->getKey() == key) break;
-            prev = node;
-            node = node->next();
-        }
-        if(node != nullptr)
-        {
-            if(prev == _hashtable[1].getBucket()[index])
-            {
-                _hashtable[1].getBucket()[index] = prev;
-            }
-            else prev->next() = node->next();
-            --_hashtable[1].nodeSize();
-        }
+        node = ht[1].erase(key);
     }
     return node; // node 为对应节点或者 nullptr
 }
 
+HashNode* Dict::find(std::string_view key)
+{
+    rehashStep();
+    if(_engine == DICT_ENGINE_FLAT) return findImpl(_flattable, key);
+    return findImpl(_hashtable, key);
+}
+
+
+void Dict::insert(std::string_view key, std::string_view value)
+{
+    rehashStep();
+    if(_engine == DICT_ENGINE_FLAT) insertImpl(_flattable, key, value);
+    else insertImpl(_hashtable, key, value);
+}
+
+HashNode* Dict::erase(std::string_view key)
+{
+    rehashStep();
+    if(_engine == DICT_ENGINE_FLAT) return eraseImpl(_flattable, key);
+    return eraseImpl(_hashtable, key);
+}
+
 int Dict::rehash(int n)
+{
+    if(_engine == DICT_ENGINE_FLAT) return rehashImpl(_flattable, n);
+    return rehashImpl(_hashtable, n);
+}
+
+template <typename Table>
+int Dict::rehashImpl(Table *ht, int n)
 {
     if(_rehashIdx == nops) // 如果还没有开始rehash
     {
-        int ret = _hashtable[0].rehash_if_need(0);
-        int nodeSize = _hashtable[0].nodeSize();
+        int ret = ht[0].rehash_if_need(0);
         if(ret == 0) return 0;
-        else if(ret == -1 && nodeSize > 128) _hashtable[1].unsafeResize(nodeSize / 2); // 重新设置 _hashtable[1] 的长度
-        else _hashtable[1].unsafeResize(nodeSize * 2);
+        size_t target = ht[0].rehashTarget(ret);
+        if(ret < 0 && target >= ht[0].bucketSize()) return 0; // 已经是最小的表
+        ht[1].unsafeResize(target); // 重新设置 ht[1] 的长度
         _rehashIdx = 0; // rehash 初始化 _rehashIdx = 0
     } 
     int empty_visits = n * 10;
 
-    while(n-- && !_hashtable[0].empty())
+    while(n-- && !ht[0].empty())
     {
-        HashNode *node = nullptr, *next = nullptr;
-
         /* Note that rehashidx can't overflow as we are sure there are more
          * elements because ht[0].used != 0 */
-        while(_hashtable[0].getBucket()[_rehashIdx]->next() == nullptr)
+        while(ht[0].migrateBucket(_rehashIdx, ht[1]) == 0)
         {
             ++_rehashIdx;
             if(--empty_visits == 0) return 1;
         }
-
-        node = _hashtable[0].getBucket()[_rehashIdx]->next();
-        while(node != nullptr)
-        {   // 进行重哈希
-            next = node->next();
-            size_t index = _hashtable[1].hash(node->getKey());
-            node->next() = _hashtable[1].getBucket()[index]->next();
-            _hashtable[1].getBucket()[index]->next() = node;
-            node = next;
-            --_hashtable[0].nodeSize();
-            ++_hashtable[1].nodeSize();
-        }
         ++_rehashIdx;
     }
 
     // 判断是否 rehash 完毕
-    if(_hashtable[0].empty())
+    if(ht[0].empty())
     { // rehash 完毕
-        // 进行交换
-        std::swap(_hashtable[0],_hashtable[1]);
-        _hashtable[0].clear();
+        // 进行交换，旧表中已经没有节点，直接丢弃，不需要遍历
+        ht[0].swap(ht[1]);
+        ht[1].drop(0);
+        _rehashIdx = nops;
         return 0;
     }
 
@@ -293,76 +819,224 @@ int Dict::rehash(int n)
     return 1;
 }
 
-int Dict::rehashMilliseconds(int64_t ms)
+int Dict::rehashMicroseconds(int64_t us)
 {
-    if(!isRehashing()) return 0;
-    auto start = std::chrono::system_clock::now().time_since_epoch().count();
+    if(!isRehashing() || _iterators != 0) return 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
     int rehashes = 0;
     while(rehash(100))
     {
         rehashes += 100;
-        if(std::chrono::system_clock::now().time_since_epoch().count() - start > ms) break;
+        if(std::chrono::steady_clock::now() >= deadline) break;
     }
     return rehashes;
 }
 
 
-void Dict::clear(std::function<void(void)> callback)
+void Dict::clear()
 {
-    int count = 0;
-    HashNode *node = nullptr, *next = nullptr;
-    for(int i=0;i<_hashtable[0].bucketSize();++i,++count)
+    if(_engine == DICT_ENGINE_FLAT)
     {
-        node = _hashtable[0].getBucket()[i];
-        while(node != nullptr)
-        {
-            next = node->next();
-            delete node;
-            node = next;
-        }
-        if(callback && count >= 65535)
-        {
-            callback();
-            count = 0;
-        }
+        _flattable[0].drop(1ul << std::max(_baseNum, 4));
+        _flattable[1].drop(0);
+    }
+    else
+    {
+        _hashtable[0].drop(1ul << (_baseNum <= 0 ? 2 : _baseNum));
+        _hashtable[1].drop(0);
     }
+    _alloc.release(); // 整体释放所有节点
+    _rehashIdx = nops;
 }
 
-// 获取node的下一个节点，重哈希情况下不允许调用
-HashNode* Dict::next(HashNode *node, size_t idx)
+bool Dict::empty()
 {
-    return node->next();
+    if(_engine == DICT_ENGINE_FLAT) return _flattable[0].empty() && _flattable[1].empty();
+    return _hashtable[0].empty() && _hashtable[1].empty();
 }
 
-// 返回第一个节点
-HashNode* Dict::first()
+size_t Dict::size()
 {
-    HashNode *node = nullptr;
-    for(int i = 0;i<_hashtable[0].bucketSize();++i)
+    if(_engine == DICT_ENGINE_FLAT) return _flattable[0].nodeSize() + _flattable[1].nodeSize();
+    return _hashtable[0].nodeSize() + _hashtable[1].nodeSize();
+}
+
+void Dict::forEach(const std::function<void(HashNode *)> &func)
+{
+    ++_iterators; // 遍历期间暂停渐进式 rehash
+    if(_engine == DICT_ENGINE_FLAT)
     {
-        if(_hashtable[0].getBucket()[i] != nullptr)
-        {
-            node = _hashtable[0].getBucket()[i];
-            break;
-        }
+        _flattable[0].forEach(func);
+        if(isRehashing()) _flattable[1].forEach(func);
     }
-    return node;
+    else
+    {
+        _hashtable[0].forEach(func);
+        if(isRehashing()) _hashtable[1].forEach(func);
+    }
+    --_iterators;
 }
-// 返回尾部
-HashNode* Dict::end()
+
+void Dict::forEach(const std::function<void(const HashNode *)> &func) const
 {
-    return nullptr;
+    auto visit = [&func](HashNode *node) { func(node); };
+    if(_engine == DICT_ENGINE_FLAT)
+    {
+        _flattable[0].forEach(visit);
+        if(_rehashIdx != nops) _flattable[1].forEach(visit);
+    }
+    else
+    {
+        _hashtable[0].forEach(visit);
+        if(_rehashIdx != nops) _hashtable[1].forEach(visit);
+    }
 }
 
-void Dict::dump_file(const std::string &fileName)
+bool Dict::expand(size_t n)
 {
+    if(!empty() || isRehashing()) return false;
+    size_t size = 1;
+    if(_engine == DICT_ENGINE_FLAT)
+    { // 负载不超过 rehash_if_need 的 3/4
+        size = FLAT_GROUP_WIDTH;
+        while(size * 3 < n * 4) size <<= 1;
+        if(size > _flattable[0].bucketSize()) _flattable[0].drop(size);
+    }
+    else
+    { // 负载为 1/2 到 1，既不会扩容也不会缩容
+        while(size < n) size <<= 1;
+        if(size > _hashtable[0].bucketSize()) _hashtable[0].drop(size);
+    }
+    return true;
+}
 
+// 把所有节点写入已经打开的 writer
+static void writeSnapshot(Dict &dict, RdbWriter &writer, const std::function<void(size_t)> &progress)
+{
+    writer.writeHeader(dict.size());
+    size_t written = 0;
+    dict.forEach([&writer, &written, &progress](HashNode *node)
+    {
+        writer.writeEntry(node->getKey(), node->getValue());
+        if(++written % RDB_PROGRESS_KEYS == 0 && progress) progress(written);
+    });
 }
-void Dict::load_file(const std::string &fileName)
+
+bool Dict::dump_file(const std::string &fileName, const std::function<void(size_t)> &progress)
 {
-    
+    std::string tempName = rdbTempFileName(fileName, getpid());
+    RdbWriter writer;
+    if(writer.open(tempName)) writeSnapshot(*this, writer, progress);
+    if(!writer.finish() || rename(tempName.c_str(), fileName.c_str()) == -1)
+    {
+        unlink(tempName.c_str());
+        return false;
+    }
+    return true;
 }
-    
 
+bool Dict::dump_stream(const std::function<bool(const void *, size_t)> &sink, const std::function<void(size_t)> &progress)
+{
+    RdbWriter writer;
+    if(writer.open(sink)) writeSnapshot(*this, writer, progress);
+    return writer.finish();
+}
 
+bool Dict::load_file(const std::string &fileName)
+{
+    RdbReader reader;
+    uint64_t count = 0;
+    if(!reader.open(fileName) || !reader.readHeader(count)) return false;
+    clear();
+    expand(count); // 预先分配足够的桶，载入过程中不会 rehash
+    std::string_view key, value;
+    for(uint64_t i=0;i<count;++i)
+    {
+        if(!reader.readEntry(key, value))
+        {
+            clear();
+            return false;
+        }
+        insert(key, value);
+    }
+    if(!reader.finish())
+    {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+bool Dict::load_file_mmap(const std::string &fileName, size_t threads)
+{
+    RdbMappedFile file;
+    if(!file.open(fileName) || !file.hasIndex()) return load_file(fileName);
+    uint64_t count = file.keyCount();
+    clear();
+    expand(count);
 
+    size_t chunks = file.chunkCount();
+    threads = std::max<size_t>(1, std::min(threads, chunks));
+    // 分配器不是线程安全的，每个线程使用自己的分配器，结束之后由 _alloc 接管
+    std::unique_ptr<SlabAllocator[]> allocs(new SlabAllocator[threads]);
+    std::vector<uint64_t> crcs(chunks), counts(chunks);
+    // 开放寻址的探测序列无法并行修改，多个线程时只计算哈希值，之后按顺序放入
+    bool deferFlat = _engine == DICT_ENGINE_FLAT && threads > 1;
+    std::vector<std::vector<std::pair<size_t, HashNode *>>> flatNodes(deferFlat ? chunks : 0);
+    std::atomic<size_t> nextChunk(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&](size_t id)
+    {
+        char keyInt[RDB_INT_BUF_SIZE], valueInt[RDB_INT_BUF_SIZE];
+        std::string_view key, value;
+        for(size_t i=nextChunk++;i<chunks && !failed;i=nextChunk++)
+        {
+            const char *p = file.chunkBegin(i), *end = file.chunkEnd(i);
+            crcs[i] = crc64(0, p, end - p);
+            while(p < end)
+            {
+                if(!rdbParseString(p, end, key, keyInt) || !rdbParseString(p, end, value, valueInt))
+                {
+                    failed = true;
+                    return;
+                }
+                HashNode *node = HashNode::create(&allocs[id], key, value);
+                if(deferFlat) flatNodes[i].emplace_back(_flattable[0].hash(key), node);
+                else if(_engine == DICT_ENGINE_FLAT)
+                { // 超过头部的数目时预留的空位可能不够
+                    if(_flattable[0].nodeSize() == count)
+                    {
+                        failed = true;
+                        return;
+                    }
+                    _flattable[0].linkNode(_flattable[0].hash(key), node);
+                }
+                else _hashtable[0].linkNodeConcurrent(node);
+                ++counts[i];
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for(size_t id=1;id<threads;++id) pool.emplace_back(worker, id);
+    worker(0);
+    for(auto &t : pool) t.join();
+    for(size_t id=0;id<threads;++id) _alloc.adopt(allocs[id]);
+
+    uint64_t loaded = 0;
+    for(uint64_t n : counts) loaded += n;
+    // 节点数目和头部不一致时不能放入开放寻址表，预留的空位可能不够
+    if(failed || loaded != count || !file.verifyChecksum(crcs))
+    {
+        clear();
+        return false;
+    }
+    if(deferFlat)
+    {
+        for(auto &nodes : flatNodes)
+        {
+            for(auto &[h, node] : nodes) _flattable[0].linkNode(h, node);
+        }
+    }
+    else if(_engine == DICT_ENGINE_CHAINED) _hashtable[0].nodeSize() = loaded;
+    return true;
+}
@@ -6,38 +6,78 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <functional>
 #include <chrono>
+#include <cstdint>
+#include "slab.h"
 
 /*
  * FNV哈希算法是一种非加密的哈希算法，全名为Fowler-Noll-Vo算法。它以三位发明人Glenn Fowler，Landon Curt Noll，Phong Vo的名字命名，最早在1991年提出。
  * FNV哈希算法的特点是能快速对大量数据进行哈希处理，并保持较小的冲突率。它的高度分散性使其特别适用于对非常相近的字符串进行哈希，如URL、hostname、文件名、text和IP地址等。
  * 
 */
-// 逐位哈希
-inline size_t bitwise_hash(const char* first, size_t count);
+// 逐位哈希，seed 与初始值异或
+size_t bitwise_hash(const char* first, size_t count, uint64_t seed = 0);
+
+/*
+ * 可插拔的哈希策略，由 Dict 在构造时选择，两张表使用相同的策略
+ * wyhash 每次处理 8/16 个字节，长 key 的速度远高于逐字节的 FNV
+ * crc32c 使用 SSE4.2 的 crc32 指令，CPU 不支持时退回 wyhash
+ * 所有策略都使用进程级别的随机种子，防止攻击者构造大量冲突的 key (hash flooding)
+ */
+enum DictHashType {
+    DICT_HASH_FNV = 0,
+    DICT_HASH_WY,
+    DICT_HASH_CRC32C
+};
+constexpr DictHashType DICT_HASH_DEFAULT = DICT_HASH_WY;
+typedef uint64_t (*DictHashFunc)(const char *first, size_t count, uint64_t seed);
+
+uint64_t wy_hash(const char *first, size_t count, uint64_t seed);
+// 根据类型返回哈希函数
+DictHashFunc dictGetHashFunction(DictHashType type);
+// 进程级别的随机种子，第一次调用时生成
+uint64_t dictHashSeed();
 
 constexpr size_t nops = static_cast<size_t>(-1); // 表示 size_t 的最大值
 
 // DictEntry
 class HashNode;
 class Hashtable;
+class FlatHashtable;
 class Dict;
 
+// Dict 底层哈希表引擎，在构造 Dict 时选择
+enum DictEngine {
+    DICT_ENGINE_CHAINED = 0, // 链式哈希
+    DICT_ENGINE_FLAT // 开放寻址哈希 (Swiss table)
+};
+
+// 节点头部之后紧跟 key 和 value 的字节，一个节点只需要一次内存分配
+// 节点通过 create 创建，destroy 释放，alloc 为 nullptr 时使用全局的 operator new/delete
 class HashNode
 {
 public:
-    HashNode() : _next(nullptr) {}
-    HashNode(std::string key, std::string value) : _key(std::move(key)), _value(std::move(value)), _next(nullptr) {}
-    void setKey(std::string &str) { _key = str; }
-    void setValue(std::string &str) { _value = str; }
-    std::string getKey() const {return _key;}
-    std::string getValue() const {return _value;}
+    static HashNode* create(SlabAllocator *alloc, std::string_view key, std::string_view value);
+    static void destroy(SlabAllocator *alloc, HashNode *node);
+    // 在原地修改 value，剩余空间不足时返回 false，需要重新创建节点
+    bool setValue(std::string_view str);
+    // 返回视图，不拷贝，视图在节点被修改或删除后失效
+    std::string_view getKey() const { return std::string_view(data(), _keyLen); }
+    std::string_view getValue() const { return std::string_view(data() + _keyLen, _valueLen); }
     HashNode*& next() {return _next;}
+    // 节点占用的字节数
+    size_t allocSize() const { return sizeof(HashNode) + _capacity; }
 private:
-    std::string _key;
-    std::string _value;
+    HashNode() = default;
+    char* data() { return reinterpret_cast<char *>(this + 1); }
+    const char* data() const { return reinterpret_cast<const char *>(this + 1); }
+
     HashNode *_next; // 指向下一个 entry 的指针
+    uint32_t _keyLen;
+    uint32_t _valueLen;
+    uint32_t _capacity; // 头部之后可用于存放 key 和 value 的字节数
 };
 
 #define DEFAULT_BUCKTNUM 128
@@ -45,71 +85,204 @@ private:
 class Hashtable
 {
 public:
-    Hashtable() : _bucketSize(DEFAULT_BUCKTNUM), _nodeSize(0), _sizeMask(_bucketSize-1), _mlf(3.0f), _buckets(DEFAULT_BUCKTNUM, nullptr) {}
-    Hashtable(int baseNum);
+    Hashtable() : Hashtable(7) {}
+    // alloc 为节点的分配器，nullptr 表示使用全局分配器，此时哈希表析构时释放所有节点
+    Hashtable(int baseNum, DictHashType hashType = DICT_HASH_DEFAULT, SlabAllocator *alloc = nullptr);
     ~Hashtable(); // 析构函数
+    Hashtable(const Hashtable &) = delete;
+    Hashtable& operator=(const Hashtable &) = delete;
+    Hashtable(Hashtable &&other);
+    Hashtable& operator=(Hashtable &&other);
     // 哈希函数
-    size_t hash(const std::string &key);
+    size_t hash(std::string_view key);
 
-    HashNode* find(const std::string key);
-    void insert(std::string key, std::string value);
-    HashNode* erase(const std::string key);
+    HashNode* find(std::string_view key);
+    void insert(std::string_view key, std::string_view value);
+    // key 存在时修改 value 并返回 true，否则返回 false
+    bool update(std::string_view key, std::string_view value);
+    // 删除元素，返回从表中摘下的节点，需要使用 HashNode::destroy 释放，不存在返回 nullptr
+    HashNode* erase(std::string_view key);
     void clear();
     bool empty() { return _nodeSize == 0; }
     // 不安全的扩/缩容 仅限于在 Dict 的 rehash 中进行调用，newSize 需要保证是2的N次方
     // 该函数会清空整个哈希表
     void unsafeResize(size_t newSize);
+    // 丢弃所有节点但不释放，节点的内存由分配器整体释放，之后桶的数目变为 newSize
+    void drop(size_t newSize);
     // 判断是否需要 rehash，不需要返回0，需要扩容返回1，需要缩容返回 -1
     int rehash_if_need(size_t n);
+    // 根据 rehash_if_need 的结果计算 rehash 目标表的大小
+    size_t rehashTarget(int direction);
+    // 将第 idx 个桶中的所有节点迁移到 dst 中，返回迁移的节点数目，仅限于 Dict 的 rehash 中调用
+    size_t migrateBucket(size_t idx, Hashtable &dst);
+    // 遍历所有节点
+    void forEach(const std::function<void(HashNode *)> &func) const;
+    // 交换两个哈希表的内容，不会释放节点
+    void swap(Hashtable &other);
+    // 多个线程同时把节点挂到桶的头部，不检查 key 是否存在也不修改节点数目，仅限于并行载入快照时调用
+    void linkNodeConcurrent(HashNode *node);
     // 获取桶
-    std::vector<HashNode*>& getBucket() { return _buckets; };
+    HashNode** getBucket() { return _buckets; };
     size_t& nodeSize() { return _nodeSize; }
     size_t bucketSize() { return _bucketSize; }
 private:
-    std::vector<HashNode *> _buckets; // 存放桶的数组
+    // 返回指向 key 所在节点的指针的地址 (桶或者前一个节点的 _next)，找不到返回 nullptr
+    HashNode** findLink(std::string_view key);
+
+    HashNode **_buckets; // 存放桶的数组，使用 calloc 分配
     size_t _bucketSize; // 桶的数目
     size_t _nodeSize; // 节点的数目
 
-    size_t _sizeMask; // 用于扩容时取余
+    size_t _sizeMask; // 桶数目 - 1，用于取桶的下标
 
     float _mlf; // 最大负载
 
+    DictHashFunc _hashFunc; // 哈希函数
+    uint64_t _seed; // 哈希种子
+    SlabAllocator *_alloc; // 节点分配器
+
+};
+
+// 开放寻址哈希表，参考 Swiss table 的设计
+// 槽数组 _slots 和控制字节数组 _ctrl 一一对应，每 FLAT_GROUP_WIDTH 个控制字节为一组，探测时使用 SSE2 一次比较一整组
+// 控制字节：FLAT_CTRL_EMPTY 空槽，FLAT_CTRL_DELETED 墓碑，非空槽为 0x80 | 哈希值的低 7 位 (H2)
+// 空槽为 0，控制字节数组可以直接使用 calloc 分配，不需要逐字节初始化
+// 槽中存放指向节点的指针，节点的 key/value 和头部在同一块内存中，命中时只需访问控制字节、槽和节点本身
+// 控制字节过滤掉了绝大部分不匹配的槽，查找不存在的 key 时通常不需要访问任何节点
+constexpr size_t FLAT_GROUP_WIDTH = 16;
+constexpr int8_t FLAT_CTRL_EMPTY = 0;
+constexpr int8_t FLAT_CTRL_DELETED = 1;
+
+class FlatHashtable
+{
+public:
+    FlatHashtable() : FlatHashtable(7) {}
+    FlatHashtable(int baseNum, DictHashType hashType = DICT_HASH_DEFAULT, SlabAllocator *alloc = nullptr);
+    ~FlatHashtable();
+    FlatHashtable(const FlatHashtable &) = delete;
+    FlatHashtable& operator=(const FlatHashtable &) = delete;
+    FlatHashtable(FlatHashtable &&other);
+    FlatHashtable& operator=(FlatHashtable &&other);
+    // 哈希函数
+    size_t hash(std::string_view key);
+
+    HashNode* find(std::string_view key);
+    void insert(std::string_view key, std::string_view value);
+    // key 存在时修改 value 并返回 true，否则返回 false
+    bool update(std::string_view key, std::string_view value);
+    // 删除元素，返回从表中摘下的节点，需要使用 HashNode::destroy 释放，不存在返回 nullptr
+    HashNode* erase(std::string_view key);
+    void clear();
+    bool empty() { return _nodeSize == 0; }
+    // 不安全的扩/缩容 仅限于在 Dict 的 rehash 中进行调用，会清空整个哈希表
+    void unsafeResize(size_t newSize);
+    // 丢弃所有节点但不释放，节点的内存由分配器整体释放，之后槽的数目变为 newSize
+    void drop(size_t newSize);
+    // 判断是否需要 rehash，不需要返回0，需要扩容返回1，需要缩容返回 -1
+    int rehash_if_need(size_t n);
+    // 根据 rehash_if_need 的结果计算 rehash 目标表的大小
+    size_t rehashTarget(int direction);
+    // 将第 idx 个槽中的节点迁移到 dst 中，原槽标记为墓碑，返回迁移的节点数目
+    size_t migrateBucket(size_t idx, FlatHashtable &dst);
+    // 遍历所有节点
+    void forEach(const std::function<void(HashNode *)> &func) const;
+    void swap(FlatHashtable &other);
+    // 直接放入哈希值为 h 的节点，不检查 key 是否存在也不扩容，调用方需要保证空位足够
+    void linkNode(size_t h, HashNode *node) { setSlot(findFreeSlot(h), h, node); }
+    size_t& nodeSize() { return _nodeSize; }
+    size_t bucketSize() { return _capacity; }
+private:
+    // 查找 key 所在的槽，找不到返回 nops
+    size_t findSlot(std::string_view key, size_t h);
+    // 查找第一个可以插入的槽 (空槽或墓碑)
+    size_t findFreeSlot(size_t h);
+    // 在槽 idx 中放入节点
+    void setSlot(size_t idx, size_t h, HashNode *node);
+    // 修改槽 idx 中节点的 value，update 和 insert 共用
+    void updateSlot(size_t idx, std::string_view key, std::string_view value);
+    // 表中的空位不足时原地扩容 (或清理墓碑)
+    void grow();
+
+    int8_t *_ctrl; // 控制字节，使用 calloc 分配
+    HashNode **_slots; // 槽数组，使用 calloc 分配
+    size_t _capacity; // 槽的数目，FLAT_GROUP_WIDTH 的 2^N 倍
+    size_t _nodeSize; // 节点的数目
+    size_t _deleted; // 墓碑的数目
+    size_t _groupMask; // 组数目 - 1
+    DictHashFunc _hashFunc; // 哈希函数
+    uint64_t _seed; // 哈希种子
+    SlabAllocator *_alloc; // 节点分配器
 };
 
 class Dict
 {
 public:
-    Dict() : _rehashIdx(nops), _iterators(0) {}
-    Dict(int baseNum);
+    Dict() : Dict(7) {}
+    Dict(int baseNum, DictEngine engine = DICT_ENGINE_CHAINED, DictHashType hashType = DICT_HASH_DEFAULT);
+    // 拷贝会把所有节点复制到自己的分配器中
+    Dict(const Dict &other);
+    Dict& operator=(const Dict &other);
     ~Dict() {}
-    HashNode* find(std::string key);
-    void insert(std::string key, std::string value);
-    HashNode* erase(std::string key);
+    // 查找和删除支持 std::string_view，调用方不需要构造临时的 std::string
+    HashNode* find(std::string_view key);
+    void insert(std::string_view key, std::string_view value);
+    // 删除元素，返回从字典中摘下的节点，使用完毕后需要调用 freeNode 释放
+    HashNode* erase(std::string_view key);
+    void freeNode(HashNode *node) { HashNode::destroy(&_alloc, node); }
     // 重哈希 n 个桶中的位置，rehash 完毕返回0，否则返回1
     int rehash(int n);
-    // 在 ms 毫秒内持续 rehash, 单次 rehash 至少100个元素
-    int rehashMilliseconds(int64_t ms);
+    // 在 us 微秒内持续 rehash, 单次 rehash 100个桶，返回迁移的桶数
+    int rehashMicroseconds(int64_t us);
     void startRehash() {rehash(0);} // 尝试 rehash, rehash 函数内部会判断是不是需要rehash
 
-    // clear 必须一次执行完毕
-    // callback 用于在可能出现的长时间阻塞情况下进行一些必要操作，例如集群中发送定时消息
-    void clear(std::function<void(void)> callback = [](){});
+    // 清空字典，节点所在的 slab 被整体释放，耗时和节点的数目无关
+    void clear();
     bool isRehashing() {return _rehashIdx != nops;}
     size_t& rehashIdx() { return _rehashIdx; }
     size_t& iterators() { return _iterators; }
     Hashtable* getTable() { return _hashtable;}
-    bool empty() { return (_hashtable[0].empty() && _hashtable[1].empty()); }
-    HashNode* next(HashNode *node, size_t idx); // 获取node的下一个节点
-    HashNode* first(); // 返回第一个节点
-    HashNode* end(); // 返回尾部
+    bool empty();
+    size_t size(); // 节点总数
+    DictEngine engine() { return _engine; }
+    // 节点分配器的统计信息
+    SlabStats memoryStats() { return _alloc.stats(); }
+    // 遍历字典中所有节点，与引擎无关，遍历期间不允许修改字典
+    void forEach(const std::function<void(HashNode *)> &func);
+    // 只读遍历，const 的字典不会 rehash，不需要暂停渐进式 rehash
+    void forEach(const std::function<void(const HashNode *)> &func) const;
+
+    // 把空字典的哈希表扩大到可以容纳 n 个节点而不触发 rehash，字典不为空或者正在 rehash 时返回 false
+    bool expand(size_t n);
 
-    void dump_file(const std::string &fileName);
-    void load_file(const std::string &fileName);
+    // 快照的格式见 rdb.h，先写入临时文件再重命名，fileName 总是一个完整的快照
+    // progress 不为空时每写入 RDB_PROGRESS_KEYS 个 key 调用一次，参数为已经写入的 key 数目
+    bool dump_file(const std::string &fileName, const std::function<void(size_t)> &progress = nullptr);
+    // 和 dump_file 相同的快照，不经过磁盘，按顺序交给 sink，参数含义见 RdbWriter::open
+    bool dump_stream(const std::function<bool(const void *, size_t)> &sink, const std::function<void(size_t)> &progress = nullptr);
+    // 用快照替换字典的内容，失败时返回 false：文件无法打开或者头部无效时字典不变，数据损坏或者校验失败时字典被清空
+    bool load_file(const std::string &fileName);
+    // 映射快照文件，由 threads 个线程按照索引分块并行解析、创建节点和校验，结果和 load_file 相同
+    // 快照由 dump_file 写入，key 不会重复，载入时不再逐个查找
+    // 没有索引的快照退回 load_file
+    bool load_file_mmap(const std::string &fileName, size_t threads);
 
 private:
+    // 各操作对两种引擎的通用实现
+    template <typename Table> HashNode* findImpl(Table *ht, std::string_view key);
+    template <typename Table> void insertImpl(Table *ht, std::string_view key, std::string_view value);
+    template <typename Table> HashNode* eraseImpl(Table *ht, std::string_view key);
+    template <typename Table> int rehashImpl(Table *ht, int n);
+    // 渐进式 rehash，每次增删查时迁移一个桶，有安全迭代器时暂停
+    void rehashStep() { if(_rehashIdx != nops && _iterators == 0) rehash(1); }
+
     size_t _rehashIdx; // 重哈希的索引，每次重哈希的单位是桶的一个元素，如果 rehashIdx == nops ,代表没有在rehash
     size_t _iterators; // 安全迭代器的数目
-    Hashtable _hashtable[2]; // hashtable
+    int _baseNum; // 初始大小，clear 之后恢复
+    DictEngine _engine; // 底层哈希表引擎
+    DictHashType _hashType; // 哈希策略
+    SlabAllocator _alloc; // 所有节点的分配器
+    Hashtable _hashtable[2]; // hashtable，DICT_ENGINE_CHAINED 使用
+    FlatHashtable _flattable[2]; // 开放寻址 hashtable，DICT_ENGINE_FLAT 使用
 };
 
 #endif
\ No newline at end of file
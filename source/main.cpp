@@ -3,12 +3,46 @@
 #include <iostream>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <thread>
+#include <atomic>
+#include <new>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
 #include "skiplist.h"
 #include "hyperLogLog.h"
 #include "server.h"
 #include "dict.h"
 #include "ae.h"
+#include "rdb.h"
+#include "bio.h"
+
+// 统计全局堆内存分配次数，用于基准测试，只在 cmake -DCOUNT_ALLOCS=ON 时替换全局的 operator new
+static std::atomic<size_t> g_allocCount(0);
+#ifdef REDIS_LEARN_COUNT_ALLOCS
+void* operator new(size_t size)
+{
+    g_allocCount.fetch_add(1, std::memory_order_relaxed);
+    if(void *p = malloc(size)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#endif
+
+// 没有替换 operator new 时分配次数无法统计
+static bool allocCountEnabled()
+{
+#ifdef REDIS_LEARN_COUNT_ALLOCS
+    return true;
+#else
+    std::cout<<"allocation counting is disabled, rebuild with cmake -DCOUNT_ALLOCS=ON\n";
+    return false;
+#endif
+}
 
 #ifdef _WIN32
     #define STORE_FILE "../dumpfile"
@@ -96,66 +130,1292 @@ void slaveTest()
 
 }
 
-void dictTest()
+// 两种引擎和 std::unordered_map 对比，覆盖插入、覆盖写、删除和渐进式 rehash 的各个阶段
+// 每项检查失败时打印 FAILED，全部通过返回 true
+bool dictTest()
 {
-    auto show = [](HashNode *node)
+    bool allOk = true;
+    auto check = [&allOk](const std::string &name, bool ok)
+    {
+        std::cout<<(ok ? "ok      " : "FAILED  ")<<name<<std::endl;
+        allOk = allOk && ok;
+    };
+    using Reference = std::unordered_map<std::string, std::string>;
+    // 节点数目、遍历结果和逐个查找都要和 ref 一致
+    auto same = [](Dict &dict, const Reference &ref)
     {
-        if(node==nullptr) std::cout<<"nullptr\n";
-        else std::cout<<node->getKey()<<" "<<node->getValue()<<'\n';
+        if(dict.size() != ref.size()) return false;
+        bool ok = true;
+        size_t seen = 0;
+        dict.forEach([&](HashNode *node)
+        {
+            auto it = ref.find(std::string(node->getKey()));
+            ok = ok && it != ref.end() && it->second == node->getValue();
+            ++seen;
+        });
+        if(!ok || seen != ref.size()) return false;
+        for(auto &p : ref)
+        {
+            HashNode *node = dict.find(p.first);
+            if(node == nullptr || node->getValue() != p.second) return false;
+        }
+        return true;
     };
-    // test hashtable
-    std::cout<<"===========Hashtable==============\n";
-    Hashtable t1;
-    HashNode *node = nullptr;
-    node = t1.find("hello");
-    show(node);
-    t1.insert("hello","myc");
-    node = t1.find("hello");
-    show(node);
-    t1.erase("hello");
-    t1.erase("hello");
-    t1.erase("hello");
-    t1.insert("world","zzzz");
-    t1.insert("world","hello");
-    show(t1.find("world"));
-
-    // test dict
-    std::cout<<"============Dict=================\n";
+    auto key = [](size_t i) { return "key:" + std::to_string(i); };
+    const std::pair<const char *, DictEngine> engines[] = {{"chained", DICT_ENGINE_CHAINED}, {"flat", DICT_ENGINE_FLAT}};
+    for(auto &e : engines)
+    {
+        std::string name = e.first;
+
+        // 删除一半的 key 后留下墓碑，剩下的 key 的探测序列经过墓碑，重新插入时复用墓碑
+        {
+            // 1024 个槽中放入 760 个 key，不触发 rehash，很多 key 的探测序列跨过多个组
+            Dict dict(10, e.second);
+            Reference ref;
+            for(size_t i=0;i<760;++i) { dict.insert(key(i), "v" + std::to_string(i)); ref[key(i)] = "v" + std::to_string(i); }
+            bool ok = !dict.isRehashing();
+            for(size_t i=1;i<760;i+=2)
+            {
+                HashNode *node = dict.erase(key(i));
+                ok = ok && node != nullptr && node->getKey() == key(i);
+                if(node != nullptr) dict.freeNode(node);
+                ok = ok && dict.erase(key(i)) == nullptr;
+                ref.erase(key(i));
+            }
+            ok = ok && same(dict, ref);
+            for(size_t i=1;i<760;i+=2) ok = ok && dict.find(key(i)) == nullptr;
+            for(size_t i=1;i<760;i+=2) { dict.insert(key(i), "w" + std::to_string(i)); ref[key(i)] = "w" + std::to_string(i); }
+            check(name + ": probing across tombstones and reusing them", ok && same(dict, ref));
+        }
+
+        // rehash 期间删除两张表中的 key、插入新 key，迁移完成后旧节点原样留在新表中
+        {
+            Dict dict(10, e.second);
+            Reference ref;
+            size_t next = 0;
+            while(!dict.isRehashing())
+            {
+                dict.insert(key(next), key(next));
+                ref[key(next)] = key(next);
+                ++next;
+            }
+            // forEach 期间暂停迁移，find 会推进迁移
+            std::vector<std::pair<std::string, HashNode *>> live(next);
+            dict.forEach([&](HashNode *node)
+            {
+                size_t i = std::stoul(std::string(node->getKey().substr(4)));
+                live[i] = std::make_pair(std::string(node->getKey()), node);
+            });
+            // 拷贝通过只读遍历读取两张表，不推进迁移
+            Dict copy(dict);
+            bool ok = same(copy, ref) && dict.isRehashing();
+            size_t erasedDuringRehash = 0, insertedDuringRehash = 0;
+            for(size_t i=0;i<next && dict.isRehashing();i+=3)
+            { // 每次操作迁移一步，删除的 key 有的已经在新表中，有的还在旧表中
+                for(size_t j : {i, next - 1 - i})
+                {
+                    if(ref.erase(key(j)) == 0) continue;
+                    HashNode *node = dict.erase(key(j));
+                    ok = ok && node != nullptr && node == live[j].second;
+                    if(node != nullptr) dict.freeNode(node);
+                    live[j].second = nullptr;
+                    ++erasedDuringRehash;
+                }
+                dict.insert(key(next + i), "new");
+                ref[key(next + i)] = "new";
+                ++insertedDuringRehash;
+            }
+            while(dict.rehash(100));
+            for(auto &p : live)
+            {
+                if(p.second == nullptr) continue;
+                HashNode *node = dict.find(p.first);
+                ok = ok && node == p.second && node->getValue() == p.first;
+            }
+            check(name + ": copy, erase and insert during migration, live nodes moved (" + std::to_string(erasedDuringRehash) +
+                  " erases, " + std::to_string(insertedDuringRehash) + " inserts)",
+                  ok && erasedDuringRehash > 0 && !dict.isRehashing() && same(dict, ref));
+        }
+
+        // 随机操作：先以插入为主扩容，再以删除为主缩容，最后混合，value 的长度变化使节点原地修改或者重新创建
+        {
+            Dict dict(4, e.second);
+            Reference ref;
+            std::mt19937_64 rng(e.second * 7919 + 1);
+            const size_t keySpace = 20000, ops = 300000;
+            size_t mismatches = 0, opsDuringRehash = 0, rehashes = 0;
+            bool wasRehashing = false;
+            for(size_t i=0;i<ops;++i)
+            {
+                int insertPercent = i < ops / 3 ? 70 : i < ops * 2 / 3 ? 5 : 45;
+                std::string k = key(rng() % keySpace);
+                int r = static_cast<int>(rng() % 100);
+                if(dict.isRehashing()) ++opsDuringRehash;
+                if(r < insertPercent)
+                {
+                    std::string v(rng() % 48, static_cast<char>('a' + i % 26));
+                    dict.insert(k, v);
+                    ref[k] = v;
+                }
+                else if(r < insertPercent + 30)
+                {
+                    HashNode *node = dict.erase(k);
+                    if((node != nullptr) != (ref.erase(k) != 0)) ++mismatches;
+                    if(node != nullptr) dict.freeNode(node);
+                }
+                else
+                {
+                    HashNode *node = dict.find(k);
+                    auto it = ref.find(k);
+                    if((node != nullptr) != (it != ref.end()) || (node != nullptr && node->getValue() != it->second)) ++mismatches;
+                }
+                if(i % 1000 == 0) dict.startRehash(); // serverCron 中的缩容
+                if(dict.isRehashing() && !wasRehashing) ++rehashes;
+                wasRehashing = dict.isRehashing();
+                if(i % 9973 == 0 && !same(dict, ref)) ++mismatches;
+            }
+            check(name + ": " + std::to_string(ops) + " random operations match std::unordered_map (" + std::to_string(rehashes) +
+                  " rehashes, " + std::to_string(opsDuringRehash) + " operations during migration)",
+                  mismatches == 0 && rehashes >= 2 && opsDuringRehash > 0 && same(dict, ref));
+            dict.clear();
+            ref.clear();
+            check(name + ": clear", dict.empty() && dict.find(key(1)) == nullptr && same(dict, ref));
+        }
+    }
+    std::cout<<(allOk ? "all dict checks passed" : "dict checks FAILED")<<std::endl;
+    return allOk;
+}
+
+// 统计一次 GET 从解析到生成回复的堆内存分配次数
+// legacy: 每条命令构造新的 Command，execCommand 返回 std::string
+// reuse : 复用 Command 和回复缓冲区，与 readQueryFromClient 的做法相同，只有不开启 IO 多线程时是这条路径
+// IO 多线程模式下 Command 和回复缓冲区经过 IOThreadRecycler 回到各自的线程复用，由 threadedAllocBenchmark 统计
+void getAllocBenchmark()
+{
+    if(!allocCountEnabled()) return;
+    Server server;
+    const int N = 100000;
+    std::string key(32, 'k'), value(64, 'v'); // 超过 SSO 长度
+    server.db.insert(key, value);
+    // 构造 GET 的二进制格式 {CMD_FLAG}{keyLen}{key}{valueLen}{value}
+    char buff[256];
+    char *p = buff;
+    *(CMD_FLAG *)p = CMD_GET; p += sizeof(CMD_FLAG);
+    *(size_t *)p = key.length() + 1; p += sizeof(size_t);
+    memcpy(p, key.c_str(), key.length() + 1); p += key.length() + 1;
+    *(size_t *)p = 1; p += sizeof(size_t);
+    *p = '\0';
+
+    size_t before = g_allocCount.load();
+    for(int i=0;i<N;++i)
+    {
+        Command cmd;
+        parseBinaryCmd(buff, cmd);
+        std::string ret = execCommand(server, cmd);
+    }
+    size_t legacy = g_allocCount.load() - before;
+
+    Command cmd;
+    std::string reply;
+    parseBinaryCmd(buff, cmd);
+    execCommand(server, cmd, reply); // 预热，使缓冲区达到所需容量
+    before = g_allocCount.load();
+    for(int i=0;i<N;++i)
+    {
+        parseBinaryCmd(buff, cmd);
+        execCommand(server, cmd, reply);
+    }
+    size_t reuse = g_allocCount.load() - before;
+    std::cout<<"allocations per GET: legacy = "<<static_cast<double>(legacy) / N
+             <<", reuse = "<<static_cast<double>(reuse) / N<<'\n';
+}
+
+// 在进程内按照 IO 多线程模式启动主线程的事件循环和 IO 线程，clients 个客户端通过 socketpair 连接，
+// clientFds 返回客户端一端的阻塞套接字，返回运行 aeMain 的线程，设置 server->serverStop 之后可以 join
+// IO 线程不会退出，它们使用的对象故意不释放
+static std::thread startThreadedServer(Server *server, size_t ioThreads, size_t clients, std::vector<int> &clientFds)
+{
+    server->setIOThreadNum(ioThreads);
+    server->setAppendOnly(false, AOF_FSYNC_DEFAULT);
+    aeEventLoop *loop = new aeEventLoop(static_cast<int>(clients) * 2 + 1024);
+    auto *io_q = new std::vector<mpmc_ring_queue<IOThreadNews>>(ioThreads);
+    auto *exe_q = new mpmc_ring_queue<std::pair<int, Command>>();
+    auto *recycle = new std::vector<IOThreadRecycler>(ioThreads);
+    for(size_t i=0;i<clients;++i)
+    {
+        int sv[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+        server->connectedClients += 1;
+        aeCreateFileEvent(sv[0], *loop, readQueryFromClient, AE_READABLE, new Client(sv[0]));
+        clientFds.push_back(sv[1]);
+    }
+    for(size_t i=0;i<ioThreads;++i)
+        std::thread(IOThreadMain, std::ref(*server), std::ref(*loop), std::ref((*io_q)[i]), std::ref(*exe_q), std::ref((*recycle)[i])).detach();
+    return std::thread(aeMain, std::ref(*server), std::ref(*loop), std::ref(*io_q), std::ref(*exe_q), std::ref(*recycle));
+}
+
+// 一条 GET 的帧：{size_t 长度}{CMD_FLAG}{keyLen}{key}{valueLen}{value}
+static std::vector<char> getCommandFrame(const std::string &key)
+{
+    std::vector<char> frame(sizeof(size_t) + sizeof(CMD_FLAG) + 2 * sizeof(size_t) + key.length() + 2);
+    char *p = frame.data() + sizeof(size_t);
+    *(CMD_FLAG *)p = CMD_GET; p += sizeof(CMD_FLAG);
+    *(size_t *)p = key.length() + 1; p += sizeof(size_t);
+    memcpy(p, key.c_str(), key.length() + 1); p += key.length() + 1;
+    *(size_t *)p = 1; p += sizeof(size_t);
+    *p = '\0';
+    *(size_t *)frame.data() = frame.size() - sizeof(size_t);
+    return frame;
+}
+
+// 统计 IO 多线程模式下一条 GET 的堆内存分配次数，经过真实的路径：
+// IO 线程读取和解析，执行队列，主线程执行和合并回复，IO 队列，IO 线程写回
+// 分配次数包括所有线程，客户端只使用预先分配的缓冲区
+void threadedAllocBenchmark(size_t n)
+{
+    if(!allocCountEnabled()) return;
+    Server *server = new Server();
+    std::string key(32, 'k'), value(64, 'v'); // 超过 SSO 长度
+    server->db.insert(key, value);
+    std::vector<int> fds;
+    std::thread mainLoop = startThreadedServer(server, 1, 1, fds);
+    std::vector<char> frame = getCommandFrame(key);
+    std::vector<char> reply(4096);
+    for(size_t pipeline : {1, 64})
+    {
+        std::vector<char> out;
+        for(size_t i=0;i<pipeline;++i) out.insert(out.end(), frame.begin(), frame.end());
+        auto round = [&]()
+        {
+            write(fds[0], out.data(), out.size());
+            for(size_t i=0;i<pipeline;++i)
+            {
+                size_t len = 0;
+                recv(fds[0], &len, sizeof(len), MSG_WAITALL);
+                recv(fds[0], reply.data(), std::min(len, reply.size()), MSG_WAITALL);
+            }
+        };
+        for(size_t i=0;i<1000;++i) round(); // 预热，使各个缓冲区达到所需容量
+        size_t before = g_allocCount.load();
+        size_t rounds = std::max<size_t>(1, n / pipeline);
+        for(size_t i=0;i<rounds;++i) round();
+        size_t allocs = g_allocCount.load() - before;
+        std::cout<<"threaded path, pipeline "<<pipeline<<": allocations per GET = "
+                 <<static_cast<double>(allocs) / (rounds * pipeline)<<'\n';
+    }
+    server->serverStop = true; // serverCron 唤醒事件循环之后退出
+    mainLoop.join();
+}
+
+// 让执行队列和 IO 队列同时超过容量：clients 个客户端轮流发送 GET，每个客户端一共 n / clients 条，
+// 不读取回复直到全部发送完，IO 线程阻塞在满的执行队列上时主线程仍然要继续取出命令
+// 所有回复在 timeoutSec 秒内收齐说明没有死锁
+void queueFloodBenchmark(size_t n)
+{
+    constexpr size_t clients = 1024, chunk = 16;
+    constexpr int timeoutSec = 60;
+    Server *server = new Server();
+    std::string key(32, 'k'), value(64, 'v');
+    server->db.insert(key, value);
+    std::vector<int> fds;
+    std::thread mainLoop = startThreadedServer(server, 1, clients, fds);
+    std::vector<char> out;
+    std::vector<char> frame = getCommandFrame(key);
+    for(size_t i=0;i<chunk;++i) out.insert(out.end(), frame.begin(), frame.end());
+    const size_t replySize = sizeof(size_t) + value.length() + 1; // 回复包括结尾的 '\0'
+    size_t perClient = std::max<size_t>(chunk, n / clients / chunk * chunk);
+    size_t total = perClient * clients;
+
+    // 读取线程：统计收到的回复字节数，避免客户端的接收缓冲区写满之后服务器停止发送
+    std::atomic<size_t> received(0);
+    std::atomic<bool> stop(false);
+    std::thread reader([&]()
+    {
+        std::vector<pollfd> pfds;
+        for(int fd : fds) pfds.push_back(pollfd{fd, POLLIN, 0});
+        std::vector<char> buff(1 << 16);
+        while(!stop && received < total * replySize)
+        {
+            if(poll(pfds.data(), pfds.size(), 100) <= 0) continue;
+            for(auto &p : pfds)
+            {
+                if(!(p.revents & POLLIN)) continue;
+                ssize_t r = recv(p.fd, buff.data(), buff.size(), MSG_DONTWAIT);
+                if(r > 0) received += r;
+            }
+        }
+    });
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::seconds(timeoutSec);
+    std::thread writer([&]()
+    {
+        for(size_t sent=0;sent<perClient && !stop;sent+=chunk)
+        {
+            for(int fd : fds) write(fd, out.data(), out.size());
+        }
+    });
+    while(received < total * replySize && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    size_t got = received / replySize;
+    stop = true;
+    if(got == total)
+    {
+        writer.join();
+        reader.join();
+        std::cout<<clients<<" clients flooded "<<total<<" GETs through queues of capacity 65536: all replies in "
+                 <<ms<<"ms ("<<static_cast<size_t>(total / ms * 1000)<<" cmds/s)\n";
+        server->serverStop = true;
+        mainLoop.join();
+        return;
+    }
+    // 发生死锁时线程无法结束，直接返回
+    writer.detach();
+    reader.detach();
+    mainLoop.detach();
+    std::cout<<clients<<" clients flooded "<<total<<" GETs: STALLED after "<<got<<" replies in "<<timeoutSec<<"s\n";
+}
+
+// 比较不同哈希策略在不同 key 长度下的耗时
+void hashBenchmark()
+{
+    const std::pair<const char *, DictHashType> types[] = {
+        {"fnv", DICT_HASH_FNV}, {"wyhash", DICT_HASH_WY}, {"crc32c", DICT_HASH_CRC32C}};
+    const size_t lens[] = {8, 16, 32, 64, 256, 1024};
+    uint64_t seed = dictHashSeed();
+    volatile uint64_t sink = 0;
+    for(size_t len : lens)
+    {
+        std::vector<std::string> keys(1024);
+        for(size_t i=0;i<keys.size();++i)
+        {
+            keys[i].resize(len);
+            for(size_t j=0;j<len;++j) keys[i][j] = static_cast<char>('a' + (i * 31 + j * 7) % 26);
+        }
+        const size_t rounds = (1ul << 26) / (len * keys.size()); // 每种策略哈希 64MB 数据
+        std::cout<<"len "<<len<<":";
+        for(auto &t : types)
+        {
+            DictHashFunc func = dictGetHashFunction(t.second);
+            auto start = std::chrono::steady_clock::now();
+            for(size_t r=0;r<rounds;++r)
+                for(const std::string &key : keys) sink = sink + func(key.data(), key.size(), seed);
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            std::cout<<"  "<<t.first<<" "<<ns / (rounds * keys.size())<<" ns";
+        }
+        std::cout<<'\n';
+    }
+}
+
+// 插入 n 个 key，统计单次插入耗时的分布，扩容时的迁移开销会体现在尾部延迟中
+// incremental: 渐进式 rehash
+// blocking   : 开始 rehash 后立即迁移完毕，模拟一次性扩容
+// shrink 模式：先插入 n 个 key 再删除到只剩 2^k - 1 个，由 startRehash 开始缩容，然后计时插入 n 个新 key
+// 旧表很稀疏，迁移需要的步数多，迁移期间的插入最容易使目标表超过 7/8 的负载
+void rehashLatencyBenchmark(size_t n)
+{
+    const std::pair<const char *, DictEngine> engines[] = {{"chained", DICT_ENGINE_CHAINED}, {"flat", DICT_ENGINE_FLAT}};
+    for(auto &e : engines)
+    {
+        for(int mode = 0; mode < 3; ++mode)
+        {
+            bool blocking = mode == 1, shrink = mode == 2;
+            Dict dict(7, e.second);
+            std::vector<uint64_t> hist(40, 0); // hist[i] 统计耗时在 [2^(i-1), 2^i) 纳秒之间的次数
+            uint64_t maxNs = 0;
+            char key[32];
+            size_t base = 0; // 计时部分第一个 key 的编号
+            if(shrink)
+            {
+                for(size_t i=0;i<n;++i) dict.insert("key:" + std::to_string(i), "value");
+                size_t keep = 1;
+                while(keep * 16 <= n) keep <<= 1;
+                for(size_t i=keep-1;i<n;++i)
+                {
+                    if(HashNode *node = dict.erase("key:" + std::to_string(i))) dict.freeNode(node);
+                }
+                dict.startRehash(); // serverCron 中的缩容
+                base = n;
+            }
+            for(size_t i=base;i<base+n;++i)
+            {
+                int len = snprintf(key, sizeof(key), "key:%zu", i);
+                auto start = std::chrono::steady_clock::now();
+                dict.insert(std::string_view(key, len), "value");
+                if(blocking) while(dict.rehash(1000));
+                uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                maxNs = std::max(maxNs, ns);
+                size_t b = 0;
+                while((1ull << b) <= ns) ++b;
+                ++hist[b];
+            }
+            auto percentile = [&](double p)
+            {
+                uint64_t target = static_cast<uint64_t>(p * n), sum = 0;
+                for(size_t b=0;b<hist.size();++b)
+                {
+                    sum += hist[b];
+                    if(sum >= target) return 1ull << b;
+                }
+                return 1ull << (hist.size() - 1);
+            };
+            std::cout<<e.first<<(blocking ? " blocking   " : shrink ? " shrink     " : " incremental")
+                     <<": p50 < "<<percentile(0.5)<<"ns, p99 < "<<percentile(0.99)
+                     <<"ns, p99.9 < "<<percentile(0.999)<<"ns, p99.99 < "<<percentile(0.9999)
+                     <<"ns, max = "<<maxNs / 1000<<"us\n    histogram(us):";
+            for(size_t b=10;b<hist.size();++b) // 只显示 1us 以上的部分
+            {
+                if(hist[b] != 0) std::cout<<" <"<<(1ull << b) / 1000<<":"<<hist[b];
+            }
+            std::cout<<'\n';
+        }
+    }
+}
+
+// 写入 n 个小 key 的快照再载入，统计耗时和文件大小，一半的 value 是可以按整数编码的数字
+void rdbBenchmark(size_t n)
+{
+    const std::string fileName = "bench_dump.rdb";
+    Dict dict;
+    char key[32], value[32];
+    for(size_t i=0;i<n;++i)
+    {
+        int keyLen = snprintf(key, sizeof(key), "key:%zu", i);
+        int valueLen = i % 2 ? snprintf(value, sizeof(value), "%zu", i * 7) : snprintf(value, sizeof(value), "value:%zu", i);
+        dict.insert(std::string_view(key, keyLen), std::string_view(value, valueLen));
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool saved = dict.dump_file(fileName);
+    double saveSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    size_t fileSize = file.tellg();
+
+    Dict loaded;
+    start = std::chrono::steady_clock::now();
+    bool ok = loaded.load_file(fileName);
+    double loadSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    // 抽查载入的内容
+    for(size_t i=0;ok && i<n;i+=n/1000+1)
+    {
+        int keyLen = snprintf(key, sizeof(key), "key:%zu", i);
+        HashNode *a = dict.find(std::string_view(key, keyLen)), *b = loaded.find(std::string_view(key, keyLen));
+        ok = b != nullptr && a->getValue() == b->getValue();
+    }
+    ok = ok && saved && loaded.size() == n && !loaded.isRehashing();
+    std::cout<<n<<" keys: save "<<saveSec<<"s, load "<<loadSec<<"s, file "<<fileSize / 1024 / 1024<<"MB, "
+             <<(ok ? "verified" : "FAILED")<<'\n';
+    unlink(fileName.c_str());
+}
+
+// 对比顺序读取和 mmap 并行载入同一个快照的耗时，threads 为并行载入的线程数
+void mmapLoadBenchmark(size_t n)
+{
+    const std::string fileName = "bench_mmap.rdb";
     Dict dict;
-    dict.insert("hello","world");
-    show(dict.find("myc"));
-    show(dict.find("hello"));
-    show(dict.erase("hello"));
-    show(dict.erase("zyg"));
-    return;
-    
+    char key[32], value[32];
+    for(size_t i=0;i<n;++i)
+    {
+        int keyLen = snprintf(key, sizeof(key), "key:%zu", i);
+        int valueLen = i % 2 ? snprintf(value, sizeof(value), "%zu", i * 7) : snprintf(value, sizeof(value), "value:%zu", i);
+        dict.insert(std::string_view(key, keyLen), std::string_view(value, valueLen));
+    }
+    if(!dict.dump_file(fileName))
+    {
+        std::cout<<"dump failed\n";
+        return;
+    }
+    size_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    for(DictEngine engine : {DICT_ENGINE_CHAINED, DICT_ENGINE_FLAT})
+    {
+        std::cout<<(engine == DICT_ENGINE_FLAT ? "flat" : "chained")<<", "<<n<<" keys:";
+        for(size_t threads : {size_t(0), size_t(1), maxThreads})
+        { // threads 为 0 表示 load_file
+            Dict loaded(7, engine);
+            auto start = std::chrono::steady_clock::now();
+            bool ok = threads == 0 ? loaded.load_file(fileName) : loaded.load_file_mmap(fileName, threads);
+            double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            for(size_t i=0;ok && i<n;i+=n/1000+1)
+            {
+                int keyLen = snprintf(key, sizeof(key), "key:%zu", i);
+                HashNode *a = dict.find(std::string_view(key, keyLen)), *b = loaded.find(std::string_view(key, keyLen));
+                ok = b != nullptr && a->getValue() == b->getValue();
+            }
+            ok = ok && loaded.size() == n;
+            if(threads == 0) std::cout<<" load_file "<<sec<<"s";
+            else std::cout<<", mmap x"<<threads<<" "<<sec<<"s";
+            if(!ok) std::cout<<" FAILED";
+        }
+        std::cout<<'\n';
+    }
+    unlink(fileName.c_str());
+}
+
+// 每种 appendfsync 策略下以不同的批大小写入 AOF，每一批命令之后调用一次 flush，统计每秒写入的命令数
+// 批大小为 1 相当于每条命令单独提交，always 策略下每条命令都要等待一次 fdatasync
+// 每种配置最多写入 n 条命令或者持续 AOF_BENCH_SECONDS 秒
+void aofBenchmark(size_t n)
+{
+    constexpr double AOF_BENCH_SECONDS = 2.0;
+    const std::string fileName = "bench_appendonly.aof";
+    const std::string value(32, 'v');
+    char key[32];
+    bioInit(); // everysec 的 fdatasync 由 bio 线程执行
+    for(AofFsyncPolicy policy : {AOF_FSYNC_NO, AOF_FSYNC_EVERYSEC, AOF_FSYNC_ALWAYS})
+    {
+        std::cout<<"appendfsync "<<aofFsyncPolicyName(policy)<<":";
+        for(size_t batch : {1, 16, 128})
+        {
+            unlink(fileName.c_str());
+            AofWriter writer;
+            if(!writer.open(fileName, policy))
+            {
+                std::cout<<" open failed\n";
+                return;
+            }
+            size_t written = 0;
+            double sec = 0;
+            auto start = std::chrono::steady_clock::now();
+            while(written < n && sec < AOF_BENCH_SECONDS)
+            {
+                for(size_t i=0;i<batch;++i,++written)
+                {
+                    int keyLen = snprintf(key, sizeof(key), "key:%zu", written);
+                    writer.append(CMD_SET, std::string_view(key, keyLen), value);
+                }
+                writer.flush();
+                sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+            size_t fsyncs = writer.fsyncCount();
+            writer.close();
+            // 校验写入的记录
+            size_t loaded = 0;
+            uint64_t validBytes = 0;
+            bool ok = aofLoadFile(fileName, [&loaded](uint8_t, std::string_view, std::string_view) { ++loaded; }, validBytes) == AOF_LOAD_OK;
+            std::cout<<" batch "<<batch<<" "<<static_cast<size_t>(written / sec / 1000)<<"K ops/s ("<<fsyncs<<" fsyncs)";
+            if(!ok || loaded != written) std::cout<<" FAILED";
+            std::cout<<(batch == 128 ? "\n" : ",");
+        }
+    }
+    unlink(fileName.c_str());
+    bioShutdown();
+}
+
+// 写入 mb MB 还没有同步的数据之后关闭并删除文件，对比主线程直接执行和交给 bio 线程时主线程的阻塞时间
+// 同时统计 bio 任务从提交到完成的延迟
+void bioBenchmark(size_t mb)
+{
+    const std::string fileName = "bench_bio.aof";
+    const std::string value(1024, 'v');
+    bioInit();
+    for(bool background : {false, true})
+    {
+        unlink(fileName.c_str());
+        AofWriter writer;
+        if(!writer.open(fileName, AOF_FSYNC_NO))
+        {
+            std::cout<<"open failed\n";
+            break;
+        }
+        for(size_t i=0;i<mb*1024;++i)
+        {
+            writer.append(CMD_SET, "key", value);
+            if(writer.pendingBytes() >= RDB_IO_BUF_SIZE) writer.flush();
+        }
+        writer.flush();
+        auto start = std::chrono::steady_clock::now();
+        if(background)
+        {
+            writer.closeInBackground();
+            bioUnlinkLazily(fileName);
+        }
+        else
+        {
+            writer.close();
+            unlink(fileName.c_str());
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout<<mb<<"MB "<<(background ? "bio" : "inline")<<": main thread blocked "<<ms<<"ms\n";
+    }
+    bioDrainWorker(BIO_CLOSE_AOF);
+    bioDrainWorker(BIO_LAZY_UNLINK);
+    for(BioJobType type : {BIO_CLOSE_AOF, BIO_LAZY_UNLINK})
+    {
+        BioStats st = bioGetStats(type);
+        std::cout<<"    bio "<<bioJobTypeName(type)<<": "<<st.processed<<" jobs, latency "<<st.maxLatencyUs / 1000.0<<"ms\n";
+    }
+    bioShutdown();
 }
 
-void serverTest()
+// 对比拷贝整个 Server 和 fork 两种后台保存方式下主线程的阻塞时间
+// BGSAVE 进行期间主线程持续修改 10% 的热点 key，统计处理的命令数、最大单次耗时和写时复制的字节数
+void bgsaveBenchmark(size_t n)
 {
+    Server server;
+    server.config.dumpDir = "bench_bgsave.rdb";
+    char key[32];
+    for(size_t i=0;i<n;++i)
+    {
+        int keyLen = snprintf(key, sizeof(key), "key:%zu", i);
+        server.db.insert(std::string_view(key, keyLen), "value");
+    }
+    auto start = std::chrono::steady_clock::now();
+    {
+        Server copy(server); // 原来的 AOFRW 把整个 Server 拷贝给重写线程
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout<<n<<" keys, copy Server: blocked "<<ms<<"ms, +"
+                 <<copy.db.memoryStats().allocatedBytes / 1024 / 1024<<"MB\n";
+    }
+
+    if(rdbSaveBackground(server) != 0)
+    {
+        std::cout<<"bgsave failed to start\n";
+        return;
+    }
+    size_t ops = 0;
+    uint64_t maxNs = 0;
+    std::mt19937_64 rng(1);
+    start = std::chrono::steady_clock::now();
+    auto lastCron = start;
+    while(server.childPid != -1)
+    {
+        for(int i=0;i<1000;++i)
+        {
+            auto opStart = std::chrono::steady_clock::now();
+            int keyLen = snprintf(key, sizeof(key), "key:%zu", static_cast<size_t>(rng() % (n / 10 + 1)));
+            server.db.insert(std::string_view(key, keyLen), "VALUE");
+            ++server.dirty;
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - opStart).count();
+            maxNs = std::max(maxNs, ns);
+            ++ops;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if(now - lastCron >= std::chrono::milliseconds(100))
+        { // 模拟 serverCron
+            lastCron = now;
+            checkChildrenDone(server);
+        }
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout<<"fork: blocked "<<server.statForkUs / 1000.0<<"ms, bgsave "<<(server.rdbLastBgsaveOk ? "ok" : "err")
+             <<" in "<<server.rdbLastBgsaveMs<<"ms, cow "<<server.rdbLastCowBytes / 1024 / 1024<<"MB, "
+             <<"parent executed "<<ops<<" SETs ("<<static_cast<size_t>(ops / sec)<<"/s), max "<<maxNs / 1000<<"us\n";
+    Dict loaded;
+    std::cout<<"reload: "<<(loaded.load_file(server.config.dumpDir) && loaded.size() == n ? "verified" : "FAILED")<<'\n';
+    unlink(server.config.dumpDir.c_str());
+}
+
+// 全量同步传输 mb MB 的快照：第一次传输到一半时断开连接，第二次从从机已经收到的偏移续传
+// 统计两次传输的吞吐量、续传的偏移和进程的峰值内存，峰值内存不随快照大小增长
+void resyncBenchmark(size_t mb)
+{
+    const std::string masterFile = "bench_resync_master.rdb", slaveFile = "bench_resync_slave.rdb";
+    signal(SIGPIPE, SIG_IGN); // 和 ServerInit 相同，从机断开之后主机的 sendfile 返回 EPIPE
+    {
+        std::ofstream out(masterFile, std::ios::binary | std::ios::trunc);
+        std::vector<char> chunk(1024 * 1024);
+        std::mt19937_64 rng(42);
+        for(size_t i=0;i<mb;++i)
+        {
+            for(auto &c : chunk) c = static_cast<char>(rng());
+            out.write(chunk.data(), chunk.size());
+        }
+    }
+    unlink(slaveFile.c_str());
+    for(int round=0;round<2;++round)
+    {
+        int fds[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        {
+            std::cout<<"socketpair failed\n";
+            break;
+        }
+        ServerConfig master, slave;
+        master.slave_socket_fd = fds[0];
+        slave.master_socket_fd = fds[1];
+        // 第一次传输到一半时从机断开连接
+        std::atomic<bool> stop(false);
+        std::thread interrupter([&slave, &stop, fds, round, mb]()
+        {
+            while(round == 0 && !stop && slave.transfer.done < mb * 1024 * 1024 / 2) std::this_thread::yield();
+            if(round == 0) shutdown(fds[1], SHUT_RDWR);
+        });
+        auto start = std::chrono::steady_clock::now();
+        std::thread sender([&master, &masterFile]() { sendFile(master, masterFile); });
+        bool ok = recvFile(slave, slaveFile);
+        stop = true;
+        sender.join();
+        interrupter.join();
+        double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint64_t bytes = slave.transfer.done - slave.transfer.resumed;
+        std::cout<<(round == 0 ? "interrupted: " : "resumed:     ")<<(ok ? "complete" : "partial")
+                 <<", offset "<<slave.transfer.resumed / 1024 / 1024<<"MB -> "<<slave.transfer.done / 1024 / 1024<<"MB, "
+                 <<bytes / 1024.0 / 1024 / sec<<"MB/s\n";
+        close(fds[0]);
+        close(fds[1]);
+    }
+    std::ifstream a(masterFile, std::ios::binary), b(slaveFile, std::ios::binary);
+    bool same = std::equal(std::istreambuf_iterator<char>(a), std::istreambuf_iterator<char>(),
+                           std::istreambuf_iterator<char>(b), std::istreambuf_iterator<char>());
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout<<mb<<"MB snapshot: "<<(same ? "verified" : "MISMATCH")<<", peak RSS "<<usage.ru_maxrss / 1024<<"MB\n";
+    unlink(masterFile.c_str());
+    unlink(slaveFile.c_str());
+}
+
+// 对比全量同步的两种方式：先写快照文件再 sendfile，和无盘同步直接把快照写入套接字 (一个从机和三个从机共享一次序列化)
+// 主机耗时为从开始同步到最后一个字节发出，每个从机收完之后载入快照并核对 key 的数目
+void disklessBenchmark(size_t n)
+{
+    signal(SIGPIPE, SIG_IGN);
+    Server server;
+    server.config.dumpDir = "bench_diskless_master.rdb";
+    char key[32];
+    const std::string value(100, 'v');
+    for(size_t i=0;i<n;++i)
+    {
+        int keyLen = snprintf(key, sizeof(key), "key:%zu", i);
+        server.db.insert(std::string_view(key, keyLen), value);
+    }
+    struct Mode { const char *name; bool diskless; size_t replicas; };
+    for(const Mode &mode : {Mode{"disk + sendfile", false, 1}, Mode{"diskless", true, 1}, Mode{"diskless x3", true, 3}})
+    {
+        std::vector<ServerConfig> slaves(mode.replicas);
+        std::vector<int> masterFds;
+        std::vector<std::thread> receivers;
+        std::atomic<size_t> verified(0);
+        for(size_t i=0;i<mode.replicas;++i)
+        {
+            int fds[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+            masterFds.push_back(fds[0]);
+            slaves[i].master_socket_fd = fds[1];
+            slaves[i].dumpDir = "bench_diskless_slave" + std::to_string(i) + ".rdb";
+            receivers.emplace_back([&slaves, &verified, i, n]()
+            {
+                Dict db;
+                if(recvFile(slaves[i], slaves[i].dumpDir) && db.load_file_mmap(slaves[i].dumpDir, 1) && db.size() == n) ++verified;
+                close(slaves[i].master_socket_fd);
+                unlink(slaves[i].dumpDir.c_str());
+            });
+        }
+        auto start = std::chrono::steady_clock::now();
+        if(mode.diskless) sendSnapshotDiskless(server, masterFds);
+        else
+        {
+            server.config.slave_socket_fd = masterFds[0];
+            server.db.dump_file(server.config.dumpDir);
+            sendFile(server.config, server.config.dumpDir);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        for(auto &t : receivers) t.join();
+        for(int fd : masterFds) close(fd);
+        std::cout<<n<<" keys, "<<mode.name<<": master "<<ms<<"ms, "<<server.config.transfer.size / 1024 / 1024<<"MB, "
+                 <<verified<<"/"<<mode.replicas<<" replicas verified\n";
+    }
+    unlink(server.config.dumpDir.c_str());
+}
+
+// 主机和从机之间的一次同步，中间经过一个转发线程，主机发给从机的字节数超过 cutAfter 时转发线程断开两边的连接，模拟网络中断
+// 返回主机发给从机的字节数
+static size_t replSyncThroughProxy(Server &master, Server &slave, size_t cutAfter)
+{
+    int m[2], s[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, m);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, s);
+    master.config.slave_socket_fd = m[0];
+    slave.config.master_socket_fd = s[1];
+    size_t forwarded = 0;
+    std::thread proxy([&forwarded, m, s, cutAfter]()
+    {
+        pollfd fds[2] = {{m[1], POLLIN, 0}, {s[0], POLLIN, 0}};
+        char buff[4096];
+        while(poll(fds, 2, -1) > 0)
+        {
+            if(fds[0].revents)
+            { // 主机发给从机，超过 cutAfter 的部分不再转发
+                ssize_t n = read(m[1], buff, sizeof(buff));
+                if(n <= 0) break;
+                size_t allowed = std::min<size_t>(n, cutAfter - forwarded);
+                if(allowed > 0) write(s[0], buff, allowed);
+                forwarded += allowed;
+                if(allowed < static_cast<size_t>(n)) break;
+            }
+            if(fds[1].revents)
+            {
+                ssize_t n = read(s[0], buff, sizeof(buff));
+                if(n <= 0) break;
+                write(m[1], buff, n);
+            }
+        }
+        shutdown(m[1], SHUT_RDWR);
+        shutdown(s[0], SHUT_RDWR);
+    });
+    // 同步完成之后主机关闭连接，从机不再等待命令流
+    std::thread sender([&master]()
+    {
+        syncWithSlave(master);
+        if(master.config.slave_socket_fd != -1) shutdown(master.config.slave_socket_fd, SHUT_RDWR);
+    });
+    syncWithMaster(slave);
+    sender.join();
+    proxy.join();
+    for(int fd : {m[1], s[0], s[1]}) close(fd);
+    if(master.config.slave_socket_fd != -1) close(master.config.slave_socket_fd);
+    return forwarded;
+}
+
+// 部分同步的验证：从机全量同步之后，主机继续写入，从机在接收部分同步的过程中断开，重连之后只接收缺少的字节
+// 最后主机写入超过积压缓冲区长度的数据，从机只能全量同步
+void psyncBenchmark(size_t n)
+{
+    signal(SIGPIPE, SIG_IGN);
+    Server master, slave;
+    master.setReplBacklogSize(1024 * 1024);
+    master.config.replDisklessSync = true;
+    slave.config.dumpDir = "bench_psync_slave.rdb";
+    size_t next = 0;
+    auto propagate = [&master, &next](size_t count)
+    {
+        for(size_t i=0;i<count;++i,++next)
+        {
+            Command cmd{CMD_SET, "key:" + std::to_string(next % 100000), "value:" + std::to_string(next)};
+            std::string reply;
+            execCommand(master, cmd, reply);
+        }
+    };
+    auto consistent = [&master, &slave]()
+    {
+        if(slave.config.conn.offset != master.cmdBinaryBuff.getOffset() || slave.db.size() != master.db.size()) return false;
+        bool same = true;
+        master.db.forEach([&slave, &same](HashNode *node)
+        {
+            HashNode *other = slave.db.find(node->getKey());
+            if(other == nullptr || other->getValue() != node->getValue()) same = false;
+        });
+        return same;
+    };
+    const size_t noCut = SIZE_MAX;
+    propagate(n);
+    replSyncThroughProxy(master, slave, noCut);
+    std::cout<<"initial sync:  full "<<master.statSyncFull<<", offset "<<slave.config.conn.offset<<", "
+             <<(consistent() ? "consistent" : "MISMATCH")<<'\n';
+
+    // 主机继续写入，从机接收到一半时断开
+    propagate(n / 10);
+    size_t missing = master.cmdBinaryBuff.getOffset() - slave.config.conn.offset;
+    size_t before = slave.config.conn.offset;
+    replSyncThroughProxy(master, slave, 2 * sizeof(ReplConnectionPack) + sizeof(size_t) + missing / 2);
+    std::cout<<"interrupted:   applied "<<slave.config.conn.offset - before<<" of "<<missing<<" bytes\n";
+
+    // 重连之后只发送缺少的字节
+    size_t expected = master.cmdBinaryBuff.getOffset() - slave.config.conn.offset;
+    size_t partialBytes = master.statSyncPartialBytes, fullBefore = master.statSyncFull;
+    replSyncThroughProxy(master, slave, noCut);
+    size_t sent = master.statSyncPartialBytes - partialBytes;
+    std::cout<<"reconnected:   partial "<<master.statSyncPartialOk<<", sent "<<sent<<" bytes, expected "<<expected
+             <<(sent == expected && master.statSyncFull == fullBefore ? " ok" : " WRONG")<<", "
+             <<(consistent() ? "consistent" : "MISMATCH")<<'\n';
+
+    // 落后超过积压缓冲区的长度
+    while(master.cmdBinaryBuff.getOffset() - slave.config.conn.offset <= master.cmdBinaryBuff.getCapacity()) propagate(1000);
+    replSyncThroughProxy(master, slave, noCut);
+    std::cout<<"out of backlog: full "<<master.statSyncFull<<", partial_err "<<master.statSyncPartialErr<<", "
+             <<(consistent() ? "consistent" : "MISMATCH")<<'\n';
+    unlink(slave.config.dumpDir.c_str());
+}
+
+// 命令流复制：从机同步完成之后，主机每执行一批写命令就由事件循环发送给所有从机
+// 逐批测量从主机执行完一批命令到所有从机执行完这一批的延迟，再测量不等待从机时的吞吐量
+void replStreamBenchmark(size_t n)
+{
+    signal(SIGPIPE, SIG_IGN);
+    constexpr size_t batch = 100;
+    for(size_t replicaNum : {1, 3})
+    {
+        Server master;
+        master.config.replDisklessSync = true;
+        aeEventLoop loop(1024);
+        std::vector<std::unique_ptr<Server>> slaves;
+        std::vector<std::thread> appliers;
+        std::vector<int> fds;
+        size_t next = 0;
+        auto propagate = [&master, &next](size_t count)
+        {
+            std::string reply;
+            for(size_t i=0;i<count;++i,++next)
+            {
+                Command cmd{CMD_SET, "key:" + std::to_string(next % 100000), "value:" + std::to_string(next)};
+                execCommand(master, cmd, reply);
+            }
+        };
+        // 主机在等待从机时处理从机套接字上的可写事件
+        auto waitReplicas = [&master, &loop, &slaves](size_t target)
+        {
+            for(auto &slave : slaves)
+            {
+                while(__atomic_load_n(&slave->config.conn.offset, __ATOMIC_ACQUIRE) < target && !master.replicas.empty())
+                {
+                    int num = aeApiPoll(loop, 0);
+                    for(int i=0;i<num;++i) replicationHandleReplicaEvent(master, loop, loop.fired[i].fd, loop.fired[i].mask);
+                    std::this_thread::yield();
+                }
+            }
+        };
+        propagate(10000);
+        for(size_t i=0;i<replicaNum;++i)
+        {
+            int sv[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+            slaves.emplace_back(new Server());
+            Server &slave = *slaves.back();
+            slave.config.dumpDir = "bench_stream_slave" + std::to_string(i) + ".rdb";
+            slave.config.master_socket_fd = sv[1];
+            master.config.slave_socket_fd = sv[0];
+            appliers.emplace_back([&slave]() { syncWithMaster(slave); });
+            if(syncWithSlave(master)) replicationAddReplica(master, loop, sv[0], master.config.conn.offset);
+            else close(sv[0]);
+        }
+
+        std::vector<double> lags;
+        for(size_t done=0;done<n;done+=batch)
+        {
+            propagate(batch);
+            auto start = std::chrono::steady_clock::now();
+            replicationWriteToReplicas(master, loop);
+            waitReplicas(master.cmdBinaryBuff.getOffset());
+            lags.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::sort(lags.begin(), lags.end());
+        double total = 0;
+        for(double l : lags) total += l;
+
+        auto start = std::chrono::steady_clock::now();
+        for(size_t done=0;done<n;done+=batch)
+        {
+            propagate(batch);
+            replicationWriteToReplicas(master, loop);
+        }
+        waitReplicas(master.cmdBinaryBuff.getOffset());
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        size_t online = master.replicas.size();
+        while(!master.replicas.empty()) replicationFreeReplica(master, &loop, master.replicas.begin()->first);
+        for(auto &t : appliers) t.join();
+        size_t consistent = 0;
+        for(auto &slave : slaves)
+        {
+            bool same = slave->config.conn.offset == master.cmdBinaryBuff.getOffset() && slave->db.size() == master.db.size();
+            master.db.forEach([&slave, &same](HashNode *node)
+            {
+                HashNode *other = slave->db.find(node->getKey());
+                if(other == nullptr || other->getValue() != node->getValue()) same = false;
+            });
+            consistent += same;
+            unlink(slave->config.dumpDir.c_str());
+        }
+        std::cout<<replicaNum<<" replicas ("<<online<<" online), batch "<<batch<<": lag avg "<<total / lags.size()<<"us, p50 "
+                 <<lags[lags.size() / 2]<<"us, p99 "<<lags[lags.size() * 99 / 100]<<"us; pipelined "<<n<<" cmds in "<<ms<<"ms ("
+                 <<static_cast<size_t>(n / ms * 1000)<<" cmds/s), "<<consistent<<"/"<<replicaNum<<" consistent\n";
+    }
+}
+
+// 多从机：k 个从机同时通过 TCP 连接主机的复制端口，由主机的事件循环接受，共享一次全量同步
+// 之后主机持续写入，统计每个从机落后的字节数和时间，最后一个从机断开重连，只需要部分同步
+void replicasBenchmark(size_t k)
+{
+    signal(SIGPIPE, SIG_IGN);
+    constexpr size_t keys = 200000, writes = 200000, batch = 100;
+    constexpr int port = 19001;
+    Server master;
+    master.config.replDisklessSync = true;
+    aeEventLoop loop(1024);
+    master.config.repl_listen_fd = createListenSocket(port, false);
+    aeApiAddEvent(loop, master.config.repl_listen_fd, AE_READABLE);
+    size_t next = 0;
+    auto propagate = [&master, &next](size_t count)
+    {
+        std::string reply;
+        for(size_t i=0;i<count;++i,++next)
+        {
+            Command cmd{CMD_SET, "key:" + std::to_string(next % keys), "value:" + std::to_string(next)};
+            execCommand(master, cmd, reply);
+        }
+    };
+    // 主机事件循环的一轮
+    auto pump = [&master, &loop](int waitMs)
+    {
+        int num = aeApiPoll(loop, waitMs);
+        for(int i=0;i<num;++i)
+        {
+            int fd = loop.fired[i].fd;
+            if(fd == master.config.repl_listen_fd) acceptReplicas(master, loop);
+            else replicationHandleReplicaEvent(master, loop, fd, loop.fired[i].mask);
+        }
+        checkChildrenDone(master);
+        replicationBeforeSleep(master, loop);
+    };
+    auto caughtUp = [&master](size_t count)
+    {
+        size_t n = 0;
+        for(auto &it : master.replicas)
+            if(it.second.state == REPLICA_STATE_ONLINE && it.second.ackOffset == master.cmdBinaryBuff.getOffset()) ++n;
+        return n == count;
+    };
+    std::vector<std::unique_ptr<Server>> slaves;
+    std::vector<std::thread> threads(k);
+    auto startReplica = [&slaves, &threads](size_t i)
+    {
+        Server &slave = *slaves[i];
+        slave.config.master_IP = "127.0.0.1";
+        slave.config.master_port = port;
+        connectToMaster(slave.config);
+        threads[i] = std::thread([&slave]() { syncWithMaster(slave); });
+    };
+    propagate(keys);
+
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i=0;i<k;++i)
+    {
+        slaves.emplace_back(new Server());
+        slaves.back()->config.dumpDir = "bench_replicas_slave" + std::to_string(i) + ".rdb";
+        startReplica(i);
+    }
+    while(!caughtUp(k)) pump(1);
+    double syncMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout<<k<<" replicas online after "<<syncMs<<"ms, full syncs "<<master.statSyncFull<<", "<<keys<<" keys\n";
+
+    // 持续写入，每一批之后记录落后最多的从机
+    size_t maxLagBytes = 0, sumLagBytes = 0, samples = 0;
+    int64_t maxLagMs = 0;
+    start = std::chrono::steady_clock::now();
+    for(size_t done=0;done<writes;done+=batch)
+    {
+        propagate(batch);
+        pump(0);
+        std::this_thread::yield();
+        for(auto &it : master.replicas)
+        {
+            size_t lagBytes = master.cmdBinaryBuff.getOffset() - it.second.ackOffset;
+            maxLagBytes = std::max(maxLagBytes, lagBytes);
+            maxLagMs = std::max(maxLagMs, replicationReplicaLagMs(master, it.second));
+            sumLagBytes += lagBytes;
+            ++samples;
+        }
+    }
+    while(!caughtUp(k)) pump(1);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout<<writes<<" writes streamed to "<<k<<" replicas in "<<ms<<"ms ("<<static_cast<size_t>(writes / ms * 1000)
+             <<" cmds/s), lag avg "<<sumLagBytes / std::max<size_t>(samples, 1)<<" bytes, max "<<maxLagBytes<<" bytes / "<<maxLagMs<<"ms\n";
+
+    // 最后一个从机断开，主机继续写入，重连之后部分同步
+    shutdown(slaves[k - 1]->config.master_socket_fd, SHUT_RDWR);
+    threads[k - 1].join();
+    close(slaves[k - 1]->config.master_socket_fd);
+    while(master.replicas.size() == k) pump(1);
+    propagate(10000);
+    size_t partialBefore = master.statSyncPartialOk;
+    startReplica(k - 1);
+    while(!caughtUp(k)) pump(1);
+    std::string info;
+    genInfoString(master, info);
+    for(size_t pos=0;(pos = info.find("\nslave", pos)) != std::string::npos;)
+    {
+        size_t end = info.find("\r\n", pos);
+        std::cout<<"  "<<info.substr(pos + 1, end - pos - 1)<<'\n';
+        pos = end;
+    }
+
+    while(!master.replicas.empty()) replicationFreeReplica(master, &loop, master.replicas.begin()->first);
+    size_t consistent = 0;
+    for(size_t i=0;i<k;++i)
+    {
+        threads[i].join();
+        Server &slave = *slaves[i];
+        bool same = slave.config.conn.offset == master.cmdBinaryBuff.getOffset() && slave.db.size() == master.db.size();
+        master.db.forEach([&slave, &same](HashNode *node)
+        {
+            HashNode *other = slave.db.find(node->getKey());
+            if(other == nullptr || other->getValue() != node->getValue()) same = false;
+        });
+        consistent += same;
+        unlink(slave.config.dumpDir.c_str());
+    }
+    std::cout<<"reconnected replica: partial syncs "<<master.statSyncPartialOk - partialBefore<<", full syncs "<<master.statSyncFull
+             <<"; "<<consistent<<"/"<<k<<" replicas consistent\n";
+}
+
+// producers 个线程写入共 n 条命令，consumers 个线程取出，返回每秒传递的命令数
+template <typename Queue>
+double queueThroughput(Queue &q, int producers, int consumers, size_t n)
+{
+    std::atomic<size_t> consumed(0);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for(int p=0;p<producers;++p)
+    {
+        threads.emplace_back([&q, p, producers, n]()
+        {
+            for(size_t i=p;i<n;i+=producers) q.push(std::make_pair(static_cast<int>(i), Command{CMD_SET, "key", "value"}));
+        });
+    }
+    for(int c=0;c<consumers;++c)
+    {
+        threads.emplace_back([&q, &consumed, n]()
+        {
+            std::pair<int, Command> item;
+            while(consumed.load(std::memory_order_relaxed) < n)
+            {
+                if(q.try_pop(item)) consumed.fetch_add(1, std::memory_order_relaxed);
+                else std::this_thread::yield();
+            }
+        });
+    }
+    for(auto &t : threads) t.join();
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return n / sec;
+}
+
+// 对比加锁队列和无锁环形队列在 IO 线程与主线程之间传递命令的吞吐量
+void queueBenchmark()
+{
+    constexpr size_t n = 2000000;
+    const std::pair<int, int> configs[] = {{1, 1}, {6, 1}, {1, 6}};
+    for(auto &c : configs)
+    {
+        threadsafe_queue<std::pair<int, Command>> locked;
+        mpmc_ring_queue<std::pair<int, Command>> ring;
+        double lockedOps = queueThroughput(locked, c.first, c.second, n);
+        double ringOps = queueThroughput(ring, c.first, c.second, n);
+        std::cout<<c.first<<" producer(s) / "<<c.second<<" consumer(s): threadsafe_queue "
+                 <<static_cast<size_t>(lockedOps / 1000)<<"K ops/s, mpmc_ring_queue "
+                 <<static_cast<size_t>(ringOps / 1000)<<"K ops/s\n";
+    }
+}
+
+// 检查时间事件的语义：单次和周期事件、删除、落后时不补触发、在处理函数中添加和删除事件，然后测量最小堆的开销
+void timerBenchmark(size_t n)
+{
+    using namespace std::chrono;
+    Server server;
     aeEventLoop loop;
+    bool allOk = true;
+    auto check = [&allOk](const char *name, bool ok)
+    {
+        std::cout<<(ok ? "ok      " : "FAILED  ")<<name<<std::endl;
+        allOk = allOk && ok;
+    };
+    // 和 aeMain 一样按照 timeEventWaitTime 等待，直到 ms 毫秒之后
+    auto runFor = [&loop, &server](int ms)
+    {
+        auto deadline = steady_clock::now() + milliseconds(ms);
+        while(steady_clock::now() < deadline)
+        {
+            int left = static_cast<int>(ceil<milliseconds>(deadline - steady_clock::now()).count());
+            poll(nullptr, 0, loop.timeEventWaitTime(left));
+            loop.dealWithTimeEvents(server);
+        }
+    };
+
+    int once = 0;
+    long long id = loop.addTimeEventToLoop([&once](Server &) { ++once; }, milliseconds(5));
+    runFor(30);
+    check("one-shot event fires once and is removed", once == 1 && loop.aeTimeEvents.count(id) == 0);
+
+    int ticks = 0;
+    id = loop.addTimeEventToLoop([&ticks](Server &) { ++ticks; }, milliseconds(10), milliseconds(10));
+    runFor(105);
+    loop.deleteTimeEvent(id);
+    check("periodic event fires every period", ticks >= 9 && ticks <= 11);
+
+    int cancelled = 0;
+    id = loop.addTimeEventToLoop([&cancelled](Server &) { ++cancelled; }, milliseconds(5));
+    bool deleted = loop.deleteTimeEvent(id);
+    runFor(20);
+    check("deleted event never fires", deleted && cancelled == 0 && !loop.deleteTimeEvent(id));
+
+    // 事件循环被阻塞了很多个周期，之后只触发一次，下一次在一个周期之后
+    int late = 0;
+    id = loop.addTimeEventToLoop([&late](Server &) { ++late; }, milliseconds(5), milliseconds(5));
+    std::this_thread::sleep_for(milliseconds(60));
+    loop.dealWithTimeEvents(server);
+    bool rescheduled = loop.aeTimeEvents.count(id) && loop.aeTimeEvents[id].when > steady_clock::now();
+    loop.deleteTimeEvent(id);
+    check("late periodic event fires once without catch-up", late == 1 && rescheduled);
+
+    // 处理函数删除自己和另一个同时到期的事件，并添加一个新事件
+    int self = 0, victim = 0, added = 0;
+    long long victimId = -1, selfId = -1;
+    selfId = loop.addTimeEventToLoop([&](Server &)
+    {
+        ++self;
+        loop.deleteTimeEvent(selfId);
+        loop.deleteTimeEvent(victimId);
+        loop.addTimeEventToLoop([&added](Server &) { ++added; }, milliseconds(0));
+    }, milliseconds(5), milliseconds(5));
+    victimId = loop.addTimeEventToLoop([&victim](Server &) { ++victim; }, milliseconds(10), milliseconds(5));
+    runFor(40);
+    check("add and delete from inside a callback", self == 1 && victim == 0 && added == 1 && loop.aeTimeEvents.empty());
+
+    // 大量事件：添加，删除一半，全部到期后处理
+    std::mt19937_64 rng(42);
+    std::vector<long long> ids(n);
+    size_t fired = 0;
+    auto start = steady_clock::now();
+    for(size_t i=0;i<n;++i) ids[i] = loop.addTimeEventToLoop([&fired](Server &) { ++fired; }, milliseconds(rng() % 50));
+    auto afterAdd = steady_clock::now();
+    for(size_t i=0;i<n;i+=2) loop.deleteTimeEvent(ids[i]);
+    auto afterDelete = steady_clock::now();
+    std::this_thread::sleep_for(milliseconds(60));
+    auto fireStart = steady_clock::now();
+    loop.dealWithTimeEvents(server);
+    auto end = steady_clock::now();
+    auto perOp = [n](steady_clock::duration d, size_t ops) { return duration<double, std::nano>(d).count() / ops; };
+    check("remaining events fire exactly once", fired == n - (n + 1) / 2 && loop.aeTimeEvents.empty());
+    std::cout<<n<<" timers: add "<<perOp(afterAdd - start, n)<<"ns, delete "<<perOp(afterDelete - afterAdd, (n + 1) / 2)
+             <<"ns, fire "<<perOp(end - fireStart, n - (n + 1) / 2)<<"ns per event"<<std::endl;
+    std::cout<<(allOk ? "all timer checks passed" : "timer checks FAILED")<<std::endl;
+}
+
+// reusePort 为 true 时使用多监听模式，每个 IO 线程独立 accept 和读取
+// ioUring 为 true 时多监听模式的 IO 线程使用 io_uring 后端
+void serverTest(bool reusePort, bool ioUring, size_t maxclients, bool appendOnly, AofFsyncPolicy appendFsync, uint64_t replPort)
+{
     Server server;
+    server.config.repl_port = replPort;
     server.setIOThreadNum(6);
+    server.setMaxClients(maxclients);
+    server.setAppendOnly(appendOnly, appendFsync);
+    server.setReusePortMode(reusePort);
+    // 主线程接收连接、IO 线程读取的模式下连接被多个线程访问，只能使用 epoll
+    if(ioUring && !reusePort) std::cout<<"io_uring backend requires reuseport mode, using epoll"<<std::endl;
+    server.setIoUringMode(ioUring && reusePort);
+    // 初始化服务器，IO 线程需要使用监听端口
+    server.ServerInit();
+    // 主线程的事件循环，事件表的上限由调整之后的 maxclients 决定
+    aeEventLoop loop(static_cast<int>(server.maxclients) + CONFIG_FDSET_INCR);
     // IO 队列
     size_t IOthreadNum = server.IOThreadNum;
     // IO 线程的工作队列
-    std::vector<threadsafe_queue<IOThreadNews>> io_queue(IOthreadNum);
-    threadsafe_queue<std::pair<int, Command>> exec_queue;
+    std::vector<mpmc_ring_queue<IOThreadNews>> io_queue(IOthreadNum);
+    mpmc_ring_queue<std::pair<int, Command>> exec_queue;
+    // IO 线程和主线程之间回收的命令和回复缓冲区
+    std::vector<IOThreadRecycler> recycle(IOthreadNum);
     std::vector<std::thread> tv(0);
     // 创建IO线程
     for(int i=0;i<IOthreadNum;++i)
     {
-        tv.emplace_back(std::thread(IOThreadMain, std::ref(server), std::ref(loop), std::ref(io_queue[i]), std::ref(exec_queue)));
+        if(reusePort) tv.emplace_back(std::thread(IOThreadLoopMain, std::ref(server), i, std::ref(io_queue[i]), std::ref(exec_queue), std::ref(recycle[i])));
+        else tv.emplace_back(std::thread(IOThreadMain, std::ref(server), std::ref(loop), std::ref(io_queue[i]), std::ref(exec_queue), std::ref(recycle[i])));
         tv[i].detach();
     }
-    // 初始化epoll
-    aeApiCreate(loop);
-    // 初始化服务器
-    server.ServerInit();
     //aeCreateFileEvent(server.config.master_socket_fd,loop,aeServerConnectToClient,AE_READABLE,nullptr);
-    aeApiAddEvent(loop, server.config.master_socket_fd, AE_READABLE); // 将服务器监听套接字加入epoll
+    if(!reusePort) aeApiAddEvent(loop, server.config.master_socket_fd, AE_READABLE); // 将服务器监听套接字加入epoll
+    // 从机总是由主线程的事件循环接受
+    if(server.config.repl_listen_fd >= 0) aeApiAddEvent(loop, server.config.repl_listen_fd, AE_READABLE);
 
-    aeMain(server,loop, io_queue, exec_queue);
+    aeMain(server,loop, io_queue, exec_queue, recycle);
 
 }
 
@@ -180,10 +1440,59 @@ void func()
 
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    // ./test bench [name] 运行基准测试，不指定 name 时运行全部
+    if(argc > 1 && std::string(argv[1]) == "bench")
+    {
+        std::string name = argc > 2 ? argv[2] : "";
+        bool ok = true;
+        if(name.empty() || name == "dict") ok = dictTest() && ok;
+        if(name.empty() || name == "alloc")
+        {
+            getAllocBenchmark();
+            threadedAllocBenchmark(argc > 3 ? std::stoul(argv[3]) : 100000);
+        }
+        if(name.empty() || name == "hash") hashBenchmark();
+        if(name.empty() || name == "queue") queueBenchmark();
+        if(name.empty() || name == "flood") queueFloodBenchmark(argc > 3 ? std::stoul(argv[3]) : 1000000);
+        if(name.empty() || name == "rehash") rehashLatencyBenchmark(argc > 3 ? std::stoul(argv[3]) : 1000000);
+        if(name.empty() || name == "rdb") rdbBenchmark(argc > 3 ? std::stoul(argv[3]) : 1000000);
+        if(name.empty() || name == "mmapload") mmapLoadBenchmark(argc > 3 ? std::stoul(argv[3]) : 1000000);
+        if(name.empty() || name == "aof") aofBenchmark(argc > 3 ? std::stoul(argv[3]) : 1000000);
+        if(name.empty() || name == "bio") bioBenchmark(argc > 3 ? std::stoul(argv[3]) : 512);
+        if(name.empty() || name == "bgsave") bgsaveBenchmark(argc > 3 ? std::stoul(argv[3]) : 1000000);
+        if(name.empty() || name == "resync") resyncBenchmark(argc > 3 ? std::stoul(argv[3]) : 256);
+        if(name.empty() || name == "diskless") disklessBenchmark(argc > 3 ? std::stoul(argv[3]) : 1000000);
+        if(name.empty() || name == "psync") psyncBenchmark(argc > 3 ? std::stoul(argv[3]) : 100000);
+        if(name.empty() || name == "replstream") replStreamBenchmark(argc > 3 ? std::stoul(argv[3]) : 100000);
+        if(name.empty() || name == "replicas") replicasBenchmark(argc > 3 ? std::stoul(argv[3]) : 5);
+        if(name.empty() || name == "timer") timerBenchmark(argc > 3 ? std::stoul(argv[3]) : 100000);
+        return ok ? 0 : 1;
+    }
 
-    serverTest();
+    // ./test [reuseport] [uring] [maxclients <n>] [appendonly yes|no] [appendfsync always|everysec|no] [replport <port>]
+    // reuseport 使用多监听模式，uring 同时使用 io_uring 后端，maxclients 设置最大客户端数
+    // appendonly 是否写 AOF，appendfsync 为 AOF 的 fdatasync 策略，replport 为接受从机连接的端口
+    bool reusePort = false, ioUring = false, appendOnly = true;
+    size_t maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
+    uint64_t replPort = 0;
+    AofFsyncPolicy appendFsync = AOF_FSYNC_DEFAULT;
+    for(int i=1;i<argc;++i)
+    {
+        std::string arg = argv[i];
+        if(arg == "reuseport") reusePort = true;
+        else if(arg == "uring") ioUring = true;
+        else if(arg == "maxclients" && i + 1 < argc) maxclients = std::stoul(argv[++i]);
+        else if(arg == "appendonly" && i + 1 < argc) appendOnly = std::string(argv[++i]) == "yes";
+        else if(arg == "replport" && i + 1 < argc) replPort = std::stoul(argv[++i]);
+        else if(arg == "appendfsync" && i + 1 < argc && !aofParseFsyncPolicy(argv[++i], appendFsync))
+        {
+            std::cerr<<"invalid appendfsync policy: "<<argv[i]<<'\n';
+            return 1;
+        }
+    }
+    serverTest(reusePort, ioUring, maxclients, appendOnly, appendFsync, replPort);
     // std::thread t1(foo);
     // std::thread t2(func);
     // t1.join();
@@ -0,0 +1,220 @@
+#include "networking.h"
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+Client::Client(int fd) : fd(fd), protocolError(false), queryFedByLoop(false), queryClosed(false), apiData(nullptr), _querybuf(nullptr), _qblen(0), _qbpos(0), _qbcap(0),
+    _replyHead(0), _replyTail(0), _sentlen(0), _replyBytes(0), _softLimitReached(false)
+{
+}
+
+Client::~Client()
+{
+    free(_querybuf);
+}
+
+void Client::reserve(size_t n)
+{
+    if(_qbpos > 0)
+    { // 丢弃已经解析的数据
+        memmove(_querybuf, _querybuf + _qbpos, _qblen - _qbpos);
+        _qblen -= _qbpos;
+        _qbpos = 0;
+    }
+    if(_qbcap - _qblen >= n) return;
+    size_t cap = _qbcap == 0 ? PROTO_IOBUF_LEN : _qbcap;
+    while(cap - _qblen < n) cap <<= 1;
+    char *buff = static_cast<char *>(realloc(_querybuf, cap));
+    if(buff == nullptr) throw std::bad_alloc();
+    _querybuf = buff;
+    _qbcap = cap;
+}
+
+bool Client::readQuery(Server &server)
+{
+    if(queryFedByLoop) return !queryClosed;
+    while(true)
+    {
+        size_t need = PROTO_IOBUF_LEN;
+        size_t pending = _qblen - _qbpos;
+        if(pending >= sizeof(size_t))
+        { // 正在读取一条大命令时，按照已经收到的字节数成倍扩大，不能只根据长度头预留整条命令
+            size_t frameLen = 0;
+            memcpy(&frameLen, _querybuf + _qbpos, sizeof(size_t));
+            if(frameLen <= PROTO_MAX_FRAME_LEN && sizeof(size_t) + frameLen > pending)
+            {
+                size_t grow = std::min(pending, PROTO_MAX_QUERY_GROW);
+                need = std::max(need, std::min(sizeof(size_t) + frameLen - pending, grow));
+            }
+        }
+        reserve(need);
+        size_t space = _qbcap - _qblen;
+        ssize_t n = read(fd, _querybuf + _qblen, space);
+        server.statNetReads += 1;
+        if(n > 0)
+        {
+            _qblen += n;
+            // 没有读满说明内核缓冲区已经读空，之后到达的数据会触发新的边缘事件
+            if(static_cast<size_t>(n) < space) return true;
+            if(!checkQueryLimit(server)) return true; // 不再读取，由调用者断开连接
+            continue;
+        }
+        if(n == 0) return false; // 客户端关闭
+        if(errno == EAGAIN || errno == EWOULDBLOCK) return true;
+        if(errno == EINTR) continue;
+        return false;
+    }
+}
+
+void Client::appendQuery(const char *buf, size_t n)
+{
+    reserve(n);
+    memcpy(_querybuf + _qblen, buf, n);
+    _qblen += n;
+}
+
+bool Client::nextCommand(Command &cmd)
+{
+    size_t pending = _qblen - _qbpos;
+    if(pending < sizeof(size_t)) return false;
+    size_t frameLen = 0;
+    memcpy(&frameLen, _querybuf + _qbpos, sizeof(size_t));
+    if(frameLen > PROTO_MAX_FRAME_LEN)
+    {
+        protocolError = true;
+        return false;
+    }
+    if(pending < sizeof(size_t) + frameLen) return false; // 命令还没有接收完整
+    const char *payload = _querybuf + _qbpos + sizeof(size_t);
+    if(!checkBinaryCmd(payload, frameLen))
+    {
+        protocolError = true;
+        return false;
+    }
+    parseBinaryCmd(payload, cmd);
+    _qbpos += sizeof(size_t) + frameLen;
+    if(_qbpos == _qblen)
+    {
+        _qbpos = _qblen = 0;
+        // 读取过大命令之后缓冲区空闲时缩小，避免长期占用内存
+        if(_qbcap > PROTO_IOBUF_LEN * 4)
+        {
+            free(_querybuf);
+            _querybuf = nullptr;
+            _qbcap = 0;
+        }
+    }
+    return true;
+}
+
+void Client::addReply(std::string &&reply)
+{
+    if(reply.empty()) return;
+    _replyBytes += reply.size();
+    if(_replyTail < _replies.size()) _replies[_replyTail] = std::move(reply);
+    else _replies.push_back(std::move(reply));
+    ++_replyTail;
+}
+
+bool Client::writeReplies(Server &server)
+{
+    iovec iov[PROTO_REPLY_IOV_MAX];
+    while(_replyHead != _replyTail)
+    {
+        int cnt = fillReplyIov(iov, PROTO_REPLY_IOV_MAX);
+        size_t total = 0;
+        for(int i=0;i<cnt;++i) total += iov[i].iov_len;
+        ssize_t n = writev(fd, iov, cnt);
+        server.statNetWrites += 1;
+        if(n < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return true; // socket 已经写满，等待可写事件
+            if(errno == EINTR) continue;
+            return false;
+        }
+        consumeReplies(static_cast<size_t>(n));
+        if(static_cast<size_t>(n) < total) return true; // 只写入了一部分，socket 已经写满
+    }
+    return true;
+}
+
+int Client::fillReplyIov(iovec *iov, int max) const
+{
+    int cnt = 0;
+    for(size_t i = _replyHead;i != _replyTail && cnt < max;++i, ++cnt)
+    {
+        size_t offset = cnt == 0 ? _sentlen : 0;
+        iov[cnt].iov_base = const_cast<char *>(_replies[i].data()) + offset;
+        iov[cnt].iov_len = _replies[i].size() - offset;
+    }
+    return cnt;
+}
+
+void Client::consumeReplies(size_t n)
+{
+    _replyBytes -= n;
+    // 释放已经发送完毕的块
+    while(n > 0)
+    {
+        std::string &block = _replies[_replyHead];
+        size_t remain = block.size() - _sentlen;
+        if(n < remain)
+        {
+            _sentlen += n;
+            break;
+        }
+        n -= remain;
+        // 较小的块留给调用者复用，大块直接释放，槽留在原处
+        if(_sentReplies.size() < PROTO_REPLY_IOV_MAX && block.capacity() <= PROTO_IOBUF_LEN) _sentReplies.push_back(std::move(block));
+        else std::string().swap(block);
+        ++_replyHead;
+        _sentlen = 0;
+    }
+    if(_replyHead == _replyTail)
+    { // 全部发送完毕，之后从头复用空槽
+        _replyHead = _replyTail = 0;
+        if(_replies.size() > PROTO_REPLY_SLOTS_MAX) _replies.clear();
+    }
+    else if(_replyHead >= PROTO_REPLY_SLOTS_MAX)
+    { // 一直没有发送完时丢弃开头的空槽，从头部删除不会移动其他的块
+        _replies.erase(_replies.begin(), _replies.begin() + _replyHead);
+        _replyTail -= _replyHead;
+        _replyHead = 0;
+    }
+}
+
+bool Client::takeSentReply(std::string &reply)
+{
+    if(_sentReplies.empty()) return false;
+    reply = std::move(_sentReplies.back());
+    _sentReplies.pop_back();
+    return true;
+}
+
+bool Client::checkQueryLimit(const Server &server) const
+{
+    return server.clientQueryBufferLimit == 0 || _qblen - _qbpos <= server.clientQueryBufferLimit;
+}
+
+bool Client::checkOutputLimits(const Server &server)
+{
+    size_t used = _replyBytes;
+    if(server.clientOutputHardLimit != 0 && used > server.clientOutputHardLimit) return false;
+    if(server.clientOutputSoftLimit == 0 || used <= server.clientOutputSoftLimit)
+    {
+        _softLimitReached = false;
+        return true;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if(!_softLimitReached)
+    {
+        _softLimitReached = true;
+        _softLimitStart = now;
+        return true;
+    }
+    return now - _softLimitStart <= std::chrono::seconds(server.clientOutputSoftSeconds);
+}
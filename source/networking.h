@@ -0,0 +1,87 @@
+#ifndef REDIS_LEARN_NETWORKING
+#define REDIS_LEARN_NETWORKING
+// 客户端连接
+// 每个连接拥有独立的输入缓冲区，一次 read 尽可能多地读取数据，然后解析出所有完整的命令，
+// 不完整的命令留在缓冲区中，等待下一次可读事件
+// 每个连接拥有独立的输出缓冲区，回复按块保存，socket 写满时保留剩余的数据，等待可写事件继续发送
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <sys/uio.h>
+#include "server.h"
+
+constexpr size_t PROTO_IOBUF_LEN = 16 * 1024; // 每次 read 至少预留的空间
+constexpr size_t PROTO_MAX_FRAME_LEN = 512 * 1024 * 1024; // 单条命令的最大长度
+constexpr size_t PROTO_MAX_QUERY_GROW = 64 * 1024 * 1024; // 读取大命令时输入缓冲区每次最多扩大的字节数
+constexpr int PROTO_REPLY_IOV_MAX = 64; // 一次发送最多包含的回复块数
+constexpr size_t PROTO_REPLY_SLOTS_MAX = 1024; // 输出缓冲区空闲时保留的空槽数，超过时释放
+
+class Client
+{
+public:
+    explicit Client(int fd);
+    ~Client();
+    Client(const Client &) = delete;
+    Client& operator=(const Client &) = delete;
+
+    // 读取 socket 中可读的数据，连接关闭或者出错时返回 false
+    // queryFedByLoop 为 true 时数据已经由事件循环写入缓冲区，只返回连接是否关闭
+    bool readQuery(Server &server);
+    // 事件循环直接收到的数据追加到输入缓冲区中（io_uring 后端）
+    void appendQuery(const char *buf, size_t n);
+    // 从输入缓冲区中解析下一条完整的命令，没有完整的命令时返回 false
+    // 命令格式非法时同样返回 false，并设置 protocolError
+    bool nextCommand(Command &cmd);
+    // 输入缓冲区占用的内存
+    size_t queryBufferSize() const { return _qbcap; }
+    // 输入缓冲区中还没有解析的数据超过 server.clientQueryBufferLimit 时返回 false，需要断开连接
+    bool checkQueryLimit(const Server &server) const;
+
+    // 追加一段已经是发送格式的回复
+    void addReply(std::string &&reply);
+    // 尽可能多地发送输出缓冲区中的数据，socket 写满时保留剩余的数据并返回 true，连接出错时返回 false
+    bool writeReplies(Server &server);
+    bool hasPendingReplies() const { return _replyBytes != 0; }
+    // 输出缓冲区中还没有发送的字节数
+    size_t outputBufferSize() const { return _replyBytes; }
+    // 输出缓冲区超过硬限制，或者超过软限制的时间过长时返回 false，需要断开连接
+    bool checkOutputLimits(const Server &server);
+    // 用输出缓冲区开头的最多 max 块数据填充 iov，返回使用的个数
+    // 由事件循环异步发送时，发送完成之前已经填充的块不能被释放
+    int fillReplyIov(iovec *iov, int max) const;
+    // 释放输出缓冲区开头已经发送的 n 字节，发送完毕的块留给 takeSentReply 复用
+    void consumeReplies(size_t n);
+    // 取出一块已经发送完毕的回复，复用它的内存，没有时返回 false
+    bool takeSentReply(std::string &reply);
+
+    int fd;
+    bool protocolError;
+    bool queryFedByLoop; // 输入由事件循环写入，readQuery 不再调用 read
+    bool queryClosed; // 事件循环已经收到连接关闭或者出错
+    void *apiData; // 事件循环后端附加在连接上的状态，由后端负责释放
+
+private:
+    // 保证缓冲区尾部至少有 n 字节空闲，会把未解析的数据移动到缓冲区头部
+    void reserve(size_t n);
+
+    char *_querybuf;
+    size_t _qblen; // 缓冲区中数据的长度
+    size_t _qbpos; // 已经解析到的位置
+    size_t _qbcap; // 缓冲区的容量
+
+    // 输出缓冲区，[_replyHead, _replyTail) 为还没有发送完的块，其余为发送完毕之后留下的空槽
+    // 全部发送完毕时从头复用空槽，deque 不会反复分配和释放内部的块；追加时已有的块不会移动，异步发送中的块地址不变
+    std::deque<std::string> _replies;
+    size_t _replyHead;
+    size_t _replyTail;
+    size_t _sentlen; // _replies[_replyHead] 中已经发送的字节数
+    size_t _replyBytes; // 输出缓冲区中还没有发送的字节数
+    std::vector<std::string> _sentReplies; // 发送完毕、等待复用的块，最多 PROTO_REPLY_IOV_MAX 块
+    bool _softLimitReached; // 是否正在超过软限制
+    std::chrono::steady_clock::time_point _softLimitStart; // 开始超过软限制的时间
+};
+
+#endif // REDIS_LEARN_NETWORKING
@@ -0,0 +1,470 @@
+#include "rdb.h"
+#include "crc64.h"
+#include <cstring>
+#include <cstdint>
+#include <charconv>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+bool rdbStringToInt(std::string_view s, int64_t &value)
+{
+    if(s.empty() || s.size() > 20) return false;
+    size_t i = 0;
+    bool negative = s[0] == '-';
+    if(negative)
+    {
+        if(s.size() == 1) return false;
+        i = 1;
+    }
+    if(s[i] == '0')
+    { // 只有 "0" 本身是规范的写法
+        if(s.size() != 1) return false;
+        value = 0;
+        return true;
+    }
+    uint64_t v = 0;
+    for(; i < s.size(); ++i)
+    {
+        if(s[i] < '0' || s[i] > '9') return false;
+        uint64_t d = s[i] - '0';
+        if(v > (UINT64_MAX - d) / 10) return false;
+        v = v * 10 + d;
+    }
+    if(negative)
+    {
+        if(v > static_cast<uint64_t>(INT64_MAX) + 1) return false;
+        value = static_cast<int64_t>(~v + 1);
+    }
+    else
+    {
+        if(v > static_cast<uint64_t>(INT64_MAX)) return false;
+        value = static_cast<int64_t>(v);
+    }
+    return true;
+}
+
+std::string rdbTempFileName(const std::string &fileName, int pid)
+{
+    return fileName + ".tmp." + std::to_string(pid);
+}
+
+// 字符串长度前缀的字节数，编码无效时返回 0
+static size_t stringHeaderSize(uint8_t b)
+{
+    switch(b >> 6)
+    {
+        case RDB_6BITLEN: return 1;
+        case RDB_14BITLEN: return 2;
+        case RDB_ENCVAL: return (b & 0x3f) <= RDB_ENC_INT64 ? 1 : 0;
+        default: return b == RDB_32BITLEN ? 5 : b == RDB_64BITLEN ? 9 : 0;
+    }
+}
+
+// 从 p 开始的字符串编码之后占用的全部字节数，[p, p + avail) 中长度前缀不完整时返回前缀的字节数
+// 编码无效时返回 0
+static uint64_t stringSize(const char *p, size_t avail)
+{
+    if(avail == 0) return 1;
+    uint8_t b = static_cast<uint8_t>(*p);
+    size_t header = stringHeaderSize(b);
+    if(header == 0) return 0;
+    if(avail < header) return header;
+    uint64_t len = 0;
+    switch(b >> 6)
+    {
+        case RDB_6BITLEN:
+            len = b & 0x3f;
+            break;
+        case RDB_14BITLEN:
+            len = (static_cast<uint64_t>(b & 0x3f) << 8) | static_cast<uint8_t>(p[1]);
+            break;
+        case RDB_ENCVAL:
+            len = 1ull << (b & 0x3f); // 1, 2, 4, 8 字节的整数
+            break;
+        default:
+            if(b == RDB_32BITLEN)
+            {
+                uint32_t len32;
+                memcpy(&len32, p + 1, 4);
+                len = len32;
+            }
+            else memcpy(&len, p + 1, 8);
+            if(len > UINT64_MAX - header) return 0;
+    }
+    return header + len;
+}
+
+bool rdbParseString(const char *&p, const char *end, std::string_view &s, char *intBuf)
+{
+    size_t avail = end - p;
+    uint64_t size = stringSize(p, avail);
+    if(size == 0 || size > avail) return false;
+    uint8_t b = static_cast<uint8_t>(*p);
+    if((b >> 6) == RDB_ENCVAL)
+    { // 按小端读取之后做符号扩展
+        size_t width = size - 1;
+        uint64_t u = 0;
+        memcpy(&u, p + 1, width);
+        int shift = 64 - 8 * static_cast<int>(width);
+        int64_t v = static_cast<int64_t>(u << shift) >> shift;
+        s = std::string_view(intBuf, std::to_chars(intBuf, intBuf + RDB_INT_BUF_SIZE, v).ptr - intBuf);
+    }
+    else
+    {
+        size_t header = stringHeaderSize(b);
+        s = std::string_view(p + header, size - header);
+    }
+    p += size;
+    return true;
+}
+
+// ==============================RdbWriter==============================
+RdbWriter::RdbWriter() : _fd(-1), _buf(new char[RDB_IO_BUF_SIZE]), _len(0), _offset(0), _crc(0), _failed(false) {}
+
+RdbWriter::~RdbWriter()
+{
+    if(_fd != -1) close(_fd);
+    delete[] _buf;
+}
+
+bool RdbWriter::open(const std::string &fileName)
+{
+    _fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    _failed = _fd == -1;
+    return !_failed;
+}
+
+bool RdbWriter::open(const std::function<bool(const void *, size_t)> &sink)
+{
+    _sink = sink;
+    _failed = !_sink;
+    return !_failed;
+}
+
+void RdbWriter::writeHeader(uint64_t count)
+{
+    char header[RDB_HEADER_SIZE];
+    memcpy(header, RDB_MAGIC, 4);
+    memcpy(header + 4, &RDB_VERSION, 4);
+    memcpy(header + 8, &count, 8);
+    append(header, RDB_HEADER_SIZE);
+}
+
+void RdbWriter::writeEntry(std::string_view key, std::string_view value)
+{
+    if(_index.empty() || _offset - _index.back() >= RDB_INDEX_INTERVAL) _index.push_back(_offset);
+    writeString(key);
+    writeString(value);
+}
+
+void RdbWriter::writeString(std::string_view s)
+{
+    int64_t v;
+    if(rdbStringToInt(s, v))
+    { // 按小端写入低 width 个字节，读取时再做符号扩展
+        uint8_t buf[9];
+        size_t width = 8;
+        uint8_t enc = RDB_ENC_INT64;
+        if(v >= INT8_MIN && v <= INT8_MAX) width = 1, enc = RDB_ENC_INT8;
+        else if(v >= INT16_MIN && v <= INT16_MAX) width = 2, enc = RDB_ENC_INT16;
+        else if(v >= INT32_MIN && v <= INT32_MAX) width = 4, enc = RDB_ENC_INT32;
+        buf[0] = (RDB_ENCVAL << 6) | enc;
+        memcpy(buf + 1, &v, width);
+        append(buf, width + 1);
+        return;
+    }
+    writeLength(s.size());
+    append(s.data(), s.size());
+}
+
+void RdbWriter::writeLength(uint64_t len)
+{
+    uint8_t buf[9];
+    if(len < 64)
+    {
+        buf[0] = static_cast<uint8_t>(len);
+        append(buf, 1);
+    }
+    else if(len < 16384)
+    {
+        buf[0] = static_cast<uint8_t>((RDB_14BITLEN << 6) | (len >> 8));
+        buf[1] = static_cast<uint8_t>(len & 0xff);
+        append(buf, 2);
+    }
+    else if(len <= UINT32_MAX)
+    {
+        uint32_t len32 = static_cast<uint32_t>(len);
+        buf[0] = RDB_32BITLEN;
+        memcpy(buf + 1, &len32, 4);
+        append(buf, 5);
+    }
+    else
+    {
+        buf[0] = RDB_64BITLEN;
+        memcpy(buf + 1, &len, 8);
+        append(buf, 9);
+    }
+}
+
+void RdbWriter::append(const void *data, size_t len)
+{
+    _offset += len;
+    if(_len + len > RDB_IO_BUF_SIZE)
+    {
+        flush();
+        if(len > RDB_IO_BUF_SIZE)
+        { // 比缓冲区还大的字符串直接写入
+            _crc = crc64(_crc, data, len);
+            writeRaw(data, len);
+            return;
+        }
+    }
+    memcpy(_buf + _len, data, len);
+    _len += len;
+}
+
+void RdbWriter::flush()
+{
+    if(_len == 0) return;
+    _crc = crc64(_crc, _buf, _len);
+    writeRaw(_buf, _len);
+    _len = 0;
+}
+
+void RdbWriter::writeRaw(const void *data, size_t len)
+{
+    if(_sink)
+    {
+        if(!_failed && len > 0 && !_sink(data, len)) _failed = true;
+        return;
+    }
+    const char *p = static_cast<const char *>(data);
+    while(len > 0 && !_failed)
+    {
+        ssize_t n = write(_fd, p, len);
+        if(n == -1)
+        {
+            if(errno == EINTR) continue;
+            _failed = true;
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+bool RdbWriter::finish()
+{
+    if(!_index.empty())
+    {
+        uint64_t indexOffset = _offset, n = _index.size();
+        uint8_t opcode = RDB_OPCODE_INDEX;
+        append(&opcode, 1);
+        append(&n, sizeof(n));
+        append(_index.data(), n * sizeof(uint64_t));
+        append(&indexOffset, sizeof(indexOffset));
+    }
+    uint8_t eof = RDB_OPCODE_EOF;
+    append(&eof, 1);
+    flush();
+    uint64_t crc = _crc;
+    writeRaw(&crc, sizeof(crc));
+    if(!_failed && _fd != -1 && fsync(_fd) == -1) _failed = true;
+    if(_fd != -1 && close(_fd) == -1) _failed = true;
+    _fd = -1;
+    return !_failed;
+}
+
+// ==============================RdbReader==============================
+RdbReader::RdbReader() : _fd(-1), _buf(new char[RDB_IO_BUF_SIZE]), _cap(RDB_IO_BUF_SIZE), _pos(0), _end(0),
+                         _fileSize(0), _fileRead(0), _crc(0) {}
+
+RdbReader::~RdbReader()
+{
+    if(_fd != -1) close(_fd);
+    delete[] _buf;
+}
+
+bool RdbReader::open(const std::string &fileName)
+{
+    _fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if(_fd == -1) return false;
+    struct stat st;
+    if(fstat(_fd, &st) == -1) return false;
+    _fileSize = st.st_size;
+    if(_fileSize < RDB_HEADER_SIZE + 1 + sizeof(uint64_t)) return false;
+    posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return true;
+}
+
+bool RdbReader::need(size_t n)
+{
+    if(_end - _pos >= n) return true;
+    if(n > _end - _pos + (_fileSize - _fileRead)) return false;
+    if(_pos + n > _cap)
+    { // 把未处理的数据移到缓冲区开头，仍然放不下时扩大缓冲区
+        if(n > _cap)
+        {
+            size_t cap = std::max(n, _cap * 2);
+            char *buf = new char[cap];
+            memcpy(buf, _buf + _pos, _end - _pos);
+            delete[] _buf;
+            _buf = buf;
+            _cap = cap;
+        }
+        else memmove(_buf, _buf + _pos, _end - _pos);
+        _end -= _pos;
+        _pos = 0;
+    }
+    while(_end - _pos < n)
+    {
+        ssize_t r = read(_fd, _buf + _end, _cap - _end);
+        if(r == -1)
+        {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        if(r == 0) return false;
+        // 最后 8 个字节是校验值本身，不参与计算
+        uint64_t crcEnd = _fileSize - sizeof(uint64_t);
+        if(_fileRead < crcEnd) _crc = crc64(_crc, _buf + _end, std::min<uint64_t>(r, crcEnd - _fileRead));
+        _fileRead += r;
+        _end += r;
+    }
+    return true;
+}
+
+bool RdbReader::readHeader(uint64_t &count)
+{
+    if(!need(RDB_HEADER_SIZE)) return false;
+    const char *header = _buf + _pos;
+    uint32_t version;
+    memcpy(&version, header + 4, 4);
+    memcpy(&count, header + 8, 8);
+    if(memcmp(header, RDB_MAGIC, 4) != 0 || version != RDB_VERSION) return false;
+    // 每对 key 和 value 至少占用 2 个字节，防止损坏的 key 数目导致分配过大的哈希表
+    if(count > (_fileSize - RDB_HEADER_SIZE - 1 - sizeof(uint64_t)) / 2) return false;
+    _pos += RDB_HEADER_SIZE;
+    return true;
+}
+
+bool RdbReader::readEntry(std::string_view &key, std::string_view &value)
+{
+    for(;;)
+    {
+        const char *p = _buf + _pos, *end = _buf + _end;
+        if(rdbParseString(p, end, key, _keyInt) && rdbParseString(p, end, value, _valueInt))
+        {
+            _pos = p - _buf;
+            return true;
+        }
+        // 缓冲区中的数据不足一个完整的 entry，按照长度前缀读入需要的字节数
+        // 长度超过文件剩余的数据时 need 直接失败，不会为损坏的长度分配缓冲区
+        size_t avail = _end - _pos;
+        uint64_t keySize = stringSize(_buf + _pos, avail);
+        if(keySize == 0) return false;
+        uint64_t n = keySize;
+        if(keySize <= avail)
+        {
+            uint64_t valueSize = stringSize(_buf + _pos + keySize, avail - keySize);
+            if(valueSize == 0 || valueSize > UINT64_MAX - keySize) return false;
+            n += valueSize;
+        }
+        if(n > SIZE_MAX || !need(n)) return false;
+    }
+}
+
+bool RdbReader::finish()
+{
+    if(!need(1)) return false;
+    if(static_cast<uint8_t>(_buf[_pos]) == RDB_OPCODE_INDEX)
+    { // 顺序读取时不需要索引，检查长度之后跳过
+        uint64_t n = 0, indexOffset = 0;
+        uint64_t offset = _fileRead - (_end - _pos);
+        if(!need(1 + sizeof(n))) return false;
+        memcpy(&n, _buf + _pos + 1, sizeof(n));
+        if(n > _fileSize / sizeof(uint64_t)) return false;
+        size_t indexSize = 1 + sizeof(n) + n * sizeof(uint64_t) + sizeof(indexOffset);
+        if(!need(indexSize)) return false;
+        memcpy(&indexOffset, _buf + _pos + indexSize - sizeof(indexOffset), sizeof(indexOffset));
+        if(indexOffset != offset) return false;
+        _pos += indexSize;
+    }
+    if(!need(RDB_TRAILER_SIZE)) return false;
+    if(static_cast<uint8_t>(_buf[_pos]) != RDB_OPCODE_EOF) return false;
+    uint64_t crc;
+    memcpy(&crc, _buf + _pos + 1, sizeof(crc));
+    _pos += RDB_TRAILER_SIZE;
+    return crc == _crc && _fileRead == _fileSize && _pos == _end;
+}
+
+// ==============================RdbMappedFile==============================
+RdbMappedFile::RdbMappedFile() : _fd(-1), _map(nullptr), _size(0), _count(0), _entriesEnd(0) {}
+
+RdbMappedFile::~RdbMappedFile()
+{
+    if(_map != nullptr) munmap(_map, _size);
+    if(_fd != -1) close(_fd);
+}
+
+bool RdbMappedFile::open(const std::string &fileName)
+{
+    _fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if(_fd == -1) return false;
+    struct stat st;
+    if(fstat(_fd, &st) == -1 || static_cast<uint64_t>(st.st_size) < RDB_HEADER_SIZE + RDB_TRAILER_SIZE) return false;
+    _size = st.st_size;
+    void *map = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if(map == MAP_FAILED) return false;
+    _map = static_cast<char *>(map);
+    // 每个线程顺序访问自己的块，内核可以提前读入并尽早回收已经访问过的页
+    madvise(_map, _size, MADV_SEQUENTIAL);
+
+    uint32_t version;
+    memcpy(&version, _map + 4, 4);
+    memcpy(&_count, _map + 8, 8);
+    if(memcmp(_map, RDB_MAGIC, 4) != 0 || version != RDB_VERSION) return false;
+    if(_count > (_size - RDB_HEADER_SIZE - RDB_TRAILER_SIZE) / 2) return false;
+    if(static_cast<uint8_t>(_map[_size - RDB_TRAILER_SIZE]) != RDB_OPCODE_EOF) return false;
+
+    // 从结尾找到索引，索引的偏移之后是 RDB_OPCODE_EOF
+    _entriesEnd = _size - RDB_TRAILER_SIZE;
+    constexpr size_t minIndexSize = 1 + 2 * sizeof(uint64_t) + sizeof(uint64_t);
+    if(_size < RDB_HEADER_SIZE + minIndexSize + RDB_TRAILER_SIZE) return true;
+    uint64_t indexOffset = 0, n = 0;
+    memcpy(&indexOffset, _map + _size - RDB_TRAILER_SIZE - sizeof(uint64_t), sizeof(uint64_t));
+    if(indexOffset < RDB_HEADER_SIZE || indexOffset > _size - RDB_TRAILER_SIZE - minIndexSize) return true;
+    if(static_cast<uint8_t>(_map[indexOffset]) != RDB_OPCODE_INDEX) return true;
+    memcpy(&n, _map + indexOffset + 1, sizeof(n));
+    if(n == 0 || n > _size / sizeof(uint64_t) ||
+       indexOffset + 1 + sizeof(n) + n * sizeof(uint64_t) + sizeof(uint64_t) != _size - RDB_TRAILER_SIZE) return true;
+    _index.resize(n);
+    memcpy(_index.data(), _map + indexOffset + 1 + sizeof(n), n * sizeof(uint64_t));
+    // 偏移必须从第一个 entry 开始严格递增
+    bool valid = _index[0] == RDB_HEADER_SIZE;
+    for(size_t i=1;valid && i<n;++i) valid = _index[i] > _index[i - 1];
+    valid = valid && _index.back() < indexOffset;
+    if(!valid)
+    {
+        _index.clear();
+        return false;
+    }
+    _entriesEnd = indexOffset;
+    return true;
+}
+
+bool RdbMappedFile::verifyChecksum(const std::vector<uint64_t> &chunkCrcs) const
+{
+    if(chunkCrcs.size() != _index.size()) return false;
+    uint64_t crc = crc64(0, _map, RDB_HEADER_SIZE);
+    for(size_t i=0;i<_index.size();++i) crc = crc64_combine(crc, chunkCrcs[i], chunkEnd(i) - chunkBegin(i));
+    // 索引和 RDB_OPCODE_EOF
+    crc = crc64(crc, _map + _entriesEnd, _size - sizeof(uint64_t) - _entriesEnd);
+    uint64_t expected;
+    memcpy(&expected, _map + _size - sizeof(uint64_t), sizeof(expected));
+    return crc == expected;
+}
@@ -0,0 +1,163 @@
+#ifndef REDIS_LEARN_RDB
+#define REDIS_LEARN_RDB
+// 二进制快照文件的格式和读写
+//
+// 文件格式，所有整数都是小端：
+//   头部 16 字节  "RLDB" | 版本 uint32 | key 的数目 uint64
+//   key 的数目个 (key, value)，每个字符串都带有长度前缀
+//   [可选的索引] RDB_OPCODE_INDEX | n uint64 | n 个 entry 的偏移 uint64 | 索引自身的偏移 uint64
+//   RDB_OPCODE_EOF | 之前所有字节的 CRC64 (uint64)
+//
+// 索引大约每 RDB_INDEX_INTERVAL 字节记录一个 entry 的起始偏移，第一个为 RDB_HEADER_SIZE
+// 相邻两个偏移之间是若干个完整的 entry，载入时可以由多个线程分别解析
+// 索引自身的偏移紧挨在 RDB_OPCODE_EOF 之前，不需要解析所有 entry 就可以从文件结尾找到索引
+//
+// 字符串的第一个字节的高两位表示编码方式：
+//   00xxxxxx                长度小于 64，低 6 位为长度
+//   01xxxxxx xxxxxxxx       长度小于 16384，14 位长度，高位在前
+//   10000000 + uint32       32 位长度
+//   10000001 + uint64       64 位长度
+//   11xxxxxx                整数编码，低 6 位为 RDB_ENC_INT8/16/32/64，之后是对应宽度的整数
+// 只有规范的十进制整数 (没有前导 0 和正号，不是 "-0") 使用整数编码，载入时可以还原为原来的字符串
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+constexpr char RDB_MAGIC[4] = {'R', 'L', 'D', 'B'};
+constexpr uint32_t RDB_VERSION = 1;
+constexpr size_t RDB_HEADER_SIZE = 16;
+constexpr uint8_t RDB_OPCODE_INDEX = 0xfe;
+constexpr uint8_t RDB_OPCODE_EOF = 0xff;
+constexpr size_t RDB_TRAILER_SIZE = 1 + sizeof(uint64_t); // RDB_OPCODE_EOF 和校验值
+
+constexpr uint8_t RDB_6BITLEN = 0;
+constexpr uint8_t RDB_14BITLEN = 1;
+constexpr uint8_t RDB_32BITLEN = 0x80;
+constexpr uint8_t RDB_64BITLEN = 0x81;
+constexpr uint8_t RDB_ENCVAL = 3;
+constexpr uint8_t RDB_ENC_INT8 = 0;
+constexpr uint8_t RDB_ENC_INT16 = 1;
+constexpr uint8_t RDB_ENC_INT32 = 2;
+constexpr uint8_t RDB_ENC_INT64 = 3;
+
+// 读写缓冲区的大小
+constexpr size_t RDB_IO_BUF_SIZE = 4 * 1024 * 1024;
+// 写入快照时每写入这么多 key 报告一次进度
+constexpr size_t RDB_PROGRESS_KEYS = 1024;
+// 索引中相邻两个偏移之间大约的字节数，也是并行载入时每个任务的大小
+constexpr uint64_t RDB_INDEX_INTERVAL = 4 * 1024 * 1024;
+// 整数编码的字符串还原为十进制时需要的缓冲区大小
+constexpr size_t RDB_INT_BUF_SIZE = 24;
+
+// 写入 fileName 时使用的临时文件，完成之后重命名为 fileName，pid 为写入快照的进程
+std::string rdbTempFileName(const std::string &fileName, int pid);
+
+// s 是规范的十进制整数并且在 int64_t 范围内时返回 true
+bool rdbStringToInt(std::string_view s, int64_t &value);
+
+// 从 [p, end) 中解析一个字符串，成功后 p 移动到字符串之后
+// 普通字符串返回指向 [p, end) 的视图，整数编码的字符串还原为十进制写入 intBuf (RDB_INT_BUF_SIZE 字节)
+// 数据不完整或者编码无效时返回 false，p 不变
+bool rdbParseString(const char *&p, const char *end, std::string_view &s, char *intBuf);
+
+// 带缓冲区的快照写入，写入的同时计算校验值并记录索引
+// 输出可以是文件，也可以是调用方提供的 sink (例如无盘同步时从机的套接字)
+// 出错之后的写入都会被忽略，由 finish 返回结果
+class RdbWriter
+{
+public:
+    RdbWriter();
+    ~RdbWriter();
+    RdbWriter(const RdbWriter &) = delete;
+    RdbWriter& operator=(const RdbWriter &) = delete;
+
+    bool open(const std::string &fileName);
+    // 缓冲区满了或者结束时把数据交给 sink，sink 返回 false 表示输出失败
+    // 使用 sink 时 finish 不会 fsync，也不关闭任何文件
+    bool open(const std::function<bool(const void *, size_t)> &sink);
+    void writeHeader(uint64_t count);
+    void writeEntry(std::string_view key, std::string_view value);
+    // 写入索引、结束标志和校验值，输出到文件时 fsync 之后关闭文件，所有写入都成功时返回 true
+    bool finish();
+private:
+    void writeString(std::string_view s);
+    void writeLength(uint64_t len);
+    void append(const void *data, size_t len);
+    void flush();
+    void writeRaw(const void *data, size_t len);
+
+    int _fd;
+    std::function<bool(const void *, size_t)> _sink;
+    char *_buf;
+    size_t _len;
+    uint64_t _offset; // 已经写入的字节数，包括缓冲区中的部分
+    std::vector<uint64_t> _index; // entry 的起始偏移
+    uint64_t _crc;
+    bool _failed;
+};
+
+// 带缓冲区的快照读取，读取的同时计算校验值
+class RdbReader
+{
+public:
+    RdbReader();
+    ~RdbReader();
+    RdbReader(const RdbReader &) = delete;
+    RdbReader& operator=(const RdbReader &) = delete;
+
+    bool open(const std::string &fileName);
+    // 读取并检查头部，count 为文件中 key 的数目
+    bool readHeader(uint64_t &count);
+    // 读取一对 key 和 value，返回的视图在下一次读取之前有效
+    bool readEntry(std::string_view &key, std::string_view &value);
+    // 跳过索引，检查结束标志和校验值，并且文件中没有多余的数据
+    bool finish();
+private:
+    // 保证缓冲区中从 _pos 开始至少有 n 个字节，文件中剩余的数据不足时返回 false
+    bool need(size_t n);
+
+    int _fd;
+    char *_buf;
+    size_t _cap;
+    size_t _pos; // 下一个未处理的字节
+    size_t _end; // 缓冲区中有效数据的结尾
+    uint64_t _fileSize;
+    uint64_t _fileRead; // 已经读入缓冲区的字节数
+    uint64_t _crc; // 文件中除了最后 8 字节之外的校验值
+    char _keyInt[RDB_INT_BUF_SIZE];
+    char _valueInt[RDB_INT_BUF_SIZE];
+};
+
+// 只读映射整个快照文件，检查头部、结尾和索引，用于多个线程并行载入
+// 按照索引把所有 entry 划分为若干块，每一块可以独立解析，校验值也按块分别计算之后再合并
+class RdbMappedFile
+{
+public:
+    RdbMappedFile();
+    ~RdbMappedFile();
+    RdbMappedFile(const RdbMappedFile &) = delete;
+    RdbMappedFile& operator=(const RdbMappedFile &) = delete;
+
+    // 映射文件并检查结构，没有索引的文件也可以打开，此时 hasIndex 为 false
+    bool open(const std::string &fileName);
+    uint64_t keyCount() const { return _count; }
+    bool hasIndex() const { return !_index.empty(); }
+    size_t chunkCount() const { return _index.size(); }
+    const char* chunkBegin(size_t i) const { return _map + _index[i]; }
+    const char* chunkEnd(size_t i) const { return _map + (i + 1 < _index.size() ? _index[i + 1] : _entriesEnd); }
+    // chunkCrcs[i] 为第 i 块的校验值，和头部、索引的校验值合并之后与文件中的校验值比较
+    bool verifyChecksum(const std::vector<uint64_t> &chunkCrcs) const;
+private:
+    int _fd;
+    char *_map;
+    size_t _size;
+    uint64_t _count;
+    uint64_t _entriesEnd; // 最后一个 entry 之后的偏移，即索引的偏移
+    std::vector<uint64_t> _index;
+};
+
+#endif // REDIS_LEARN_RDB
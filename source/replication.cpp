@@ -1,4 +1,61 @@
 #include "server.h"
+#include "ae.h"
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <random>
+#include <poll.h>
+
+// 等待非阻塞的套接字可读或者可写
+static bool replWaitFd(int fd, short events)
+{
+    pollfd p{fd, events, 0};
+    while(poll(&p, 1, -1) == -1)
+    {
+        if(errno != EINTR) return false;
+    }
+    return true;
+}
+
+// 套接字上的完整读写，对端关闭或者出错时返回 false
+// 全量同步的子进程使用和父进程相同的非阻塞套接字，EAGAIN 时等待
+static bool replWriteAll(int fd, const void *data, size_t len)
+{
+    const char *p = static_cast<const char *>(data);
+    while(len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if(n == -1 && errno == EINTR) continue;
+        if(n == -1 && errno == EAGAIN && replWaitFd(fd, POLLOUT)) continue;
+        if(n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool replReadAll(int fd, void *data, size_t len)
+{
+    char *p = static_cast<char *>(data);
+    while(len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if(n == -1 && errno == EINTR) continue;
+        if(n == -1 && errno == EAGAIN && replWaitFd(fd, POLLIN)) continue;
+        if(n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+void replicationCreateReplid(char *replid)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::random_device rd;
+    std::mt19937_64 rng((static_cast<uint64_t>(rd()) << 32) ^ rd() ^ static_cast<uint64_t>(getpid()));
+    for(size_t i=0;i<REPL_ID_LEN;++i) replid[i] = digits[rng() & 15];
+    replid[REPL_ID_LEN] = '\0';
+}
 
 // =====================master=============================
 // 主机等待从机连接，主机相当于服务器
@@ -94,60 +151,580 @@ void sendToSlave(ServerConfig &config)
     return;
 }
 
-// 和从机同步
-void syncWithSlave(Server &server)
+// 发送积压缓冲区中从全局偏移 from 开始的所有字节
+static bool sendBacklog(Server &server, int fd, size_t from)
+{
+    CmdBinaryBuff &backlog = server.cmdBinaryBuff;
+    size_t sendLen = backlog.getOffset() - from;
+    if(!replWriteAll(fd, &sendLen, sizeof(size_t))) return false;
+    while(from < backlog.getOffset())
+    {
+        const char *data = nullptr;
+        size_t n = backlog.peek(from, data);
+        if(!replWriteAll(fd, data, n)) return false;
+        from += n;
+    }
+    server.statSyncPartialBytes += sendLen;
+    return true;
+}
+
+// 根据从机的复制 ID 和偏移选择同步方式，返回 REPL_STATE_ACK、REPL_STATE_INCRREPL 或者 REPL_STATE_FULLREPL
+// 从机的复制 ID 和主机相同，并且它的偏移还在积压缓冲区中时只发送缺少的字节，否则全量同步
+static ReplStatus replicationChooseSync(Server &server, ReplConnectionPack &slaveConn)
+{
+    slaveConn.replid[REPL_ID_LEN] = '\0';
+    bool sameHistory = strcmp(slaveConn.replid, server.config.conn.replid) == 0;
+    if(sameHistory && slaveConn.offset == server.cmdBinaryBuff.getOffset()) return REPL_STATE_ACK;
+    if(sameHistory && server.cmdBinaryBuff.contains(slaveConn.offset)) return REPL_STATE_INCRREPL;
+    // 全量同步，从机之前复制过这个主机时说明它落后得太多，超出了积压缓冲区的范围
+    if(sameHistory) ++server.statSyncPartialErr;
+    ++server.statSyncFull;
+    return REPL_STATE_FULLREPL;
+}
+
+// 把快照发送给 fds 中所有已经收到 FULLREPL 包的从机，发送失败的从机被关闭并从 fds 中移除
+static bool replicationSendSnapshot(Server &server, std::vector<int> &fds)
+{
+    if(server.config.replDisklessSync) return sendSnapshotDiskless(server, fds); // 快照直接写入从机的套接字
+    // 生成最新 文件
+    if(!server.db.dump_file(server.config.dumpDir))
+    {
+        debugMessage("dump file error!");
+        return false;
+    }
+    for(size_t i=0;i<fds.size();)
+    {
+        server.config.slave_socket_fd = fds[i];
+        if(sendFile(server.config, server.config.dumpDir))
+        {
+            ++i;
+            continue;
+        }
+        shutdown(fds[i], SHUT_RDWR);
+        close(fds[i]);
+        fds.erase(fds.begin() + i);
+    }
+    return !fds.empty();
+}
+
+// 和从机同步，阻塞直到同步完成
+// 返回时从机的偏移为 server.config.conn.offset，可以开始接收命令流
+bool syncWithSlave(Server &server)
 {
+    server.config.conn.offset = server.cmdBinaryBuff.getOffset();
     server.config.conn.status = REPL_STATE_CHECK;
     sendToSlave(server.config);
     ReplConnectionPack slaveConn;
-    int readLen = read(server.config.slave_socket_fd,reinterpret_cast<void*>(&slaveConn),sizeof(slaveConn));
-    if (server.config.conn.offset - slaveConn.offset == 0)
-    { // 无需同步
+    if(!replReadAll(server.config.slave_socket_fd, &slaveConn, sizeof(slaveConn)))
+    {
+        debugMessage("read slave pack error!");
+        return false;
+    }
+    server.config.conn.status = replicationChooseSync(server, slaveConn);
+    sendToSlave(server.config);
+    if(server.config.conn.status == REPL_STATE_ACK) return true; // 无需同步
+    if(server.config.conn.status == REPL_STATE_INCRREPL)
+    { // 部分同步，只发送从机缺少的字节
+        if(!sendBacklog(server, server.config.slave_socket_fd, slaveConn.offset))
+        {
+            debugMessage("partial resync error!");
+            return false;
+        }
+        ++server.statSyncPartialOk;
+        return true;
+    }
+    // 快照发送完之后才能开始发送命令流，两者不能交错
+    std::vector<int> fds{server.config.slave_socket_fd};
+    if(replicationSendSnapshot(server, fds)) return true;
+    server.config.slave_socket_fd = -1;
+    return false;
+}
+
+// ====================命令流复制===========================
+void replicationFeedReplicas(Server &server, const Command &cmd)
+{
+    CmdBinaryBuff &backlog = server.cmdBinaryBuff;
+    size_t prev = backlog.getOffset();
+    backlog.writeCmdBack(cmd);
+    if(server.replicas.empty()) return;
+    for(auto &it : server.replicas)
+    {
+        ReplicaClient &r = it.second;
+        // 握手中的从机同步时从积压缓冲区中取得需要的命令
+        if(r.state != REPLICA_STATE_ONLINE && r.state != REPLICA_STATE_SYNCING) continue;
+        // 命令只编码一次，直接复制积压缓冲区中刚写入的字节
+        if(backlog.contains(prev))
+        {
+            for(size_t off = prev; off < backlog.getOffset();)
+            {
+                const char *data = nullptr;
+                size_t n = backlog.peek(off, data);
+                r.buf.append(data, n);
+                off += n;
+            }
+        }
+        else encodeBinaryCmd(cmd, r.buf); // 命令比积压缓冲区还长
+        r.offset = backlog.getOffset();
+    }
+}
+
+// 把一个包放入从机的输出缓冲区
+static void replicaAddPack(Server &server, ReplicaClient &r, ReplStatus status, size_t offset)
+{
+    ReplConnectionPack pack(server.config.conn);
+    pack.status = status;
+    pack.offset = offset;
+    r.buf.append(reinterpret_cast<const char *>(&pack), sizeof(pack));
+}
+
+// 在输出缓冲区中的同步数据之后放入 LONG_CONNECT 包和 offset 之后的命令，之后的写命令会继续追加
+static void replicaStartStream(Server &server, ReplicaClient &r, size_t offset, ReplicaState state)
+{
+    CmdBinaryBuff &backlog = server.cmdBinaryBuff;
+    replicaAddPack(server, r, REPL_STATE_LONG_CONNECT, offset);
+    r.offset = offset;
+    // 同步之后写入积压缓冲区的命令
+    while(r.offset < backlog.getOffset())
+    {
+        const char *data = nullptr;
+        size_t n = backlog.peek(r.offset, data);
+        r.buf.append(data, n);
+        r.offset += n;
+    }
+    r.state = state;
+    debugMessage("replica " + std::to_string(r.fd) + " streaming from offset " + std::to_string(offset));
+}
+
+bool replicationAddReplica(Server &server, aeEventLoop &aeLoop, int fd, size_t offset)
+{
+    if(fd < 0 || !server.cmdBinaryBuff.contains(offset) || server.replicas.count(fd))
+    {
+        if(fd >= 0) close(fd);
+        return false;
+    }
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval)); // unix 套接字上失败，忽略
+    int flag = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+    if(aeCreateFileEvent(fd, aeLoop, nullptr, AE_READABLE, nullptr) == -1)
+    {
+        close(fd);
+        return false;
+    }
+    ReplicaClient &r = server.replicas.emplace(fd, ReplicaClient(fd, offset)).first->second;
+    replicaStartStream(server, r, offset, REPLICA_STATE_ONLINE);
+    return true;
+}
+
+void replicationFreeReplica(Server &server, aeEventLoop *aeLoop, int fd)
+{
+    if(server.replicas.erase(fd) == 0) return;
+    if(aeLoop != nullptr)
+    {
+        aeApiDelEvent(*aeLoop, fd, AE_READABLE | AE_WRITABLE);
+        aeLoop->fileEvent(fd).mask = AE_NONE;
+    }
+    shutdown(fd, SHUT_RDWR); // 全量同步的子进程也持有这个套接字
+    close(fd);
+    debugMessage("replica " + std::to_string(fd) + " disconnected");
+}
+
+void acceptReplicas(Server &server, aeEventLoop &aeLoop)
+{
+    while(true)
+    {
+        int fd = accept4(server.config.repl_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) break; // EAGAIN，没有等待的连接
+        if(fd >= aeLoop.maxSetSize || aeCreateFileEvent(fd, aeLoop, nullptr, AE_READABLE, nullptr) == -1)
+        {
+            close(fd);
+            continue;
+        }
+        int optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        // 发送主机的复制 ID 和偏移，等待从机回复它的复制 ID 和偏移
+        size_t offset = server.cmdBinaryBuff.getOffset();
+        ReplicaClient &r = server.replicas.emplace(fd, ReplicaClient(fd, offset, REPLICA_STATE_HANDSHAKE)).first->second;
+        replicaAddPack(server, r, REPL_STATE_CHECK, offset);
+        debugMessage("replica " + std::to_string(fd) + " connected");
+    }
+}
+
+// 处理从机在握手时回复的包，选择同步方式
+static void replicaProcessHandshake(Server &server, ReplicaClient &r, ReplConnectionPack &slaveConn)
+{
+    size_t offset = server.cmdBinaryBuff.getOffset();
+    ReplStatus status = replicationChooseSync(server, slaveConn);
+    if(status == REPL_STATE_FULLREPL)
+    { // 快照由子进程发送，多个从机可以共享同一个子进程
+        r.state = REPLICA_STATE_WAIT_BGSAVE;
         return;
     }
-    else  // 需要同步
+    r.ackOffset = slaveConn.offset;
+    r.ackTime = std::chrono::steady_clock::now();
+    replicaAddPack(server, r, status, offset);
+    if(status == REPL_STATE_INCRREPL)
+    { // 部分同步，长度和从机缺少的字节
+        CmdBinaryBuff &backlog = server.cmdBinaryBuff;
+        size_t from = slaveConn.offset, sendLen = offset - from;
+        r.buf.append(reinterpret_cast<const char *>(&sendLen), sizeof(size_t));
+        while(from < offset)
+        {
+            const char *data = nullptr;
+            size_t n = backlog.peek(from, data);
+            r.buf.append(data, n);
+            from += n;
+        }
+        ++server.statSyncPartialOk;
+        server.statSyncPartialBytes += sendLen;
+    }
+    replicaStartStream(server, r, offset, REPLICA_STATE_ONLINE);
+}
+
+// 为所有等待全量同步的从机 fork 一个子进程发送快照，已经有子进程时等待它结束
+static void replicationStartFullSync(Server &server)
+{
+    if(server.childPid != -1) return;
+    std::vector<int> fds;
+    for(auto &it : server.replicas)
+    { // 握手包还没有发送完的从机等到下一轮，子进程和父进程不能同时写入
+        if(it.second.state == REPLICA_STATE_WAIT_BGSAVE && it.second.pending() == 0) fds.push_back(it.first);
+    }
+    if(fds.empty()) return;
+    size_t offset = server.cmdBinaryBuff.getOffset();
+    pid_t pid = forkChild(server, CHILD_TYPE_REPL);
+    if(pid == -1) return; // 下一轮重试
+    if(pid == 0)
+    { // 子进程发送 FULLREPL 包和 fork 时的快照
+        ReplConnectionPack pack(server.config.conn);
+        pack.status = REPL_STATE_FULLREPL;
+        pack.offset = offset;
+        for(size_t i=0;i<fds.size();)
+        {
+            if(replWriteAll(fds[i], &pack, sizeof(pack))) ++i;
+            else fds.erase(fds.begin() + i);
+        }
+        bool ok = !fds.empty() && replicationSendSnapshot(server, fds);
+        // 只有收完快照的从机才能开始接收命令流
+        if(ok) for(int fd : fds) sendChildInfo(server, server.db.size(), fd);
+        sendChildInfo(server, server.db.size());
+        _exit(ok ? 0 : 1);
+    }
+    // fork 之后的命令暂存在输出缓冲区中，子进程结束之后发送
+    for(int fd : fds)
     {
-        // 生成最新 文件
-        server.db.dump_file(server.config.dumpDir);
-        if (slaveConn.offset == 0 || server.config.conn.offset < server.cmdBinaryBuff.getStart()) // 超出缓冲区范围
-        { // 全量同步
-            server.config.conn.status = REPL_STATE_FULLREPL;
-            sendToSlave(server.config);
-            std::thread fullReplThread(sendFile,std::ref(server.config),server.config.dumpDir,0);
-            fullReplThread.detach();
+        ReplicaClient &r = server.replicas[fd];
+        r.ackOffset = offset;
+        r.ackTime = std::chrono::steady_clock::now();
+        replicaStartStream(server, r, offset, REPLICA_STATE_SYNCING);
+    }
+    showMesage("Full resync of " + std::to_string(fds.size()) + " replicas started by pid " + std::to_string(pid));
+}
+
+void replicationReplicaSynced(Server &server, int fd)
+{
+    auto it = server.replicas.find(fd);
+    if(it == server.replicas.end() || it->second.state != REPLICA_STATE_SYNCING) return;
+    it->second.state = REPLICA_STATE_ONLINE;
+}
+
+void replicationFullSyncDone(Server &server, bool ok)
+{
+    size_t failed = 0;
+    for(auto &it : server.replicas)
+    {
+        ReplicaClient &r = it.second;
+        if(r.state != REPLICA_STATE_SYNCING) continue;
+        // 子进程没有报告收完快照，即使有别的从机成功也要断开，下一次事件循环中关闭
+        r.state = REPLICA_STATE_CLOSE;
+        ++failed;
+    }
+    if(ok && failed == 0) showMesage("Full resync terminated with success");
+    else showMesage("Full resync error, " + std::to_string(failed) + " replicas closed");
+}
+
+// 尽量发送一个从机输出缓冲区中的命令，写不完时注册可写事件，出错或者超过输出缓冲区的限制时断开
+static bool writeToReplica(Server &server, aeEventLoop &aeLoop, ReplicaClient &r)
+{
+    // 子进程正在发送快照时只检查输出缓冲区的限制
+    while(r.state != REPLICA_STATE_SYNCING && r.pending() > 0)
+    {
+        ssize_t n = write(r.fd, r.buf.data() + r.bufPos, r.pending());
+        if(n == -1 && errno == EINTR) continue;
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if(n <= 0) return false;
+        r.bufPos += n;
+        server.statNetWrites += 1;
+    }
+    // 已经发送的部分超过一半时才移动剩余的内容
+    if(r.bufPos == r.buf.size()) r.buf.clear(), r.bufPos = 0;
+    else if(r.bufPos > r.buf.size() / 2) r.buf.erase(0, r.bufPos), r.bufPos = 0;
+    if(server.clientOutputHardLimit != 0 && r.pending() > server.clientOutputHardLimit)
+    { // 从机重连之后如果偏移还在积压缓冲区中可以部分同步
+        std::cout<<"replica output buffer limit reached, fd =="<<r.fd<<", size = "<<r.pending()<<std::endl;
+        server.statOutputLimitDisconnections += 1;
+        return false;
+    }
+    if(r.state == REPLICA_STATE_SYNCING) return true;
+    int mask = aeLoop.fileEvent(r.fd).mask;
+    if(r.pending() > 0 && !(mask & AE_WRITABLE))
+    {
+        aeApiAddEvent(aeLoop, r.fd, AE_WRITABLE);
+        aeLoop.fileEvent(r.fd).mask |= AE_WRITABLE;
+    }
+    else if(r.pending() == 0 && (mask & AE_WRITABLE))
+    {
+        aeApiDelEvent(aeLoop, r.fd, AE_WRITABLE);
+        aeLoop.fileEvent(r.fd).mask &= ~AE_WRITABLE;
+    }
+    return true;
+}
+
+void replicationWriteToReplicas(Server &server, aeEventLoop &aeLoop)
+{
+    if(server.replicas.empty()) return;
+    // 记录这一次发送的偏移和时间，从机报告的偏移越过它时说明这部分命令已经执行
+    size_t offset = server.cmdBinaryBuff.getOffset();
+    auto &samples = server.replOffsetSamples;
+    if(samples.empty() || samples.back().first < offset)
+    {
+        samples.emplace_back(offset, std::chrono::steady_clock::now());
+        if(samples.size() > REPL_LAG_SAMPLES) samples.pop_front();
+    }
+    std::vector<int> failed;
+    for(auto &it : server.replicas)
+    {
+        ReplicaClient &r = it.second;
+        if(r.state == REPLICA_STATE_WAIT_BGSAVE || r.state == REPLICA_STATE_CLOSE) continue;
+        // 已经注册了可写事件说明套接字的发送缓冲区是满的，等待可写事件
+        if(r.pending() == 0 || (aeLoop.fileEvent(r.fd).mask & AE_WRITABLE)) continue;
+        if(!writeToReplica(server, aeLoop, r)) failed.push_back(r.fd);
+    }
+    for(int fd : failed) replicationFreeReplica(server, &aeLoop, fd);
+}
+
+void replicationBeforeSleep(Server &server, aeEventLoop &aeLoop)
+{
+    if(server.replicas.empty()) return;
+    std::vector<int> closed;
+    bool waiting = false;
+    size_t minAck = SIZE_MAX;
+    for(auto &it : server.replicas)
+    {
+        if(it.second.state == REPLICA_STATE_CLOSE) closed.push_back(it.first);
+        else if(it.second.state == REPLICA_STATE_WAIT_BGSAVE) waiting = true;
+        else if(it.second.state != REPLICA_STATE_HANDSHAKE) minAck = std::min(minAck, it.second.ackOffset);
+    }
+    for(int fd : closed) replicationFreeReplica(server, &aeLoop, fd);
+    if(waiting) replicationStartFullSync(server);
+    // 所有从机都已经执行的部分不再需要
+    auto &samples = server.replOffsetSamples;
+    while(!samples.empty() && samples.front().first <= minAck) samples.pop_front();
+    replicationWriteToReplicas(server, aeLoop);
+}
+
+int64_t replicationReplicaLagMs(const Server &server, const ReplicaClient &r)
+{
+    if(r.state != REPLICA_STATE_ONLINE || r.ackOffset >= server.cmdBinaryBuff.getOffset()) return 0;
+    // 第一次发送从机还没有执行的命令的时间
+    const auto &samples = server.replOffsetSamples;
+    auto it = std::upper_bound(samples.begin(), samples.end(), r.ackOffset,
+        [](size_t off, const std::pair<size_t, std::chrono::steady_clock::time_point> &s) { return off < s.first; });
+    if(it == samples.end()) return 0; // 还没有发送
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - it->second).count();
+}
+
+static const char* replicaStateName(ReplicaState state)
+{
+    switch(state)
+    {
+        case REPLICA_STATE_HANDSHAKE: return "handshake";
+        case REPLICA_STATE_WAIT_BGSAVE: return "wait_bgsave";
+        case REPLICA_STATE_SYNCING: return "send_bulk";
+        case REPLICA_STATE_ONLINE: return "online";
+        case REPLICA_STATE_CLOSE: return "close";
+        default: return "unknown";
+    }
+}
+
+void replicationGenInfoString(Server &server, std::string &info)
+{
+    // 按 fd 排序，同一组从机每次的编号相同
+    std::vector<const ReplicaClient *> replicas;
+    for(auto &it : server.replicas) replicas.push_back(&it.second);
+    std::sort(replicas.begin(), replicas.end(), [](const ReplicaClient *a, const ReplicaClient *b) { return a->fd < b->fd; });
+    char buff[256];
+    size_t masterOffset = server.cmdBinaryBuff.getOffset();
+    for(size_t i=0;i<replicas.size();++i)
+    {
+        const ReplicaClient &r = *replicas[i];
+        int len = snprintf(buff, sizeof(buff), "slave%zu:fd=%d,state=%s,offset=%zu,lag_bytes=%zu,lag_ms=%lld,output_buffer=%zu\r\n",
+            i, r.fd, replicaStateName(r.state), r.ackOffset, masterOffset > r.ackOffset ? masterOffset - r.ackOffset : 0,
+            static_cast<long long>(replicationReplicaLagMs(server, r)), r.pending());
+        info.append(buff, len);
+    }
+}
+
+// 读取从机发来的包：握手时的复制 ID 和偏移，之后是定期报告的偏移
+static bool readFromReplica(Server &server, ReplicaClient &r)
+{
+    char buff[256];
+    while(true)
+    {
+        ssize_t n = read(r.fd, buff, sizeof(buff));
+        if(n > 0)
+        {
+            r.inBuf.append(buff, n);
+            continue;
+        }
+        if(n == -1 && errno == EINTR) continue;
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        return false; // 连接断开
+    }
+    size_t pos = 0;
+    ReplConnectionPack pack;
+    for(;r.inBuf.size() - pos >= sizeof(pack);pos += sizeof(pack))
+    {
+        memcpy(static_cast<void *>(&pack), r.inBuf.data() + pos, sizeof(pack));
+        if(r.state == REPLICA_STATE_HANDSHAKE) replicaProcessHandshake(server, r, pack);
+        else if(pack.status == REPL_STATE_ACK && pack.offset >= r.ackOffset && pack.offset <= server.cmdBinaryBuff.getOffset())
+        {
+            r.ackOffset = pack.offset;
+            r.ackTime = std::chrono::steady_clock::now();
+        }
+    }
+    r.inBuf.erase(0, pos);
+    return true;
+}
+
+bool replicationHandleReplicaEvent(Server &server, aeEventLoop &aeLoop, int fd, int mask)
+{
+    auto it = server.replicas.find(fd);
+    if(it == server.replicas.end()) return false;
+    ReplicaClient &r = it->second;
+    // 子进程发送快照时从机回复的数据由子进程读取
+    if(r.state == REPLICA_STATE_SYNCING || r.state == REPLICA_STATE_CLOSE) return true;
+    if((mask & AE_READABLE) && !readFromReplica(server, r))
+    {
+        replicationFreeReplica(server, &aeLoop, fd);
+        return true;
+    }
+    if((mask & AE_WRITABLE) && !writeToReplica(server, aeLoop, r)) replicationFreeReplica(server, &aeLoop, fd);
+    return true;
+}
+
+// 内核不支持 sendfile 时使用 pread 和 write，每次只占用 REPL_TRANSFER_BUFF 的内存
+static bool sendFileRange(ServerConfig &config, int fd, uint64_t offset, uint64_t size)
+{
+    std::vector<char> buff(REPL_TRANSFER_BUFF);
+    while(offset < size)
+    {
+        ssize_t n = pread(fd, buff.data(), std::min<uint64_t>(buff.size(), size - offset), offset);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0 || !replWriteAll(config.slave_socket_fd, buff.data(), n)) return false;
+        offset += n;
+        config.transfer.done = offset;
+    }
+    return true;
+}
+
+// 向所有从机发送一个块，发送失败的从机从 fds 中移除并关闭，还有从机时返回 true
+static bool sendChunkToReplicas(std::vector<int> &fds, const void *data, uint64_t len)
+{
+    for(size_t i=0;i<fds.size();)
+    {
+        if(replWriteAll(fds[i], &len, sizeof(len)) && replWriteAll(fds[i], data, len))
+        {
+            ++i;
+            continue;
         }
+        debugMessage("diskless sync: replica " + std::to_string(fds[i]) + " disconnected");
+        shutdown(fds[i], SHUT_RDWR); // 在子进程中发送时父进程也持有这个套接字
+        close(fds[i]);
+        fds.erase(fds.begin() + i);
+    }
+    return !fds.empty();
+}
+
+// 无盘同步
+bool sendSnapshotDiskless(Server &server, std::vector<int> &fds)
+{
+    // 快照的长度事先未知，不能续传，从机回复的偏移被忽略
+    ReplTransferHeader header{REPL_TRANSFER_STREAMED, 0};
+    for(size_t i=0;i<fds.size();)
+    {
+        uint64_t offset = 0;
+        if(replWriteAll(fds[i], &header, sizeof(header)) && replReadAll(fds[i], &offset, sizeof(offset))) ++i;
         else
-        { // 增量同步 我们假设每次发送都是若干个完整的指令
-            server.config.conn.status = REPL_STATE_INCRREPL;
-            sendToSlave(server.config);
-            size_t sendLen = server.config.conn.offset - slaveConn.offset;
-            write(server.config.slave_socket_fd, reinterpret_cast<void *>(&sendLen), sizeof(size_t));
-            const char *ch = server.cmdBinaryBuff.getbuff() + (slaveConn.offset - server.cmdBinaryBuff.getStart());
-            write(server.config.slave_socket_fd, const_cast<char *>(ch), sendLen);
-            server.config.conn.offset+=sendLen;
+        {
+            close(fds[i]);
+            fds.erase(fds.begin() + i);
         }
     }
+    if(fds.empty()) return false;
+    ReplTransferProgress &transfer = server.config.transfer;
+    transfer.size = 0;
+    transfer.resumed = 0;
+    transfer.done = 0;
+    transfer.inProgress = true;
+    // 序列化一次，每次 RdbWriter 的缓冲区满了就作为一个块发给所有从机
+    bool ok = server.db.dump_stream([&fds, &transfer](const void *data, size_t len)
+    {
+        if(!sendChunkToReplicas(fds, data, len)) return false;
+        transfer.done = transfer.done + len;
+        return true;
+    });
+    ok = sendChunkToReplicas(fds, nullptr, 0) && ok;
+    transfer.size = transfer.done.load();
+    transfer.inProgress = false;
+    if(!ok) debugMessage("diskless sync error!");
+    return ok;
 }
 
 // 发送文件
-void sendFile(ServerConfig &config, std::string fileName, size_t offset = 0)
+bool sendFile(ServerConfig &config, const std::string &fileName)
 {
-    constexpr size_t BUFFSIZE = 8192;
-    std::ifstream file(fileName, std::ios::binary);
-
-    char buff[BUFFSIZE];
-    std::vector<char> file_data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    size_t fileLen = file_data.size() - offset;
-    // 发送文件长度
-    write(config.slave_socket_fd, reinterpret_cast<void *>(&(fileLen)), sizeof(size_t));
-    // 发送文件内容
-    for (int i = 0; i < fileLen; i += BUFFSIZE) // 发送文件
+    int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1)
     {
-        size_t byte_send = std::min(BUFFSIZE, file_data.size() - i);
-        memcpy(buff, file_data.data() + i + offset, byte_send);
-        write(config.slave_socket_fd, reinterpret_cast<void *>(buff), byte_send);
+        debugMessage("open file " + fileName + " error!");
+        if(fd != -1) close(fd);
+        return false;
+    }
+    // 快照以 CRC64 结尾，内容相同的快照标识相同
+    ReplTransferHeader header{static_cast<uint64_t>(st.st_size), 0};
+    if(header.fileSize >= sizeof(uint64_t) &&
+       pread(fd, &header.snapshotId, sizeof(uint64_t), header.fileSize - sizeof(uint64_t)) != sizeof(uint64_t))
+        header.snapshotId = 0;
+    // 发送文件长度和标识，从机回复已经收到的字节数
+    uint64_t offset = 0;
+    bool ok = replWriteAll(config.slave_socket_fd, &header, sizeof(header)) &&
+              replReadAll(config.slave_socket_fd, &offset, sizeof(offset));
+    if(offset > header.fileSize) offset = 0;
+    config.transfer.size = header.fileSize;
+    config.transfer.resumed = offset;
+    config.transfer.done = offset;
+    config.transfer.inProgress = true;
+    // 发送文件内容，页缓存中的数据直接写入套接字，不复制到用户态
+    off_t pos = offset;
+    while(ok && static_cast<uint64_t>(pos) < header.fileSize)
+    {
+        ssize_t n = sendfile(config.slave_socket_fd, fd, &pos, std::min<uint64_t>(REPL_SENDFILE_CHUNK, header.fileSize - pos));
+        if(n == -1 && errno == EINTR) continue;
+        if(n == -1 && errno == EAGAIN && replWaitFd(config.slave_socket_fd, POLLOUT)) continue;
+        if(n == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            ok = sendFileRange(config, fd, pos, header.fileSize);
+            break;
+        }
+        if(n <= 0) ok = false;
+        else config.transfer.done = pos;
     }
-    file.close();
+    close(fd);
+    config.transfer.inProgress = false;
+    if(!ok) debugMessage("send file " + fileName + " error!");
+    return ok;
 }
 
 //======================slave=============================
@@ -213,6 +790,75 @@ void sendToMaster(ServerConfig &config)
     write(config.master_socket_fd, reinterpret_cast<const void *>(&(config.conn)), sizeof(ReplConnectionPack));
 }
 
+// 复制流中从 buff 开始的一条命令，完整时返回 1 并设置它的长度，还没有收完时返回 0，格式错误时返回 -1
+static int replStreamFrame(const char *buff, size_t len, size_t &frameLen)
+{
+    constexpr size_t header = sizeof(CMD_FLAG) + sizeof(size_t);
+    if(len < header) return 0;
+    CMD_FLAG flag;
+    size_t keyLen = 0, valueLen = 0;
+    memcpy(&flag, buff, sizeof(CMD_FLAG));
+    memcpy(&keyLen, buff + sizeof(CMD_FLAG), sizeof(size_t));
+    // 只有写命令会被传播，key 和 value 的长度都包括结尾的 '\0'
+    if(flag != CMD_SET || keyLen == 0 || keyLen > REPL_MAX_CMD_LEN) return -1;
+    if(len < header + keyLen + sizeof(size_t)) return 0;
+    memcpy(&valueLen, buff + header + keyLen, sizeof(size_t));
+    if(valueLen == 0 || valueLen > REPL_MAX_CMD_LEN) return -1;
+    frameLen = header + keyLen + sizeof(size_t) + valueLen;
+    return len >= frameLen ? 1 : 0;
+}
+
+// 从主机接收 len 个字节的复制流并依次执行其中的命令，每执行一条命令偏移增加这条命令的长度
+// len 为 SIZE_MAX 时一直接收到连接断开，用于同步之后的命令流，这时执行完已经到达的命令之后向主机报告偏移
+// 中断时已经执行的命令和偏移保持一致，重连之后从这个偏移继续部分同步
+static bool applyReplStream(Server &db, size_t len)
+{
+    std::vector<char> buff(REPL_TRANSFER_BUFF);
+    size_t used = 0;
+    Command cmd;
+    bool stream = len == SIZE_MAX;
+    auto lastAck = std::chrono::steady_clock::now();
+    while(len > 0)
+    {
+        ssize_t n = read(db.config.master_socket_fd, buff.data() + used, std::min(buff.size() - used, len));
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        used += n;
+        if(!stream) len -= n;
+        size_t pos = 0, frameLen = 0;
+        int status = 0;
+        // 一次 read 得到的所有完整命令都在这里执行，不完整的部分留到下一次
+        while((status = replStreamFrame(buff.data() + pos, used - pos, frameLen)) == 1)
+        {
+            parseBinaryCmd(buff.data() + pos, cmd);
+            execCommand(db, cmd);
+            db.config.conn.offset += frameLen;
+            pos += frameLen;
+        }
+        if(status == -1)
+        {
+            debugMessage("bad replication stream at offset " + std::to_string(db.config.conn.offset));
+            return false;
+        }
+        memmove(buff.data(), buff.data() + pos, used - pos);
+        used -= pos;
+        if(stream && pos > 0)
+        { // 没有更多数据时立即报告，持续接收时每隔 REPL_ACK_INTERVAL_MS 报告一次
+            pollfd p{db.config.master_socket_fd, POLLIN, 0};
+            auto now = std::chrono::steady_clock::now();
+            if(poll(&p, 1, 0) == 0 || now - lastAck >= std::chrono::milliseconds(REPL_ACK_INTERVAL_MS))
+            {
+                db.config.conn.status = REPL_STATE_ACK;
+                sendToMaster(db.config);
+                lastAck = now;
+            }
+        }
+        // 比缓冲区还长的命令，已经知道长度时一次扩大到足够
+        if(used == buff.size()) buff.resize(std::max(buff.size() * 2, frameLen));
+    }
+    return used == 0;
+}
+
 // 和主机同步
 void syncWithMaster(Server &db)
 {
@@ -223,59 +869,72 @@ void syncWithMaster(Server &db)
     while (flag)
     {
         flag = false;
-        int readLen = read(db.config.master_socket_fd, reinterpret_cast<void *>(&retpack), packlen);
+        if(!replReadAll(db.config.master_socket_fd, &retpack, packlen))
+        {
+            showMesage("slave disconnect!!!");
+            return;
+        }
         switch (retpack.status)
         {
             case REPL_STATE_CHECK: // 心跳包
             {
                 debugMessage("heart jump pack");
+                // 回复自己的复制 ID 和偏移，然后继续接收主机选择的同步方式
                 db.config.conn.status = REPL_STATE_CHECK;
                 sendToMaster(db.config);
+                flag = true;
+                break;
+            }
+            case REPL_STATE_ACK: // 偏移和主机相同，无需同步
+            {
+                flag = true; // 同步完成之后主机发送命令流
                 break;
             }
             case REPL_STATE_FULLREPL: // 全量复制
             {
                 debugMessage("full replicatio");
-                // 接收文件
-                db.config.conn.offset = retpack.offset; // 全量更新，偏移值变为主机的偏移值
-                // 接收全量文件
-                recvFile(db.config, db.config.dumpDir);
+                // 接收全量文件，中断时保留已经收到的部分，不更新数据库
+                if(!recvFile(db.config, db.config.dumpDir)) break;
                 // 更新数据库
                 db.db.clear();
-                db.db.load_file(db.config.dumpDir);
+                if(!db.db.load_file_mmap(db.config.dumpDir, std::max(1u, std::thread::hardware_concurrency())))
+                {
+                    debugMessage("load dump file error!");
+                    break;
+                }
+                // 全量更新，复制 ID 和偏移值变为主机的
+                db.config.conn.offset = retpack.offset;
+                memcpy(db.config.conn.replid, retpack.replid, sizeof(retpack.replid));
+                db.config.conn.replid[REPL_ID_LEN] = '\0';
+                flag = true;
                 break;
             }
             case REPL_STATE_INCRREPL: // 增量复制
             {
                 debugMessage("increase replicatio");
-                // 首先接收发送数据的长度
-                size_t readLen;
-                read(db.config.master_socket_fd, reinterpret_cast<void *>(&readLen), sizeof(size_t));
-                char *buff = new char[readLen + 1];
-                read(db.config.master_socket_fd, reinterpret_cast<void *>(buff), readLen);
-                char *ptr = buff;
-                while (ptr != buff + readLen)
-                {
-                    Command cmd;
-                    ptr += parseBinaryCmd(ptr, cmd);
-                    execCommand(db, cmd);
-                    db.config.conn.offset  += getLenOfCmd(cmd);
-                }
-
-                delete buff;
+                // 首先接收发送数据的长度，然后边接收边执行
+                size_t readLen = 0;
+                if(!replReadAll(db.config.master_socket_fd, &readLen, sizeof(size_t)) || !applyReplStream(db, readLen))
+                    debugMessage("partial resync interrupted at offset " + std::to_string(db.config.conn.offset));
+                else flag = true;
                 break;
             }
             case REPL_STATE_LONG_CONNECT: // 长连接复制
             {
                 debugMessage("long connecting replication");
-                constexpr int BUFFSIZE = 1024;
-                char buff[BUFFSIZE];
-                read(db.config.master_socket_fd, reinterpret_cast<void *>(buff), BUFFSIZE);
-                Command cmd;
-                parseBinaryCmd(buff, cmd);
-                // 接收到一条指令，直接执行
-                execCommand(db, cmd);
-                db.config.conn.offset  += getLenOfCmd(cmd);
+                // 命令流必须从自己已经执行到的偏移开始，否则断开，重连之后重新同步
+                retpack.replid[REPL_ID_LEN] = '\0';
+                if(retpack.offset != db.config.conn.offset || strcmp(retpack.replid, db.config.conn.replid) != 0)
+                {
+                    debugMessage("replication stream offset mismatch!");
+                    break;
+                }
+                // 报告同步之后的偏移，主机据此计算落后的字节数
+                db.config.conn.status = REPL_STATE_ACK;
+                sendToMaster(db.config);
+                // 边接收边执行，直到连接断开
+                applyReplStream(db, SIZE_MAX);
+                debugMessage("replication stream closed at offset " + std::to_string(db.config.conn.offset));
                 break;
             }
             case REPL_STATE_NULL:
@@ -286,17 +945,138 @@ void syncWithMaster(Server &db)
     }
 }
 
+// 没有收完的文件和它属于的快照，收完之后重命名为 fileName
+static std::string replTransferFileName(const std::string &fileName)
+{
+    return fileName + ".transfer";
+}
+
+static std::string replTransferMetaName(const std::string &fileName)
+{
+    return fileName + ".transfer.meta";
+}
+
+// 之前没有收完的文件属于同一个快照时返回已经收到的字节数，否则从头开始并记录新的快照
+static uint64_t replPrepareTransferFile(const std::string &fileName, const ReplTransferHeader &header, int &fd)
+{
+    std::string partName = replTransferFileName(fileName), metaName = replTransferMetaName(fileName);
+    ReplTransferHeader old{0, 0};
+    int metaFd = open(metaName.c_str(), O_RDONLY | O_CLOEXEC);
+    bool same = metaFd != -1 && replReadAll(metaFd, &old, sizeof(old)) &&
+                old.fileSize == header.fileSize && old.snapshotId == header.snapshotId;
+    if(metaFd != -1) close(metaFd);
+    fd = open(partName.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1) return 0;
+    uint64_t offset = same ? std::min<uint64_t>(st.st_size, header.fileSize) : 0;
+    if(!same)
+    { // 先记录快照的标识再接收内容
+        metaFd = open(metaName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(metaFd != -1)
+        {
+            if(!replWriteAll(metaFd, &header, sizeof(header)) || fdatasync(metaFd) == -1) unlink(metaName.c_str());
+            close(metaFd);
+        }
+    }
+    if(ftruncate(fd, offset) == -1 || lseek(fd, offset, SEEK_SET) == -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return offset;
+}
+
+// 从 offset 开始接收长度为 size 的文件
+static bool recvSizedFile(ServerConfig &config, int fd, uint64_t offset, uint64_t size)
+{
+    // 每次 read 得到的数据先放入缓冲区，缓冲区满了再写入文件，内存中最多只有一个缓冲区
+    std::vector<char> buff(REPL_TRANSFER_BUFF);
+    size_t used = 0;
+    uint64_t received = offset;
+    bool ok = true;
+    while(received < size)
+    {
+        ssize_t n = read(config.master_socket_fd, buff.data() + used, std::min<uint64_t>(buff.size() - used, size - received));
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0)
+        {
+            ok = false;
+            break;
+        }
+        used += n;
+        received += n;
+        if(used < buff.size() && received < size) continue;
+        if(!replWriteAll(fd, buff.data(), used)) return false;
+        used = 0;
+        config.transfer.done = received;
+    }
+    // 中断时把缓冲区中已经收到的部分也写入文件，下一次从这里续传
+    if(used > 0 && replWriteAll(fd, buff.data(), used)) config.transfer.done = config.transfer.done + used;
+    return ok;
+}
+
+// 接收无盘同步的快照，每个块为长度 uint64_t 和内容，长度为 0 的块表示结束
+static bool recvStreamedFile(ServerConfig &config, int fd)
+{
+    std::vector<char> buff(REPL_TRANSFER_BUFF);
+    uint64_t len = 0;
+    while(replReadAll(config.master_socket_fd, &len, sizeof(len)))
+    {
+        if(len == 0) return true;
+        while(len > 0)
+        {
+            size_t n = std::min<uint64_t>(len, buff.size());
+            if(!replReadAll(config.master_socket_fd, buff.data(), n) || !replWriteAll(fd, buff.data(), n)) return false;
+            len -= n;
+            config.transfer.done = config.transfer.done + n;
+        }
+    }
+    return false;
+}
+
 // 接收文件
-void recvFile(ServerConfig &config, std::string fileName)
+bool recvFile(ServerConfig &config, const std::string &fileName)
 {
-    constexpr size_t BUFFSIZE = 8192;
-    size_t fileLen = 0;
-    int readLen = read(config.master_socket_fd, reinterpret_cast<void *>(&fileLen), sizeof(size_t));
-    if (readLen != sizeof(size_t))
+    ReplTransferHeader header;
+    if(!replReadAll(config.master_socket_fd, &header, sizeof(header)))
+    {
         debugMessage("revc file len error!");
-    std::ofstream file(fileName, std::ios::binary);
-    char *buff = new char[fileLen + 1];
-    read(config.master_socket_fd, static_cast<void *>(buff), fileLen);
-    file.write(buff, fileLen);
+        return false;
+    }
+    int fd = -1;
+    bool streamed = header.fileSize == REPL_TRANSFER_STREAMED;
+    uint64_t offset = 0;
+    if(streamed)
+    { // 无盘同步不能续传，之前没有收完的文件作废
+        unlink(replTransferMetaName(fileName).c_str());
+        fd = open(replTransferFileName(fileName).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    else offset = replPrepareTransferFile(fileName, header, fd);
+    if(fd == -1 || !replWriteAll(config.master_socket_fd, &offset, sizeof(offset)))
+    {
+        if(fd != -1) close(fd);
+        debugMessage("prepare file " + fileName + " error!");
+        return false;
+    }
+    config.transfer.size = streamed ? 0 : header.fileSize;
+    config.transfer.resumed = offset;
+    config.transfer.done = offset;
+    config.transfer.inProgress = true;
+    bool ok = streamed ? recvStreamedFile(config, fd) : recvSizedFile(config, fd, offset, header.fileSize);
+    if(streamed) config.transfer.size = config.transfer.done.load();
+    if(ok) ok = fdatasync(fd) == 0;
+    if(close(fd) == -1) ok = false;
+    config.transfer.inProgress = false;
+    if(!ok)
+    {
+        debugMessage("recv file " + fileName + " interrupted at " + std::to_string(config.transfer.done.load()) + " bytes");
+        return false;
+    }
+    if(rename(replTransferFileName(fileName).c_str(), fileName.c_str()) == -1)
+    {
+        debugMessage("rename file " + fileName + " error!");
+        return false;
+    }
+    unlink(replTransferMetaName(fileName).c_str());
+    return true;
 }
-
@@ -1,4 +1,7 @@
 #include "server.h"
+#include "rdb.h"
+#include "bio.h"
+#include <sys/stat.h>
 
 CmdBuff::CmdBuff(int buffsize):_start(0), _end(0), _size(0), _capacity(buffsize), v(std::vector<Command>(buffsize))
 {}
@@ -58,90 +61,238 @@ void CmdBuff::clear()
     _start = _end = 0;
 }
 
-// 在缓冲区尾部写入一个cmd
-// 缓冲区默认大小为 REPL_COPY_BUFF 如过剩余的空间不够添加一个命令，则将原来缓冲区的一半缓存删除
-void CmdBinaryBuff::writeCmdBack(Command &cmd)
+void CmdBinaryBuff::resize(size_t newCapacity)
 {
-    // 首先计算 cmd 的长度
+    if(newCapacity == 0) newCapacity = 1;
+    delete[] buff;
+    buff = new char[newCapacity];
+    capacity = newCapacity;
+    histlen = 0;
+}
+
+// 在缓冲区尾部写入一个cmd，格式和 parseBinaryCmd 相同，字符串的长度包括结尾的 '\0'
+void CmdBinaryBuff::writeCmdBack(const Command &cmd)
+{
+    static const char zero = '\0';
     size_t keyLen = cmd.key.length() + 1; // 加1包括 '\0'
     size_t valueLen = cmd.value.length() + 1;
-    size_t totalLen = getLenOfCmd(cmd);
-    if(capacity-size < totalLen)
-    {   // 需要删除前面一半空间
-        char *newbuff = new char[REPL_COPY_BUFF];
-        memset(newbuff,0,capacity);
-        memcpy(newbuff, buff + capacity/2, capacity-capacity/2);
-        delete buff;
-        buff = newbuff;
-        newbuff = nullptr;
-        start_index += capacity/2;
-        cur_index = capacity - capacity/2;
-        size = capacity-capacity/2;
+    append(&cmd.cmdFlag, sizeof(CMD_FLAG));
+    append(&keyLen, sizeof(size_t));
+    append(cmd.key.data(), cmd.key.length());
+    append(&zero, 1);
+    append(&valueLen, sizeof(size_t));
+    append(cmd.value.data(), cmd.value.length());
+    append(&zero, 1);
+}
+
+void CmdBinaryBuff::append(const void *data, size_t len)
+{
+    const char *p = static_cast<const char *>(data);
+    // 只有最后 capacity 个字节会留在缓冲区中
+    if(len > capacity)
+    {
+        offset += len - capacity;
+        p += len - capacity;
+        len = capacity;
     }
-    // 将指令写入缓冲区
-    // memset(buff+cur_index, 0, totalLen); // 初始化空间
-    *(CMD_FLAG*)(buff+cur_index) = cmd.cmdFlag;
-    *(size_t *)(buff + sizeof(CMD_FLAG)) = keyLen;
-    memcpy(buff +  sizeof(CMD_FLAG) + sizeof(size_t), cmd.key.c_str(), keyLen - 1); 
-    *(size_t *)(buff + sizeof(CMD_FLAG) + sizeof(size_t) + keyLen) =  valueLen;
-    memcpy(buff  + sizeof(CMD_FLAG) + 2 * sizeof(size_t) + keyLen, cmd.value.c_str(), valueLen - 1);
-    cur_index += totalLen;
-    size+=totalLen;
+    size_t pos = offset % capacity;
+    size_t first = std::min(len, capacity - pos);
+    memcpy(buff + pos, p, first);
+    memcpy(buff, p + first, len - first);
+    offset += len;
+    histlen = std::min(histlen + len, capacity);
+}
+
+size_t CmdBinaryBuff::peek(size_t off, const char *&data) const
+{
+    size_t pos = off % capacity;
+    data = buff + pos;
+    return std::min(offset - off, capacity - pos);
+}
+
+void encodeBinaryCmd(const Command &cmd, std::string &out)
+{
+    size_t keyLen = cmd.key.length() + 1; // 加1包括 '\0'
+    size_t valueLen = cmd.value.length() + 1;
+    out.append(reinterpret_cast<const char *>(&cmd.cmdFlag), sizeof(CMD_FLAG));
+    out.append(reinterpret_cast<const char *>(&keyLen), sizeof(size_t));
+    out.append(cmd.key).push_back('\0');
+    out.append(reinterpret_cast<const char *>(&valueLen), sizeof(size_t));
+    out.append(cmd.value).push_back('\0');
 }
 
 // 解析一个cmd，并返回，假设一定能解析成功
+// 使用 assign 写入 cmd，重复使用同一个 Command 时不会重新分配内存
 size_t parseBinaryCmd(const char *buff, Command &cmd)
 {
     cmd.cmdFlag = *(CMD_FLAG *)buff;
     size_t keyLen = *(size_t *)(buff + sizeof(CMD_FLAG));
-    cmd.key = buff + sizeof(CMD_FLAG) + sizeof(size_t);
+    cmd.key.assign(buff + sizeof(CMD_FLAG) + sizeof(size_t), keyLen - 1);
     size_t valueLen = *(size_t *)(buff + sizeof(CMD_FLAG) + sizeof(size_t) + keyLen);
-    cmd.value = buff + sizeof(CMD_FLAG) + 2 * sizeof(size_t) + keyLen;
+    cmd.value.assign(buff + sizeof(CMD_FLAG) + 2 * sizeof(size_t) + keyLen, valueLen - 1);
     return sizeof(CMD_FLAG) + 2 * sizeof(size_t) + keyLen + valueLen;
 }
 
+bool checkBinaryCmd(const char *buff, size_t len)
+{
+    constexpr size_t header = sizeof(CMD_FLAG) + sizeof(size_t);
+    if(len < header) return false;
+    size_t keyLen = 0, valueLen = 0;
+    memcpy(&keyLen, buff + sizeof(CMD_FLAG), sizeof(size_t));
+    if(keyLen == 0 || keyLen > len - header) return false;
+    size_t rest = len - header - keyLen; // value 的长度字段和 value
+    if(rest < sizeof(size_t)) return false;
+    memcpy(&valueLen, buff + header + keyLen, sizeof(size_t));
+    return valueLen != 0 && valueLen <= rest - sizeof(size_t);
+}
+
 std::string execCommand(Server &server, Command &cmd)
 {
     std::string ret;
+    execCommand(server, cmd, ret);
+    return ret;
+}
+
+// 执行结果写入 reply，reply 的容量足够时整个过程不发生堆内存分配
+void execCommand(Server &server, Command &cmd, std::string &reply)
+{
     switch (cmd.cmdFlag)
     {
         case CMD_SET :
         {
             server.db.insert(cmd.key, cmd.value);
-            server.cmdbuff.push_back(cmd);
-            // 处理AOF缓存
-            if(server.aof_buff.size() == server.aof_buff.capacity())
-            {
-                // 缓冲区已满，直接写入
-                writeInrcAofFile(server.aof_buff,server.incrAofStream);
-                server.aof_buff.clear();
-            }
-            server.aof_buff.push_back(cmd);
-            ret = "ok";
+            ++server.dirty;
+            server.aof.append(CMD_SET, cmd.key, cmd.value);
+            replicationFeedReplicas(server, cmd);
+            reply.assign("ok");
             break;
         }
         case CMD_GET :
         {
             HashNode * node = server.db.find(cmd.key);
-            if(node != nullptr) ret = node->getValue();
-            else ret = "Not found!";
+            if(node != nullptr) reply.assign(node->getValue().data(), node->getValue().size());
+            else reply.assign("Not found!");
+            break;
+        }
+        case CMD_BGSAVE:
+        {
+            if(server.childPid != -1) reply.assign("Background child already in progress");
+            else if(rdbSaveBackground(server) == 0) reply.assign("Background saving started");
+            else reply.assign("Background saving error");
+            break;
+        }
+        case CMD_AOF_REWRIIE:
+        {
+            if(!server.aof.isOpen()) reply.assign("Append only file is disabled");
+            else if(server.childPid != -1) reply.assign("Background child already in progress");
+            else if(AOFRW(server) == 0) reply.assign("Background append only file rewriting started");
+            else reply.assign("Background append only file rewriting error");
             break;
         }
         case CMD_SHUTDOWN:
         {
             server.serverStop = true;
-            ret = "server is shutdown!";
+            reply.assign("server is shutdown!");
+            break;
+        }
+        case CMD_INFO:
+        {
+            genInfoString(server, reply);
             break;
         }
         default:
             std::cout<<"unknow cmd !\n";
-            ret = "unknow cmd !";
+            reply.assign("unknow cmd !");
         break;
     }
-    return ret;
 }
 
 
+void genInfoString(Server &server, std::string &info)
+{
+    SlabStats st = server.db.memoryStats();
+    auto now = std::chrono::steady_clock::now();
+    bool rdbInProgress = server.childType == CHILD_TYPE_RDB;
+    long long currentMs = rdbInProgress ? std::chrono::duration_cast<std::chrono::milliseconds>(now - server.childStartTime).count() : -1;
+    char buff[4096];
+    int len = snprintf(buff, sizeof(buff),
+        "keys:%zu\r\n"
+        "slab_used_bytes:%zu\r\n"
+        "slab_allocated_bytes:%zu\r\n"
+        "slab_pages:%zu\r\n"
+        "slab_large_objects:%zu\r\n"
+        "slab_fragmentation_ratio:%.2f\r\n"
+        "total_commands_processed:%zu\r\n"
+        "total_reads_processed:%zu\r\n"
+        "total_writes_processed:%zu\r\n"
+        "client_output_buffer_limit_disconnections:%zu\r\n"
+        "client_query_buffer_limit_disconnections:%zu\r\n"
+        "connected_clients:%zu\r\n"
+        "maxclients:%zu\r\n"
+        "rejected_connections:%zu\r\n"
+        "rdb_changes_since_last_save:%zu\r\n"
+        "rdb_bgsave_in_progress:%d\r\n"
+        "rdb_last_save_time:%lld\r\n"
+        "rdb_last_bgsave_status:%s\r\n"
+        "rdb_last_bgsave_time_ms:%lld\r\n"
+        "rdb_current_bgsave_time_ms:%lld\r\n"
+        "rdb_current_bgsave_keys_processed:%zu\r\n"
+        "rdb_current_bgsave_keys_total:%zu\r\n"
+        "rdb_last_cow_size:%zu\r\n"
+        "aof_enabled:%d\r\n"
+        "aof_fsync:%s\r\n"
+        "aof_rewrite_in_progress:%d\r\n"
+        "aof_last_write_status:%s\r\n"
+        "aof_current_size:%llu\r\n"
+        "aof_buffer_length:%zu\r\n"
+        "aof_fsyncs:%zu\r\n"
+        "aof_last_bgrewrite_status:%s\r\n"
+        "aof_last_rewrite_time_ms:%lld\r\n"
+        "aof_rewrites:%zu\r\n"
+        "aof_base_seq:%llu\r\n"
+        "aof_incr_files:%zu\r\n"
+        "master_replid:%s\r\n"
+        "master_repl_offset:%zu\r\n"
+        "repl_backlog_size:%zu\r\n"
+        "repl_backlog_first_byte_offset:%zu\r\n"
+        "repl_backlog_histlen:%zu\r\n"
+        "sync_full:%zu\r\n"
+        "sync_partial_ok:%zu\r\n"
+        "sync_partial_err:%zu\r\n"
+        "sync_partial_bytes:%zu\r\n"
+        "connected_slaves:%zu\r\n"
+        "repl_diskless_sync:%d\r\n"
+        "repl_transfer_in_progress:%d\r\n"
+        "repl_transfer_size:%llu\r\n"
+        "repl_transfer_done:%llu\r\n"
+        "repl_transfer_resumed_offset:%llu\r\n"
+        "current_cow_size:%zu\r\n"
+        "latest_fork_usec:%lld\r\n",
+        server.db.size(), st.usedBytes, st.allocatedBytes, st.slabCount, st.largeCount, st.fragmentation(),
+        server.statNumCommands.load(), server.statNetReads.load(), server.statNetWrites.load(),
+        server.statOutputLimitDisconnections.load(), server.statQueryLimitDisconnections.load(), server.connectedClients.load(), server.maxclients,
+        server.statRejectedConnections.load(),
+        server.dirty, rdbInProgress ? 1 : 0, static_cast<long long>(server.rdbLastSaveTime),
+        server.rdbLastBgsaveOk ? "ok" : "err", static_cast<long long>(server.rdbLastBgsaveMs), currentMs,
+        rdbInProgress ? server.childKeysDone : 0, rdbInProgress ? server.childKeysTotal : 0, server.rdbLastCowBytes,
+        server.aof.isOpen() ? 1 : 0, aofFsyncPolicyName(server.aofFsync),
+        server.childType == CHILD_TYPE_AOF ? 1 : 0, server.aof.lastWriteOk() ? "ok" : "err",
+        static_cast<unsigned long long>(server.aof.fileSize()), server.aof.pendingBytes(), server.aof.fsyncCount(),
+        server.aofLastBgrewriteOk ? "ok" : "err", static_cast<long long>(server.aofLastBgrewriteMs), server.statAofRewrites,
+        static_cast<unsigned long long>(server.aofManifest.currBaseSeq), server.aofManifest.incrs.size(),
+        server.config.conn.replid, server.cmdBinaryBuff.getOffset(), server.cmdBinaryBuff.getCapacity(),
+        server.cmdBinaryBuff.getStart(), server.cmdBinaryBuff.getSize(),
+        server.statSyncFull, server.statSyncPartialOk, server.statSyncPartialErr, server.statSyncPartialBytes,
+        server.replicas.size(),
+        server.config.replDisklessSync ? 1 : 0, server.config.transfer.inProgress ? 1 : 0, static_cast<unsigned long long>(server.config.transfer.size.load()),
+        static_cast<unsigned long long>(server.config.transfer.done.load()), static_cast<unsigned long long>(server.config.transfer.resumed.load()),
+        server.childPid != -1 ? server.childCowBytes : 0,
+        static_cast<long long>(server.statForkUs));
+    info.assign(buff, len);
+    replicationGenInfoString(server, info);
+    bioGenInfoString(info);
+}
+
 // 显示命令信息
 void showCommand(const Command &cmd)
 {
@@ -157,11 +308,26 @@ void showCommand(const Command &cmd)
             std::cout<<"CMD_GET"<<" ";
             break;
         }
+        case CMD_BGSAVE :
+        {
+            std::cout<<"CMD_BGSAVE"<<" ";
+            break;
+        }
+        case CMD_AOF_REWRIIE :
+        {
+            std::cout<<"CMD_AOF_REWRIIE"<<" ";
+            break;
+        }
         case CMD_SHUTDOWN :
         {
             std::cout<<"CMD_SHUTDOWN"<<" ";
             break;
         }
+        case CMD_INFO :
+        {
+            std::cout<<"CMD_INFO"<<" ";
+            break;
+        }
         default:
             std::cout<<"unknow cmd ! ";
         break;
@@ -188,74 +354,298 @@ void showMesage(std::string message)
     return;
 }
 
-// 将 aof_buff 中de命令写入到 ofs 文件中，一般是 INCR_AOF
-void writeInrcAofFile(CmdBuff &aof_buff, std::ofstream &ofs)
+void flushAppendOnlyFile(Server &server)
 {
-    // 将 aof_buff 中的所有命令拿出来，写入到文件中
-    int n = aof_buff.size();
-    for(int i=0;i<n;++i)
-    {
-        ofs<<aof_buff.at(i).cmdFlag<<' ';
-        ofs<<aof_buff.at(i).key<<' ';
-        ofs<<aof_buff.at(i).value<<'\n';
-    }
-    aof_buff.clear();
+    bool wasOk = server.aof.lastWriteOk();
+    if(server.aof.flush()) return;
+    if(server.aof.policy() == AOF_FSYNC_ALWAYS)
+        errorHandling("Can't persist AOF for fsync error when the AOF fsync policy is 'always': " + std::string(strerror(errno)));
+    // 数据留在缓冲区中，之后每一批命令都会重试，只在第一次失败时输出
+    if(wasOk) debugMessage("Error writing to the AOF file: " + std::string(strerror(errno)));
 }
 
 // 重写 BASE_AOF 文件 重写到 targetFile 文件中，做法是遍历数据库，然后依次写入文件
-// 重写 AOF 文件和 rehash 不能同时发生 ，因此只需要遍历 Dict::_hashtable[0] 即可
-void reWriteBaseAofFile(Server server, std::string targetFile)
+// 在子进程中调用时数据库是 fork 时的副本，不需要考虑 rehash
+bool reWriteBaseAofFile(Server &server, const std::string &targetFile, const std::function<void(size_t)> &progress)
 {
-    // if(server.db.isRehashing()) return; // 正在重哈希，不允许AOF
-    std::ofstream ofs;
-    ofs.open(targetFile,std::ios::trunc);
-    if(ofs.is_open())
+    std::string tempName = rdbTempFileName(targetFile, getpid());
+    unlink(tempName.c_str());
+    AofWriter writer;
+    bool ok = writer.open(tempName, AOF_FSYNC_NO);
+    if(ok)
     {
-        for(size_t i=0;i<server.db.getTable()[0].bucketSize();++i)
+        size_t keys = 0;
+        // 缓冲区满了就写入文件，内存中最多只有一个缓冲区的记录
+        server.db.forEach([&writer, &ok, &keys, &progress](HashNode *node)
         {
-            HashNode *node = server.db.getTable()[0].getBucket()[i];
-            if(node == nullptr) continue;
-            while(node != nullptr)
-            {
-                ofs<<CMD_SET<<" ";
-                ofs<<node->getKey()<<" ";
-                ofs<<node->getValue()<<" ";
-                node = node->next();
-            }
-        }
-        ofs.close();
+            writer.append(CMD_SET, node->getKey(), node->getValue());
+            ++keys;
+            if(writer.pendingBytes() < RDB_IO_BUF_SIZE) return;
+            ok = writer.flush() && ok;
+            if(progress) progress(keys);
+        });
+        ok = writer.close() && ok;
     }
-    else 
+    if(!ok || rename(tempName.c_str(), targetFile.c_str()) == -1)
     {
         debugMessage("reWriteBaseAofFile error!!!");
+        unlink(tempName.c_str());
+        return false;
     }
+    return true;
+}
+
+std::string aofRewriteTempFileName(Server &server, pid_t childPid)
+{
+    return server.aofDir + "/temp-rewriteaof-bg-" + std::to_string(childPid) + ".aof";
+}
+
+// 创建一个新的 INCR 文件并写入 manifest，之后的命令都追加到新文件中
+// manifest 写入失败时继续使用原来的文件
+static bool openNewIncrAof(Server &server)
+{
+    AofManifest manifest = server.aofManifest;
+    std::string incrName = server.aofDir + "/" + manifest.addIncr();
+    // 先创建文件再写入 manifest，manifest 中的文件总是存在的
+    AofWriter writer;
+    if(!writer.open(incrName, AOF_FSYNC_NO) || !writer.close() || !aofPersistManifest(server.aofDir, manifest))
+    {
+        unlink(incrName.c_str());
+        return false;
+    }
+    server.aofManifest = manifest;
+    // fdatasync 和关闭由 bio 线程完成
+    if(server.aof.isOpen()) server.aof.closeInBackground();
+    if(!server.aof.open(incrName, server.aofFsync)) errorHandling("Can't open the append-only file " + incrName);
+    return true;
+}
+
+// 删除 manifest 中的历史文件，manifest 已经不再引用它们
+static void aofDelHistoryFiles(Server &server)
+{
+    if(server.aofManifest.history.empty()) return;
+    for(auto &info : server.aofManifest.history) bioUnlinkLazily(server.aofDir + "/" + info.fileName);
+    AofManifest manifest = server.aofManifest;
+    manifest.history.clear();
+    // 失败时历史文件留在 manifest 中，下一次启动或者重写时再删除
+    if(aofPersistManifest(server.aofDir, manifest)) server.aofManifest = manifest;
 }
 
 // 重写 AOF 的整个流程
-void AOFRW(Server &server)
-{
-    // 关闭之前写入 incr_aof_file 的ofstream，将原来的文件重命名，然后产生新的 incr_aof_file 文件
-    if(server.incrAofStream.is_open()) server.incrAofStream.close();
-    std::string oldIncrName = "../"+INCR_AOF_FILE_NAME;
-    std::string tempIncrName = "../"+TEMP_INCR_AOF_FILE_NAME;
-    // 文件重命名
-    rename(oldIncrName.c_str(),tempIncrName.c_str());
-    
+int AOFRW(Server &server)
+{
+    if(!server.aof.isOpen()) return -1;
+    if(server.childPid != -1)
+    {
+        debugMessage("AOFRW: background child already in progress");
+        return -1;
+    }
+    // 先把这一批命令写入原来的 INCR 文件，之后的命令写入新的 INCR 文件，重写完成后原来的文件都成为历史文件
+    flushAppendOnlyFile(server);
+    if(!openNewIncrAof(server))
+    {
+        debugMessage("AOFRW: can't open a new INCR AOF file");
+        server.aofLastBgrewriteOk = false;
+        return -1;
+    }
+    // 子进程通过写时复制访问数据库，不需要拷贝整个 Server
+    pid_t pid = forkChild(server, CHILD_TYPE_AOF);
+    if(pid == -1)
+    {
+        debugMessage("AOFRW fork error!");
+        server.aofLastBgrewriteOk = false;
+        return -1;
+    }
+    if(pid == 0)
+    {
+        auto last = std::chrono::steady_clock::now();
+        bool ok = reWriteBaseAofFile(server, aofRewriteTempFileName(server, getpid()), [&server, &last](size_t keys)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if(now - last < std::chrono::milliseconds(CHILD_INFO_INTERVAL_MS)) return;
+            last = now;
+            sendChildInfo(server, keys);
+        });
+        sendChildInfo(server, server.db.size());
+        _exit(ok ? 0 : 1);
+    }
+    showMesage("Background append only file rewriting started by pid " + std::to_string(pid));
+    return 0;
+}
 
-    // 将之前的 base_aof_file 重命名，然后开辟子线程用来重写base_aof_file
-    std::string oldBaseName = "../"+BASE_AOF_FILE_NAME;
-    std::string tempBaseName = "../"+TEMP_BASE_AOF_FILE_NAME;
-    rename(oldBaseName.c_str(),tempBaseName.c_str());
-    std::thread childThread(reWriteBaseAofFile, server, oldBaseName);
-    childThread.detach();
-    // 然后产生新的 incr_aof_file 文件, ofstream 指向新的文件，父进程继续添加AOF文件
-    // 删除以前的文件
-    remove(tempBaseName.c_str()); 
-    remove(tempIncrName.c_str());
-    server.incrAofStream.open(oldIncrName,std::ios::trunc);
-    
+bool backgroundRewriteDoneHandler(Server &server, pid_t childPid)
+{
+    std::string tempName = aofRewriteTempFileName(server, childPid);
+    AofManifest manifest = server.aofManifest;
+    std::string baseName = server.aofDir + "/" + manifest.replaceBase();
+    if(rename(tempName.c_str(), baseName.c_str()) == -1)
+    {
+        debugMessage("Can't rename the rewritten AOF file: " + std::string(strerror(errno)));
+        bioUnlinkLazily(tempName);
+        return false;
+    }
+    // manifest 替换之前宕机时新的 BASE 不会被引用，原来的文件仍然完整
+    if(!aofPersistManifest(server.aofDir, manifest))
+    {
+        debugMessage("Can't persist the AOF manifest: " + std::string(strerror(errno)));
+        bioUnlinkLazily(baseName);
+        return false;
+    }
+    server.aofManifest = manifest;
+    aofDelHistoryFiles(server);
+    return true;
+}
+
+// 子进程中写时复制的字节数，即 /proc/self/smaps_rollup 中的 Private_Dirty
+// 父进程修改共享页之后，子进程持有的原页面变为私有，因此子进程的 Private_Dirty 就是写时复制的开销
+static size_t getPrivateDirtyBytes()
+{
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if(fp == nullptr) fp = fopen("/proc/self/smaps", "r"); // 老的内核没有 smaps_rollup，需要累加每个映射
+    if(fp == nullptr) return 0;
+    char line[256];
+    size_t total = 0, kb = 0;
+    while(fgets(line, sizeof(line), fp) != nullptr)
+    {
+        if(sscanf(line, "Private_Dirty: %zu kB", &kb) == 1) total += kb;
+    }
+    fclose(fp);
+    return total * 1024;
+}
+
+pid_t forkChild(Server &server, ChildType type)
+{
+    if(server.childPid != -1) return -1;
+    if(pipe(server.childInfoPipe) == -1) return -1;
+    // 两端都是非阻塞的，父进程来不及读取时子进程丢弃这次报告而不是阻塞
+    for(int fd : server.childInfoPipe) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    server.childKeysTotal = server.db.size();
+    server.childKeysDone = 0;
+    server.childCowBytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if(pid == 0)
+    { // 子进程只有调用 fork 的线程，IO 线程不存在，子进程只能访问数据库，结束时使用 _exit
+        close(server.childInfoPipe[0]);
+        server.childInfoPipe[0] = -1;
+        return 0;
+    }
+    close(server.childInfoPipe[1]);
+    server.childInfoPipe[1] = -1;
+    if(pid == -1)
+    {
+        close(server.childInfoPipe[0]);
+        server.childInfoPipe[0] = -1;
+        debugMessage("fork error!");
+        return -1;
+    }
+    server.statForkUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    server.childPid = pid;
+    server.childType = type;
+    server.childStartTime = start;
+    return pid;
+}
+
+void sendChildInfo(Server &server, size_t keys, int replicaFd)
+{
+    ChildInfo info{keys, getPrivateDirtyBytes(), replicaFd};
+    write(server.childInfoPipe[1], &info, sizeof(info));
+}
+
+void receiveChildInfo(Server &server)
+{
+    if(server.childInfoPipe[0] == -1) return;
+    ChildInfo info;
+    while(read(server.childInfoPipe[0], &info, sizeof(info)) == sizeof(info))
+    {
+        server.childKeysDone = info.keys;
+        server.childCowBytes = info.cowBytes;
+        if(info.replicaFd != -1) replicationReplicaSynced(server, info.replicaFd);
+    }
 }
 
+void checkChildrenDone(Server &server)
+{
+    if(server.childPid == -1) return;
+    receiveChildInfo(server);
+    int status = 0;
+    pid_t pid = waitpid(server.childPid, &status, WNOHANG);
+    if(pid == 0) return; // 子进程还在运行
+    receiveChildInfo(server); // 子进程退出前报告的最终结果
+    bool ok = pid == server.childPid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - server.childStartTime).count();
+    if(server.childType == CHILD_TYPE_RDB)
+    {
+        server.rdbLastBgsaveOk = ok;
+        server.rdbLastBgsaveMs = ms;
+        server.rdbLastCowBytes = server.childCowBytes;
+        if(ok)
+        { // fork 之后的修改不在快照中
+            server.dirty -= server.dirtyBeforeBgsave;
+            server.rdbLastSaveTime = time(nullptr);
+            showMesage("Background saving terminated with success");
+        }
+        else
+        {
+            bioUnlinkLazily(rdbTempFileName(server.config.dumpDir, server.childPid));
+            showMesage("Background saving error");
+        }
+    }
+    else if(server.childType == CHILD_TYPE_REPL) replicationFullSyncDone(server, ok);
+    else
+    {
+        if(ok) ok = backgroundRewriteDoneHandler(server, server.childPid);
+        else bioUnlinkLazily(aofRewriteTempFileName(server, server.childPid));
+        server.aofLastBgrewriteOk = ok;
+        server.aofLastBgrewriteMs = ms;
+        if(ok) ++server.statAofRewrites;
+        showMesage(ok ? "Background AOF rewrite terminated with success" : "Background AOF rewrite error");
+    }
+    close(server.childInfoPipe[0]);
+    server.childInfoPipe[0] = -1;
+    server.childPid = -1;
+    server.childType = CHILD_TYPE_NONE;
+}
+
+void killChild(Server &server)
+{
+    if(server.childPid == -1) return;
+    kill(server.childPid, SIGKILL);
+    waitpid(server.childPid, nullptr, 0);
+    if(server.childType == CHILD_TYPE_AOF) bioUnlinkLazily(aofRewriteTempFileName(server, server.childPid));
+    else bioUnlinkLazily(rdbTempFileName(server.config.dumpDir, server.childPid)); // 全量同步的子进程也可能在写快照
+    if(server.childType == CHILD_TYPE_REPL) replicationFullSyncDone(server, false);
+    close(server.childInfoPipe[0]);
+    server.childInfoPipe[0] = -1;
+    server.childPid = -1;
+    server.childType = CHILD_TYPE_NONE;
+}
+
+int rdbSaveBackground(Server &server)
+{
+    pid_t pid = forkChild(server, CHILD_TYPE_RDB);
+    if(pid == -1)
+    {
+        if(server.childPid == -1) server.rdbLastBgsaveOk = false; // fork 失败
+        return -1;
+    }
+    if(pid == 0)
+    { // 子进程
+        auto last = std::chrono::steady_clock::now();
+        bool ok = server.db.dump_file(server.config.dumpDir, [&server, &last](size_t keys)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if(now - last < std::chrono::milliseconds(CHILD_INFO_INTERVAL_MS)) return;
+            last = now;
+            sendChildInfo(server, keys);
+        });
+        sendChildInfo(server, server.db.size());
+        _exit(ok ? 0 : 1);
+    }
+    server.dirtyBeforeBgsave = server.dirty;
+    showMesage("Background saving started by pid " + std::to_string(pid));
+    return 0;
+}
 
 
 // server 时间事件函数
@@ -265,52 +655,181 @@ void AOFRW(Server &server)
 // 利用 run_with_period 宏来一定固定频率执行任务
 void serverCron(Server &server)
 {
-    // 以一秒的频率执行AOF文件磁盘写入操作
-    run_with_period(1000)
+    // 上一次写入 AOF 失败时数据还留在缓冲区中，没有新的命令也需要重试
+    // everysec 策略下最后一批命令之后没有新的命令时，也由这里提交 fdatasync
+    flushAppendOnlyFile(server);
+    // 回收结束的后台子进程
+    checkChildrenDone(server);
+    // 判断是否需要缩容，并在时间预算内持续 rehash
+    // 有后台子进程时不主动 rehash，迁移节点会修改大量的页，增加写时复制的开销
+    if(server.childPid == -1)
     {
-        writeInrcAofFile(server.aof_buff, server.incrAofStream);
-        server.aof_buff.clear();
+        server.db.startRehash();
+        server.db.rehashMicroseconds(server.rehashBudgetUs);
     }
-    // 持续尝试rehash
-    server.db.rehashMilliseconds(100);
 
     ++server.cronloops;
 }
 
 
-void Server::ServerInit()
+int createListenSocket(int port, bool reusePort)
 {
-    // 设置端口号
-    this->config.master_port = DEFAULT_SERVER_PORT;
-    // Redis server 创建监听套接字
-    this->config.master_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(fd == -1) errorHandling("socket error!");
 
     sockaddr_in master_adr;
     memset(&master_adr, 0, sizeof(master_adr));
     master_adr.sin_family = AF_INET;
     master_adr.sin_addr.s_addr = htonl(INADDR_ANY);
-    master_adr.sin_port = htons(config.master_port);
+    master_adr.sin_port = htons(port);
 
     // 设置为socket为立即可用，便于调试
     int optval = 1;
-    setsockopt(this->config.master_socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if(reusePort) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
 
     // 套接字和IP，端口绑定
-    if(bind(this->config.master_socket_fd, reinterpret_cast<sockaddr *>(&master_adr), sizeof(master_adr))==-1)
+    if(bind(fd, reinterpret_cast<sockaddr *>(&master_adr), sizeof(master_adr))==-1)
     {
         errorHandling("bind error!");
     }
 
-    // 监听
-    if(listen(this->config.master_socket_fd,1) == -1)
+    // 监听，backlog 过小时并发连接会被丢弃
+    if(listen(fd,511) == -1)
     {
         errorHandling("listen error!");
-    }  
+    }
+    // 监听套接字使用边缘触发，需要设置为非阻塞，每次事件循环 accept 直到 EAGAIN
+    int flag = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flag|O_NONBLOCK);
+    return fd;
+}
+
+// 根据 maxclients 提高进程可以打开的 fd 数目，无法提高时按照实际的限制减小 maxclients
+static void adjustOpenFilesLimit(Server &server)
+{
+    rlim_t need = server.maxclients + CONFIG_MIN_RESERVED_FDS;
+    rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= need) return;
+    rlimit wanted = limit;
+    wanted.rlim_cur = need;
+    if(wanted.rlim_max < need) wanted.rlim_max = need;
+    if(setrlimit(RLIMIT_NOFILE, &wanted) == 0) return;
+    // 没有权限提高硬限制，最多只能提高到硬限制
+    wanted.rlim_cur = wanted.rlim_max = limit.rlim_max;
+    if(limit.rlim_max > limit.rlim_cur && setrlimit(RLIMIT_NOFILE, &wanted) == 0) limit.rlim_cur = limit.rlim_max;
+    size_t maxclients = limit.rlim_cur > static_cast<rlim_t>(CONFIG_MIN_RESERVED_FDS) * 2 ? limit.rlim_cur - CONFIG_MIN_RESERVED_FDS : CONFIG_MIN_RESERVED_FDS;
+    std::cout<<"can't raise open files limit to "<<need<<", maxclients is set to "<<maxclients<<std::endl;
+    server.maxclients = maxclients;
+}
+
+// 依次载入 manifest 中的 BASE_AOF 和 INCR_AOF
+// 最后一个 INCR_AOF 结尾不完整的记录是宕机时没有写完的，截断之后继续启动，其他的损坏或者缺失拒绝启动
+static void loadAppendOnlyFiles(Server &server)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t records = 0;
+    auto apply = [&server, &records](uint8_t cmd, std::string_view key, std::string_view value)
+    {
+        if(cmd == CMD_SET) server.db.insert(key, value);
+        ++records;
+    };
+    const AofManifest &manifest = server.aofManifest;
+    uint64_t validBytes = 0;
+    if(!manifest.base.fileName.empty())
+    {
+        std::string baseName = server.aofDir + "/" + manifest.base.fileName;
+        if(aofLoadFile(baseName, apply, validBytes) != AOF_LOAD_OK) errorHandling("Bad AOF file " + baseName + ", refusing to start");
+    }
+    for(size_t i=0;i<manifest.incrs.size();++i)
+    {
+        std::string incrName = server.aofDir + "/" + manifest.incrs[i].fileName;
+        bool last = i + 1 == manifest.incrs.size();
+        AofLoadStatus status = aofLoadFile(incrName, apply, validBytes);
+        if(status == AOF_LOAD_OK) continue;
+        if(status != AOF_LOAD_TRUNCATED || !last) errorHandling("Bad AOF file " + incrName + ", refusing to start");
+        if(truncate(incrName.c_str(), validBytes) == -1) errorHandling("Can't truncate the AOF file " + incrName);
+        showMesage("!!! Warning: short read while loading the AOF file " + incrName + ", truncated to " + std::to_string(validBytes) + " bytes");
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    showMesage("DB loaded from append only file: " + std::to_string(records) + " records in " + std::to_string(ms) + " ms");
+}
+
+// 启动时在开始监听之前载入数据，开启 AOF 并且 manifest 存在时只载入 AOF，否则载入快照
+// 文件不存在时从空数据库开始，文件损坏时拒绝启动
+static void loadDataFromDisk(Server &server)
+{
+    if(server.aofEnabled)
+    {
+        bool exist = false;
+        if(aofLoadManifest(server.aofDir, server.aofManifest, exist))
+        {
+            loadAppendOnlyFiles(server);
+            return;
+        }
+        if(exist) errorHandling("Bad AOF manifest in " + server.aofDir + ", refusing to start");
+    }
+    if(access(server.config.dumpDir.c_str(), F_OK) == -1) return;
+    auto start = std::chrono::steady_clock::now();
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    if(!server.db.load_file_mmap(server.config.dumpDir, threads))
+        errorHandling("Bad snapshot file " + server.config.dumpDir + ", refusing to start");
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    server.rdbLastSaveTime = time(nullptr);
+    showMesage("DB loaded from disk: " + std::to_string(server.db.size()) + " keys in " + std::to_string(ms) + " ms");
+}
+
+// 打开 manifest 中最后一个 INCR 文件继续追加，删除上一次没有删完的历史文件
+// 第一次开启 AOF 时先把快照中的数据写成 BASE_AOF，之后的启动只载入 AOF
+static void openAppendOnlyFile(Server &server)
+{
+    if(mkdir(server.aofDir.c_str(), 0755) == -1 && errno != EEXIST) errorHandling("Can't create the AOF directory " + server.aofDir);
+    AofManifest &manifest = server.aofManifest;
+    if(manifest.base.fileName.empty() && manifest.incrs.empty() && !server.db.empty())
+    {
+        AofManifest initial = manifest;
+        std::string baseName = server.aofDir + "/" + initial.replaceBase();
+        if(!reWriteBaseAofFile(server, baseName)) errorHandling("Can't create the base AOF file " + baseName);
+        manifest = initial;
+    }
+    if(manifest.incrs.empty())
+    {
+        if(!openNewIncrAof(server)) errorHandling("Can't create the append-only file in " + server.aofDir);
+    }
+    else if(!server.aof.open(server.aofDir + "/" + manifest.incrs.back().fileName, server.aofFsync))
+        errorHandling("Can't open the append-only file");
+    aofDelHistoryFiles(server);
+}
+
+void Server::ServerInit()
+{
+    adjustOpenFilesLimit(*this);
+    // 对端关闭之后继续写入会产生 SIGPIPE，忽略它，让 writev 返回 EPIPE 并关闭连接
+    signal(SIGPIPE, SIG_IGN);
+    // 关闭文件、fdatasync 和删除文件由 bio 线程执行
+    bioInit();
+    this->backgroundIO = true;
+    loadDataFromDisk(*this);
+    if(this->aofEnabled) openAppendOnlyFile(*this);
+    // 设置端口号
+    this->config.master_port = DEFAULT_SERVER_PORT;
+    // Redis server 创建监听套接字，多监听模式下由各个 IO 线程自己创建
+    if(this->reusePortMode) this->config.master_socket_fd = -1;
+    else this->config.master_socket_fd = createListenSocket(this->config.master_port, false);
+    // 从机连接的监听套接字，由主线程的事件循环 accept
+    if(this->config.repl_port != 0) this->config.repl_listen_fd = createListenSocket(this->config.repl_port, false);
 }
 
 void Server::closeServer()
 {
-    close(this->config.master_socket_fd);
+    if(this->config.master_socket_fd >= 0) close(this->config.master_socket_fd);
+    if(this->config.repl_listen_fd >= 0) close(this->config.repl_listen_fd);
+    this->config.repl_listen_fd = -1;
+    while(!this->replicas.empty()) replicationFreeReplica(*this, nullptr, this->replicas.begin()->first);
+    killChild(*this);
+    this->aof.close();
+    if(this->backgroundIO) bioShutdown();
+    this->backgroundIO = false;
 
     // 释放客户端 fd 。。。
 }
\ No newline at end of file
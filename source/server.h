@@ -10,13 +10,22 @@
 #include <cstdio>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/resource.h> // 调整可以打开的 fd 数目
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <csignal>
+#include <chrono>
+#include <ctime>
+#include <sys/wait.h>
 #include <atomic>
 #include <unordered_set>
+#include <unordered_map>
+#include <deque>
 #include "skiplist.h"
 #include "dict.h"
 #include "threadsafe_structures.h"
+#include "aof.h"
 
 #define DEFAULT_SERVER_PORT 9000
 
@@ -24,8 +33,21 @@ typedef Dict DB; // 数据库类型
 typedef HashNode DBNode; // 数据库节点
 
 constexpr size_t REPL_BUFF_LEN = 128; // CmdBuff 缓存长度
-constexpr size_t REPL_COPY_BUFF = 1024;// 主从复制缓冲区长度，unit：byte
-constexpr size_t AOF_BUFF_LEN = 128; // aof_buff 缓冲长度
+constexpr size_t REPL_BACKLOG_SIZE = 1024 * 1024; // 复制积压缓冲区的默认长度，unit：byte
+constexpr size_t REPL_ID_LEN = 40; // 复制 ID 的长度，十六进制字符
+constexpr size_t REPL_TRANSFER_BUFF = 1024 * 1024; // 从机接收快照的缓冲区长度，也是主机不能使用 sendfile 时每次读取的长度，unit：byte
+constexpr size_t REPL_SENDFILE_CHUNK = 8 * 1024 * 1024; // 主机每次 sendfile 最多发送的字节数，每次发送之后更新进度，unit：byte
+constexpr size_t REPL_MAX_CMD_LEN = 512 * 1024 * 1024; // 复制流中 key 或 value 的最大长度，超过时认为复制流损坏，unit：byte
+constexpr int REPL_ACK_INTERVAL_MS = 100; // 从机持续接收命令流时报告偏移的间隔，收完已经到达的命令时也会报告，unit：ms
+constexpr size_t REPL_LAG_SAMPLES = 4096; // 主机记录的 (偏移, 发送时间) 的最大数目，用于计算从机落后的时间
+constexpr size_t CLIENT_OUTPUT_HARD_LIMIT = 256 * 1024 * 1024; // 客户端输出缓冲区的硬限制
+constexpr size_t CLIENT_OUTPUT_SOFT_LIMIT = 64 * 1024 * 1024; // 客户端输出缓冲区的软限制
+constexpr int CLIENT_OUTPUT_SOFT_SECONDS = 60; // 允许持续超过软限制的时间，unit：s
+constexpr size_t CLIENT_QUERY_BUFFER_LIMIT = 1024 * 1024 * 1024; // 客户端输入缓冲区中未解析数据的上限
+constexpr size_t CONFIG_DEFAULT_MAX_CLIENTS = 10000; // 默认的最大客户端数
+constexpr int CONFIG_MIN_RESERVED_FDS = 32; // 除客户端之外需要预留的 fd，监听套接字、eventfd、持久化文件等
+constexpr int CONFIG_FDSET_INCR = CONFIG_MIN_RESERVED_FDS + 96; // 事件表的上限比 maxclients 多出的部分
+constexpr int CHILD_INFO_INTERVAL_MS = 1000; // 后台子进程报告进度的最小间隔，unit：ms
 
 enum ReplStatus {
     REPL_STATE_NONE = 0, // 初始状态
@@ -39,22 +61,59 @@ enum ReplStatus {
     REPL_STATE_NULL // 无效状态
 };
 
-// AOF 文件名相关定义
-const std::string BASE_AOF_FILE_NAME = "base_aof.txt";
-const std::string INCR_AOF_FILE_NAME = "incr_aof.txt";
-const std::string TEMP_BASE_AOF_FILE_NAME = "temp_base_aof.txt";
-const std::string TEMP_INCR_AOF_FILE_NAME = "temp_incr_aof.txt";
+// AOF 目录，BASE、INCR 和 manifest 文件的命名见 aof.h
+const std::string AOF_DIR_NAME = "appendonlydir";
+// 快照文件名
+const std::string RDB_FILE_NAME = "dump.rdb";
 
 
+// 握手时主机和从机交换的包
+// 主机的 replid 是自己的复制 ID，offset 是复制流的全局字节偏移
+// 从机的 replid 和 offset 是它正在复制的主机的 ID 和已经执行到的偏移，两者都和主机相同时才能部分同步
 struct ReplConnectionPack
 {
-    size_t offset; // 主机发送文件的字节数或者是从机接收的文件字节数
+    size_t offset;
     ReplStatus status;
-    ReplConnectionPack():offset(0),status(REPL_STATE_NONE) {}
+    char replid[REPL_ID_LEN + 1];
+    ReplConnectionPack():offset(0),status(REPL_STATE_NONE),replid{} {}
     ReplConnectionPack (const ReplConnectionPack &repl)
     {
         this->offset = repl.offset;
         this->status = repl.status;
+        memcpy(this->replid, repl.replid, sizeof(replid));
+    }
+};
+
+// 生成一个新的随机复制 ID
+void replicationCreateReplid(char *replid);
+
+// 全量同步时主机在快照内容之前发送的头部，从机回复一个 uint64_t 表示从哪个偏移开始发送
+// 无盘同步时 fileSize 为 REPL_TRANSFER_STREAMED，之后是若干个块，每块为长度 uint64_t 和内容，长度为 0 的块表示结束
+struct ReplTransferHeader
+{
+    uint64_t fileSize; // 快照文件的总字节数
+    uint64_t snapshotId; // 快照结尾的 CRC64，从机用它判断之前没有收完的文件是否属于同一个快照
+};
+
+constexpr uint64_t REPL_TRANSFER_STREAMED = UINT64_MAX;
+
+// 全量同步的传输进度，主机的发送线程或者从机的接收方更新，其他线程可以读取
+struct ReplTransferProgress
+{
+    std::atomic<bool> inProgress;
+    std::atomic<uint64_t> size; // 快照文件的总字节数
+    std::atomic<uint64_t> done; // 已经传输的字节数，包括续传时跳过的部分
+    std::atomic<uint64_t> resumed; // 这一次传输开始的偏移，不续传时为 0
+    ReplTransferProgress():inProgress(false),size(0),done(0),resumed(0) {}
+    ReplTransferProgress(const ReplTransferProgress &p)
+        :inProgress(p.inProgress.load()),size(p.size.load()),done(p.done.load()),resumed(p.resumed.load()) {}
+    ReplTransferProgress& operator=(const ReplTransferProgress &p)
+    {
+        inProgress = p.inProgress.load();
+        size = p.size.load();
+        done = p.done.load();
+        resumed = p.resumed.load();
+        return *this;
     }
 };
 
@@ -65,8 +124,12 @@ struct ServerConfig
     bool isSlave;  // 自己是不是从机
     std::string master_IP, slave_IP; // 主机/从机的IP
     uint64_t master_port, slave_port; // 主机/从机的端口号
-    int master_socket_fd,slave_socket_fd; // 主机从机套接字文件描述符
+    int master_socket_fd = -1,slave_socket_fd = -1; // 主机从机套接字文件描述符
     ReplConnectionPack conn; // 握手发送的包
+    ReplTransferProgress transfer; // 全量同步的传输进度
+    bool replDisklessSync = false; // 全量同步时不生成快照文件，序列化的结果直接写入从机的套接字
+    uint64_t repl_port = 0; // 主机接受从机连接的端口，0 表示不接受
+    int repl_listen_fd = -1; // 从机连接的监听套接字，由主线程的事件循环 accept
 
     std::string dumpDir; // 持久化文件的路径
 };
@@ -79,7 +142,8 @@ enum CMD_FLAG {
     CMD_BGSAVE,
     CMD_SYNC,
     CMD_AOF_REWRIIE,
-    CMD_SHUTDOWN
+    CMD_SHUTDOWN,
+    CMD_INFO
 };
 
 // 命令结构体
@@ -113,28 +177,79 @@ private:
     int _capacity;
 };
 
-// 复制缓冲区
+// 复制积压缓冲区 (backlog)，固定长度的环形缓冲区，保存复制流中最近的 capacity 个字节
+// 偏移是从复制开始以来的全局字节偏移，全局偏移 offset 的字节位于 buff[offset % capacity]
+// 从机重连时如果它的偏移还在缓冲区中，只需要发送之后的字节 (部分同步)
 // cmmond 命令格式 {CMD_FLAG}{keyLen}{key}{valueLen}{value}
 class CmdBinaryBuff
 {
 public:
-    CmdBinaryBuff():start_index(0),cur_index(0),size(0),capacity(REPL_COPY_BUFF)
-    {
-        buff = new char[REPL_COPY_BUFF];
-        memset(buff,0,capacity);
-    }
+    explicit CmdBinaryBuff(size_t capacity = REPL_BACKLOG_SIZE):buff(new char[capacity]),capacity(capacity),offset(0),histlen(0) {}
+    ~CmdBinaryBuff() { delete[] buff; }
+    CmdBinaryBuff(const CmdBinaryBuff &) = delete;
+    CmdBinaryBuff& operator=(const CmdBinaryBuff &) = delete;
+    // 修改长度，之前的内容被丢弃，全局偏移不变
+    void resize(size_t newCapacity);
     // 在缓冲区尾部写入一个cmd
-    void writeCmdBack(Command &cmd);
-    size_t getStart() { return start_index; }
-    const char *getbuff() { return buff; }
-    size_t getSize() { return size; }
+    void writeCmdBack(const Command &cmd);
+    // 在缓冲区尾部写入复制流中的 len 个字节，超出长度时覆盖最早的字节
+    void append(const void *data, size_t len);
+    size_t getStart() const { return offset - histlen; } // 缓冲区中第一个字节的全局偏移
+    size_t getOffset() const { return offset; } // 最后一个字节之后的全局偏移
+    size_t getSize() const { return histlen; }
+    size_t getCapacity() const { return capacity; }
+    // 全局偏移 off 之后的字节都还在缓冲区中
+    bool contains(size_t off) const { return off >= getStart() && off <= offset; }
+    // 返回从全局偏移 off 开始的一段连续的字节，在缓冲区结尾处折返时需要多次调用，off 必须满足 contains
+    size_t peek(size_t off, const char *&data) const;
 private:
-    size_t start_index;
-    size_t cur_index;
-    size_t size;
-    size_t capacity;
     char *buff;
+    size_t capacity;
+    size_t offset; // 复制流的全局偏移，即写入的总字节数
+    size_t histlen; // 缓冲区中有效的字节数，最多为 capacity
+};
 
+// 主机上从机连接的状态
+enum ReplicaState {
+    REPLICA_STATE_HANDSHAKE = 0, // 等待从机回复它的复制 ID 和偏移
+    REPLICA_STATE_WAIT_BGSAVE, // 需要全量同步，等待没有其他子进程时 fork
+    REPLICA_STATE_SYNCING, // 子进程正在发送快照，父进程不读写这个套接字，命令流暂存在 buf 中
+    REPLICA_STATE_ONLINE, // 正在接收命令流
+    REPLICA_STATE_CLOSE // 同步失败，等待事件循环关闭
+};
+
+// 主机上的一个从机连接
+// 写命令执行时编码后追加到 buf，事件循环每一轮把 buf 写入非阻塞的套接字，写不完时注册可写事件
+// 从机定期回复已经执行到的偏移 (ackOffset)，它和主机偏移的差就是从机落后的字节数
+struct ReplicaClient
+{
+    int fd;
+    ReplicaState state;
+    size_t offset; // 已经放入 buf 的复制流的全局偏移
+    std::string buf; // 还没有发送的命令流，bufPos 之前的部分已经发送
+    size_t bufPos;
+    std::string inBuf; // 从机发来的还不完整的包
+    size_t ackOffset; // 从机最近一次报告的偏移
+    std::chrono::steady_clock::time_point ackTime; // 最近一次报告的时间
+    ReplicaClient(int fd = -1, size_t offset = 0, ReplicaState state = REPLICA_STATE_ONLINE)
+        :fd(fd),state(state),offset(offset),bufPos(0),ackOffset(offset),ackTime(std::chrono::steady_clock::now()) {}
+    size_t pending() const { return buf.size() - bufPos; }
+};
+
+// 后台子进程的类型
+enum ChildType {
+    CHILD_TYPE_NONE = 0,
+    CHILD_TYPE_RDB, // BGSAVE
+    CHILD_TYPE_AOF, // AOF 重写
+    CHILD_TYPE_REPL // 向等待全量同步的从机发送快照
+};
+
+// 子进程通过管道发送给父进程的信息，长度小于 PIPE_BUF，写入是原子的
+struct ChildInfo
+{
+    size_t keys; // 已经写入的 key 数目
+    size_t cowBytes; // 子进程中因为写时复制而私有的字节数
+    int replicaFd; // 全量同步的子进程已经把快照完整发送给这个从机，其他子进程为 -1
 };
 
 class Server
@@ -143,13 +258,20 @@ public:
     DB db;
     ServerConfig config;
 
-    // 主从复制命令缓存
-    CmdBuff cmdbuff;
-    CmdBinaryBuff cmdBinaryBuff;
-    // incr_aof.txt 文件写入流
-    std::ofstream incrAofStream;
-    // aof_buff
-    CmdBuff aof_buff;
+    CmdBinaryBuff cmdBinaryBuff; // 复制积压缓冲区，它的全局偏移就是主机的复制偏移
+    std::unordered_map<int, ReplicaClient> replicas; // 所有从机连接，key 为套接字，只由主线程访问
+    // 命令流每次发送给从机时的 (主机偏移, 时间)，按偏移递增，用于计算从机落后的时间
+    std::deque<std::pair<size_t, std::chrono::steady_clock::time_point>> replOffsetSamples;
+    // 当前的 INCR AOF 文件，SET 命令执行时追加到它的缓冲区，每一批命令执行完之后由 flushAppendOnlyFile 写入
+    AofWriter aof;
+    bool aofEnabled; // 关闭时不写 AOF，启动时只载入快照
+    AofFsyncPolicy aofFsync;
+    std::string aofDir; // AOF 文件所在的目录
+    AofManifest aofManifest; // 和磁盘上的 manifest 一致，只在持久化成功之后修改
+    bool aofLastBgrewriteOk;
+    int64_t aofLastBgrewriteMs; // 上一次重写的耗时，unit：ms
+    size_t statAofRewrites; // 成功完成的重写次数
+    bool backgroundIO; // ServerInit 启动了 bio 线程，closeServer 时停止
 
     // 服务器运行的频率，默认10
     int hz;
@@ -157,26 +279,95 @@ public:
     // 时间循环事件的处理次数
     int cronloops;
 
+    // serverCron 中每次 rehash 的时间预算，单位微秒
+    int64_t rehashBudgetUs;
+
     // 停止服务器
     bool serverStop;
 
     // IO线程的数量
     size_t IOThreadNum;
 
-    // 正在处理的 IO fd
-    threadsafe_unordered_set<int> fdSet;
+    // 多监听模式，每个 IO 线程拥有独立的事件循环和 SO_REUSEPORT 监听套接字
+    bool reusePortMode;
+
+    // 多监听模式下 IO 线程的事件循环使用 io_uring 后端，内核不支持时使用 epoll
+    bool ioUringMode;
+
+    // 最大客户端数，ServerInit 中会根据它提高进程可以打开的 fd 数目，无法提高时减小
+    size_t maxclients;
+    std::atomic<size_t> connectedClients; // 当前连接的客户端数
+
+    // 客户端输出缓冲区的限制，单位字节，0 表示不限制
+    // 超过硬限制，或者持续超过软限制 clientOutputSoftSeconds 秒的客户端会被断开
+    size_t clientOutputHardLimit;
+    size_t clientOutputSoftLimit;
+    int clientOutputSoftSeconds;
+    // 客户端输入缓冲区中还没有解析的数据超过这个大小时断开连接，0 表示不限制
+    size_t clientQueryBufferLimit;
+
+    // 统计信息，IO 线程和主线程都会修改
+    std::atomic<size_t> statNumCommands; // 执行的命令数
+    std::atomic<size_t> statNetReads; // 读取客户端的系统调用次数
+    std::atomic<size_t> statNetWrites; // 向客户端写入的系统调用次数
+    std::atomic<size_t> statOutputLimitDisconnections; // 因为输出缓冲区超过限制而断开的客户端数
+    std::atomic<size_t> statQueryLimitDisconnections; // 因为输入缓冲区超过限制而断开的客户端数
+    std::atomic<size_t> statRejectedConnections; // 因为超过 maxclients 而拒绝的连接数
+
+    // 后台子进程，同一时间最多只有一个，只由主线程访问
+    pid_t childPid; // 没有子进程时为 -1
+    ChildType childType;
+    int childInfoPipe[2]; // 子进程通过管道向父进程报告进度
+    std::chrono::steady_clock::time_point childStartTime;
+    size_t childKeysTotal; // fork 时数据库中 key 的数目
+    size_t childKeysDone; // 子进程最近报告的已经写入的 key 数目
+    size_t childCowBytes; // 子进程最近报告的写时复制字节数
+
+    // 快照相关的统计信息
+    size_t dirty; // 上一次成功保存快照之后修改数据库的次数
+    size_t dirtyBeforeBgsave; // fork 时的 dirty，保存成功之后从 dirty 中减去
+    time_t rdbLastSaveTime; // 上一次成功保存快照的时间
+    bool rdbLastBgsaveOk;
+    int64_t rdbLastBgsaveMs; // 上一次 BGSAVE 的耗时，unit：ms
+    size_t rdbLastCowBytes; // 上一次 BGSAVE 的写时复制字节数
+    int64_t statForkUs; // 最近一次 fork 的耗时，父进程只在这段时间内阻塞，unit：us
+
+    // 主从复制的统计信息
+    size_t statSyncFull; // 全量同步的次数
+    size_t statSyncPartialOk; // 部分同步的次数
+    size_t statSyncPartialErr; // 从机的偏移已经不在积压缓冲区中或者复制 ID 不同，只能全量同步的次数
+    size_t statSyncPartialBytes; // 部分同步发送的字节数
 public:
     // 构造函数
-    Server():db(6),cmdbuff(REPL_BUFF_LEN),incrAofStream(),aof_buff(AOF_BUFF_LEN),hz(10),cronloops(0),serverStop(false),IOThreadNum(1)
+    Server():db(6),aofEnabled(true),aofFsync(AOF_FSYNC_DEFAULT),aofLastBgrewriteOk(true),aofLastBgrewriteMs(-1),statAofRewrites(0),backgroundIO(false),hz(10),cronloops(0),rehashBudgetUs(1000),serverStop(false),IOThreadNum(1),reusePortMode(false),ioUringMode(false),
+            maxclients(CONFIG_DEFAULT_MAX_CLIENTS),connectedClients(0),
+            clientOutputHardLimit(CLIENT_OUTPUT_HARD_LIMIT),clientOutputSoftLimit(CLIENT_OUTPUT_SOFT_LIMIT),clientOutputSoftSeconds(CLIENT_OUTPUT_SOFT_SECONDS),clientQueryBufferLimit(CLIENT_QUERY_BUFFER_LIMIT),
+            statNumCommands(0),statNetReads(0),statNetWrites(0),statOutputLimitDisconnections(0),statQueryLimitDisconnections(0),statRejectedConnections(0),
+            childPid(-1),childType(CHILD_TYPE_NONE),childInfoPipe{-1,-1},childKeysTotal(0),childKeysDone(0),childCowBytes(0),
+            dirty(0),dirtyBeforeBgsave(0),rdbLastSaveTime(time(nullptr)),rdbLastBgsaveOk(true),rdbLastBgsaveMs(-1),rdbLastCowBytes(0),statForkUs(0),
+            statSyncFull(0),statSyncPartialOk(0),statSyncPartialErr(0),statSyncPartialBytes(0)
     {
-        std::string fileName = "../"+INCR_AOF_FILE_NAME;
-        incrAofStream.open(fileName,std::ios::trunc);
+        config.dumpDir = "../"+RDB_FILE_NAME;
+        replicationCreateReplid(config.conn.replid);
+        aofDir = "../"+AOF_DIR_NAME;
     }
-    Server(const Server& db)
+    Server(const Server& db) : aofEnabled(db.aofEnabled),aofFsync(db.aofFsync),aofDir(db.aofDir),aofLastBgrewriteOk(true),aofLastBgrewriteMs(-1),statAofRewrites(0),backgroundIO(false),statNumCommands(0),statNetReads(0),statNetWrites(0),statOutputLimitDisconnections(0),statQueryLimitDisconnections(0),statRejectedConnections(0),
+            childPid(-1),childType(CHILD_TYPE_NONE),childInfoPipe{-1,-1},childKeysTotal(0),childKeysDone(0),childCowBytes(0),
+            dirty(0),dirtyBeforeBgsave(0),rdbLastSaveTime(time(nullptr)),rdbLastBgsaveOk(true),rdbLastBgsaveMs(-1),rdbLastCowBytes(0),statForkUs(0),
+            statSyncFull(0),statSyncPartialOk(0),statSyncPartialErr(0),statSyncPartialBytes(0)
     {
         this->db = db.db;
+        replicationCreateReplid(this->config.conn.replid);
         this->hz = db.hz;
+        this->rehashBudgetUs = db.rehashBudgetUs;
         this->IOThreadNum = db.IOThreadNum;
+        this->reusePortMode = db.reusePortMode;
+        this->ioUringMode = db.ioUringMode;
+        this->maxclients = db.maxclients;
+        this->clientOutputHardLimit = db.clientOutputHardLimit;
+        this->clientOutputSoftLimit = db.clientOutputSoftLimit;
+        this->clientOutputSoftSeconds = db.clientOutputSoftSeconds;
+        this->clientQueryBufferLimit = db.clientQueryBufferLimit;
         this->serverStop = false;
         this->cronloops = 0;
     }
@@ -184,7 +375,6 @@ public:
     ~Server()
     {
         closeServer();
-        this->incrAofStream.close();
     }
     // 初始化数据库服务器
     void ServerInit();
@@ -196,11 +386,37 @@ public:
     {
         this->IOThreadNum = num;
     }
+    void setReusePortMode(bool on)
+    {
+        this->reusePortMode = on;
+    }
+    void setIoUringMode(bool on)
+    {
+        this->ioUringMode = on;
+    }
+    void setMaxClients(size_t num)
+    {
+        this->maxclients = num;
+    }
+    void setReplBacklogSize(size_t size)
+    {
+        this->cmdBinaryBuff.resize(size);
+    }
+    void setAppendOnly(bool on, AofFsyncPolicy policy)
+    {
+        this->aofEnabled = on;
+        this->aofFsync = policy;
+    }
 };
 
+// 创建非阻塞的监听套接字，reusePort 为 true 时多个套接字可以绑定同一个端口，由内核分配连接
+int createListenSocket(int port, bool reusePort);
+
 
 // ====================执行相关命令================
 std::string execCommand(Server &server, Command &cmd);
+// 执行命令，结果写入调用方复用的 reply 缓冲区中
+void execCommand(Server &server, Command &cmd, std::string &reply);
 
 // 计算一个cmd转换为发送格式的长度
 inline size_t getLenOfCmd(Command &cmd)
@@ -212,6 +428,11 @@ inline size_t getLenOfCmd(Command &cmd)
 }
 
 size_t parseBinaryCmd(const char *buff, Command &cmd); // 解析一个cmd，并返回，假设一定能解析成功
+void encodeBinaryCmd(const Command &cmd, std::string &out); // 把 cmd 编码后追加到 out，格式和 parseBinaryCmd 相同
+bool checkBinaryCmd(const char *buff, size_t len); // 检查长度为 len 的 cmd 是否完整，防止解析时越界
+
+// 生成服务器的统计信息，格式为每行一个 name:value
+void genInfoString(Server &server, std::string &info);
 
 // 显示命令信息
 void showCommand(const Command &cmd);
@@ -228,10 +449,13 @@ void showMesage(std::string message);
 
 
 // ============================AOF 相关实现========================
-// Multi Part AOF 设计
+// Multi Part AOF 设计，文件和 manifest 的格式见 aof.h
 
 // AOF_INRC AOF 增长文件
 // AOF_BASE AOF 基础文件
+// 子进程通过写时复制访问 fork 时的数据库，边遍历边写入临时文件，父进程的内存不会翻倍
+// 重写过程中任何时刻宕机，磁盘上的 manifest 描述的文件都包含全部数据：
+//   新的 BASE 在 manifest 替换之前不会被引用，历史文件在 manifest 替换之后才删除
 
 // 如何重写AOF文件
 /* This is how rewriting of the append only file in background works:
@@ -250,16 +474,48 @@ void showMesage(std::string message);
  *    4e) Delete the history files use bio                                              删除历史文件
  */
 
-// AOF 文件的格式是：
-// CMD_FLAG\tKey\tValue\n
-// 将 aof_buff 中de命令写入到 ofs 文件中，一般是 INCR_AOF
-void writeInrcAofFile(CmdBuff &aof_buff, std::ofstream &ofs);
+// AOF 文件的格式见 aof.h，BASE_AOF 和 INCR_AOF 使用相同的格式
+// 把 server.aof 缓冲区中这一批命令的记录写入文件，必须在发送这一批命令的回复之前调用
+// always 策略下 fdatasync 失败时无法保证已经回复的命令不丢失，直接退出
+void flushAppendOnlyFile(Server &server);
 
 // 重写 BASE_AOF 文件 重写到 targetFile 文件中，做法是遍历数据库，然后依次写入文件
-void reWriteBaseAofFile(Server server, std::string targetFile);
+// 先写入临时文件，fdatasync 之后再重命名，成功返回 true，progress 参数含义和 Dict::dump_file 相同
+bool reWriteBaseAofFile(Server &server, const std::string &targetFile, const std::function<void(size_t)> &progress = nullptr);
+
+// 重写 AOF 的整个流程，BASE_AOF 由 fork 出的子进程重写
+// 成功返回 0，AOF 没有开启、已经有子进程、无法切换 INCR 文件或者 fork 失败时返回 -1
+int AOFRW(Server &server);
+
+// 子进程写入的临时 BASE 文件
+std::string aofRewriteTempFileName(Server &server, pid_t childPid);
+
+// 子进程成功结束之后使用新的 BASE 文件，替换 manifest 之后删除历史文件
+bool backgroundRewriteDoneHandler(Server &server, pid_t childPid);
+
+
+// ============================RDB 相关========================
+// BGSAVE 使用 fork 出的子进程遍历数据库并把快照写入 config.dumpDir，父进程继续处理命令
+// 子进程和父进程通过写时复制共享内存，父进程只在 fork 时阻塞，之后只有被修改的页才会被复制
+// 子进程通过 childInfoPipe 报告进度和写时复制的字节数，serverCron 回收结束的子进程并更新统计信息
+
+// fork 后台子进程，返回值和 fork 相同，已经有子进程或者 fork 失败时返回 -1
+pid_t forkChild(Server &server, ChildType type);
+
+// 子进程向父进程报告已经写入的 key 数目和写时复制的字节数，全量同步的子进程还报告收完快照的从机
+void sendChildInfo(Server &server, size_t keys, int replicaFd = -1);
+
+// 读取子进程报告的所有信息
+void receiveChildInfo(Server &server);
+
+// 回收已经结束的后台子进程并更新统计信息，由 serverCron 调用
+void checkChildrenDone(Server &server);
 
-// 重写 AOF 的整个流程
-void AOFRW(Server &server);
+// 结束并回收后台子进程，服务器关闭时调用
+void killChild(Server &server);
+
+// 开始 BGSAVE，成功返回 0，已经有子进程或者 fork 失败时返回 -1
+int rdbSaveBackground(Server &server);
 
 
 
@@ -285,10 +541,56 @@ ReplConnectionPack shakeHandWithSlave(ServerConfig &config); // 和从机握手
 
 void sendToSlave(ServerConfig &config); // 向 slave 发送包
 
-void syncWithSlave(Server &dserver); // 和从机同步
+bool syncWithSlave(Server &dserver); // 和从机同步，成功返回 true
+
+// 发送文件，内容由 sendfile 从页缓存直接写入套接字，从从机回复的偏移开始发送，成功返回 true
+bool sendFile(ServerConfig &config, const std::string &fileName);
+
+// 无盘同步，把数据库的快照直接写入 fds 中所有从机的套接字，所有从机共享同一次序列化
+// 发送失败的从机被关闭并从 fds 中移除，返回时 fds 中只剩下完整收到快照的从机，至少有一个时返回 true
+bool sendSnapshotDiskless(Server &server, std::vector<int> &fds);
+
+
+// 命令流复制：同步完成之后主机把每条写命令追加到积压缓冲区和每个从机的输出缓冲区，由事件循环发送
+// 从机先收到一个 REPL_STATE_LONG_CONNECT 包，offset 为命令流开始的偏移，之后是连续的命令，格式和 parseBinaryCmd 相同
+class aeEventLoop;
+
+// 执行写命令时调用，cmd 追加到积压缓冲区和所有从机的输出缓冲区
+void replicationFeedReplicas(Server &server, const Command &cmd);
+
+// 同步完成的从机开始接收命令流，offset 为从机同步到的偏移，之后积压缓冲区中的命令也会发送给它
+// fd 被设置为非阻塞并注册到 aeLoop 中，失败时关闭 fd 并返回 false
+bool replicationAddReplica(Server &server, aeEventLoop &aeLoop, int fd, size_t offset);
+
+// 把所有从机输出缓冲区中的命令写入套接字
+void replicationWriteToReplicas(Server &server, aeEventLoop &aeLoop);
+
+// 在事件循环每一轮等待事件之前调用：关闭同步失败的从机，没有子进程时为等待全量同步的从机 fork，然后发送命令流
+void replicationBeforeSleep(Server &server, aeEventLoop &aeLoop);
+
+// 多从机：主机在 config.repl_listen_fd 上接受任意数目的从机，连接和握手都在主线程的事件循环中进行
+// 可以部分同步或者无需同步的从机直接把需要的字节放入输出缓冲区
+// 需要全量同步的从机由一个子进程一起发送快照，子进程运行期间新的命令暂存在它们的输出缓冲区中
+// 接受 config.repl_listen_fd 上所有等待的从机，并向它们发送握手包
+void acceptReplicas(Server &server, aeEventLoop &aeLoop);
+
+// 子进程报告 fd 已经收完快照，由 receiveChildInfo 调用，从机开始接收命令流
+void replicationReplicaSynced(Server &server, int fd);
+
+// 全量同步的子进程结束，由 checkChildrenDone 调用，没有报告收完快照的从机都被断开
+void replicationFullSyncDone(Server &server, bool ok);
+
+// 从机最近一次报告的偏移之后的命令已经发送了多久，已经追上主机时为 0，unit：ms
+int64_t replicationReplicaLagMs(const Server &server, const ReplicaClient &r);
+
+// 追加每个从机的状态，每行一个 slave<i>:fd=..,state=..,offset=..,lag_bytes=..,lag_ms=..
+void replicationGenInfoString(Server &server, std::string &info);
 
-void sendFile(ServerConfig &config, std::string fileName, size_t offset); // 发送文件
+// 处理从机套接字上的事件，fd 不是从机时返回 false
+bool replicationHandleReplicaEvent(Server &server, aeEventLoop &aeLoop, int fd, int mask);
 
+// 断开从机，aeLoop 为空时只关闭套接字
+void replicationFreeReplica(Server &server, aeEventLoop *aeLoop, int fd);
 
 //======================slave=============================
 bool connectToMaster(ServerConfig &config); // 从机等待主机连接
@@ -299,9 +601,11 @@ ReplConnectionPack shakeHandWithMaster(ServerConfig &config); // 和主机握手
 
 void sendToMaster(ServerConfig &config); // 向 master 发送包
 
-void syncWithMaster(Server &db); // 和主机同步
+void syncWithMaster(Server &db); // 和主机同步，之后执行主机发送的命令流，直到连接断开
 
-void recvFile(ServerConfig &config, std::string fileName); // 接收文件
+// 接收文件，边接收边写入 fileName 的临时文件，收完之后重命名为 fileName，成功返回 true
+// 连接中断时保留已经收到的部分，下一次全量同步时主机的快照没有变化就从这里续传
+bool recvFile(ServerConfig &config, const std::string &fileName);
 
 
 
@@ -0,0 +1,195 @@
+#include "slab.h"
+#include <cstdlib>
+#include <new>
+
+// 大小类，均为 16 的倍数，相邻大小类之间的比例不超过 1.25 左右
+static const size_t slabClassSizes[] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448,
+    512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048};
+constexpr size_t SLAB_CLASS_NUM = sizeof(slabClassSizes) / sizeof(slabClassSizes[0]);
+
+// 以 16 字节为单位的大小到大小类下标的映射
+static const std::vector<uint8_t>& classTable()
+{
+    static const std::vector<uint8_t> table = []()
+    {
+        std::vector<uint8_t> t(SLAB_MAX_CLASS_SIZE / 16 + 1);
+        size_t cls = 0;
+        for(size_t i=0;i<t.size();++i)
+        {
+            while(slabClassSizes[cls] < i * 16) ++cls;
+            t[i] = static_cast<uint8_t>(cls);
+        }
+        return t;
+    }();
+    return table;
+}
+
+SlabAllocator::SlabAllocator() : _large(nullptr), _usedBytes(0), _largeBytes(0), _largeCount(0)
+{
+    _classes.resize(SLAB_CLASS_NUM);
+    for(size_t i=0;i<SLAB_CLASS_NUM;++i)
+    {
+        _classes[i].size = slabClassSizes[i];
+        _classes[i].freeList = nullptr;
+        _classes[i].cur = _classes[i].end = nullptr;
+    }
+}
+
+SlabAllocator::~SlabAllocator()
+{
+    release();
+}
+
+int SlabAllocator::classIndex(size_t size)
+{
+    if(size > SLAB_MAX_CLASS_SIZE) return -1;
+    return classTable()[(size + 15) / 16];
+}
+
+size_t SlabAllocator::usableSize(size_t size)
+{
+    int idx = classIndex(size);
+    return idx < 0 ? size : slabClassSizes[idx];
+}
+
+void* SlabAllocator::allocate(size_t size)
+{
+    int idx = classIndex(size);
+    if(idx < 0)
+    { // 大对象，直接向系统申请
+        LargeChunk *chunk = static_cast<LargeChunk *>(malloc(sizeof(LargeChunk) + size));
+        if(chunk == nullptr) throw std::bad_alloc();
+        chunk->prev = nullptr;
+        chunk->next = _large;
+        chunk->size = size;
+        if(_large != nullptr) _large->prev = chunk;
+        _large = chunk;
+        _usedBytes += size;
+        _largeBytes += sizeof(LargeChunk) + size;
+        ++_largeCount;
+        return chunk + 1;
+    }
+    SizeClass &cls = _classes[idx];
+    void *ptr = nullptr;
+    if(cls.freeList != nullptr)
+    {
+        ptr = cls.freeList;
+        cls.freeList = cls.freeList->next;
+    }
+    else
+    {
+        if(cls.cur + cls.size > cls.end)
+        { // 当前 slab 页已经用完，申请新的 slab 页
+            char *page = static_cast<char *>(malloc(SLAB_PAGE_SIZE));
+            if(page == nullptr) throw std::bad_alloc();
+            _slabs.push_back(page);
+            cls.cur = page;
+            cls.end = page + (SLAB_PAGE_SIZE / cls.size) * cls.size;
+        }
+        ptr = cls.cur;
+        cls.cur += cls.size;
+    }
+    _usedBytes += cls.size;
+    return ptr;
+}
+
+void SlabAllocator::deallocate(void *ptr, size_t size)
+{
+    if(ptr == nullptr) return;
+    int idx = classIndex(size);
+    if(idx < 0)
+    {
+        LargeChunk *chunk = static_cast<LargeChunk *>(ptr) - 1;
+        if(chunk->prev != nullptr) chunk->prev->next = chunk->next;
+        else _large = chunk->next;
+        if(chunk->next != nullptr) chunk->next->prev = chunk->prev;
+        _usedBytes -= size;
+        _largeBytes -= sizeof(LargeChunk) + size;
+        --_largeCount;
+        free(chunk);
+        return;
+    }
+    SizeClass &cls = _classes[idx];
+    FreeChunk *chunk = static_cast<FreeChunk *>(ptr);
+    chunk->next = cls.freeList;
+    cls.freeList = chunk;
+    _usedBytes -= cls.size;
+}
+
+// 释放的代价只和 slab 页以及大对象的数目有关，和对象的数目无关
+void SlabAllocator::release()
+{
+    for(void *page : _slabs) free(page);
+    _slabs.clear();
+    _slabs.shrink_to_fit();
+    while(_large != nullptr)
+    {
+        LargeChunk *next = _large->next;
+        free(_large);
+        _large = next;
+    }
+    for(SizeClass &cls : _classes)
+    {
+        cls.freeList = nullptr;
+        cls.cur = cls.end = nullptr;
+    }
+    _usedBytes = _largeBytes = _largeCount = 0;
+}
+
+void SlabAllocator::adopt(SlabAllocator &other)
+{
+    if(&other == this) return;
+    _slabs.insert(_slabs.end(), other._slabs.begin(), other._slabs.end());
+    if(other._large != nullptr)
+    {
+        LargeChunk *tail = other._large;
+        while(tail->next != nullptr) tail = tail->next;
+        tail->next = _large;
+        if(_large != nullptr) _large->prev = tail;
+        _large = other._large;
+    }
+    for(size_t i=0;i<_classes.size();++i)
+    {
+        SizeClass &cls = _classes[i], &from = other._classes[i];
+        // other 当前 slab 页中剩余的部分：本分配器没有当前页时直接使用，否则切分后放入空闲链表
+        if(cls.cur == cls.end)
+        {
+            cls.cur = from.cur;
+            cls.end = from.end;
+        }
+        else
+        {
+            for(char *p = from.cur; p != nullptr && p + cls.size <= from.end; p += cls.size)
+            {
+                FreeChunk *chunk = reinterpret_cast<FreeChunk *>(p);
+                chunk->next = cls.freeList;
+                cls.freeList = chunk;
+            }
+        }
+        while(from.freeList != nullptr)
+        {
+            FreeChunk *chunk = from.freeList;
+            from.freeList = chunk->next;
+            chunk->next = cls.freeList;
+            cls.freeList = chunk;
+        }
+        from.cur = from.end = nullptr;
+    }
+    _usedBytes += other._usedBytes;
+    _largeBytes += other._largeBytes;
+    _largeCount += other._largeCount;
+    other._slabs.clear();
+    other._large = nullptr;
+    other._usedBytes = other._largeBytes = other._largeCount = 0;
+}
+
+SlabStats SlabAllocator::stats() const
+{
+    SlabStats st;
+    st.usedBytes = _usedBytes;
+    st.slabCount = _slabs.size();
+    st.largeCount = _largeCount;
+    st.allocatedBytes = _slabs.size() * SLAB_PAGE_SIZE + _largeBytes;
+    return st;
+}
@@ -0,0 +1,75 @@
+#ifndef REDIS_LEARN_SLAB
+#define REDIS_LEARN_SLAB
+
+// 按大小类划分的 slab 分配器，用于存放数据库的节点
+// 每个大小类从独立的 slab 页中切分 chunk，释放的 chunk 放入该大小类的空闲链表中
+// 超过 SLAB_MAX_CLASS_SIZE 的对象直接向系统申请，使用双向链表串起来，便于整体释放
+// 非线程安全，只能在执行命令的线程中使用
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+constexpr size_t SLAB_PAGE_SIZE = 64 * 1024; // 每个 slab 页的大小
+constexpr size_t SLAB_MAX_CLASS_SIZE = 2048; // 最大的大小类
+
+// 分配器统计信息
+struct SlabStats
+{
+    size_t usedBytes; // 已分配出去的字节数，按大小类取整
+    size_t allocatedBytes; // 向系统申请的字节数，slab 页和大对象
+    size_t slabCount; // slab 页的数目
+    size_t largeCount; // 大对象的数目
+    // 碎片率，向系统申请的内存 / 实际使用的内存
+    double fragmentation() const { return usedBytes == 0 ? 1.0 : static_cast<double>(allocatedBytes) / usedBytes; }
+};
+
+class SlabAllocator
+{
+public:
+    SlabAllocator();
+    ~SlabAllocator();
+    SlabAllocator(const SlabAllocator &) = delete;
+    SlabAllocator& operator=(const SlabAllocator &) = delete;
+
+    void* allocate(size_t size);
+    // size 必须和 allocate 时的 size 属于同一个大小类
+    void deallocate(void *ptr, size_t size);
+    // 申请 size 字节时实际可以使用的字节数
+    static size_t usableSize(size_t size);
+    // 一次性释放所有 slab 页和大对象，之前分配的指针全部失效
+    void release();
+    // 接管 other 的所有 slab 页、大对象和空闲的 chunk，other 变为空
+    // 之后 other 分配的对象可以由本分配器释放，用于多个线程分别分配之后合并
+    void adopt(SlabAllocator &other);
+    SlabStats stats() const;
+
+private:
+    struct FreeChunk
+    {
+        FreeChunk *next;
+    };
+    struct alignas(16) LargeChunk
+    {
+        LargeChunk *prev;
+        LargeChunk *next;
+        size_t size;
+    };
+    struct SizeClass
+    {
+        size_t size; // chunk 的大小
+        FreeChunk *freeList; // 空闲链表
+        char *cur; // 当前 slab 页中下一个未使用的位置
+        char *end; // 当前 slab 页的结尾
+    };
+    static int classIndex(size_t size);
+
+    std::vector<SizeClass> _classes;
+    std::vector<void *> _slabs; // 所有的 slab 页
+    LargeChunk *_large; // 大对象链表
+    size_t _usedBytes;
+    size_t _largeBytes;
+    size_t _largeCount;
+};
+
+#endif // REDIS_LEARN_SLAB
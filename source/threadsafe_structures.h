@@ -5,6 +5,13 @@
 #include <condition_variable>
 #include <queue>
 #include <unordered_set>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 template <typename T>
 class threadsafe_queue
@@ -19,14 +26,14 @@ public:
     void push(T value)
     {
         std::lock_guard<std::mutex> lk(mtx);
-        data_queue.push(value);
+        data_queue.push(std::move(value));
         data_cond.notify_one(); // 唤醒 wait_and_pop
     }
     void wait_and_pop(T &value)
     {
         std::unique_lock<std::mutex> lk(mtx);
         data_cond.wait(lk, [this](){return !data_queue.empty();}); // lambda 表达式传入this
-        value = data_queue.front();
+        value = std::move(data_queue.front());
         data_queue.pop();
     }
     std::shared_ptr<T> wait_and_pop()
@@ -41,7 +48,7 @@ public:
     {
         std::lock_guard<std::mutex> lk(mtx);
         if(data_queue.empty()) {  return false; }
-        value = data_queue.front();
+        value = std::move(data_queue.front());
         data_queue.pop();
         return true;
     }
@@ -64,6 +71,165 @@ private:
     std::condition_variable data_cond; // 同步
 };
 
+// 有界无锁多生产者多消费者环形队列
+// 每个槽位带有一个序号，生产者和消费者通过 CAS 抢占 _tail/_head 的位置，序号用于判断槽位是否可写/可读
+// push/pop 只移动元素，不拷贝
+// useEventfd 为 true 时，消费者在队列为空时阻塞在 eventfd 上，生产者只在有消费者等待时才写 eventfd
+// 消费者也可以把 eventFd() 注册到自己的 epoll 中，在 epoll_wait 前后调用 prepare_wait/finish_wait
+template <typename T>
+class mpmc_ring_queue
+{
+public:
+    explicit mpmc_ring_queue(size_t capacity = 65536, bool useEventfd = true) : _head(0), _tail(0), _waiters(0), _eventfd(-1)
+    {
+        size_t cap = 2;
+        while(cap < capacity) cap <<= 1; // 容量取 2 的幂，用掩码代替取模
+        _mask = cap - 1;
+        _cells = new Cell[cap];
+        for(size_t i=0;i<cap;++i) _cells[i].seq.store(i, std::memory_order_relaxed);
+        // 信号量模式，每次 read 只消耗一次唤醒，多个消费者等待时不会丢失唤醒
+        if(useEventfd) _eventfd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE | EFD_NONBLOCK);
+    }
+    ~mpmc_ring_queue()
+    {
+        delete [] _cells;
+        if(_eventfd >= 0) close(_eventfd);
+    }
+    mpmc_ring_queue(const mpmc_ring_queue &) = delete;
+    mpmc_ring_queue& operator=(const mpmc_ring_queue &) = delete;
+
+    // 队列已满时返回 false，此时 value 不会被移动
+    bool try_push(T &&value)
+    {
+        Cell *cell = nullptr;
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        while(true)
+        {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if(dif == 0)
+            { // 槽位可写，尝试抢占
+                if(_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if(dif < 0) return false; // 队列已满
+            else pos = _tail.load(std::memory_order_relaxed); // 被其他生产者抢先
+        }
+        cell->data = std::move(value);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        notify();
+        return true;
+    }
+    // 队列已满时让出 CPU 等待消费者
+    void push(T value)
+    {
+        while(!try_push(std::move(value))) std::this_thread::yield();
+    }
+    bool try_pop(T &value)
+    {
+        Cell *cell = nullptr;
+        size_t pos = _head.load(std::memory_order_relaxed);
+        while(true)
+        {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if(dif == 0)
+            { // 槽位可读，尝试抢占
+                if(_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if(dif < 0) return false; // 队列为空
+            else pos = _head.load(std::memory_order_relaxed);
+        }
+        value = std::move(cell->data);
+        cell->seq.store(pos + _mask + 1, std::memory_order_release); // 槽位留给下一轮的生产者
+        return true;
+    }
+    // 批量出队，最多取 maxNum 个元素追加到 out 的末尾，返回取出的数目
+    size_t try_pop_bulk(std::vector<T> &out, size_t maxNum)
+    {
+        size_t n = 0;
+        T value;
+        while(n < maxNum && try_pop(value))
+        {
+            out.push_back(std::move(value));
+            ++n;
+        }
+        return n;
+    }
+    // 队列为空时阻塞，没有开启 eventfd 时退化为让出 CPU 的自旋
+    void wait_and_pop(T &value)
+    {
+        while(!try_pop(value))
+        {
+            if(_eventfd < 0)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            prepare_wait();
+            if(try_pop(value))
+            {
+                _waiters.fetch_sub(1);
+                return;
+            }
+            pollfd pfd {_eventfd, POLLIN, 0};
+            poll(&pfd, 1, -1); // 阻塞直到生产者唤醒
+            uint64_t cnt = 0;
+            ssize_t ret = read(_eventfd, &cnt, sizeof(cnt)); // 可能被其他消费者抢先，返回 EAGAIN 时重新检查队列
+            (void)ret;
+            _waiters.fetch_sub(1);
+        }
+    }
+    // 在 epoll_wait 之前调用，之后生产者写入的元素一定会唤醒 eventFd
+    // 调用之后需要再检查一次队列是否为空，非空时不应阻塞
+    void prepare_wait()
+    {
+        _waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    // 在 epoll_wait 返回之后调用，清空 eventfd 中积累的唤醒
+    void finish_wait()
+    {
+        _waiters.fetch_sub(1);
+        uint64_t cnt = 0;
+        while(read(_eventfd, &cnt, sizeof(cnt)) > 0);
+    }
+    // 近似值，并发修改时只作参考
+    bool empty() const
+    {
+        return _head.load(std::memory_order_acquire) >= _tail.load(std::memory_order_acquire);
+    }
+    size_t capacity() const { return _mask + 1; }
+    // 用于注册到 epoll 中，没有开启时为 -1
+    int eventFd() const { return _eventfd; }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T data;
+    };
+    void notify()
+    {
+        if(_eventfd < 0) return;
+        // 和 wait_and_pop 中的屏障配对，保证生产者能看到等待者或者等待者能看到新元素
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(_waiters.load(std::memory_order_relaxed) == 0) return;
+        uint64_t one = 1;
+        ssize_t ret = write(_eventfd, &one, sizeof(one));
+        (void)ret;
+    }
+
+    Cell *_cells;
+    size_t _mask;
+    // 生产者和消费者的位置分别放在不同的缓存行中，避免伪共享
+    alignas(64) std::atomic<size_t> _head;
+    alignas(64) std::atomic<size_t> _tail;
+    alignas(64) std::atomic<int> _waiters;
+    int _eventfd;
+};
+
 template <typename T>
 class threadsafe_unordered_set
 {